@@ -0,0 +1,1286 @@
+// ff7gx-pack: builds image packs for the renderer.
+//
+// Usage:
+//   ff7gx-pack build <dump directory> <output pack> [threads]
+//       Upscales background dumps saved by the renderer into a background pack
+//   ff7gx-pack textures <tga directory> <output pack>
+//       Packs replacement textures named like the texture dumps saved by the renderer
+//   ff7gx-pack synth <output pack> <count> [size]
+//       Writes a texture pack of random size x size images, for benchmarking
+//   ff7gx-pack bench <pack> [lookups]
+//       Measures open time, lookup latency and memory use of a pack
+//   ff7gx-pack uploads <texture pack> [budget KiB] [budget ms] [threads]
+//       Requests every texture in a pack at once and measures how the uploads are spread over frames
+//   ff7gx-pack hashbench [MiB]
+//       Measures texture hashing speed of each kernel on typical texture sizes
+//   ff7gx-pack collisions [count]
+//       Hashes a corpus of similar synthetic textures and counts colliding hashes
+//   ff7gx-pack cache <directory> [operations]
+//       Drives a background cache with synthetic keys and checks its hits, misses and evictions,
+//       and that entries written to the directory are read back in a new session
+//   ff7gx-pack xbrbench [repeat]
+//       Checks that every super-xBR kernel upscales random images of odd sizes the same, with one
+//       thread and with all, and measures upscaling 320x240 to 1280x960
+//   ff7gx-pack xbrparams <shader directory>
+//       Checks that the super-xBR shaders are compiled with the same parameters as the CPU upscaler
+
+#include "BackgroundCache.h"
+#include "BackgroundDump.h"
+#include "Common.h"
+#include "ImagePack.h"
+#include "SuperXBR.h"
+#include "TextureHash.h"
+#include "Tga.h"
+#include "UploadScheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <Psapi.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+using Clock = std::chrono::high_resolution_clock;
+
+static double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static bool EndsWith(const std::string& s, const std::string& suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Resident set size of the process
+static double GetResidentMiB()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0.0;
+    }
+
+    return counters.WorkingSetSize / (1024.0 * 1024.0);
+#else
+    unsigned long size = 0;
+    unsigned long resident = 0;
+
+    if (FILE* statm = std::fopen("/proc/self/statm", "r")) {
+        if (std::fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+            resident = 0;
+        }
+
+        std::fclose(statm);
+    }
+
+    return static_cast<double>(resident) * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+#endif
+}
+
+static std::vector<std::string> ListFiles(const std::string& directory, const std::string& extension)
+{
+    std::vector<std::string> paths;
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((directory + "\\*" + extension).c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            paths.push_back(directory + "\\" + data.cFileName);
+        } while (FindNextFileA(find, &data));
+
+        FindClose(find);
+    }
+#else
+    if (DIR* dir = opendir(directory.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            if (EndsWith(entry->d_name, extension)) {
+                paths.push_back(directory + "/" + entry->d_name);
+            }
+        }
+
+        closedir(dir);
+    }
+#endif
+
+    // Keep the output deterministic
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+// Calls func(index, worker) for every index in 0..count from the given number of threads
+template<typename Func>
+static void ParallelFor(u32 count, u32 threads, Func func)
+{
+    std::atomic<u32> next(0);
+    std::vector<std::thread> workers;
+
+    for (u32 worker = 0; worker < threads; worker++) {
+        workers.emplace_back([&, worker] {
+            for (u32 i = next++; i < count; i = next++) {
+                func(i, worker);
+            }
+        });
+    }
+
+    for (auto& thread : workers) {
+        thread.join();
+    }
+}
+
+static int Build(const std::string& dumpDirectory, const std::string& packPath, u32 threads)
+{
+    const auto start = Clock::now();
+
+    const auto paths = ListFiles(dumpDirectory, ".bgd");
+    if (paths.empty()) {
+        std::fprintf(stderr, "No .bgd files in %s\n", dumpDirectory.c_str());
+        return 1;
+    }
+
+    // Only the headers are needed to lay out the pack
+    ImagePackWriter writer(packPath, ImagePack::Contents::Backgrounds);
+    std::vector<BackgroundDump> headers(paths.size());
+
+    for (std::size_t i = 0; i < paths.size(); i++) {
+        if (!ReadBackgroundDump(paths[i], headers[i], true)) {
+            std::fprintf(stderr, "Invalid dump %s\n", paths[i].c_str());
+            return 1;
+        }
+
+        writer.Add(headers[i].key, headers[i].width * 2, headers[i].height * 2);
+    }
+
+    if (!writer.Create()) {
+        std::fprintf(stderr, "Failed to create %s\n", packPath.c_str());
+        return 1;
+    }
+
+    // Images are upscaled in parallel, so each upscaler only needs one thread
+    std::vector<std::unique_ptr<SuperXBR>> upscalers;
+    for (u32 i = 0; i < threads; i++) {
+        upscalers.push_back(std::make_unique<SuperXBR>(SuperXBR::Params(), SuperXBR::Kernel::Auto, 1));
+    }
+
+    std::atomic<u32> failed(0);
+    std::atomic<u32> upscaled(0);
+    const auto upscaleStart = Clock::now();
+
+    ParallelFor(static_cast<u32>(paths.size()), threads, [&](u32 index, u32 worker) {
+        BackgroundDump dump;
+        if (!ReadBackgroundDump(paths[index], dump)) {
+            failed++;
+            return;
+        }
+
+        // The renderer names the dumps by key, so check the contents really match it
+        if (BackgroundCache::MakeKey(dump.pixels.data(), dump.width, dump.height, dump.layers) != dump.key) {
+            std::fprintf(stderr, "Key mismatch in %s\n", paths[index].c_str());
+            failed++;
+            return;
+        }
+
+        std::vector<u32> output(dump.width * 2 * dump.height * 2);
+        upscalers[worker]->Upscale(dump.pixels.data(), dump.width, dump.height, output.data());
+
+        if (!writer.WritePayload(dump.key, output.data())) {
+            failed++;
+            return;
+        }
+
+        upscaled++;
+    });
+
+    const double upscaleTime = SecondsSince(upscaleStart);
+    const double totalTime = SecondsSince(start);
+
+    std::printf("Images:      %u (%zu unique)\n", upscaled.load(), writer.GetEntries().size());
+    std::printf("Failed:      %u\n", failed.load());
+    std::printf("Threads:     %u\n", threads);
+    std::printf("Pack size:   %.1f MiB\n", writer.GetFileSize() / (1024.0 * 1024.0));
+    std::printf("Throughput:  %.1f images/s\n", upscaleTime > 0.0 ? upscaled / upscaleTime : 0.0);
+    std::printf("Build time:  %.3f s\n", totalTime);
+
+    return failed ? 1 : 0;
+}
+
+// Texture dumps are named by their key, so replacements keep the name of the dump they replace
+static bool ParseTextureKey(const std::string& path, u64& key)
+{
+    const auto slash = path.find_last_of("/\\");
+    const auto name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+
+    char* end;
+    key = std::strtoull(name.c_str(), &end, 16);
+
+    return end == name.c_str() + 16 && std::string(end) == ".tga";
+}
+
+static int PackTextures(const std::string& tgaDirectory, const std::string& packPath)
+{
+    const auto start = Clock::now();
+
+    const auto paths = ListFiles(tgaDirectory, ".tga");
+    if (paths.empty()) {
+        std::fprintf(stderr, "No .tga files in %s\n", tgaDirectory.c_str());
+        return 1;
+    }
+
+    struct Texture
+    {
+        u64 key;
+        u32 width;
+        u32 height;
+        std::vector<u32> pixels;
+    };
+
+    std::vector<Texture> textures;
+    ImagePackWriter writer(packPath, ImagePack::Contents::Textures);
+
+    for (const auto& path : paths) {
+        Texture texture;
+        if (!ParseTextureKey(path, texture.key)) {
+            std::fprintf(stderr, "Skipping %s, the name isn't a texture key\n", path.c_str());
+            continue;
+        }
+
+        if (!ReadTga(path, texture.width, texture.height, texture.pixels)) {
+            std::fprintf(stderr, "Skipping %s, only uncompressed 32-bit TGA is supported\n", path.c_str());
+            continue;
+        }
+
+        writer.Add(texture.key, texture.width, texture.height);
+        textures.push_back(std::move(texture));
+    }
+
+    if (!writer.Create()) {
+        std::fprintf(stderr, "Failed to create %s\n", packPath.c_str());
+        return 1;
+    }
+
+    for (const auto& texture : textures) {
+        if (!writer.WritePayload(texture.key, texture.pixels.data())) {
+            std::fprintf(stderr, "Failed to write %016llx\n", static_cast<unsigned long long>(texture.key));
+            return 1;
+        }
+    }
+
+    std::printf("Textures:    %zu\n", writer.GetEntries().size());
+    std::printf("Pack size:   %.1f MiB\n", writer.GetFileSize() / (1024.0 * 1024.0));
+    std::printf("Build time:  %.3f s\n", SecondsSince(start));
+
+    return 0;
+}
+
+static int Synth(const std::string& packPath, u32 count, u32 size)
+{
+    const auto start = Clock::now();
+
+    std::mt19937_64 random(1);
+    ImagePackWriter writer(packPath, ImagePack::Contents::Textures);
+
+    for (u32 i = 0; i < count; i++) {
+        writer.Add(random(), size, size);
+    }
+
+    if (!writer.Create()) {
+        std::fprintf(stderr, "Failed to create %s\n", packPath.c_str());
+        return 1;
+    }
+
+    std::vector<u32> pixels(size * size);
+    for (const auto& entry : writer.GetEntries()) {
+        for (auto& pixel : pixels) {
+            pixel = static_cast<u32>(random());
+        }
+
+        writer.WritePayload(entry.key, pixels.data());
+    }
+
+    std::printf("Textures:    %zu\n", writer.GetEntries().size());
+    std::printf("Pack size:   %.1f MiB\n", writer.GetFileSize() / (1024.0 * 1024.0));
+    std::printf("Build time:  %.3f s\n", SecondsSince(start));
+
+    return 0;
+}
+
+static int Bench(const std::string& packPath, u32 lookups)
+{
+    const double residentBefore = GetResidentMiB();
+    const auto openStart = Clock::now();
+
+    ImagePackReader reader;
+    if (!reader.Open(packPath.c_str(), ImagePack::Contents::Backgrounds) &&
+        !reader.Open(packPath.c_str(), ImagePack::Contents::Textures)) {
+        std::fprintf(stderr, "Failed to open %s\n", packPath.c_str());
+        return 1;
+    }
+
+    const double openTime = SecondsSince(openStart);
+    const double residentOpen = GetResidentMiB();
+
+    if (reader.GetEntryCount() == 0) {
+        std::fprintf(stderr, "%s is empty\n", packPath.c_str());
+        return 1;
+    }
+
+    // Half of the lookups are for keys in the pack, half are random keys that most likely aren't
+    // Seeded differently from Synth(), so the random keys aren't the ones in a synthetic pack
+    std::mt19937_64 random(2);
+    std::vector<u64> keys(lookups);
+    for (u32 i = 0; i < lookups; i++) {
+        keys[i] = (i & 1) ? random() : reader.GetEntry(static_cast<u32>(random() % reader.GetEntryCount())).key;
+    }
+
+    u32 hits = 0;
+    u64 checksum = 0;
+    const auto lookupStart = Clock::now();
+
+    for (auto key : keys) {
+        ImagePack::Image image;
+        if (reader.Find(key, image)) {
+            hits++;
+            checksum += image.pixels[0];
+        }
+    }
+
+    const double lookupTime = SecondsSince(lookupStart);
+    const double residentLookups = GetResidentMiB();
+
+    std::printf("Entries:         %u\n", reader.GetEntryCount());
+    std::printf("Open time:       %.3f ms\n", openTime * 1000.0);
+    std::printf("Lookups:         %u (%u hits)\n", lookups, hits);
+    std::printf("Lookup latency:  %.1f ns\n", lookupTime * 1e9 / lookups);
+    std::printf("Checksum:        %016llx\n", static_cast<unsigned long long>(checksum));
+
+    // Only the index and the touched pages of the payloads should be resident
+    std::printf("RSS:             %.1f MiB before open, %.1f MiB after open, %.1f MiB after lookups\n",
+        residentBefore, residentOpen, residentLookups);
+
+    return 0;
+}
+
+// Copies the images like a texture upload would, standing in for the D3D texture creation
+class CopySink : public UploadScheduler::Sink
+{
+public:
+    CopySink() :
+        m_checksum(0)
+    {
+    }
+
+    virtual void Upload(const UploadScheduler::Image& image) override
+    {
+        m_texture.resize(image.pixels.size());
+        std::memcpy(m_texture.data(), image.pixels.data(), image.pixels.size() * sizeof(u32));
+        m_checksum += m_texture[0];
+    }
+
+    u64 GetChecksum() const
+    {
+        return m_checksum;
+    }
+
+private:
+    std::vector<u32> m_texture;
+    u64 m_checksum;
+};
+
+static int Uploads(const std::string& packPath, const UploadScheduler::Budget& budget, u32 threads)
+{
+    ImagePackReader reader;
+    if (!reader.Open(packPath.c_str(), ImagePack::Contents::Textures)) {
+        std::fprintf(stderr, "Failed to open %s\n", packPath.c_str());
+        return 1;
+    }
+
+    // Same decode as the renderer, copying the payload out of the mapping
+    UploadScheduler scheduler([&reader](u64 key, UploadScheduler::Image& image) {
+        ImagePack::Image packImage;
+        if (!reader.Find(key, packImage)) {
+            return false;
+        }
+
+        image.width = packImage.width;
+        image.height = packImage.height;
+        image.pixels.assign(packImage.pixels, packImage.pixels + packImage.width * packImage.height);
+        return true;
+    }, threads);
+
+    CopySink sink;
+    const u32 count = reader.GetEntryCount();
+    const auto start = Clock::now();
+
+    for (u32 i = 0; i < count; i++) {
+        scheduler.Request(reader.GetEntry(i).key);
+    }
+
+    // Frames are simulated back to back. Only frames that uploaded something are counted, with
+    // the queue depth sampled at the start of each.
+    u32 frames = 0;
+    u64 totalDepth = 0;
+    u32 maxDepth = 0;
+
+    for (;;) {
+        const auto stats = scheduler.GetStats();
+        const u32 depth = stats.queued + stats.decoding + stats.ready;
+        if (depth == 0) {
+            break;
+        }
+
+        if (!scheduler.ApplyCompleted(sink, budget)) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        totalDepth += depth;
+        maxDepth = std::max(maxDepth, depth);
+        frames++;
+    }
+
+    const double totalTime = SecondsSince(start);
+    const auto stats = scheduler.GetStats();
+
+    std::printf("Textures:          %u (%u failed)\n", stats.totalUploaded, stats.failed);
+    std::printf("Frames:            %u (%u over budget)\n", frames, stats.framesOverBudget);
+    std::printf("Total time:        %.3f ms\n", totalTime * 1000.0);
+    std::printf("Max upload time:   %.3f ms per frame\n", stats.maxUploadMilliseconds);
+    std::printf("Queue depth:       %.1f average, %u max\n", frames ? double(totalDepth) / frames : 0.0, maxDepth);
+    std::printf("Checksum:          %016llx\n", static_cast<unsigned long long>(sink.GetChecksum()));
+
+    return 0;
+}
+
+static const char* GetKernelName(TextureHasher::Kernel kernel)
+{
+    switch (kernel) {
+    case TextureHasher::Kernel::AVX2:
+        return "AVX2";
+    case TextureHasher::Kernel::SSE2:
+        return "SSE2";
+    default:
+        return "scalar";
+    }
+}
+
+static int HashBench(u32 mebibytes)
+{
+    struct Size
+    {
+        u32 width;
+        u32 height;
+        u32 bytesPerPixel;
+    };
+
+    // Texture page sized and smaller textures, like the ones created during field loads
+    static const Size sizes[] = {
+        { 16, 16, 4 }, { 32, 32, 4 }, { 64, 64, 4 }, { 128, 128, 4 }, { 256, 256, 4 }, { 256, 256, 1 },
+    };
+
+    static const TextureHasher::Kernel kernels[] = {
+        TextureHasher::Kernel::Scalar, TextureHasher::Kernel::SSE2, TextureHasher::Kernel::AVX2,
+    };
+
+    std::mt19937_64 random(3);
+    std::vector<u8> texture((256 * 4 + 64) * 256);
+    for (auto& byte : texture) {
+        byte = static_cast<u8>(random());
+    }
+
+    u32 palette[256];
+    for (auto& entry : palette) {
+        entry = static_cast<u32>(random());
+    }
+
+    const u64 totalBytes = static_cast<u64>(mebibytes) * 1024 * 1024;
+
+    for (const auto& size : sizes) {
+        // Pitch is padded like a locked texture's can be
+        const u32 pitch = size.width * size.bytesPerPixel + 64;
+        const u64 textureBytes = static_cast<u64>(size.width) * size.height * size.bytesPerPixel;
+        const u32 iterations = static_cast<u32>(std::max<u64>(totalBytes / textureBytes, 1));
+        const bool paletted = size.bytesPerPixel == 1;
+
+        std::printf("%3ux%-3u %u bpp%s:", size.width, size.height, size.bytesPerPixel * 8, paletted ? " + palette" : "");
+
+        for (auto kernel : kernels) {
+            if (TextureHasher(0, kernel).GetKernel() != kernel) {
+                continue;
+            }
+
+            u64 checksum = 0;
+            const auto start = Clock::now();
+
+            for (u32 i = 0; i < iterations; i++) {
+                checksum += HashTexture(texture.data(), pitch, size.width, size.height, size.bytesPerPixel,
+                    paletted ? palette : nullptr, paletted ? 256 : 0, kernel);
+            }
+
+            const double seconds = SecondsSince(start);
+            std::printf("  %s %.2f GB/s (%.0f ns)", GetKernelName(kernel),
+                iterations * textureBytes / seconds / 1e9, seconds * 1e9 / iterations);
+
+            // Keeps the loop from being optimized out
+            if (checksum == 1) {
+                std::printf("!");
+            }
+        }
+
+        std::printf("\n");
+    }
+
+    return 0;
+}
+
+// Much cheaper to seed than std::mt19937_64, which matters when every texture has its own seed
+class SplitMix64
+{
+public:
+    explicit SplitMix64(u64 seed) :
+        m_state(seed)
+    {
+    }
+
+    u64 operator()()
+    {
+        u64 z = (m_state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+private:
+    u64 m_state;
+};
+
+static int Collisions(u32 count)
+{
+    // Every group of variants is made from the same seed, so the textures within a group are nearly
+    // identical: the same data with one bit flipped, with the width and height swapped, with a
+    // different palette, and a mostly empty texture with a single pixel set.
+    const u32 VARIANTS = 6;
+
+    const u32 SIZE = 64;
+    std::vector<u32> pixels(SIZE * SIZE);
+    std::vector<u8> indices(SIZE * SIZE);
+    u32 palette[256];
+
+    std::vector<u64> keys;
+    keys.reserve(count);
+
+    u32 kernelMismatches = 0;
+    const auto start = Clock::now();
+
+    for (u32 i = 0; i < count; i++) {
+        const u32 group = i / VARIANTS;
+        const u32 variant = i % VARIANTS;
+
+        SplitMix64 random(group);
+        u64 key = 0;
+
+        switch (variant) {
+        case 0:
+        case 1:
+        case 2:
+            for (auto& pixel : pixels) {
+                pixel = static_cast<u32>(random());
+            }
+
+            if (variant == 1) {
+                const u32 bit = static_cast<u32>(random() % (pixels.size() * 32));
+                pixels[bit / 32] ^= 1u << (bit % 32);
+            }
+
+            if (variant == 2) {
+                key = HashTexture(pixels.data(), SIZE * 2 * 4, SIZE * 2, SIZE / 2, 4);
+            } else {
+                key = HashTexture(pixels.data(), SIZE * 4, SIZE, SIZE, 4);
+            }
+            break;
+
+        case 3:
+        case 4:
+            for (auto& index : indices) {
+                index = static_cast<u8>(random());
+            }
+
+            for (auto& entry : palette) {
+                entry = static_cast<u32>(random());
+            }
+
+            if (variant == 4) {
+                palette[random() % 256] ^= 0x00010000;
+            }
+
+            key = HashTexture(indices.data(), SIZE, SIZE, SIZE, 1, palette, 256);
+            break;
+
+        default:
+            std::fill(pixels.begin(), pixels.end(), 0);
+            pixels[group % pixels.size()] = group / static_cast<u32>(pixels.size()) + 1;
+
+            key = HashTexture(pixels.data(), SIZE * 4, SIZE, SIZE, 4);
+            break;
+        }
+
+        // Spot check that the kernels agree
+        if ((i & 1023) == 0 && variant == 0 &&
+            key != HashTexture(pixels.data(), SIZE * 4, SIZE, SIZE, 4, nullptr, 0, TextureHasher::Kernel::Scalar)) {
+            kernelMismatches++;
+        }
+
+        keys.push_back(key);
+    }
+
+    const double seconds = SecondsSince(start);
+
+    std::sort(keys.begin(), keys.end());
+
+    u32 collisions = 0;
+    for (std::size_t i = 1; i < keys.size(); i++) {
+        if (keys[i] == keys[i - 1]) {
+            collisions++;
+        }
+    }
+
+    // For an ideal 64-bit hash
+    const double expected = static_cast<double>(count) * (count - 1) / 2 / 18446744073709551616.0;
+
+    std::printf("Textures:          %u (%u groups of %u variants)\n", count, count / VARIANTS, VARIANTS);
+    std::printf("Time:              %.3f s\n", seconds);
+    std::printf("Collisions:        %u (%.2g expected)\n", collisions, expected);
+    std::printf("Kernel mismatches: %u\n", kernelMismatches);
+
+    return collisions || kernelMismatches ? 1 : 0;
+}
+
+// What BackgroundCache does with entries of the same size: the keys it holds, the most recently used first
+class CacheModel
+{
+public:
+    explicit CacheModel(u32 capacity) :
+        m_capacity(capacity),
+        m_stats{}
+    {
+    }
+
+    bool Find(u64 key)
+    {
+        auto it = std::find(m_keys.begin(), m_keys.end(), key);
+        if (it == m_keys.end()) {
+            m_stats.misses++;
+            return false;
+        }
+
+        m_keys.erase(it);
+        m_keys.insert(m_keys.begin(), key);
+        m_stats.hits++;
+        return true;
+    }
+
+    void Insert(u64 key)
+    {
+        auto it = std::find(m_keys.begin(), m_keys.end(), key);
+        if (it != m_keys.end()) {
+            m_keys.erase(it);
+        } else if (m_keys.size() == m_capacity) {
+            m_keys.pop_back();
+            m_stats.evictions++;
+        }
+
+        m_keys.insert(m_keys.begin(), key);
+    }
+
+    const BackgroundCache::Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    u32 m_capacity;
+    std::vector<u64> m_keys;
+    BackgroundCache::Stats m_stats;
+};
+
+// 16x16 pixels, derived from the key so a wrong entry can't pass for the right one
+static std::vector<u32> MakeCachePixels(u64 key)
+{
+    SplitMix64 random(key);
+    std::vector<u32> pixels(16 * 16);
+
+    for (auto& pixel : pixels) {
+        pixel = static_cast<u32>(random());
+    }
+
+    return pixels;
+}
+
+static const std::size_t CACHE_ENTRY_BYTES = 16 * 16 * sizeof(u32);
+
+static bool FindCached(BackgroundCache& cache, u64 key)
+{
+    const auto entry = cache.Find(key);
+    return entry && entry->width == 16 && entry->height == 16 && entry->pixels == MakeCachePixels(key);
+}
+
+static void InsertCached(BackgroundCache& cache, u64 key)
+{
+    cache.Insert(key, 16, 16, MakeCachePixels(key));
+}
+
+// Prints the stats of a scenario and returns the number of them that aren't the expected ones
+static u32 CheckCacheStats(const char* name, const BackgroundCache::Stats& stats, const BackgroundCache::Stats& expected,
+    u32 otherErrors)
+{
+    std::printf("%-20s %8u %8u %10u %10u %12u %10zu\n", name, stats.hits, stats.misses, stats.evictions,
+        stats.diskHits, stats.diskWrites, stats.bytes / 1024);
+
+    const u32 errors = (stats.hits != expected.hits) + (stats.misses != expected.misses) +
+        (stats.evictions != expected.evictions) + (stats.diskHits != expected.diskHits) +
+        (stats.diskWrites != expected.diskWrites) + (stats.bytes != expected.bytes) + otherErrors;
+
+    if (errors) {
+        std::printf("  expected %u hits, %u misses, %u evictions, %u disk hits, %u disk writes, %zu KiB\n",
+            expected.hits, expected.misses, expected.evictions, expected.diskHits, expected.diskWrites,
+            expected.bytes / 1024);
+    }
+
+    return errors;
+}
+
+static int CacheCheck(const std::string& directory, u32 operations)
+{
+    const u32 CAPACITY = 4;
+    const std::size_t budget = CAPACITY * CACHE_ENTRY_BYTES;
+
+    std::printf("%-20s %8s %8s %10s %10s %12s %10s\n", "scenario", "hits", "misses", "evictions", "disk hits",
+        "disk writes", "KiB");
+
+    u32 errors = 0;
+
+    // Filling the cache, touching every entry, then going one over evicts the least recently used
+    {
+        BackgroundCache cache(budget, "");
+        u32 wrong = 0;
+
+        for (u64 key = 1; key <= 4; key++) {
+            InsertCached(cache, key);
+        }
+
+        for (u64 key = 1; key <= 4; key++) {
+            wrong += !FindCached(cache, key);
+        }
+
+        InsertCached(cache, 5);         // Evicts 1
+        wrong += cache.Find(1) != nullptr;
+        wrong += !FindCached(cache, 2);
+        InsertCached(cache, 6);         // Evicts 3, 2 was just used
+        wrong += cache.Find(3) != nullptr;
+
+        for (u64 key : { 2, 4, 5, 6 }) {
+            wrong += !FindCached(cache, key);
+        }
+
+        // Inserting a key again replaces its entry without evicting anything
+        InsertCached(cache, 4);
+
+        errors += CheckCacheStats("lru sequence", cache.GetStats(), { 9, 2, 2, 0, 0, budget }, wrong);
+    }
+
+    // An entry over the budget on its own evicts everything else, and is kept
+    {
+        BackgroundCache cache(budget, "");
+        u32 wrong = 0;
+
+        for (u64 key = 1; key <= 3; key++) {
+            InsertCached(cache, key);
+        }
+
+        cache.Insert(100, 64, 64, std::vector<u32>(64 * 64, 1));
+        wrong += cache.Find(100) == nullptr;
+
+        for (u64 key = 1; key <= 3; key++) {
+            wrong += cache.Find(key) != nullptr;
+        }
+
+        errors += CheckCacheStats("oversized entry", cache.GetStats(), { 1, 3, 3, 0, 0, 64 * 64 * sizeof(u32) },
+            wrong);
+    }
+
+    // Random lookups, inserting on a miss like the renderer does, against a model of the LRU list.
+    // Half the keys come from a small set that mostly fits.
+    {
+        BackgroundCache cache(budget, "");
+        CacheModel model(CAPACITY);
+        std::mt19937 random(97);
+        u32 wrong = 0;
+
+        for (u32 i = 0; i < operations; i++) {
+            const u32 keys = random() % 2 ? 5 : 20;
+            const u64 key = random() % keys;
+            const bool hit = FindCached(cache, key);
+
+            wrong += hit != model.Find(key);
+
+            if (!hit || random() % 8 == 0) {
+                InsertCached(cache, key);
+                model.Insert(key);
+            }
+        }
+
+        auto expected = model.GetStats();
+        expected.bytes = budget;
+        errors += CheckCacheStats("random", cache.GetStats(), expected, wrong);
+    }
+
+    // Entries evicted from memory come back from disk, and a new session finds all of them. Keys
+    // are from this run, so entries left by an earlier one aren't found.
+    std::vector<u64> keys;
+    SplitMix64 keyRandom(static_cast<u64>(Clock::now().time_since_epoch().count()));
+    for (u32 i = 0; i < 8; i++) {
+        keys.push_back(keyRandom());
+    }
+
+    const u64 missingKey = keyRandom();
+
+    {
+        BackgroundCache cache(budget, directory);
+        u32 wrong = 0;
+
+        for (const u64 key : keys) {
+            InsertCached(cache, key);
+        }
+
+        // Written through a temporary file, which is renamed
+        wrong += !ListFiles(directory, ".tmp").empty();
+
+        wrong += !FindCached(cache, keys[0]);
+        wrong += cache.Find(missingKey) != nullptr;
+
+        errors += CheckCacheStats("disk write", cache.GetStats(), { 1, 1, 5, 1, 8, budget }, wrong);
+    }
+
+    {
+        BackgroundCache cache(budget, directory);
+        u32 wrong = 0;
+
+        for (const u64 key : keys) {
+            wrong += !FindCached(cache, key);
+        }
+
+        // Found in memory this time
+        wrong += !FindCached(cache, keys.back());
+
+        errors += CheckCacheStats("disk read", cache.GetStats(), { 9, 0, 4, 8, 0, budget }, wrong);
+    }
+
+    // Truncated entries and ones with another key in the header are misses
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/%016" PRIx64 ".bin", keys[0]);
+        const std::string path = directory + name;
+
+        std::snprintf(name, sizeof(name), "/%016" PRIx64 ".bin", keys[1]);
+        const std::string otherPath = directory + name;
+
+        std::vector<char> contents;
+        if (FILE* file = std::fopen(otherPath.c_str(), "rb")) {
+            char buffer[4096];
+            for (std::size_t size; (size = std::fread(buffer, 1, sizeof(buffer), file)) != 0;) {
+                contents.insert(contents.end(), buffer, buffer + size);
+            }
+
+            std::fclose(file);
+        }
+
+        u32 wrong = contents.size() != 24 + CACHE_ENTRY_BYTES;
+
+        if (FILE* file = std::fopen(path.c_str(), "wb")) {
+            std::fwrite(contents.data(), 1, contents.size(), file);
+            std::fclose(file);
+        }
+
+        if (FILE* file = std::fopen(otherPath.c_str(), "wb")) {
+            std::fwrite(contents.data(), 1, contents.size() / 2, file);
+            std::fclose(file);
+        }
+
+        BackgroundCache cache(budget, directory);
+        wrong += cache.Find(keys[0]) != nullptr;
+        wrong += cache.Find(keys[1]) != nullptr;
+        wrong += !FindCached(cache, keys[2]);
+
+        errors += CheckCacheStats("corrupt entries", cache.GetStats(), { 1, 2, 0, 1, 0, CACHE_ENTRY_BYTES }, wrong);
+    }
+
+    for (const u64 key : keys) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/%016" PRIx64 ".bin", key);
+        std::remove((directory + name).c_str());
+    }
+
+    std::printf("Errors: %u\n", errors);
+    return errors ? 1 : 0;
+}
+
+static const char* GetKernelName(SuperXBR::Kernel kernel)
+{
+    switch (kernel) {
+    case SuperXBR::Kernel::AVX2:
+        return "AVX2";
+    case SuperXBR::Kernel::SSE2:
+        return "SSE2";
+    default:
+        return "Scalar";
+    }
+}
+
+static int XbrBench(u32 repeat)
+{
+    struct Size
+    {
+        u32 width;
+        u32 height;
+    };
+
+    // Sizes that aren't a multiple of any vector width, single rows and columns, and a background
+    static const Size sizes[] = {
+        { 1, 1 }, { 33, 1 }, { 1, 33 }, { 7, 5 }, { 17, 3 }, { 320, 240 },
+    };
+
+    static const SuperXBR::Kernel kernels[] = {
+        SuperXBR::Kernel::Scalar, SuperXBR::Kernel::SSE2, SuperXBR::Kernel::AVX2,
+    };
+
+    std::vector<SuperXBR::Kernel> available;
+    for (auto kernel : kernels) {
+        if (SuperXBR(SuperXBR::Params(), kernel, 1).GetKernel() == kernel) {
+            available.push_back(kernel);
+        }
+    }
+
+    // Checked with several threads even on a single core, so the row bands are split
+    const u32 threads = std::max(std::thread::hardware_concurrency(), 1u);
+    const u32 checkThreads = std::max(threads, 4u);
+    std::mt19937_64 random(5);
+    u32 errors = 0;
+
+    std::printf("Pixels differing from the scalar kernel, with 1 and %u threads:\n", checkThreads);
+
+    for (const auto& size : sizes) {
+        const std::size_t count = static_cast<std::size_t>(size.width) * size.height;
+        std::vector<u32> image(count);
+        for (auto& pixel : image) {
+            pixel = static_cast<u32>(random());
+        }
+
+        std::vector<u32> expected(count * 4);
+        std::vector<u32> output(count * 4);
+        SuperXBR(SuperXBR::Params(), SuperXBR::Kernel::Scalar, 1).Upscale(image.data(), size.width, size.height,
+            expected.data());
+
+        std::printf("%4ux%-4u", size.width, size.height);
+
+        for (auto kernel : available) {
+            std::printf("  %s", GetKernelName(kernel));
+
+            for (const u32 kernelThreads : { 1u, checkThreads }) {
+                SuperXBR upscaler(SuperXBR::Params(), kernel, kernelThreads);
+
+                // Upscaled twice, so the second run reuses the planes of the first
+                for (u32 run = 0; run < 2; run++) {
+                    std::fill(output.begin(), output.end(), 0);
+                    upscaler.Upscale(image.data(), size.width, size.height, output.data());
+                }
+
+                u32 mismatches = 0;
+                for (std::size_t i = 0; i < output.size(); i++) {
+                    mismatches += output[i] != expected[i];
+                }
+
+                std::printf(" %u", mismatches);
+                errors += mismatches != 0;
+            }
+        }
+
+        std::printf("\n");
+    }
+
+    // Two 2x steps, like the default UpscaleChain of a 320x240 background
+    std::vector<u32> background(320 * 240);
+    for (auto& pixel : background) {
+        pixel = static_cast<u32>(random());
+    }
+
+    std::vector<u32> half(640 * 480);
+    std::vector<u32> full(1280 * 960);
+    std::vector<u32> expected;
+
+    std::vector<u32> timedThreads(1, 1);
+    if (threads > 1) {
+        timedThreads.push_back(threads);
+    }
+
+    std::printf("320x240 to 1280x960, %u runs:\n", repeat);
+
+    for (auto kernel : available) {
+        std::printf("  %-6s", GetKernelName(kernel));
+
+        for (const u32 kernelThreads : timedThreads) {
+            SuperXBR upscaler(SuperXBR::Params(), kernel, kernelThreads);
+
+            const auto start = Clock::now();
+            for (u32 run = 0; run < repeat; run++) {
+                upscaler.Upscale(background.data(), 320, 240, half.data());
+                upscaler.Upscale(half.data(), 640, 480, full.data());
+            }
+            const double seconds = SecondsSince(start);
+
+            std::printf("  %2u thread%s %7.2f ms", kernelThreads, kernelThreads == 1 ? " " : "s",
+                repeat ? seconds * 1e3 / repeat : 0.0);
+
+            if (expected.empty()) {
+                expected = full;
+            } else if (full != expected) {
+                std::printf(" (differs)");
+                errors++;
+            }
+        }
+
+        std::printf("\n");
+    }
+
+    std::printf("Errors: %u\n", errors);
+    return errors ? 1 : 0;
+}
+
+// Reads the value given to each name by lines like "<prefix> <name> <value>". Quoted text between
+// the name and the value, like the description of a #pragma parameter, is skipped.
+static bool ReadShaderValues(const std::string& path, const std::string& prefix, const std::string& start,
+    const std::string& end, std::vector<std::pair<std::string, float>>& values)
+{
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    // Only lines between start and end are read, if given
+    bool reading = start.empty();
+
+    for (std::string line; std::getline(file, line);) {
+        if (!start.empty() && line.compare(0, start.size(), start) == 0) {
+            reading = true;
+            continue;
+        }
+
+        if (!end.empty() && line.compare(0, end.size(), end) == 0) {
+            reading = false;
+            continue;
+        }
+
+        if (!reading || line.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+
+        const char* text = line.c_str() + prefix.size();
+        while (*text == ' ') {
+            text++;
+        }
+
+        const char* nameEnd = text;
+        while (*nameEnd && *nameEnd != ' ') {
+            nameEnd++;
+        }
+
+        const std::string name(text, nameEnd);
+        text = nameEnd;
+
+        while (*text == ' ' || *text == '=') {
+            text++;
+        }
+
+        if (*text == '"') {
+            text = std::strchr(text + 1, '"');
+            if (!text) {
+                continue;
+            }
+
+            text++;
+        }
+
+        char* valueEnd;
+        const float value = std::strtof(text, &valueEnd);
+        if (valueEnd != text) {
+            values.emplace_back(name, value);
+        }
+    }
+
+    return true;
+}
+
+static int XbrParams(const std::string& shaderDirectory)
+{
+    // The GPU chain compiles the shaders without PARAMETER_UNIFORM, so they use the constants of
+    // super-xbr-params.inc. The #pragma parameter lines give the defaults of the original shaders.
+    std::vector<std::pair<std::string, float>> pragmas;
+    std::vector<std::pair<std::string, float>> constants;
+
+    if (!ReadShaderValues(shaderDirectory + "/super-xbr-pass0.pixel.hlsl", "#pragma parameter", "", "", pragmas) ||
+        !ReadShaderValues(shaderDirectory + "/super-xbr-params.inc", "const static float", "#else", "#endif",
+            constants)) {
+        std::fprintf(stderr, "Can't read the super-xBR shaders in %s\n", shaderDirectory.c_str());
+        return 1;
+    }
+
+    const auto find = [](const std::vector<std::pair<std::string, float>>& values, const char* name) {
+        for (const auto& value : values) {
+            if (value.first == name) {
+                return value.second;
+            }
+        }
+
+        return -1.0f;
+    };
+
+    const SuperXBR::Params params;
+
+    struct Param
+    {
+        const char* name;
+        float value;
+    };
+
+    const Param expected[] = {
+        { "XBR_EDGE_STR", params.edgeStrength },
+        { "XBR_WEIGHT", params.weight },
+        { "XBR_ANTI_RINGING", params.antiRinging },
+    };
+
+    std::printf("%-20s %8s %8s %8s\n", "parameter", "pragma", "shader", "cpu");
+
+    u32 errors = 0;
+
+    for (const auto& param : expected) {
+        const float pragma = find(pragmas, param.name);
+        const float constant = find(constants, param.name);
+
+        std::printf("%-20s %8.3f %8.3f %8.3f\n", param.name, pragma, constant, param.value);
+        errors += pragma != param.value || constant != param.value;
+    }
+
+    std::printf("Errors: %u\n", errors);
+    return errors ? 1 : 0;
+}
+
+static void PrintUsage()
+{
+    std::fprintf(stderr,
+        "Usage:\n"
+        "  ff7gx-pack build <dump directory> <output pack> [threads]\n"
+        "  ff7gx-pack textures <tga directory> <output pack>\n"
+        "  ff7gx-pack synth <output pack> <count> [size]\n"
+        "  ff7gx-pack bench <pack> [lookups]\n"
+        "  ff7gx-pack uploads <texture pack> [budget KiB] [budget ms] [threads]\n"
+        "  ff7gx-pack hashbench [MiB]\n"
+        "  ff7gx-pack collisions [count]\n"
+        "  ff7gx-pack cache <directory> [operations]\n"
+        "  ff7gx-pack xbrbench [repeat]\n"
+        "  ff7gx-pack xbrparams <shader directory>\n");
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        PrintUsage();
+        return 1;
+    }
+
+    const std::string command = argv[1];
+
+    if (command == "hashbench") {
+        const u32 mebibytes = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        return HashBench(mebibytes ? mebibytes : 1024);
+    }
+
+    if (command == "collisions") {
+        const u32 count = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        return Collisions(count ? count : 1000000);
+    }
+
+    if (command == "xbrbench") {
+        const u32 repeat = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        return XbrBench(repeat ? repeat : 20);
+    }
+
+    if (argc < 3) {
+        PrintUsage();
+        return 1;
+    }
+
+    if (command == "build" && argc >= 4) {
+        u32 threads = argc >= 5 ? std::strtoul(argv[4], nullptr, 10) : 0;
+        if (!threads) {
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+
+        return Build(argv[2], argv[3], threads);
+    }
+
+    if (command == "textures" && argc >= 4) {
+        return PackTextures(argv[2], argv[3]);
+    }
+
+    if (command == "synth" && argc >= 4) {
+        const u32 count = std::strtoul(argv[3], nullptr, 10);
+        const u32 size = argc >= 5 ? std::strtoul(argv[4], nullptr, 10) : 64;
+
+        return Synth(argv[2], count, size ? size : 64);
+    }
+
+    if (command == "bench") {
+        u32 lookups = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+        if (!lookups) {
+            lookups = 1000000;
+        }
+
+        return Bench(argv[2], lookups);
+    }
+
+    if (command == "cache") {
+        const u32 operations = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+        return CacheCheck(argv[2], operations ? operations : 100000);
+    }
+
+    if (command == "xbrparams") {
+        return XbrParams(argv[2]);
+    }
+
+    if (command == "uploads") {
+        // Same defaults as the renderer
+        UploadScheduler::Budget budget;
+        budget.bytes = static_cast<std::size_t>(argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 4096) * 1024;
+        budget.milliseconds = argc >= 5 ? std::strtod(argv[4], nullptr) : 2.0;
+        const u32 threads = argc >= 6 ? std::strtoul(argv[5], nullptr, 10) : 2;
+
+        return Uploads(argv[2], budget, threads);
+    }
+
+    PrintUsage();
+    return 1;
+}
@@ -0,0 +1,4543 @@
+// ff7gx-trace: inspects traces recorded by the renderer with TracePath set.
+//
+// Usage:
+//   ff7gx-trace dump <trace> [max records]
+//       Prints every call with its arguments and payload sizes
+//   ff7gx-trace stats <trace>
+//       Prints call counts, payload bytes and frame times
+//   ff7gx-trace bench <output trace> [frames] [draws per frame]
+//       Records synthetic frames and measures the recording overhead
+//   ff7gx-trace replay <trace> [repeat] [multi|single] [per-frame csv]
+//       Replays the trace through the renderer's background logic against a mock device, and
+//       measures CPU time, draw calls, state changes and heap allocations per frame
+//   ff7gx-trace render <trace> <width>x<height> [threads] [tga directory]
+//       Renders the trace with the software rasterizer and prints a hash of every frame, for
+//       golden image checks. Game textures are replaced by placeholders.
+//   ff7gx-trace rasterbench <trace> [max threads]
+//       Renders the trace from 320x240 to 3840x2160 with 1, 2, 4... threads and checks that
+//       every thread count produces the same frames
+//   ff7gx-trace profile <trace> [repeat] [chrome trace]
+//       Measures the cost of a profiler scope, replays the trace with and without the profiler and
+//       prints the time spent in every scope
+//   ff7gx-trace statefilter <trace> [multi|single]
+//       Replays the trace making the D3D calls the renderer and the game make, and checks that
+//       dropping the redundant ones with a StateCache leaves the device in the same state at
+//       every draw
+//   ff7gx-trace statesave <trace> [multi|single] [upscale chain]
+//       Replays the trace like statefilter, and checks that saving and restoring only the states
+//       the background passes change leaves the device in the state the game set. The upscale
+//       chain is given like UpscaleChain in ff7gx.ini.
+//   ff7gx-trace skipcheck <trace> [multi|single]
+//       Replays the trace skipping unchanged backgrounds, and checks that every frame skipped would
+//       have drawn the same background and that the frames render the same as without skipping.
+//       Does the same with some frames changed in different ways.
+//   ff7gx-trace dirtyrects <trace> [repeat]
+//       Replays the trace with animated tiles, and checks that the dirty rectangles cover every
+//       pixel of the background that changed and that a model of the upscale chain drawing only
+//       them gives the same output. Prints the share of the background found dirty and the time
+//       tracking it takes per frame.
+//   ff7gx-trace batchcheck <trace> [multi|single]
+//       Replays the trace with tile batching on and off, and checks that both draw the same triangles
+//       with the same states. Does the same for synthetic batches around the 65536 vertex limit.
+//   ff7gx-trace composite <trace> [repeat]
+//       Composites the layers over every frame of the trace on the CPU, once per layer and in a
+//       single pass with a lookup, checks that both give the same pixels and prints their cost
+//   ff7gx-trace eventbench [calls]
+//       Measures the cost of naming the D3D event of a generated wrapper, formatted on every call
+//       like the wrappers used to and formatted only when events are enabled
+//   ff7gx-trace dispatchbench [calls]
+//       Measures the cost of a call through a generated wrapper that looks the renderer up and
+//       calls it virtually, one that calls a cached instance statically, and a bypassed slot
+//   ff7gx-trace logbench [max threads] [messages per thread]
+//       Measures the latency of logging a message from 1, 2, 4... threads at once, with the
+//       asynchronous logger and with a synchronous one formatting under a lock
+//   ff7gx-trace vertexbench [vertices per call]
+//       Checks every vertex transform kernel against the scalar one, and measures their throughput
+//   ff7gx-trace texturepool [plans]
+//       Plans random frames with a TexturePool and checks that requests sharing a texture never
+//       overlap, that no plan uses more textures than it has to, that planning a frame again
+//       creates nothing, and that the memory tracked matches what's created
+//   ff7gx-trace upscalechain [upscale chain] [internal scale]
+//       Prints the passes and targets planned for an upscale chain and checks that every pass
+//       reads targets already written, at the sizes it expects. Without a chain, checks every
+//       chain of up to 4 steps.
+//   ff7gx-trace quality [upscale chain] [internal scale] [target us]
+//       Prints the quality levels DynamicQuality steps through from an upscale chain, and runs the
+//       controller on synthetic frame times: light, heavy and changing loads, noise, hitches and vsync.
+//   ff7gx-trace frameallocator [frames]
+//       Allocates frames from a FrameAllocator, and checks that once it's warmed up, frames make no
+//       heap calls, also after a frame that didn't fit grew it. Prints the time per frame.
+//   ff7gx-trace layerdepths [frames]
+//       Checks that LayerDepthSet gives the layers the unordered_set it replaced did, apart from its
+//       clamping, for random depths and edge cases like NaNs and infinities, and times both.
+//       Checks that the same frame times give the same levels, that the level doesn't flap, and
+//       that it settles on one holding the target.
+
+#include "BackgroundRenderer.h"
+#include "Common.h"
+#include "DirtyRects.h"
+#include "FrameAllocator.h"
+#include "GameTypes.h"
+#include "LayerComposite.h"
+#include "Log.h"
+#include "Profiler.h"
+#include "QualityController.h"
+#include "ScopedD3DEvent.h"
+#include "StateCache.h"
+#include "StateSet.h"
+#include "SoftRasterizer.h"
+#include "TexturePool.h"
+#include "Tga.h"
+#include "ThreadPool.h"
+#include "TraceReader.h"
+#include "TraceRecorder.h"
+#include "UpscaleChain.h"
+#include "VertexTransform.h"
+
+#include "Generated/GfxSlotNames.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdarg>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <cwchar>
+
+using Clock = std::chrono::high_resolution_clock;
+
+// Offsets of the FF7::GfxFunctions the renderer overrides. EndFrame marks the end of a frame in a trace.
+static const u16 END_FRAME_SLOT = 0x10;
+static const u16 CLEAR_SLOT = 0x14;
+static const u16 CLEAR_ALL_SLOT = 0x18;
+static const u16 SET_RENDER_STATE_SLOT = 0x64;
+static const u16 GFX_FN_84_SLOT = 0x84;
+static const u16 GFX_FN_88_SLOT = 0x88;
+static const u16 DRAW_TILES_SLOT = 0xB4;
+
+static const u32 VERTEX_SIZE = sizeof(FF7::Vertex);
+
+// Counts heap allocations, so replay can report the ones made by the renderer, and frees for the
+// frameallocator check
+static std::atomic<u64> g_heapAllocations(0);
+static std::atomic<u64> g_heapFrees(0);
+
+// Kept out of line, otherwise GCC sees the malloc() and free() in them where standard containers
+// allocate, and warns that new and delete don't match
+#ifdef __GNUC__
+#define HEAP_COUNTER_FN __attribute__((noinline))
+#else
+#define HEAP_COUNTER_FN
+#endif
+
+HEAP_COUNTER_FN void* operator new(std::size_t size)
+{
+    g_heapAllocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+
+    throw std::bad_alloc();
+}
+
+HEAP_COUNTER_FN void operator delete(void* memory) noexcept
+{
+    g_heapFrees.fetch_add(memory != nullptr, std::memory_order_relaxed);
+    std::free(memory);
+}
+
+HEAP_COUNTER_FN void operator delete(void* memory, std::size_t) noexcept
+{
+    g_heapFrees.fetch_add(memory != nullptr, std::memory_order_relaxed);
+    std::free(memory);
+}
+
+static double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static std::string GetSlotName(u16 slot)
+{
+    if (slot == Trace::Slot::DrawHook) {
+        return "DrawHook";
+    }
+
+    if (slot == Trace::Slot::Return) {
+        return "Return";
+    }
+
+    if (slot == Trace::Slot::GameMode) {
+        return "GameMode";
+    }
+
+    const u32 index = slot / 4;
+    if (slot % 4 == 0 && index < sizeof(GFX_SLOT_NAMES) / sizeof(GFX_SLOT_NAMES[0]) && GFX_SLOT_NAMES[index]) {
+        return GFX_SLOT_NAMES[index];
+    }
+
+    char name[16];
+    std::snprintf(name, sizeof(name), "Slot_%02X", slot);
+    return name;
+}
+
+// Like GetSlotName(), but only returns names that stay valid, for profiler scopes
+static const char* GetScopeName(u16 slot)
+{
+    if (slot == Trace::Slot::DrawHook) {
+        return "DrawHook";
+    }
+
+    if (slot == Trace::Slot::Return) {
+        return "Return";
+    }
+
+    if (slot == Trace::Slot::GameMode) {
+        return "GameMode";
+    }
+
+    const u32 index = slot / 4;
+    if (slot % 4 == 0 && index < sizeof(GFX_SLOT_NAMES) / sizeof(GFX_SLOT_NAMES[0]) && GFX_SLOT_NAMES[index]) {
+        return GFX_SLOT_NAMES[index];
+    }
+
+    return "Unknown";
+}
+
+static bool OpenTrace(TraceReader& reader, const std::string& path)
+{
+    if (!reader.Open(path.c_str())) {
+        std::fprintf(stderr, "Failed to open %s\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static void ReportTruncated(const TraceReader& reader)
+{
+    if (reader.IsTruncated()) {
+        std::fprintf(stderr, "Warning: the trace ends with a partial record\n");
+    }
+}
+
+static int Dump(const std::string& path, u64 maxRecords)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    TraceRecord record;
+    u64 frame = 0;
+
+    for (u64 i = 0; i < maxRecords && reader.Next(record); i++) {
+        std::printf("%6" PRIu64 " %12.3f ms  %s(", frame, record.time / 1e6, GetSlotName(record.slot).c_str());
+
+        for (u32 arg = 0; arg < record.argCount; arg++) {
+            std::printf(arg ? ", 0x%x" : "0x%x", record.args[arg]);
+        }
+
+        std::printf(")");
+
+        for (u32 payload = 0; payload < record.payloadCount; payload++) {
+            std::printf(" [%u bytes]", record.payloads[payload].size);
+        }
+
+        std::printf("\n");
+
+        if (record.slot == END_FRAME_SLOT) {
+            frame++;
+        }
+    }
+
+    ReportTruncated(reader);
+    return 0;
+}
+
+static int Stats(const std::string& path)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    struct SlotStats
+    {
+        u64 calls;
+        u64 payloadBytes;
+    };
+
+    std::map<u16, SlotStats> slots;
+    std::vector<u64> frameTimes;
+
+    TraceRecord record;
+    u64 records = 0;
+    u64 firstTime = 0;
+    u64 lastTime = 0;
+    u64 lastFrameEnd = 0;
+
+    while (reader.Next(record)) {
+        if (records++ == 0) {
+            firstTime = record.time;
+            lastFrameEnd = record.time;
+        }
+
+        lastTime = record.time;
+
+        auto& stats = slots[record.slot];
+        stats.calls++;
+
+        for (u32 i = 0; i < record.payloadCount; i++) {
+            stats.payloadBytes += record.payloads[i].size;
+        }
+
+        if (record.slot == END_FRAME_SLOT) {
+            frameTimes.push_back(record.time - lastFrameEnd);
+            lastFrameEnd = record.time;
+        }
+    }
+
+    std::printf("Records:  %" PRIu64 " (%.1f MiB)\n", records, reader.GetSize() / (1024.0 * 1024.0));
+    std::printf("Duration: %.3f s\n", (lastTime - firstTime) / 1e9);
+    std::printf("Frames:   %zu\n", frameTimes.size());
+
+    if (!frameTimes.empty()) {
+        std::sort(frameTimes.begin(), frameTimes.end());
+
+        u64 total = 0;
+        for (auto time : frameTimes) {
+            total += time;
+        }
+
+        std::printf("Frame time: %.3f ms average, %.3f ms median, %.3f ms max\n",
+            total / 1e6 / frameTimes.size(), frameTimes[frameTimes.size() / 2] / 1e6, frameTimes.back() / 1e6);
+    }
+
+    std::printf("\n%-16s %10s %14s\n", "Function", "Calls", "Payload bytes");
+    for (const auto& slot : slots) {
+        std::printf("%-16s %10" PRIu64 " %14" PRIu64 "\n", GetSlotName(slot.first).c_str(), slot.second.calls,
+            slot.second.payloadBytes);
+    }
+
+    ReportTruncated(reader);
+    return 0;
+}
+
+// Stand-in for the work the game and the renderer do per draw, so the overhead can be compared
+// against something
+static u32 SimulateDraw(const std::vector<FF7::Vertex>& vertices, const std::vector<u16>& indices)
+{
+    const auto bytes = reinterpret_cast<const u8*>(vertices.data());
+
+    u32 checksum = 0;
+    for (std::size_t i = 0; i < vertices.size() * VERTEX_SIZE; i++) {
+        checksum = checksum * 31 + bytes[i];
+    }
+
+    for (auto index : indices) {
+        checksum += index;
+    }
+
+    return checksum;
+}
+
+static int Bench(const std::string& path, u32 frames, u32 drawsPerFrame)
+{
+    // A field screen is mostly background tiles, each a 16x16 quad on one of a few layers
+    const u32 TILES_PER_DRAW = 16;
+    const u32 VERTICES_PER_DRAW = 4 * TILES_PER_DRAW;
+    const u32 INDICES_PER_DRAW = 6 * TILES_PER_DRAW;
+
+    // The game changes the texture page and render states every few draws
+    const u32 DRAWS_PER_TEXTURE = 8;
+
+    std::vector<FF7::Vertex> vertices(VERTICES_PER_DRAW);
+    std::vector<u16> indices(INDICES_PER_DRAW);
+
+    for (u32 tile = 0; tile < TILES_PER_DRAW; tile++) {
+        const float x = static_cast<float>(tile % 8) * 32.0f;
+        const float y = static_cast<float>(tile / 8) * 32.0f;
+        const float z = static_cast<float>(1 + tile % 4) / 64.0f;
+        const float corners[4][2] = { { 0.0f, 0.0f }, { 32.0f, 0.0f }, { 32.0f, 32.0f }, { 0.0f, 32.0f } };
+
+        for (u32 corner = 0; corner < 4; corner++) {
+            auto& vertex = vertices[tile * 4 + corner];
+            vertex.x = x + corners[corner][0];
+            vertex.y = y + corners[corner][1];
+            vertex.z = z;
+            vertex.w = 1.0f;
+            vertex.color = 0xff808080 + tile;
+            vertex.unknown = 0.0f;
+            vertex.u = corners[corner][0] / 256.0f;
+            vertex.v = corners[corner][1] / 256.0f;
+        }
+
+        const u16 quad[6] = { 0, 1, 2, 0, 2, 3 };
+        for (u32 i = 0; i < 6; i++) {
+            indices[tile * 6 + i] = static_cast<u16>(tile * 4 + quad[i]);
+        }
+    }
+
+    const u32 vertexBytes = static_cast<u32>(vertices.size() * VERTEX_SIZE);
+
+    // Runs the frames with or without recording, and returns the time per frame
+    auto runFrames = [&](TraceRecorder* recorder, u32& checksum) {
+        const auto start = Clock::now();
+
+        for (u32 frame = 0; frame < frames; frame++) {
+            // The call sequence of a field screen: clear, draw the background, switch to dialogs
+            if (recorder) {
+                const u32 clearArgs[] = { 1, 1 };
+                recorder->Record(CLEAR_SLOT, clearArgs, 2);
+
+                const u32 drawModeArgs[] = { 0, 0 };
+                recorder->Record(GFX_FN_88_SLOT, drawModeArgs, 2);
+
+                const u32 returnArgs[] = { GFX_FN_88_SLOT, 1 };
+                recorder->Record(Trace::Slot::Return, returnArgs, 2);
+
+                const u32 drawTilesArgs[] = { 0, 0 };
+                recorder->Record(DRAW_TILES_SLOT, drawTilesArgs, 2);
+            }
+
+            for (u32 draw = 0; draw < drawsPerFrame; draw++) {
+                if (recorder) {
+                    const u32 texture = 0x1000 + draw / DRAWS_PER_TEXTURE;
+
+                    if (draw % DRAWS_PER_TEXTURE == 0) {
+                        const u32 renderStateArgs[] = { 1, texture, 0 };
+                        recorder->Record(SET_RENDER_STATE_SLOT, renderStateArgs, 3);
+                    }
+
+                    const u32 args[] = { FF7::PrimitiveType::TriangleList, FF7::DrawType::Ortho, 0, VERTICES_PER_DRAW,
+                        0, INDICES_PER_DRAW, 0, 0, texture };
+                    TraceRecorder::Payload payloads[] = {
+                        { vertices.data(), vertexBytes },
+                        { indices.data(), static_cast<u32>(indices.size() * sizeof(u16)) }
+                    };
+
+                    recorder->Record(Trace::Slot::DrawHook, args, 9, payloads, 2);
+                }
+
+                checksum += SimulateDraw(vertices, indices);
+            }
+
+            if (recorder) {
+                const u32 returnArgs[] = { DRAW_TILES_SLOT, 0 };
+                recorder->Record(Trace::Slot::Return, returnArgs, 2);
+
+                const u32 drawModeArgs[] = { 1, 0 };
+                recorder->Record(GFX_FN_84_SLOT, drawModeArgs, 2);
+
+                const u32 gameModeArgs[] = { FF7::GameMode::Field };
+                recorder->Record(Trace::Slot::GameMode, gameModeArgs, 1);
+
+                const u32 args[] = { 0 };
+                recorder->Record(END_FRAME_SLOT, args, 1);
+            }
+        }
+
+        return SecondsSince(start) / frames;
+    };
+
+    u32 checksum = 0;
+    const double baseline = runFrames(nullptr, checksum);
+
+    TraceRecorder::Stats stats;
+    double recorded;
+
+    {
+        TraceRecorder recorder(path, 16 * 1024 * 1024);
+        if (!recorder.IsOpen()) {
+            std::fprintf(stderr, "Failed to create %s\n", path.c_str());
+            return 1;
+        }
+
+        recorded = runFrames(&recorder, checksum);
+        stats = recorder.GetStats();
+    }
+
+    // Everything that wasn't dropped has to come back out intact
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    TraceRecord record;
+    u64 records = 0;
+    u64 corrupted = 0;
+
+    while (reader.Next(record)) {
+        records++;
+
+        if (record.slot == Trace::Slot::DrawHook &&
+            (record.payloadCount != 2 || record.payloads[0].size != vertexBytes ||
+                std::memcmp(record.payloads[0].data, vertices.data(), vertexBytes) != 0)) {
+            corrupted++;
+        }
+    }
+
+    const double overhead = recorded - baseline;
+
+    std::printf("Frames:            %u with %u draws each (checksum %08x)\n", frames, drawsPerFrame, checksum);
+    std::printf("Frame time:        %.3f ms without recording, %.3f ms with\n", baseline * 1e3, recorded * 1e3);
+    std::printf("Overhead:          %.3f ms per frame, %.2f%% of a 60 Hz frame\n", overhead * 1e3,
+        overhead / (1.0 / 60.0) * 100.0);
+    std::printf("Per record:        %.0f ns\n", overhead * frames * 1e9 / std::max<u64>(stats.records, 1));
+    std::printf("Records:           %" PRIu64 " written, %" PRIu64 " dropped, %" PRIu64 " read back\n",
+        stats.records, stats.dropped, records);
+    std::printf("Trace size:        %.1f MiB, ring peaked at %.1f MiB\n", stats.bytes / (1024.0 * 1024.0),
+        stats.maxRingUsage / (1024.0 * 1024.0));
+
+    if (records != stats.records || corrupted || reader.IsTruncated()) {
+        std::fprintf(stderr, "Trace doesn't match what was recorded (%" PRIu64 " corrupted records)\n", corrupted);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Stands in for Renderer on D3D. Counts what would be sent to the device instead of drawing.
+class MockDevice : public BackgroundRenderer::Device
+{
+public:
+    struct Counters
+    {
+        u64 drawCalls;
+        u64 vertices;
+        u64 indices;
+        u64 stateChanges;   // Render target switches, passes, layers, state block applies and game state changes
+        u64 clears;
+    };
+
+    MockDevice() :
+        m_counters{},
+        m_texture(nullptr)
+    {
+    }
+
+    // The texture the game bound for the current draw, which only the trace knows
+    void SetGameTexture(const void* texture)
+    {
+        m_texture = texture;
+    }
+
+    Counters& GetCounters()
+    {
+        return m_counters;
+    }
+
+    // The game changed a render state with its own SetRenderState()
+    void GameStateChanged(u32, u32)
+    {
+        m_counters.stateChanges++;
+    }
+
+    virtual void CaptureState() override
+    {
+    }
+
+    virtual void ApplyState() override
+    {
+        m_counters.stateChanges++;
+    }
+
+    virtual void SetRenderTarget(BackgroundRenderer::Target) override
+    {
+        m_counters.stateChanges++;
+    }
+
+    virtual void BeginPass(BackgroundRenderer::Pass, const LayerDepthSet&) override
+    {
+        m_counters.stateChanges++;
+    }
+
+    virtual void EndPass() override
+    {
+        m_counters.stateChanges++;
+    }
+
+    virtual void SetLayer(u32) override
+    {
+        m_counters.stateChanges++;
+    }
+
+    virtual void PrepareLayers(const LayerDepthSet&, const DirtyRects&) override
+    {
+    }
+
+    virtual void Draw(const TileBatcher::DrawState&, const FF7::Vertex*, u32 vertexCount, const u16*,
+        u32 indexCount) override
+    {
+        m_counters.drawCalls++;
+        m_counters.vertices += vertexCount;
+        m_counters.indices += indexCount;
+    }
+
+    virtual const void* GetTexture() override
+    {
+        return m_texture;
+    }
+
+    virtual void SetTexture(const void* texture) override
+    {
+        m_texture = texture;
+        m_counters.stateChanges++;
+    }
+
+    virtual u32 ClearTarget(u32, u32) override
+    {
+        m_counters.clears++;
+        return 0;
+    }
+
+    virtual void GetRenderDimensions(float* width, float* height) override
+    {
+        *width = 640.0f;
+        *height = 480.0f;
+    }
+
+private:
+    Counters m_counters;
+    const void* m_texture;
+};
+
+// A call from the trace that the renderer's logic depends on, decoded up front so replaying
+// doesn't measure reading the trace
+struct ReplayCall
+{
+    u16 slot;
+    u32 args[4];
+
+    // DrawHook only, pointing into the mapped trace
+    const FF7::Vertex* vertices;
+    u32 vertexCount;
+    const u16* indices;
+    u32 indexCount;
+    const void* texture;
+};
+
+static bool DecodeCall(const TraceRecord& record, ReplayCall& call)
+{
+    call = ReplayCall{};
+    call.slot = record.slot;
+
+    switch (record.slot) {
+    case Trace::Slot::DrawHook:
+        if (record.argCount < 8 || record.payloadCount < 2) {
+            return false;
+        }
+
+        call.args[0] = record.args[0];  // primType
+        call.args[1] = record.args[1];  // drawType
+        call.args[2] = record.args[6];  // a7
+        call.args[3] = record.args[7];  // scissor
+
+        // Payloads are 4-byte aligned, which is enough for both
+        call.vertices = reinterpret_cast<const FF7::Vertex*>(record.payloads[0].data);
+        call.vertexCount = std::min(record.args[3], record.payloads[0].size / VERTEX_SIZE);
+        call.indices = reinterpret_cast<const u16*>(record.payloads[1].data);
+        call.indexCount = std::min(record.args[5], static_cast<u32>(record.payloads[1].size / sizeof(u16)));
+        call.texture = record.argCount > 8 ? reinterpret_cast<const void*>(static_cast<std::uintptr_t>(record.args[8])) : nullptr;
+        return true;
+
+    case END_FRAME_SLOT:
+    case CLEAR_SLOT:
+    case CLEAR_ALL_SLOT:
+    case SET_RENDER_STATE_SLOT:
+    case GFX_FN_84_SLOT:
+    case GFX_FN_88_SLOT:
+    case DRAW_TILES_SLOT:
+    case Trace::Slot::Return:
+    case Trace::Slot::GameMode:
+        std::copy(record.args, record.args + std::min<u32>(record.argCount, 4), call.args);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+struct ReplayFrame
+{
+    double seconds;
+    u64 drawCalls;
+    u64 tileBatches;
+    u64 stateChanges;
+    u64 heapAllocations;
+    u32 frameAllocations;
+    u32 frameBytes;
+};
+
+// Feeds the calls to BackgroundRenderer the way Renderer does. endFrame(renderer) is called at the end
+// of every frame instead of EndFrame(), so the caller can measure the frame.
+template<typename DeviceType, typename EndFrameFunc>
+static void PlayCalls(const std::vector<ReplayCall>& calls, DeviceType& device, BackgroundRenderer& renderer,
+    EndFrameFunc endFrame)
+{
+    // GfxFn_84 needs the game mode and GfxFn_88 its result, which are recorded after the call
+    u32 pendingDrawMode84 = 0;
+    u32 pendingDrawMode88 = 0;
+    bool pending84 = false;
+    bool inTiles = false;
+
+    for (const auto& call : calls) {
+        // Stands in for the scope of the generated wrapper
+        ProfileScope _profile(GetScopeName(call.slot));
+
+        switch (call.slot) {
+        case Trace::Slot::DrawHook:
+            // The game binds the tile texture before each draw, which Renderer::SetTextureHook() sees
+            renderer.BeforeSetTexture(call.texture);
+            device.SetGameTexture(call.texture);
+            renderer.DrawHook(static_cast<FF7::PrimitiveType>(call.args[0]), call.args[1], call.vertices,
+                call.vertexCount, call.indices, call.indexCount, call.args[2], call.args[3]);
+            break;
+
+        case DRAW_TILES_SLOT:
+            if (renderer.IsDrawingBackground()) {
+                renderer.BeginTiles();
+                inTiles = true;
+            }
+            break;
+
+        case SET_RENDER_STATE_SLOT:
+            renderer.FlushTiles();
+            device.GameStateChanged(call.args[0], call.args[1]);
+            break;
+
+        case CLEAR_SLOT:
+            renderer.Clear(call.args[0], call.args[1]);
+            break;
+
+        case CLEAR_ALL_SLOT:
+            renderer.Clear(1, 1);
+            break;
+
+        case GFX_FN_84_SLOT:
+            pendingDrawMode84 = call.args[0];
+            pending84 = true;
+            break;
+
+        case Trace::Slot::GameMode:
+            if (pending84) {
+                renderer.GfxFn_84(pendingDrawMode84, call.args[0]);
+                pending84 = false;
+            }
+            break;
+
+        case GFX_FN_88_SLOT:
+            pendingDrawMode88 = call.args[0];
+            break;
+
+        case Trace::Slot::Return:
+            if (call.args[0] == GFX_FN_88_SLOT) {
+                renderer.GfxFn_88(pendingDrawMode88, call.args[1]);
+            } else if (call.args[0] == DRAW_TILES_SLOT && inTiles) {
+                renderer.EndTiles();
+                inTiles = false;
+            }
+            break;
+
+        case END_FRAME_SLOT:
+            if (inTiles) {
+                renderer.EndTiles();
+                inTiles = false;
+            }
+
+            endFrame(renderer);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+// Replays the calls against a MockDevice and measures each frame
+static void ReplayCalls(const std::vector<ReplayCall>& calls, bool singlePassLayers, std::vector<ReplayFrame>& frames)
+{
+    MockDevice device;
+    BackgroundRenderer renderer(device, singlePassLayers);
+
+    MockDevice::Counters start = device.GetCounters();
+    u64 startBatches = renderer.GetTileStats().batches;
+    u64 startAllocations = g_heapAllocations.load(std::memory_order_relaxed);
+    auto startTime = Clock::now();
+
+    PlayCalls(calls, device, renderer, [&](BackgroundRenderer& renderer) {
+        // Read before EndFrame() resets them
+        const auto allocatorStats = renderer.GetFrameAllocatorStats();
+        renderer.EndFrame();
+
+        const auto& counters = device.GetCounters();
+
+        ReplayFrame frame;
+        frame.seconds = SecondsSince(startTime);
+        frame.drawCalls = counters.drawCalls - start.drawCalls;
+        frame.tileBatches = renderer.GetTileStats().batches - startBatches;
+        frame.stateChanges = counters.stateChanges - start.stateChanges;
+        frame.heapAllocations = g_heapAllocations.load(std::memory_order_relaxed) - startAllocations;
+        frame.frameAllocations = allocatorStats.allocations;
+        frame.frameBytes = allocatorStats.bytesUsed;
+        frames.push_back(frame);
+
+        // Like Renderer::EndFrame()
+        if (auto profiler = GetProfiler()) {
+            profiler->EndFrame();
+        }
+
+        // push_back() may allocate, so the next frame starts counting after it
+        start = counters;
+        startBatches = renderer.GetTileStats().batches;
+        startAllocations = g_heapAllocations.load(std::memory_order_relaxed);
+        startTime = Clock::now();
+    });
+}
+
+// Decodes the calls BackgroundRenderer needs, returns the number of complete frames
+static u64 LoadCalls(TraceReader& reader, std::vector<ReplayCall>& calls)
+{
+    TraceRecord record;
+    ReplayCall call;
+    u64 frameCount = 0;
+    bool hasResults = false;
+
+    while (reader.Next(record)) {
+        if (DecodeCall(record, call)) {
+            calls.push_back(call);
+            frameCount += call.slot == END_FRAME_SLOT;
+            hasResults |= call.slot == Trace::Slot::Return;
+        }
+    }
+
+    ReportTruncated(reader);
+
+    if (!frameCount) {
+        std::fprintf(stderr, "The trace has no complete frames\n");
+    } else if (!hasResults) {
+        std::fprintf(stderr, "Warning: the trace has no return values, so background tiles aren't replayed\n");
+    }
+
+    return frameCount;
+}
+
+static int Replay(const std::string& path, u32 repeat, bool singlePassLayers, const std::string& csvPath)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    const u64 frameCount = LoadCalls(reader, calls);
+    if (!frameCount) {
+        return 1;
+    }
+
+    // Enough for every frame, so recording the frames doesn't allocate during the replay
+    std::vector<ReplayFrame> frames;
+    frames.reserve(static_cast<std::size_t>(frameCount) * repeat);
+
+    for (u32 i = 0; i < repeat; i++) {
+        ReplayCalls(calls, singlePassLayers, frames);
+    }
+
+    if (!csvPath.empty()) {
+        std::ofstream csv(csvPath);
+        if (!csv) {
+            std::fprintf(stderr, "Failed to create %s\n", csvPath.c_str());
+            return 1;
+        }
+
+        csv << "frame,microseconds,draw calls,tile batches,state changes,heap allocations,frame allocations,frame bytes\n";
+        for (std::size_t i = 0; i < frames.size(); i++) {
+            const auto& frame = frames[i];
+            csv << i << ',' << frame.seconds * 1e6 << ',' << frame.drawCalls << ',' << frame.tileBatches << ','
+                << frame.stateChanges << ',' << frame.heapAllocations << ',' << frame.frameAllocations << ','
+                << frame.frameBytes << '\n';
+        }
+    }
+
+    std::vector<double> times;
+    u64 drawCalls = 0, tileBatches = 0, stateChanges = 0, heapAllocations = 0, frameAllocations = 0;
+    u64 maxDrawCalls = 0, maxHeapAllocations = 0, framesAllocating = 0, maxFrameBytes = 0;
+
+    for (const auto& frame : frames) {
+        times.push_back(frame.seconds);
+        drawCalls += frame.drawCalls;
+        tileBatches += frame.tileBatches;
+        stateChanges += frame.stateChanges;
+        heapAllocations += frame.heapAllocations;
+        frameAllocations += frame.frameAllocations;
+        maxDrawCalls = std::max(maxDrawCalls, frame.drawCalls);
+        maxHeapAllocations = std::max(maxHeapAllocations, frame.heapAllocations);
+        maxFrameBytes = std::max<u64>(maxFrameBytes, frame.frameBytes);
+        framesAllocating += frame.heapAllocations != 0;
+    }
+
+    std::sort(times.begin(), times.end());
+
+    double totalTime = 0.0;
+    for (auto time : times) {
+        totalTime += time;
+    }
+
+    const double count = static_cast<double>(frames.size());
+
+    std::printf("Calls:             %zu replayed per pass, %" PRIu64 " frames, %u passes, %s layers\n",
+        calls.size(), frameCount, repeat, singlePassLayers ? "single pass" : "multi-pass");
+    std::printf("Frame time:        %.2f us average, %.2f us median, %.2f us 99th percentile, %.2f us max\n",
+        totalTime / count * 1e6, times[times.size() / 2] * 1e6, times[std::min(times.size() - 1, times.size() * 99 / 100)] * 1e6,
+        times.back() * 1e6);
+    std::printf("Draw calls:        %.1f per frame (%" PRIu64 " max), %.2f tile batches per draw call\n",
+        drawCalls / count, maxDrawCalls, drawCalls ? static_cast<double>(tileBatches) / drawCalls : 0.0);
+    std::printf("State changes:     %.1f per frame\n", stateChanges / count);
+    std::printf("Frame allocator:   %.1f allocations per frame, %.1f KiB peak\n", frameAllocations / count,
+        maxFrameBytes / 1024.0);
+    std::printf("Heap allocations:  %.2f per frame (%" PRIu64 " max), in %" PRIu64 " of %zu frames\n",
+        heapAllocations / count, maxHeapAllocations, framesAllocating, frames.size());
+
+    return 0;
+}
+
+// Implements Device on a SoftRasterizer, like Renderer does on D3D9.
+//
+// The trace doesn't have texture contents, so every game texture is replaced by a checkerboard
+// with a color derived from its address. Perspective draws are skipped since the game's matrices
+// aren't recorded either. Everything else follows the renderer: the tiles are drawn to a 320x240
+// background target and the layers sample it with the background shaders.
+class RasterDevice : public BackgroundRenderer::Device
+{
+public:
+    static const u32 BACKGROUND_WIDTH = 320;
+    static const u32 BACKGROUND_HEIGHT = 240;
+    static const u32 PLACEHOLDER_SIZE = 64;
+
+    RasterDevice(SoftRasterizer& rasterizer, u32 width, u32 height) :
+        m_rasterizer(rasterizer),
+        m_background(BACKGROUND_WIDTH, BACKGROUND_HEIGHT),
+        m_backbuffer(width, height),
+        m_lookup(LayerComposite::LOOKUP_SIZE),
+        m_texture(nullptr),
+        m_skippedDraws(0)
+    {
+        m_state = GameState();
+        m_savedState = m_state;
+        m_rasterizer.SetTarget(&m_backbuffer);
+    }
+
+    void SetGameTexture(const void* texture)
+    {
+        m_texture = texture;
+    }
+
+    void GameStateChanged(u32, u32)
+    {
+    }
+
+    const SoftRasterizer::Target& GetBackbuffer() const
+    {
+        return m_backbuffer;
+    }
+
+    const SoftRasterizer::Target& GetBackground() const
+    {
+        return m_background;
+    }
+
+    u64 GetSkippedDraws() const
+    {
+        return m_skippedDraws;
+    }
+
+    virtual void CaptureState() override
+    {
+        m_savedState = m_state;
+    }
+
+    virtual void ApplyState() override
+    {
+        m_state = m_savedState;
+    }
+
+    virtual void SetRenderTarget(BackgroundRenderer::Target target) override
+    {
+        m_rasterizer.SetTarget(target == BackgroundRenderer::Target::Background ? &m_background : &m_backbuffer);
+    }
+
+    virtual void BeginPass(BackgroundRenderer::Pass pass, const LayerDepthSet& layers) override
+    {
+        // The passes draw in 320x240 coordinates, either to the background or through its projection
+        m_state.viewWidth = static_cast<float>(BACKGROUND_WIDTH);
+        m_state.viewHeight = static_cast<float>(BACKGROUND_HEIGHT);
+        m_state.depthWrite = false;
+        m_state.alphaBlend = false;
+
+        if (pass == BackgroundRenderer::Pass::Tiles) {
+            // The background target has no depth buffer of its own
+            m_state.shader = SoftRasterizer::Shader::Background;
+            m_state.depthTest = false;
+            return;
+        }
+
+        // Reading the background flushes the tiles drawn to it
+        m_rasterizer.Flush();
+
+        m_state.texture = m_background.AsTexture();
+        m_state.pointTexture = m_background.AsTexture();
+        m_state.filter = SoftRasterizer::Filter::Linear;
+        m_state.depthTest = true;
+        m_state.shader = SoftRasterizer::Shader::BackgroundLayer;
+
+        if (pass == BackgroundRenderer::Pass::Composite) {
+            LayerComposite::BuildLookup(layers, m_lookup.data());
+            m_state.layerLookup = m_lookup.data();
+            m_state.shader = SoftRasterizer::Shader::BackgroundComposite;
+        }
+    }
+
+    virtual void EndPass() override
+    {
+    }
+
+    virtual void SetLayer(u32 layer) override
+    {
+        m_state.layerDepth = static_cast<float>(layer);
+    }
+
+    virtual void PrepareLayers(const LayerDepthSet&, const DirtyRects&) override
+    {
+    }
+
+    virtual void Draw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+        const u16* indices, u32 indexCount) override
+    {
+        if (state.drawType != FF7::DrawType::Ortho) {
+            m_skippedDraws++;
+            return;
+        }
+
+        SoftRasterizer::State drawState = m_state;
+        drawState.primType = state.primType;
+        drawState.drawType = state.drawType;
+
+        // The layer passes bind the background themselves. Like the game's Draw(), the others draw with
+        // the bound texture rather than the one in the batch state.
+        if (drawState.shader == SoftRasterizer::Shader::Game || drawState.shader == SoftRasterizer::Shader::Background) {
+            drawState.texture = GetPlaceholder(m_texture);
+        }
+
+        m_rasterizer.Draw(drawState, vertices, vertexCount, indices, indexCount);
+    }
+
+    virtual const void* GetTexture() override
+    {
+        return m_texture;
+    }
+
+    virtual void SetTexture(const void* texture) override
+    {
+        m_texture = texture;
+    }
+
+    virtual u32 ClearTarget(u32 clearRenderTarget, u32 clearDepthBuffer) override
+    {
+        m_rasterizer.Clear(clearRenderTarget != 0, 0xff000000, clearDepthBuffer != 0, 1.0f);
+        return 0;
+    }
+
+    virtual void GetRenderDimensions(float* width, float* height) override
+    {
+        *width = 640.0f;
+        *height = 480.0f;
+    }
+
+private:
+    static SoftRasterizer::State GameState()
+    {
+        return SoftRasterizer::State::Default(640.0f, 480.0f);
+    }
+
+    SoftRasterizer::Texture GetPlaceholder(const void* texture)
+    {
+        if (!texture) {
+            return SoftRasterizer::Texture{ 0, 0, nullptr };
+        }
+
+        auto& pixels = m_placeholders[texture];
+        if (pixels.empty()) {
+            // Addresses differ between runs, but the checkerboard only has to tell textures apart
+            u32 color = static_cast<u32>(reinterpret_cast<std::uintptr_t>(texture) * 2654435761u);
+            color = 0xff000000 | (color >> 8);
+
+            pixels.resize(PLACEHOLDER_SIZE * PLACEHOLDER_SIZE);
+            for (u32 y = 0; y < PLACEHOLDER_SIZE; y++) {
+                for (u32 x = 0; x < PLACEHOLDER_SIZE; x++) {
+                    const bool odd = ((x / 8) ^ (y / 8)) & 1;
+                    pixels[y * PLACEHOLDER_SIZE + x] = odd ? color : (color & 0xff7f7f7f);
+                }
+            }
+        }
+
+        return SoftRasterizer::Texture{ PLACEHOLDER_SIZE, PLACEHOLDER_SIZE, pixels.data() };
+    }
+
+    SoftRasterizer& m_rasterizer;
+    SoftRasterizer::Target m_background;
+    SoftRasterizer::Target m_backbuffer;
+    std::vector<u32> m_lookup;
+
+    SoftRasterizer::State m_state;
+    SoftRasterizer::State m_savedState;
+
+    const void* m_texture;
+    std::map<const void*, std::vector<u32>> m_placeholders;
+    u64 m_skippedDraws;
+};
+
+static u64 HashPixels(const u32* pixels, std::size_t count)
+{
+    // FNV-1a
+    u64 hash = 0xcbf29ce484222325ull;
+    const u8* bytes = reinterpret_cast<const u8*>(pixels);
+
+    for (std::size_t i = 0; i < count * sizeof(u32); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+struct RenderResult
+{
+    double seconds;
+    u64 frames;
+    u64 hash;           // Of all frame hashes
+    u64 skippedDraws;
+    u64 unchangedFrames;
+    u32 threads;
+    SoftRasterizer::Stats stats;
+    ThreadPool::Stats poolStats;
+};
+
+// Renders every frame of the trace. frameHashes and tgaDir are optional.
+static RenderResult RenderCalls(const std::vector<ReplayCall>& calls, u32 width, u32 height, u32 threads,
+    bool singlePassLayers, bool skipUnchanged, std::vector<u64>* frameHashes, const std::string& tgaDir)
+{
+    ThreadPool pool(threads);
+    SoftRasterizer rasterizer(pool);
+    RasterDevice device(rasterizer, width, height);
+    BackgroundRenderer renderer(device, singlePassLayers);
+    renderer.SetSkipUnchanged(skipUnchanged);
+
+    RenderResult result{};
+    u64 hash = 0xcbf29ce484222325ull;
+
+    // Hashing and writing the frames isn't timed
+    double seconds = 0.0;
+    auto startTime = Clock::now();
+
+    PlayCalls(calls, device, renderer, [&](BackgroundRenderer& renderer) {
+        renderer.EndFrame();
+        rasterizer.Flush();
+        seconds += SecondsSince(startTime);
+
+        const auto& backbuffer = device.GetBackbuffer();
+        const u64 frameHash = HashPixels(backbuffer.GetColor(), static_cast<std::size_t>(width) * height);
+        hash = (hash ^ frameHash) * 0x100000001b3ull;
+
+        if (frameHashes) {
+            frameHashes->push_back(frameHash);
+        }
+
+        if (!tgaDir.empty()) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "/frame%05" PRIu64 ".tga", result.frames);
+            if (!WriteTga(tgaDir + name, backbuffer.GetColor(), width, height)) {
+                std::fprintf(stderr, "Failed to write %s%s\n", tgaDir.c_str(), name);
+            }
+        }
+
+        result.frames++;
+        startTime = Clock::now();
+    });
+
+    result.seconds = seconds;
+    result.hash = hash;
+    result.skippedDraws = device.GetSkippedDraws();
+    result.unchangedFrames = renderer.GetChangeStats().unchangedFrames;
+    result.threads = pool.GetThreadCount();
+    result.stats = rasterizer.GetStats();
+    result.poolStats = pool.GetStats();
+    return result;
+}
+
+static bool ParseResolution(const std::string& text, u32& width, u32& height)
+{
+    char* end;
+    width = std::strtoul(text.c_str(), &end, 10);
+    if (*end != 'x') {
+        return false;
+    }
+
+    height = std::strtoul(end + 1, &end, 10);
+    return *end == 0 && width && height && width <= 16384 && height <= 16384;
+}
+
+static int Render(const std::string& path, u32 width, u32 height, u32 threads, const std::string& tgaDir)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    if (!LoadCalls(reader, calls)) {
+        return 1;
+    }
+
+    std::vector<u64> frameHashes;
+    const auto result = RenderCalls(calls, width, height, threads, false, false, &frameHashes, tgaDir);
+    const double frames = static_cast<double>(result.frames);
+
+    for (std::size_t i = 0; i < frameHashes.size(); i++) {
+        std::printf("Frame %05zu: %016" PRIx64 "\n", i, frameHashes[i]);
+    }
+
+    std::printf("Resolution:   %ux%u, %u threads\n", width, height, result.threads);
+    std::printf("Frame time:   %.3f ms average\n", result.seconds / frames * 1e3);
+    std::printf("Triangles:    %.1f per frame, %.1f culled, %.1f tiles per triangle\n",
+        result.stats.triangles / frames, result.stats.culled / frames,
+        result.stats.triangles > result.stats.culled ? static_cast<double>(result.stats.binned) / (result.stats.triangles - result.stats.culled) : 0.0);
+    std::printf("Fragments:    %.0f per frame, %.0f written\n", result.stats.fragments / frames, result.stats.writes / frames);
+    std::printf("Skipped:      %" PRIu64 " perspective draws\n", result.skippedDraws);
+    std::printf("Hash:         %016" PRIx64 "\n", result.hash);
+
+    return 0;
+}
+
+static int RasterBench(const std::string& path, u32 maxThreads)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    if (!LoadCalls(reader, calls)) {
+        return 1;
+    }
+
+    static const u32 resolutions[][2] = {
+        { 320, 240 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 2560, 1440 }, { 3840, 2160 }
+    };
+
+    bool mismatch = false;
+
+    std::printf("%-10s %8s %12s %12s %10s %8s\n", "resolution", "threads", "ms/frame", "Mpixels/s", "speedup", "steals");
+
+    for (const auto& resolution : resolutions) {
+        double singleThreaded = 0.0;
+        u64 hash = 0;
+
+        for (u32 threads = 1; threads <= maxThreads; threads *= 2) {
+            const auto result = RenderCalls(calls, resolution[0], resolution[1], threads, false, false, nullptr, "");
+            const double msPerFrame = result.seconds / result.frames * 1e3;
+
+            if (threads == 1) {
+                singleThreaded = msPerFrame;
+                hash = result.hash;
+            } else if (result.hash != hash) {
+                std::fprintf(stderr, "%ux%u: %u threads rendered different frames than 1 thread\n",
+                    resolution[0], resolution[1], threads);
+                mismatch = true;
+            }
+
+            char name[16];
+            std::snprintf(name, sizeof(name), "%ux%u", resolution[0], resolution[1]);
+            std::printf("%-10s %8u %12.3f %12.1f %9.2fx %8" PRIu64 "\n", name, threads, msPerFrame,
+                static_cast<double>(resolution[0]) * resolution[1] / (msPerFrame * 1e3), singleThreaded / msPerFrame,
+                result.poolStats.steals);
+        }
+    }
+
+    return mismatch ? 1 : 0;
+}
+
+static double AverageFrameTime(const std::vector<ReplayFrame>& frames)
+{
+    double total = 0.0;
+    for (const auto& frame : frames) {
+        total += frame.seconds;
+    }
+
+    return frames.empty() ? 0.0 : total / frames.size();
+}
+
+static int Profile(const std::string& path, u32 repeat, const std::string& chromePath)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    const u64 frameCount = LoadCalls(reader, calls);
+    if (!frameCount) {
+        return 1;
+    }
+
+    // Enough for a few frames of a busy field screen
+    Profiler profiler(256 * 1024);
+
+    // The cost of a scope on its own, without and with a profiler
+    const u32 SCOPES = 10000000;
+    double scopeSeconds[2];
+
+    for (u32 enabled = 0; enabled < 2; enabled++) {
+        SetProfiler(enabled ? &profiler : nullptr);
+
+        const auto start = Clock::now();
+        for (u32 i = 0; i < SCOPES; i++) {
+            ProfileScope _profile("Bench");
+        }
+        scopeSeconds[enabled] = SecondsSince(start);
+    }
+
+    // Alternates between the two so both see the same conditions. The benchmark's events are
+    // still in the ring, so start over with an empty one.
+    std::vector<ReplayFrame> disabledFrames, enabledFrames;
+    disabledFrames.reserve(static_cast<std::size_t>(frameCount) * repeat);
+    enabledFrames.reserve(static_cast<std::size_t>(frameCount) * repeat);
+
+    Profiler replayProfiler(256 * 1024);
+
+    // Untimed, so creating this thread's ring and the first allocations of the renderer aren't measured
+    std::vector<ReplayFrame> warmupFrames;
+    SetProfiler(&replayProfiler);
+    ReplayCalls(calls, false, warmupFrames);
+
+    for (u32 i = 0; i < repeat; i++) {
+        SetProfiler(nullptr);
+        ReplayCalls(calls, false, disabledFrames);
+
+        SetProfiler(&replayProfiler);
+        ReplayCalls(calls, false, enabledFrames);
+    }
+
+    SetProfiler(nullptr);
+
+    const double disabledTime = AverageFrameTime(disabledFrames);
+    const double enabledTime = AverageFrameTime(enabledFrames);
+    const auto stats = replayProfiler.GetStats();
+
+    std::printf("Scope cost:     %.2f ns disabled, %.2f ns enabled\n", scopeSeconds[0] / SCOPES * 1e9,
+        scopeSeconds[1] / SCOPES * 1e9);
+    std::printf("Frame time:     %.2f us without the profiler, %.2f us with, %.2f%% overhead\n", disabledTime * 1e6,
+        enabledTime * 1e6, disabledTime > 0.0 ? (enabledTime / disabledTime - 1.0) * 100.0 : 0.0);
+    std::printf("Events:         %.1f per frame, %" PRIu64 " overwritten\n",
+        static_cast<double>(stats.events) / stats.frames, stats.overwritten);
+
+    std::printf("\n%-32s %12s %14s %12s\n", "Scope", "calls/frame", "us/frame", "max us");
+    for (const auto& scope : replayProfiler.GetTotalStats()) {
+        const std::string name = std::string(scope.depth * 2, ' ') + scope.name;
+        std::printf("%-32s %12.1f %14.2f %12.2f\n", name.c_str(), static_cast<double>(scope.calls) / stats.frames,
+            scope.totalNs / 1e3 / stats.frames, scope.maxNs / 1e3);
+    }
+
+    if (!chromePath.empty() && !replayProfiler.WriteChromeTrace(chromePath)) {
+        std::fprintf(stderr, "Failed to write %s\n", chromePath.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+// The device state StateCache covers, as the device holds it
+struct ModelDeviceState
+{
+    // Set by render target 0, or by SetViewport() and SetScissorRect()
+    static const u32 VIEWPORT_FROM_TARGET = 0;
+
+    std::map<u32, u32> renderStates;
+    std::map<u32, u32> samplerStates;       // Sampler * 256 + type
+    std::map<u32, const void*> textures;
+    const void* vertexShader = nullptr;
+    const void* pixelShader = nullptr;
+    std::map<u32, std::array<float, 4>> psConstants;
+    std::map<u32, const void*> renderTargets;
+    std::map<u32, u32> transforms;          // Only which matrix, not its values
+    u32 viewport = VIEWPORT_FROM_TARGET;
+
+    bool operator==(const ModelDeviceState& other) const
+    {
+        return renderStates == other.renderStates && samplerStates == other.samplerStates &&
+            textures == other.textures && vertexShader == other.vertexShader && pixelShader == other.pixelShader &&
+            psConstants == other.psConstants && renderTargets == other.renderTargets &&
+            transforms == other.transforms && viewport == other.viewport;
+    }
+};
+
+// Restores the states in the set like a state block recorded with them would. A state missing
+// from the saved maps was never set, so it's restored by removing it.
+static void RestoreStates(ModelDeviceState& state, const ModelDeviceState& saved, const StateSet& states)
+{
+    auto restore = [](auto& current, const auto& saved, u32 key) {
+        auto it = saved.find(key);
+        if (it != saved.end()) {
+            current[key] = it->second;
+        } else {
+            current.erase(key);
+        }
+    };
+
+    for (const auto& s : states.GetStates()) {
+        switch (s.kind) {
+        case StateSet::Kind::RenderState:
+            restore(state.renderStates, saved.renderStates, s.index);
+            break;
+        case StateSet::Kind::SamplerState:
+            restore(state.samplerStates, saved.samplerStates, s.index * 256 + s.type);
+            break;
+        case StateSet::Kind::Texture:
+            restore(state.textures, saved.textures, s.index);
+            break;
+        case StateSet::Kind::VertexShader:
+            state.vertexShader = saved.vertexShader;
+            break;
+        case StateSet::Kind::PixelShader:
+            state.pixelShader = saved.pixelShader;
+            break;
+        case StateSet::Kind::PixelShaderConstant:
+            restore(state.psConstants, saved.psConstants, s.index);
+            break;
+        case StateSet::Kind::VertexShaderConstant:
+        case StateSet::Kind::VertexDeclaration:
+            // Not modeled, StateCache doesn't cover them
+            break;
+        case StateSet::Kind::Transform:
+            restore(state.transforms, saved.transforms, s.index);
+            break;
+        case StateSet::Kind::Viewport:
+        case StateSet::Kind::ScissorRect:
+            // The model doesn't tell the two apart, and the renderer restores both
+            state.viewport = saved.viewport;
+            break;
+        }
+    }
+}
+
+// Makes the D3D9 calls Renderer makes, and the ones the game's Draw() makes, against two models
+// of the device: one gets every call and the other only what a StateCache lets through. Their
+// states are compared at every draw. Only the pass states are saved and restored, and after every
+// restore the state is also compared to what the game set: the saved state and every state change
+// the game made since. The calls of the game's Draw() and SetRenderState() are an
+// approximation, the traces only have their arguments. With an upscale chain, PrepareLayers() makes
+// the calls of Renderer::RunUpscaleChain().
+class StateDevice : public BackgroundRenderer::Device
+{
+public:
+    explicit StateDevice(const UpscaleChain* upscaleChain = nullptr) :
+        m_upscaleChain(upscaleChain),
+        m_upscaleTargets(upscaleChain ? upscaleChain->GetTargets().size() : 0),
+        m_texture(nullptr),
+        m_layerTexture(&m_backgroundTexture),
+        m_vertexShader(&m_gameVS),
+        m_textureFiltering(false),
+        m_draws(0),
+        m_mismatches(0),
+        m_applies(0),
+        m_restoreMismatches(0),
+        m_capturing(false)
+    {
+        BackgroundRenderer::GetPassStates(m_passStates, upscaleChain != nullptr);
+    }
+
+    // The texture the game bound for the current draw, which only the trace knows
+    void SetGameTexture(const void* texture)
+    {
+        m_texture = texture;
+    }
+
+    void GameStateChanged(u32 state, u32 value)
+    {
+        DeviceSetRenderState(state & 0xff, value);
+
+        if (m_capturing) {
+            m_gameChanges.emplace_back(state & 0xff, value);
+        }
+    }
+
+    const StateSet& GetPassStates() const
+    {
+        return m_passStates;
+    }
+
+    const StateCache::Stats& GetStats() const
+    {
+        return m_cache.GetStats();
+    }
+
+    u64 GetDraws() const
+    {
+        return m_draws;
+    }
+
+    u64 GetMismatches() const
+    {
+        return m_mismatches;
+    }
+
+    u64 GetApplies() const
+    {
+        return m_applies;
+    }
+
+    u64 GetRestoreMismatches() const
+    {
+        return m_restoreMismatches;
+    }
+
+    virtual void CaptureState() override
+    {
+        m_savedAll = m_all;
+        m_savedFiltered = m_filtered;
+        m_capturing = true;
+        m_gameChanges.clear();
+    }
+
+    virtual void ApplyState() override
+    {
+        // State blocks don't include render targets, and the game's own changes have to survive
+        ModelDeviceState expected = m_savedAll;
+        expected.renderTargets = m_all.renderTargets;
+        for (const auto& change : m_gameChanges) {
+            expected.renderStates[change.first] = change.second;
+        }
+
+        RestoreStates(m_all, m_savedAll, m_passStates);
+        RestoreStates(m_filtered, m_savedFiltered, m_passStates);
+        m_cache.Invalidate();
+        m_capturing = false;
+
+        m_applies++;
+        m_restoreMismatches += !(m_all == expected);
+    }
+
+    virtual void SetRenderTarget(BackgroundRenderer::Target target) override
+    {
+        const void* surface = target == BackgroundRenderer::Target::Background ? &m_backgroundTarget : &m_backbuffer;
+
+        Emit(m_cache.SetRenderTarget(0, surface), [&](ModelDeviceState& state) {
+            state.renderTargets[0] = surface;
+            state.viewport = ModelDeviceState::VIEWPORT_FROM_TARGET;
+        });
+    }
+
+    virtual void BeginPass(BackgroundRenderer::Pass pass, const LayerDepthSet&) override
+    {
+        m_vertexShader = &m_backgroundVS;
+
+        if (pass == BackgroundRenderer::Pass::Tiles) {
+            m_cache.ViewportChanged();
+            m_all.viewport = 1;
+            m_filtered.viewport = 1;
+            m_all.transforms[D3D::TS_PROJECTION] = 1;
+            m_filtered.transforms[D3D::TS_PROJECTION] = 1;
+
+            DeviceSetPixelShader(&m_backgroundPS);
+            DeviceSetRenderState(D3D::RS_ZWRITEENABLE, 0);
+            DeviceSetRenderState(D3D::RS_ALPHABLENDENABLE, 0);
+            return;
+        }
+
+        DeviceSetTexture(0, m_layerTexture);
+        DeviceSetTexture(1, &m_backgroundTexture);
+        DeviceSetSamplerState(1, D3D::SAMP_MAGFILTER, D3D::TEXF_POINT);
+        DeviceSetPixelShader(&m_layerPS);
+        m_textureFiltering = true;
+        DeviceSetRenderState(D3D::RS_ZENABLE, 1);
+        DeviceSetRenderState(D3D::RS_ZWRITEENABLE, 0);
+
+        if (pass == BackgroundRenderer::Pass::Composite) {
+            DeviceSetTexture(2, &m_lookupTexture);
+            DeviceSetSamplerState(2, D3D::SAMP_MINFILTER, D3D::TEXF_POINT);
+            DeviceSetSamplerState(2, D3D::SAMP_MAGFILTER, D3D::TEXF_POINT);
+            DeviceSetSamplerState(2, D3D::SAMP_ADDRESSU, D3D::TADDRESS_CLAMP);
+            DeviceSetSamplerState(2, D3D::SAMP_ADDRESSV, D3D::TADDRESS_CLAMP);
+            DeviceSetPixelShader(&m_compositePS);
+        }
+    }
+
+    virtual void EndPass() override
+    {
+        m_vertexShader = &m_gameVS;
+    }
+
+    virtual void SetLayer(u32 layer) override
+    {
+        const float constant[4] = { static_cast<float>(layer), 0.0f, 0.0f, 0.0f };
+        DeviceSetPixelShaderConstantF(0, constant);
+    }
+
+    virtual void PrepareLayers(const LayerDepthSet& layers, const DirtyRects& dirty) override
+    {
+        // Like Renderer, the layers are drawn from the same texture as in the previous frame
+        if (dirty.Empty()) {
+            return;
+        }
+
+        m_layerTexture = &m_backgroundTexture;
+
+        if (!m_upscaleChain || layers.Empty()) {
+            return;
+        }
+
+        // The vertex shader constants and the vertex format aren't modeled
+        DeviceSetRenderState(D3D::RS_ZENABLE, 0);
+        DeviceSetRenderState(D3D::RS_ALPHABLENDENABLE, 0);
+        DeviceSetRenderState(D3D::RS_ALPHATESTENABLE, 0);
+        DeviceSetRenderState(D3D::RS_CULLMODE, D3D::CULL_NONE);
+
+        for (u32 stage = 0; stage < UpscaleChain::MAX_INPUTS; stage++) {
+            DeviceSetSamplerState(stage, D3D::SAMP_ADDRESSU, D3D::TADDRESS_CLAMP);
+            DeviceSetSamplerState(stage, D3D::SAMP_ADDRESSV, D3D::TADDRESS_CLAMP);
+        }
+
+        auto getTexture = [this](u32 target) -> const void* {
+            return target == UpscaleChain::SOURCE ? &m_backgroundTexture : &m_upscaleTargets[target];
+        };
+
+        m_upscaleChain->GetDirtyRects(dirty, m_upscaleDirtyRects);
+
+        for (const auto& pass : m_upscaleChain->GetPasses()) {
+            const auto& rects = m_upscaleDirtyRects[pass.output];
+            if (rects.Empty()) {
+                continue;
+            }
+
+            const void* target = &m_upscaleTargets[pass.output];
+            Emit(m_cache.SetRenderTarget(0, target), [&](ModelDeviceState& state) {
+                state.renderTargets[0] = target;
+                state.viewport = ModelDeviceState::VIEWPORT_FROM_TARGET;
+            });
+
+            const u32 filter = pass.shader == UpscaleChain::Shader::Bilinear ? D3D::TEXF_LINEAR : D3D::TEXF_POINT;
+
+            for (u32 stage = 0; stage < UpscaleChain::MAX_INPUTS; stage++) {
+                DeviceSetTexture(stage, stage < pass.inputCount ? getTexture(pass.inputs[stage]) : nullptr);
+                DeviceSetSamplerState(stage, D3D::SAMP_MINFILTER, filter);
+                DeviceSetSamplerState(stage, D3D::SAMP_MAGFILTER, filter);
+            }
+
+            DeviceSetVertexShader(&m_upscaleVS[pass.shader == UpscaleChain::Shader::SuperXBRPass0 ? 0 : 1]);
+            DeviceSetPixelShader(&m_upscalePS[static_cast<u32>(pass.shader)]);
+
+            const float inputSize[4] = {
+                static_cast<float>(pass.inputWidth), static_cast<float>(pass.inputHeight), 0.0f, 0.0f
+            };
+            for (u32 i = 0; i < UpscaleChain::INPUT_REGISTERS; i++) {
+                DeviceSetPixelShaderConstantF(UpscaleChain::PS_INPUT_REGISTER + i, inputSize);
+            }
+
+            // The scissor rectangles aren't modeled
+            const bool whole = rects.GetArea() == static_cast<u64>(pass.width) * pass.height;
+            DeviceSetRenderState(D3D::RS_SCISSORTESTENABLE, whole ? 0 : 1);
+        }
+
+        m_layerTexture = getTexture(m_upscaleChain->GetOutput());
+    }
+
+    // The game's Draw() sets the vertex shader, texture and filtering on every call
+    virtual void Draw(const TileBatcher::DrawState& state, const FF7::Vertex*, u32, const u16*, u32) override
+    {
+        DeviceSetVertexShader(m_vertexShader);
+        DeviceSetTexture(0, state.texture);
+
+        const u32 filter = m_textureFiltering ? D3D::TEXF_LINEAR : D3D::TEXF_POINT;
+        DeviceSetSamplerState(0, D3D::SAMP_MINFILTER, filter);
+        DeviceSetSamplerState(0, D3D::SAMP_MAGFILTER, filter);
+
+        const float textureFlag[4] = { state.texture ? 1.0f : 0.0f, 0.0f, 0.0f, 0.0f };
+        DeviceSetPixelShaderConstantF(1, textureFlag);
+
+        m_draws++;
+        m_mismatches += !(m_all == m_filtered);
+    }
+
+    virtual const void* GetTexture() override
+    {
+        return m_texture;
+    }
+
+    virtual void SetTexture(const void* texture) override
+    {
+        m_texture = texture;
+        DeviceSetTexture(0, texture);
+    }
+
+    virtual u32 ClearTarget(u32, u32) override
+    {
+        return 0;
+    }
+
+    virtual void GetRenderDimensions(float* width, float* height) override
+    {
+        *width = 640.0f;
+        *height = 480.0f;
+    }
+
+private:
+    // Applies a call to the device that gets everything, and to the other one if it got through
+    template<typename ApplyFunc>
+    void Emit(bool forward, ApplyFunc apply)
+    {
+        apply(m_all);
+        if (forward) {
+            apply(m_filtered);
+        }
+    }
+
+    void DeviceSetRenderState(u32 type, u32 value)
+    {
+        Emit(m_cache.SetRenderState(type, value), [&](ModelDeviceState& state) {
+            state.renderStates[type] = value;
+        });
+    }
+
+    void DeviceSetSamplerState(u32 sampler, u32 type, u32 value)
+    {
+        Emit(m_cache.SetSamplerState(sampler, type, value), [&](ModelDeviceState& state) {
+            state.samplerStates[sampler * 256 + type] = value;
+        });
+    }
+
+    void DeviceSetTexture(u32 stage, const void* texture)
+    {
+        Emit(m_cache.SetTexture(stage, texture), [&](ModelDeviceState& state) {
+            state.textures[stage] = texture;
+        });
+    }
+
+    void DeviceSetVertexShader(const void* shader)
+    {
+        Emit(m_cache.SetVertexShader(shader), [&](ModelDeviceState& state) {
+            state.vertexShader = shader;
+        });
+    }
+
+    void DeviceSetPixelShader(const void* shader)
+    {
+        Emit(m_cache.SetPixelShader(shader), [&](ModelDeviceState& state) {
+            state.pixelShader = shader;
+        });
+    }
+
+    void DeviceSetPixelShaderConstantF(u32 index, const float* values)
+    {
+        Emit(m_cache.SetPixelShaderConstantF(index, values, 1), [&](ModelDeviceState& state) {
+            std::copy(values, values + 4, state.psConstants[index].begin());
+        });
+    }
+
+    StateCache m_cache;
+    ModelDeviceState m_all;
+    ModelDeviceState m_filtered;
+    ModelDeviceState m_savedAll;
+    ModelDeviceState m_savedFiltered;
+    StateSet m_passStates;
+
+    const UpscaleChain* m_upscaleChain;
+    std::vector<DirtyRects> m_upscaleDirtyRects;
+    std::vector<char> m_upscaleTargets;
+    char m_upscaleVS[2];
+    char m_upscalePS[3];
+
+    // Stand-ins for the D3D objects, only their addresses are used
+    char m_backbuffer;
+    char m_backgroundTarget;
+    char m_backgroundTexture;
+    char m_lookupTexture;
+    char m_gameVS;
+    char m_backgroundVS;
+    char m_backgroundPS;
+    char m_layerPS;
+    char m_compositePS;
+
+    const void* m_texture;
+    const void* m_layerTexture;
+    const void* m_vertexShader;
+    bool m_textureFiltering;
+
+    u64 m_draws;
+    u64 m_mismatches;
+
+    u64 m_applies;
+    u64 m_restoreMismatches;
+
+    // The game's state changes between CaptureState() and ApplyState()
+    bool m_capturing;
+    std::vector<std::pair<u32, u32>> m_gameChanges;
+};
+
+static int StateFilterCheck(const std::string& path, bool singlePassLayers)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    if (!LoadCalls(reader, calls)) {
+        return 1;
+    }
+
+    StateDevice device;
+    BackgroundRenderer renderer(device, singlePassLayers);
+
+    PlayCalls(calls, device, renderer, [](BackgroundRenderer& renderer) {
+        renderer.EndFrame();
+    });
+
+    static const char* const KIND_NAMES[] = {
+        "Render states", "Sampler states", "Textures", "Vertex shaders", "Pixel shaders", "Pixel shader constants",
+        "Render targets"
+    };
+
+    const auto& stats = device.GetStats();
+
+    std::printf("%-24s %10s %10s\n", "", "calls", "dropped");
+    for (u32 i = 0; i < static_cast<u32>(StateCache::Kind::Count); i++) {
+        std::printf("%-24s %10" PRIu64 " %10" PRIu64 " (%.1f%%)\n", KIND_NAMES[i], stats.calls[i], stats.filtered[i],
+            stats.calls[i] ? 100.0 * stats.filtered[i] / stats.calls[i] : 0.0);
+    }
+
+    std::printf("%-24s %10" PRIu64 " %10" PRIu64 " (%.1f%%)\n", "Total", stats.TotalCalls(), stats.TotalFiltered(),
+        stats.TotalCalls() ? 100.0 * stats.TotalFiltered() / stats.TotalCalls() : 0.0);
+    std::printf("Invalidations: %" PRIu64 ", draws checked: %" PRIu64 ", mismatches: %" PRIu64 "\n",
+        stats.invalidations, device.GetDraws(), device.GetMismatches());
+
+    return device.GetMismatches() ? 1 : 0;
+}
+
+static int StateSaveCheck(const std::string& path, bool singlePassLayers, const std::string& upscaleChain)
+{
+    std::vector<UpscaleChain::Filter> filters;
+    if (!UpscaleChain::Parse(upscaleChain, filters)) {
+        std::fprintf(stderr, "Invalid upscale chain %s\n", upscaleChain.c_str());
+        return 1;
+    }
+
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    if (!LoadCalls(reader, calls)) {
+        return 1;
+    }
+
+    const UpscaleChain chain(320, 240, filters, UINT32_MAX);
+    StateDevice device(filters.empty() ? nullptr : &chain);
+    BackgroundRenderer renderer(device, singlePassLayers);
+
+    PlayCalls(calls, device, renderer, [](BackgroundRenderer& renderer) {
+        renderer.EndFrame();
+    });
+
+    std::printf("States saved and restored: %zu\n", device.GetPassStates().GetStates().size());
+    std::printf("Restores checked: %" PRIu64 ", mismatches: %" PRIu64 "\n", device.GetApplies(),
+        device.GetRestoreMismatches());
+
+    return device.GetRestoreMismatches() ? 1 : 0;
+}
+
+// Records what's drawn to the background target, to tell which frames really left it unchanged
+class BackgroundLogDevice : public MockDevice
+{
+public:
+    BackgroundLogDevice() :
+        m_target(BackgroundRenderer::Target::Backbuffer)
+    {
+    }
+
+    // Everything drawn to the background since the last call
+    std::vector<u8> TakeLog()
+    {
+        std::vector<u8> log;
+        log.swap(m_log);
+        return log;
+    }
+
+    virtual void SetRenderTarget(BackgroundRenderer::Target target) override
+    {
+        m_target = target;
+        MockDevice::SetRenderTarget(target);
+    }
+
+    virtual void Draw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+        const u16* indices, u32 indexCount) override
+    {
+        if (m_target == BackgroundRenderer::Target::Background) {
+            // The bound texture, which is what the game's Draw() uses
+            const u64 header[] = {
+                static_cast<u64>(state.primType), state.drawType, reinterpret_cast<std::uintptr_t>(GetTexture()),
+                state.a7, state.scissor, vertexCount, indexCount
+            };
+
+            Append(header, sizeof(header));
+            Append(vertices, vertexCount * sizeof(FF7::Vertex));
+            Append(indices, indexCount * sizeof(u16));
+        }
+
+        MockDevice::Draw(state, vertices, vertexCount, indices, indexCount);
+    }
+
+    virtual u32 ClearTarget(u32 clearRenderTarget, u32 clearDepthBuffer) override
+    {
+        // Held back clears keep the depth buffer, which the backbuffer shares
+        if (m_target == BackgroundRenderer::Target::Background) {
+            const u64 header[] = { UINT64_MAX, clearRenderTarget };
+            Append(header, sizeof(header));
+        }
+
+        return MockDevice::ClearTarget(clearRenderTarget, clearDepthBuffer);
+    }
+
+private:
+    void Append(const void* data, std::size_t size)
+    {
+        auto bytes = static_cast<const u8*>(data);
+        m_log.insert(m_log.end(), bytes, bytes + size);
+    }
+
+    BackgroundRenderer::Target m_target;
+    std::vector<u8> m_log;
+};
+
+// A trace with some of its frames changed. The changed vertices and indices are kept here.
+struct MutatedCalls
+{
+    std::vector<ReplayCall> calls;
+    std::deque<std::vector<FF7::Vertex>> vertices;
+    std::deque<std::vector<u16>> indices;
+    u32 mutations;
+};
+
+// Changes one frame in every 7, each in a different way: a moved vertex in the last tile draw, so
+// every other event was held back, a changed index, another texture, a missing or an extra tile
+// draw, or a clear of the depth buffer only
+static void MutateFrames(const std::vector<ReplayCall>& calls, MutatedCalls& mutated)
+{
+    mutated.calls.clear();
+    mutated.mutations = 0;
+
+    std::size_t begin = 0;
+    for (u32 frame = 0; begin < calls.size(); frame++) {
+        std::size_t end = begin;
+        while (end < calls.size() && calls[end++].slot != END_FRAME_SLOT) {
+        }
+
+        std::vector<std::size_t> draws;
+        std::size_t clear = end;
+        for (std::size_t i = begin; i < end; i++) {
+            if (calls[i].slot == Trace::Slot::DrawHook) {
+                draws.push_back(i);
+            } else if ((calls[i].slot == CLEAR_SLOT || calls[i].slot == CLEAR_ALL_SLOT) && clear == end) {
+                clear = i;
+            }
+        }
+
+        // The frame after a changed one is compared to it, so it's left alone
+        const bool mutate = frame % 7 == 3 && end < calls.size() && !draws.empty();
+        const u32 kind = (frame / 7) % 6;
+
+        for (std::size_t i = begin; i < end; i++) {
+            ReplayCall call = calls[i];
+
+            if (!mutate) {
+                mutated.calls.push_back(call);
+                continue;
+            }
+
+            if (kind == 0 && i == draws.back()) {
+                mutated.vertices.emplace_back(call.vertices, call.vertices + call.vertexCount);
+                mutated.vertices.back()[0].x += 8.0f;
+                call.vertices = mutated.vertices.back().data();
+            } else if (kind == 1 && i == draws[draws.size() / 2] && call.vertexCount > 1) {
+                mutated.indices.emplace_back(call.indices, call.indices + call.indexCount);
+                mutated.indices.back()[0] = static_cast<u16>((mutated.indices.back()[0] + 1) % call.vertexCount);
+                call.indices = mutated.indices.back().data();
+            } else if (kind == 2 && i == draws.front()) {
+                call.texture = reinterpret_cast<const void*>(reinterpret_cast<std::uintptr_t>(call.texture) + 0x10);
+            } else if (kind == 3 && i == draws.back()) {
+                continue;
+            } else if (kind == 4 && i == draws.back()) {
+                mutated.calls.push_back(call);
+            } else if (kind == 5 && i == clear) {
+                call.slot = CLEAR_SLOT;
+                call.args[0] = 0;
+                call.args[1] = 1;
+            }
+
+            mutated.calls.push_back(call);
+        }
+
+        mutated.mutations += mutate;
+        begin = end;
+    }
+}
+
+struct ChangeCheckResult
+{
+    u64 frames;
+    u64 unchangedFrames;
+    u64 wrongSkips;     // Skipped, but the background would have been drawn differently
+    u64 missedSkips;    // Not skipped, but the background would have been drawn the same
+    u64 drawMismatches; // Not skipped, but the background was drawn differently than without skipping
+    u64 draws;
+    u64 skippingDraws;
+    u64 renderMismatches;
+};
+
+// Replays the calls with and without skipping unchanged backgrounds, and compares the frames that
+// were skipped to what would have been drawn, and the frames rendered both ways
+static ChangeCheckResult CheckChangeDetection(const std::vector<ReplayCall>& calls, bool singlePassLayers)
+{
+    ChangeCheckResult result{};
+
+    // Without skipping, what's drawn to the background tells which frames are really unchanged
+    std::vector<std::vector<u8>> logs;
+    {
+        BackgroundLogDevice device;
+        BackgroundRenderer renderer(device, singlePassLayers);
+
+        PlayCalls(calls, device, renderer, [&](BackgroundRenderer& renderer) {
+            renderer.EndFrame();
+            logs.push_back(device.TakeLog());
+        });
+
+        result.draws = device.GetCounters().drawCalls;
+    }
+
+    {
+        BackgroundLogDevice device;
+        BackgroundRenderer renderer(device, singlePassLayers);
+        renderer.SetSkipUnchanged(true);
+
+        PlayCalls(calls, device, renderer, [&](BackgroundRenderer& renderer) {
+            const u64 unchangedFrames = renderer.GetChangeStats().unchangedFrames;
+            renderer.EndFrame();
+
+            const u64 frame = result.frames++;
+            const bool skipped = renderer.GetChangeStats().unchangedFrames != unchangedFrames;
+            const bool same = frame > 0 && logs[frame] == logs[frame - 1];
+            result.unchangedFrames += skipped;
+            result.wrongSkips += skipped && !same;
+            result.missedSkips += !skipped && same;
+
+            // Held back events are drawn as they would have been, and a skipped frame draws nothing
+            const auto log = device.TakeLog();
+            result.drawMismatches += skipped ? !log.empty() : log != logs[frame];
+        });
+
+        result.skippingDraws = device.GetCounters().drawCalls;
+    }
+
+    // The rasterizer keeps the background target from frame to frame like D3D, so a frame skipped
+    // by mistake or held back events drawn wrong show up in the image
+    std::vector<u64> hashes;
+    std::vector<u64> skippingHashes;
+    RenderCalls(calls, 160, 120, 0, singlePassLayers, false, &hashes, "");
+    RenderCalls(calls, 160, 120, 0, singlePassLayers, true, &skippingHashes, "");
+
+    for (std::size_t i = 0; i < hashes.size(); i++) {
+        result.renderMismatches += i >= skippingHashes.size() || hashes[i] != skippingHashes[i];
+    }
+
+    return result;
+}
+
+static void PrintChangeCheck(const char* name, const ChangeCheckResult& result)
+{
+    std::printf("%-9s %" PRIu64 " frames, %" PRIu64 " skipped as unchanged, %" PRIu64 " wrongly, %" PRIu64
+        " missed, %" PRIu64 " draw calls instead of %" PRIu64 "\n", name, result.frames, result.unchangedFrames,
+        result.wrongSkips, result.missedSkips, result.skippingDraws, result.draws);
+    std::printf("%-9s %" PRIu64 " frames drawn differently, %" PRIu64 " rendered differently\n", "",
+        result.drawMismatches, result.renderMismatches);
+}
+
+static int ChangeDetectionCheck(const std::string& path, bool singlePassLayers)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    if (!LoadCalls(reader, calls)) {
+        return 1;
+    }
+
+    MutatedCalls mutated;
+    MutateFrames(calls, mutated);
+
+    const auto result = CheckChangeDetection(calls, singlePassLayers);
+    const auto mutatedResult = CheckChangeDetection(mutated.calls, singlePassLayers);
+
+    PrintChangeCheck("Trace:", result);
+    PrintChangeCheck("Mutated:", mutatedResult);
+    std::printf("Frames mutated: %u\n", mutated.mutations);
+
+    const u64 errors = result.wrongSkips + result.drawMismatches + result.renderMismatches +
+        mutatedResult.wrongSkips + mutatedResult.drawMismatches + mutatedResult.renderMismatches;
+    std::printf("Errors: %" PRIu64 "\n", errors);
+
+    return errors ? 1 : 0;
+}
+
+enum class Animation
+{
+    None,
+    Water,      // Every tile in the lower half of the area the tiles cover, every other frame
+    Flicker     // A different one in 16 tiles every frame
+};
+
+static const char* GetAnimationName(Animation animation)
+{
+    switch (animation) {
+    case Animation::None:
+        return "none";
+    case Animation::Water:
+        return "water";
+    case Animation::Flicker:
+        return "flicker";
+    }
+
+    return "unknown";
+}
+
+// Animates tiles like a busy field does, by moving their texture coordinates by a checker square
+// of RasterDevice's placeholders. The tiles are the quads of four consecutive vertices the game draws.
+static void AnimateFrames(const std::vector<ReplayCall>& calls, Animation animation, MutatedCalls& animated)
+{
+    animated.calls.clear();
+    animated.mutations = 0;
+
+    float minY = 0.0f;
+    float maxY = 0.0f;
+    bool first = true;
+
+    for (const auto& call : calls) {
+        for (u32 i = 0; call.slot == Trace::Slot::DrawHook && i < call.vertexCount; i++) {
+            minY = first ? call.vertices[i].y : std::min(minY, call.vertices[i].y);
+            maxY = first ? call.vertices[i].y : std::max(maxY, call.vertices[i].y);
+            first = false;
+        }
+    }
+
+    const float waterTop = (minY + maxY) / 2.0f;
+    u32 frame = 0;
+    u32 draw = 0;
+
+    for (const auto& call : calls) {
+        ReplayCall animatedCall = call;
+
+        if (call.slot == END_FRAME_SLOT) {
+            frame++;
+            draw = 0;
+        }
+
+        if (call.slot == Trace::Slot::DrawHook && animation != Animation::None) {
+            std::vector<FF7::Vertex> vertices(call.vertices, call.vertices + call.vertexCount);
+            bool changed = false;
+
+            for (u32 tile = 0; tile * 4 + 4 <= call.vertexCount; tile++) {
+                FF7::Vertex* quad = &vertices[tile * 4];
+                bool animate;
+
+                if (animation == Animation::Water) {
+                    const float top = std::min(std::min(quad[0].y, quad[1].y), std::min(quad[2].y, quad[3].y));
+                    animate = frame % 2 == 1 && top >= waterTop;
+                } else {
+                    const u32 hash = (frame * 7919u + draw * 104729u + tile) * 2654435761u;
+                    animate = (hash >> 28) == 0;
+                }
+
+                if (animate) {
+                    for (u32 i = 0; i < 4; i++) {
+                        quad[i].u += 0.125f;
+                    }
+
+                    changed = true;
+                }
+            }
+
+            if (changed) {
+                animated.vertices.push_back(std::move(vertices));
+                animatedCall.vertices = animated.vertices.back().data();
+                animated.mutations++;
+            }
+
+            draw++;
+        }
+
+        animated.calls.push_back(animatedCall);
+    }
+}
+
+// Stands in for the shaders of the upscale chain. Every output pixel mixes the input pixels the
+// shader reads for it, per the sampling offsets in the shaders, so it changes whenever one of them
+// does. Passes can be run only on the rectangles UpscaleChain::GetDirtyRects() gives.
+class UpscaleModel
+{
+public:
+    explicit UpscaleModel(const UpscaleChain& chain) :
+        m_chain(chain),
+        m_targets(chain.GetTargets().size())
+    {
+        for (u32 i = 0; i < m_targets.size(); i++) {
+            m_targets[i].resize(static_cast<std::size_t>(chain.GetTargets()[i].width) * chain.GetTargets()[i].height);
+        }
+    }
+
+    // Returns the number of pixels drawn
+    u64 Run(const u32* source, const DirtyRects& dirty)
+    {
+        m_chain.GetDirtyRects(dirty, m_dirty);
+        u64 drawn = 0;
+
+        for (const auto& pass : m_chain.GetPasses()) {
+            auto& output = m_targets[pass.output];
+
+            for (const auto& rect : m_dirty[pass.output].GetRects()) {
+                for (i32 y = rect.top; y < rect.bottom; y++) {
+                    for (i32 x = rect.left; x < rect.right; x++) {
+                        output[static_cast<std::size_t>(y) * pass.width + x] = Shade(pass, source, x, y);
+                    }
+                }
+
+                drawn += rect.Area();
+            }
+        }
+
+        return drawn;
+    }
+
+    const std::vector<std::vector<u32>>& GetTargets() const
+    {
+        return m_targets;
+    }
+
+private:
+    u32 Shade(const UpscaleChain::Pass& pass, const u32* source, i32 x, i32 y) const
+    {
+        // super-xBR reads up to one and a half pixels away from the input position, bilinear
+        // filtering half a pixel
+        const float reach = pass.shader == UpscaleChain::Shader::Bilinear ? 0.5f : 1.5f;
+        const float cx = (x + 0.5f) * pass.inputWidth / pass.width;
+        const float cy = (y + 0.5f) * pass.inputHeight / pass.height;
+
+        const i32 x0 = static_cast<i32>(std::floor(cx - reach));
+        const i32 x1 = static_cast<i32>(std::floor(cx + reach));
+        const i32 y0 = static_cast<i32>(std::floor(cy - reach));
+        const i32 y1 = static_cast<i32>(std::floor(cy + reach));
+
+        u32 value = 2166136261u ^ static_cast<u32>(pass.shader);
+
+        for (u32 i = 0; i < pass.inputCount; i++) {
+            const u32* input = pass.inputs[i] == UpscaleChain::SOURCE ? source : m_targets[pass.inputs[i]].data();
+
+            for (i32 ty = y0; ty <= y1; ty++) {
+                for (i32 tx = x0; tx <= x1; tx++) {
+                    // Clamped like the samplers
+                    const i32 sx = std::min(std::max(tx, 0), static_cast<i32>(pass.inputWidth) - 1);
+                    const i32 sy = std::min(std::max(ty, 0), static_cast<i32>(pass.inputHeight) - 1);
+                    value = (value ^ input[static_cast<std::size_t>(sy) * pass.inputWidth + sx]) * 16777619u;
+                }
+            }
+        }
+
+        return value;
+    }
+
+    const UpscaleChain& m_chain;
+    std::vector<std::vector<u32>> m_targets;
+    std::vector<DirtyRects> m_dirty;
+};
+
+struct DirtyCheckResult
+{
+    u64 frames;
+    u64 changedPixels;      // Of the background, that differ from the previous frame
+    u64 dirtyPixels;
+    u64 uncoveredPixels;    // Changed, but outside of the dirty rectangles
+    u64 rects;
+    u64 chainPixels;        // Drawn by the modeled upscale chain
+    u64 fullChainPixels;    // Drawn by it without dirty rectangles
+    u64 chainMismatches;    // Frames where drawing only the dirty rectangles gave another output
+    u64 tightMismatches;    // The same, with rectangles around just the pixels that changed
+};
+
+// Checks the dirty rectangles PrepareLayers() gets against the background the rasterizer drew:
+// every pixel that changed since the previous frame must be in them. Also runs an UpscaleModel of
+// the chain on the background in full and only where the dirty rectangles reach, which must give
+// the same targets. The tiles' bounds have a margin, so the chain is also run with rectangles
+// merged from just the changed pixels, which would show a border too small.
+class DirtyCheckDevice : public RasterDevice
+{
+public:
+    DirtyCheckDevice(SoftRasterizer& rasterizer, const UpscaleChain& chain) :
+        RasterDevice(rasterizer, 160, 120),
+        m_rasterizer(rasterizer),
+        m_full(chain),
+        m_partial(chain),
+        m_tight(chain),
+        m_result{}
+    {
+        m_all.AddAll(BACKGROUND_WIDTH, BACKGROUND_HEIGHT);
+    }
+
+    const DirtyCheckResult& GetResult() const
+    {
+        return m_result;
+    }
+
+    virtual void PrepareLayers(const LayerDepthSet& layers, const DirtyRects& dirty) override
+    {
+        // The tiles may still be queued
+        m_rasterizer.Flush();
+
+        const u32* pixels = GetBackground().GetColor();
+        const std::size_t count = static_cast<std::size_t>(BACKGROUND_WIDTH) * BACKGROUND_HEIGHT;
+
+        DirtyRects changed;
+
+        if (m_previous.empty()) {
+            changed.AddAll(BACKGROUND_WIDTH, BACKGROUND_HEIGHT);
+        } else {
+            for (u32 y = 0; y < BACKGROUND_HEIGHT; y++) {
+                for (u32 x = 0; x < BACKGROUND_WIDTH; x++) {
+                    if (pixels[y * BACKGROUND_WIDTH + x] != m_previous[y * BACKGROUND_WIDTH + x]) {
+                        const i32 px = static_cast<i32>(x);
+                        const i32 py = static_cast<i32>(y);
+
+                        changed.Add({ px, py, px + 1, py + 1 });
+                        m_result.changedPixels++;
+                        m_result.uncoveredPixels += !dirty.Contains(px, py);
+                    }
+                }
+            }
+        }
+
+        m_previous.assign(pixels, pixels + count);
+
+        m_result.frames++;
+        m_result.dirtyPixels += dirty.GetArea();
+        m_result.rects += dirty.GetRects().size();
+        m_result.fullChainPixels += m_full.Run(pixels, m_all);
+        m_result.chainPixels += m_partial.Run(pixels, dirty);
+        m_result.chainMismatches += m_full.GetTargets() != m_partial.GetTargets();
+
+        m_tight.Run(pixels, changed);
+        m_result.tightMismatches += m_full.GetTargets() != m_tight.GetTargets();
+
+        RasterDevice::PrepareLayers(layers, dirty);
+    }
+
+private:
+    SoftRasterizer& m_rasterizer;
+    UpscaleModel m_full;
+    UpscaleModel m_partial;
+    UpscaleModel m_tight;
+    DirtyRects m_all;
+    std::vector<u32> m_previous;
+    DirtyCheckResult m_result;
+};
+
+static DirtyCheckResult CheckDirtyRects(const std::vector<ReplayCall>& calls, const UpscaleChain& chain,
+    bool skipUnchanged)
+{
+    ThreadPool pool(0);
+    SoftRasterizer rasterizer(pool);
+    DirtyCheckDevice device(rasterizer, chain);
+    BackgroundRenderer renderer(device, false);
+    renderer.SetSkipUnchanged(skipUnchanged);
+    renderer.SetTrackDirtyRects(true);
+
+    PlayCalls(calls, device, renderer, [&](BackgroundRenderer& renderer) {
+        renderer.EndFrame();
+        rasterizer.Flush();
+    });
+
+    return device.GetResult();
+}
+
+// Seconds per frame replaying the calls on a MockDevice
+static double TimeDirtyTracking(const std::vector<ReplayCall>& calls, bool track, u32 repeat)
+{
+    MockDevice device;
+    BackgroundRenderer renderer(device, false);
+    renderer.SetTrackDirtyRects(track);
+
+    u64 frames = 0;
+    const auto startTime = Clock::now();
+
+    for (u32 i = 0; i < repeat; i++) {
+        PlayCalls(calls, device, renderer, [&](BackgroundRenderer& renderer) {
+            renderer.EndFrame();
+            frames++;
+        });
+    }
+
+    return frames ? SecondsSince(startTime) / frames : 0.0;
+}
+
+static int DirtyRectCheck(const std::string& path, u32 repeat)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    if (!LoadCalls(reader, calls)) {
+        return 1;
+    }
+
+    // All three shaders, making the background 4 times larger
+    std::vector<UpscaleChain::Filter> filters;
+    UpscaleChain::Parse("superxbr,bilinear", filters);
+    const UpscaleChain chain(RasterDevice::BACKGROUND_WIDTH, RasterDevice::BACKGROUND_HEIGHT, filters,
+        RasterDevice::BACKGROUND_WIDTH * 4);
+
+    std::printf("%-8s %-5s %7s %9s %9s %6s %9s %10s %12s %12s\n", "Anim", "Skip", "Frames", "Changed", "Dirty",
+        "Rects", "Upscaled", "Uncovered", "Mismatches", "Tracking");
+
+    u64 errors = 0;
+
+    for (const auto animation : { Animation::None, Animation::Water, Animation::Flicker }) {
+        MutatedCalls animated;
+        AnimateFrames(calls, animation, animated);
+
+        const double plain = TimeDirtyTracking(animated.calls, false, repeat);
+        const double tracking = TimeDirtyTracking(animated.calls, true, repeat);
+
+        for (const bool skipUnchanged : { false, true }) {
+            const auto result = CheckDirtyRects(animated.calls, chain, skipUnchanged);
+            const double pixels = static_cast<double>(result.frames) * RasterDevice::BACKGROUND_WIDTH *
+                RasterDevice::BACKGROUND_HEIGHT;
+
+            // Changed and dirty pixels in % of the background, upscaled in % of the full chain, and the
+            // time tracking adds per frame
+            std::printf("%-8s %-5s %7" PRIu64 " %8.2f%% %8.2f%% %6.2f %8.2f%% %10" PRIu64 " %12" PRIu64 " %9.1f us\n",
+                GetAnimationName(animation), skipUnchanged ? "yes" : "no", result.frames,
+                pixels ? 100.0 * result.changedPixels / pixels : 0.0, pixels ? 100.0 * result.dirtyPixels / pixels : 0.0,
+                result.frames ? static_cast<double>(result.rects) / result.frames : 0.0,
+                result.fullChainPixels ? 100.0 * result.chainPixels / result.fullChainPixels : 0.0,
+                result.uncoveredPixels, result.chainMismatches + result.tightMismatches, (tracking - plain) * 1e6);
+
+            errors += result.uncoveredPixels + result.chainMismatches + result.tightMismatches;
+        }
+    }
+
+    std::printf("Errors: %" PRIu64 "\n", errors);
+    return errors ? 1 : 0;
+}
+
+// Appends a draw to a stream of what's drawn, resolving the indices. Triangle lists are split into
+// their triangles, each with the draw state, so a merged draw gives the same stream as the draws it
+// merged. Returns the number of indices past the vertices, which are left out.
+static u64 AppendExpandedDraw(std::vector<u8>& stream, const TileBatcher::DrawState& state,
+    const FF7::Vertex* vertices, u32 vertexCount, const u16* indices, u32 indexCount)
+{
+    auto append = [&](const void* data, std::size_t size) {
+        auto bytes = static_cast<const u8*>(data);
+        stream.insert(stream.end(), bytes, bytes + size);
+    };
+
+    const bool list = state.primType == FF7::PrimitiveType::TriangleList;
+    const u32 indicesPerRecord = list ? 3 : indexCount;
+    u64 badIndices = 0;
+
+    for (u32 first = 0; first + indicesPerRecord <= indexCount && indicesPerRecord; first += indicesPerRecord) {
+        const u64 header[] = {
+            static_cast<u64>(state.primType), state.drawType, reinterpret_cast<std::uintptr_t>(state.texture),
+            state.a7, state.scissor, indicesPerRecord
+        };
+        append(header, sizeof(header));
+
+        for (u32 i = first; i < first + indicesPerRecord; i++) {
+            if (indices[i] < vertexCount) {
+                append(&vertices[indices[i]], sizeof(FF7::Vertex));
+            } else {
+                badIndices++;
+            }
+        }
+    }
+
+    return badIndices;
+}
+
+// Records the expanded draws and every state change of a replay
+class TriangleStreamDevice : public MockDevice
+{
+public:
+    TriangleStreamDevice() :
+        m_badIndices(0),
+        m_maxVertices(0)
+    {
+    }
+
+    // Everything since the last call
+    std::vector<u8> TakeStream()
+    {
+        std::vector<u8> stream;
+        stream.swap(m_stream);
+        return stream;
+    }
+
+    u64 GetBadIndices() const
+    {
+        return m_badIndices;
+    }
+
+    // The most vertices of a single draw
+    u32 GetMaxVertices() const
+    {
+        return m_maxVertices;
+    }
+
+    virtual void ApplyState() override
+    {
+        AppendEvent(1, 0);
+        MockDevice::ApplyState();
+    }
+
+    virtual void SetRenderTarget(BackgroundRenderer::Target target) override
+    {
+        AppendEvent(2, static_cast<u64>(target));
+        MockDevice::SetRenderTarget(target);
+    }
+
+    virtual void BeginPass(BackgroundRenderer::Pass pass, const LayerDepthSet& layers) override
+    {
+        AppendEvent(3, static_cast<u64>(pass));
+        MockDevice::BeginPass(pass, layers);
+    }
+
+    virtual void EndPass() override
+    {
+        AppendEvent(4, 0);
+        MockDevice::EndPass();
+    }
+
+    virtual void SetLayer(u32 layer) override
+    {
+        AppendEvent(5, layer);
+        MockDevice::SetLayer(layer);
+    }
+
+    virtual void SetTexture(const void* texture) override
+    {
+        AppendEvent(6, reinterpret_cast<std::uintptr_t>(texture));
+        MockDevice::SetTexture(texture);
+    }
+
+    virtual u32 ClearTarget(u32 clearRenderTarget, u32 clearDepthBuffer) override
+    {
+        AppendEvent(7, clearRenderTarget * 2 + clearDepthBuffer);
+        return MockDevice::ClearTarget(clearRenderTarget, clearDepthBuffer);
+    }
+
+    virtual void Draw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+        const u16* indices, u32 indexCount) override
+    {
+        // Recorded with the bound texture, which is what the game's Draw() uses
+        auto drawn = state;
+        drawn.texture = GetTexture();
+
+        m_badIndices += AppendExpandedDraw(m_stream, drawn, vertices, vertexCount, indices, indexCount);
+        m_maxVertices = std::max(m_maxVertices, vertexCount);
+        MockDevice::Draw(state, vertices, vertexCount, indices, indexCount);
+    }
+
+private:
+    // Kinds are above any primitive type, so events and draws can't be confused
+    void AppendEvent(u64 kind, u64 value)
+    {
+        const u64 event[] = { 0x100 + kind, value };
+        auto bytes = reinterpret_cast<const u8*>(event);
+        m_stream.insert(m_stream.end(), bytes, bytes + sizeof(event));
+    }
+
+    std::vector<u8> m_stream;
+    u64 m_badIndices;
+    u32 m_maxVertices;
+};
+
+struct TriangleStreams
+{
+    std::vector<std::vector<u8>> frames;
+    u64 drawCalls;
+    u64 tileBatches;
+    u64 badIndices;
+    u32 maxVertices;
+};
+
+static TriangleStreams RecordTriangleStreams(const std::vector<ReplayCall>& calls, bool singlePassLayers,
+    bool skipUnchanged, bool batch)
+{
+    TriangleStreamDevice device;
+    BackgroundRenderer renderer(device, singlePassLayers);
+    renderer.SetSkipUnchanged(skipUnchanged);
+    renderer.SetBatchTiles(batch);
+
+    TriangleStreams streams;
+    PlayCalls(calls, device, renderer, [&](BackgroundRenderer& renderer) {
+        renderer.EndFrame();
+        streams.frames.push_back(device.TakeStream());
+    });
+
+    streams.drawCalls = device.GetCounters().drawCalls;
+    streams.tileBatches = renderer.GetTileStats().batches;
+    streams.badIndices = device.GetBadIndices();
+    streams.maxVertices = device.GetMaxVertices();
+    return streams;
+}
+
+// Batches of tiles sharing one vertex array, fed to a TileBatcher merging and not merging
+struct SyntheticBatches
+{
+    const char* name;
+    u32 tileVertices;   // 3 or 4
+    u32 batches;
+    u32 textureInterval;    // Every this many batches use another texture, if not 0
+    u32 gapInterval;        // Every this many batches leave a vertex out before them, if not 0
+    u32 stripInterval;      // Every this many batches, the last is a triangle strip, if not 0
+    u32 expectedDraws;      // When merging
+};
+
+static u32 CheckSyntheticBatches(const SyntheticBatches& test)
+{
+    static const u16 QUAD_INDICES[] = { 0, 1, 2, 2, 1, 3 };
+    static const u16 QUAD_INDICES_REVERSED[] = { 3, 1, 2, 2, 1, 0 };
+    static const u16 TRIANGLE_INDICES[] = { 2, 0, 1 };
+    static const u16 STRIP_INDICES[] = { 0, 1, 2, 3 };
+
+    const u32 tileVertices = test.tileVertices;
+    std::vector<FF7::Vertex> vertices(test.batches * (tileVertices + 1));
+    for (u32 i = 0; i < vertices.size(); i++) {
+        vertices[i] = FF7::Vertex{};
+        vertices[i].x = static_cast<float>(i);
+        vertices[i].y = static_cast<float>(i / 4);
+    }
+
+    std::vector<u8> streams[2];
+    u32 draws[2] = {};
+    u64 badIndices = 0;
+    u32 maxVertices = 0;
+    u32 maxIndex = 0;
+
+    for (const bool merge : { false, true }) {
+        auto& stream = streams[merge];
+
+        // Like the game's Draw(), batches are drawn with the bound texture
+        const void* boundTexture = nullptr;
+
+        TileBatcher batcher([&](const TileBatcher::DrawState& state, const FF7::Vertex* drawVertices, u32 vertexCount,
+            const u16* indices, u32 indexCount) {
+            auto drawn = state;
+            drawn.texture = boundTexture;
+
+            badIndices += AppendExpandedDraw(stream, drawn, drawVertices, vertexCount, indices, indexCount);
+            draws[merge]++;
+
+            if (merge) {
+                maxVertices = std::max(maxVertices, vertexCount);
+                maxIndex = std::max<u32>(maxIndex, *std::max_element(indices, indices + indexCount));
+            }
+        });
+        batcher.SetMerging(merge);
+
+        u32 next = 0;
+        for (u32 batch = 0; batch < test.batches; batch++) {
+            const bool strip = test.stripInterval && batch % test.stripInterval == test.stripInterval - 1;
+
+            TileBatcher::DrawState state{ FF7::PrimitiveType::TriangleList, FF7::DrawType::Ortho, nullptr, 0, 0 };
+            state.texture = reinterpret_cast<const void*>(static_cast<std::uintptr_t>(
+                0x1000 + (test.textureInterval ? batch / test.textureInterval : 0)));
+
+            if (test.gapInterval && batch && batch % test.gapInterval == 0) {
+                next++;
+            }
+
+            const u16* indices;
+            u32 indexCount;
+            if (strip) {
+                state.primType = FF7::PrimitiveType::TriangleStrip;
+                indices = STRIP_INDICES;
+                indexCount = tileVertices;
+            } else if (tileVertices == 3) {
+                indices = TRIANGLE_INDICES;
+                indexCount = 3;
+            } else {
+                indices = batch % 2 ? QUAD_INDICES_REVERSED : QUAD_INDICES;
+                indexCount = 6;
+            }
+
+            // What BackgroundRenderer::BeforeSetTexture() does when the game binds the texture
+            batcher.FlushTexture(state.texture);
+            boundTexture = state.texture;
+
+            batcher.Add(state, &vertices[next], tileVertices, indices, indexCount);
+            next += tileVertices;
+        }
+
+        batcher.Flush();
+    }
+
+    u32 errors = 0;
+    errors += streams[0] != streams[1];
+    errors += draws[0] != test.batches || draws[1] != test.expectedDraws;
+    errors += badIndices != 0 || maxVertices > 0x10000;
+
+    std::printf("%-20s %8u %8u %10u %9u %10s\n", test.name, test.batches, draws[1], maxVertices, maxIndex,
+        streams[0] == streams[1] ? "yes" : "no");
+
+    if (errors) {
+        std::printf("  %s failed %u checks\n", test.name, errors);
+    }
+
+    return errors;
+}
+
+static int BatchCheck(const std::string& path, bool singlePassLayers)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    if (!LoadCalls(reader, calls)) {
+        return 1;
+    }
+
+    MutatedCalls mutated;
+    MutateFrames(calls, mutated);
+
+    std::printf("%-8s %-5s %7s %8s %11s %11s %9s %12s\n", "Calls", "Skip", "Frames", "Batches", "Draws off",
+        "Draws on", "Max vtx", "Mismatches");
+
+    u64 errors = 0;
+
+    for (const auto* replayed : { &calls, &mutated.calls }) {
+        for (const bool skipUnchanged : { false, true }) {
+            const auto off = RecordTriangleStreams(*replayed, singlePassLayers, skipUnchanged, false);
+            const auto on = RecordTriangleStreams(*replayed, singlePassLayers, skipUnchanged, true);
+
+            u64 mismatches = off.frames.size() != on.frames.size();
+            for (std::size_t frame = 0; frame < std::min(off.frames.size(), on.frames.size()); frame++) {
+                mismatches += off.frames[frame] != on.frames[frame];
+            }
+
+            std::printf("%-8s %-5s %7zu %8" PRIu64 " %11" PRIu64 " %11" PRIu64 " %9u %12" PRIu64 "\n",
+                replayed == &calls ? "trace" : "mutated", skipUnchanged ? "yes" : "no", on.frames.size(),
+                on.tileBatches, off.drawCalls, on.drawCalls, on.maxVertices, mismatches);
+
+            errors += mismatches + off.badIndices + on.badIndices + (on.maxVertices > 0x10000) +
+                (off.tileBatches != on.tileBatches);
+        }
+    }
+
+    // Merges around the 65536 vertex limit, with rebased indices up to 0xFFFF, and what stops merging
+    const SyntheticBatches synthetic[] = {
+        { "exactly 0x10000", 4, 0x4000, 0, 0, 0, 1 },
+        { "one over", 4, 0x4001, 0, 0, 0, 2 },
+        { "triangles", 3, 21846, 0, 0, 0, 2 },
+        { "twice over", 4, 0x8001, 0, 0, 0, 3 },
+        { "texture changes", 4, 100, 10, 0, 0, 10 },
+        { "vertex gaps", 4, 100, 0, 7, 0, 15 },
+        { "strips", 4, 100, 0, 0, 25, 8 },
+    };
+
+    std::printf("\n%-20s %8s %8s %10s %9s %10s\n", "Synthetic", "Batches", "Draws", "Max vtx", "Max idx", "Matching");
+
+    for (const auto& test : synthetic) {
+        errors += CheckSyntheticBatches(test);
+    }
+
+    std::printf("Errors: %" PRIu64 "\n", errors);
+    return errors ? 1 : 0;
+}
+
+// The cost and results of both ways of compositing, for one kind of input
+struct CompositeCheckInput
+{
+    u64 mismatchedFrames;
+    u64 mismatchedPixels;
+    LayerComposite::Cost multiPass;
+    LayerComposite::Cost singlePass;
+    double multiPassSeconds;
+    double singlePassSeconds;
+};
+
+struct CompositeCheckResult
+{
+    u64 frames;
+    u64 layers;
+    CompositeCheckInput rendered;   // The background and scene as rendered
+    CompositeCheckInput layered;    // With depths around the layers of the frame
+};
+
+// Composites the layers of every frame with both CPU references, over the scene the frame rendered
+// at the resolution of the background. The trace's tiles may all be in front of the layers, so every
+// frame is also composited with the depths of the background and the scene spread around its layers.
+class CompositeCheckDevice : public RasterDevice
+{
+public:
+    CompositeCheckDevice(SoftRasterizer& rasterizer, u32 repeat) :
+        RasterDevice(rasterizer, BACKGROUND_WIDTH, BACKGROUND_HEIGHT),
+        m_rasterizer(rasterizer),
+        m_repeat(repeat),
+        m_random(1357),
+        m_result{}
+    {
+    }
+
+    const CompositeCheckResult& GetResult() const
+    {
+        return m_result;
+    }
+
+    virtual void PrepareLayers(const LayerDepthSet& layers, const DirtyRects& dirty) override
+    {
+        // The tiles and the scene may still be queued
+        m_rasterizer.Flush();
+
+        const auto& background = GetBackground();
+        const auto& backbuffer = GetBackbuffer();
+        const std::size_t count = static_cast<std::size_t>(BACKGROUND_WIDTH) * BACKGROUND_HEIGHT;
+
+        LayerComposite::Frame frame{ BACKGROUND_WIDTH, BACKGROUND_HEIGHT, background.GetColor(),
+            backbuffer.GetDepth(), nullptr };
+        Composite(frame, layers, backbuffer.GetColor(), m_result.rendered);
+
+        // Every pixel gets a layer's depth, one next to it, or the nearest or farthest depth. The scene
+        // is at a layer's depth, just in front of it, or at the far plane.
+        std::vector<u32> depths;
+        layers.ForEachDescending([&](u32 layer) {
+            depths.push_back(layer);
+        });
+        depths.push_back(0);
+        depths.push_back(255);
+
+        m_layeredBackground.resize(count);
+        m_layeredDepth.resize(count);
+
+        for (std::size_t i = 0; i < count; i++) {
+            const u32 depth = depths[m_random() % depths.size()];
+            const u32 offset = m_random() % 4;
+            const u32 pixelDepth = offset == 1 ? std::min(depth + 1, 255u) : (offset == 2 ? (depth ? depth - 1 : 0) : depth);
+            m_layeredBackground[i] = (background.GetColor()[i] & 0x00ffffff) | (pixelDepth << 24);
+
+            const u32 sceneLayer = depths[m_random() % depths.size()];
+            const float sceneDepth = static_cast<float>(sceneLayer / 255.0f);
+            switch (m_random() % 3) {
+            case 0:
+                m_layeredDepth[i] = sceneDepth;
+                break;
+            case 1:
+                m_layeredDepth[i] = std::nextafter(sceneDepth, -1.0f);
+                break;
+            default:
+                m_layeredDepth[i] = 1.0f;
+                break;
+            }
+        }
+
+        frame.background = m_layeredBackground.data();
+        frame.sceneDepth = m_layeredDepth.data();
+        Composite(frame, layers, backbuffer.GetColor(), m_result.layered);
+
+        m_result.frames++;
+        m_result.layers += depths.size() - 2;
+
+        RasterDevice::PrepareLayers(layers, dirty);
+    }
+
+private:
+    // Every run starts from the scene, copying it isn't timed
+    void Composite(LayerComposite::Frame& frame, const LayerDepthSet& layers, const u32* scene,
+        CompositeCheckInput& result)
+    {
+        const std::size_t count = static_cast<std::size_t>(frame.width) * frame.height;
+
+        for (u32 run = 0; run < m_repeat; run++) {
+            m_multiPass.assign(scene, scene + count);
+            frame.output = m_multiPass.data();
+            auto start = Clock::now();
+            const auto multiPass = LayerComposite::CompositeMultiPass(frame, layers);
+            result.multiPassSeconds += SecondsSince(start);
+
+            m_singlePass.assign(scene, scene + count);
+            frame.output = m_singlePass.data();
+            start = Clock::now();
+            const auto singlePass = LayerComposite::CompositeSinglePass(frame, layers);
+            result.singlePassSeconds += SecondsSince(start);
+
+            if (run == 0) {
+                Add(result.multiPass, multiPass);
+                Add(result.singlePass, singlePass);
+            }
+        }
+
+        u64 mismatches = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            mismatches += m_multiPass[i] != m_singlePass[i];
+        }
+
+        result.mismatchedFrames += mismatches != 0;
+        result.mismatchedPixels += mismatches;
+    }
+
+    static void Add(LayerComposite::Cost& total, const LayerComposite::Cost& cost)
+    {
+        total.passes += cost.passes;
+        total.fragments += cost.fragments;
+        total.writes += cost.writes;
+    }
+
+    SoftRasterizer& m_rasterizer;
+    u32 m_repeat;
+    std::mt19937 m_random;
+    std::vector<u32> m_layeredBackground;
+    std::vector<float> m_layeredDepth;
+    std::vector<u32> m_multiPass;
+    std::vector<u32> m_singlePass;
+    CompositeCheckResult m_result;
+};
+
+static int CompositeCheck(const std::string& path, u32 repeat)
+{
+    TraceReader reader;
+    if (!OpenTrace(reader, path)) {
+        return 1;
+    }
+
+    std::vector<ReplayCall> calls;
+    if (!LoadCalls(reader, calls)) {
+        return 1;
+    }
+
+    ThreadPool pool(0);
+    SoftRasterizer rasterizer(pool);
+    CompositeCheckDevice device(rasterizer, repeat);
+    BackgroundRenderer renderer(device, false);
+
+    PlayCalls(calls, device, renderer, [&](BackgroundRenderer& renderer) {
+        renderer.EndFrame();
+        rasterizer.Flush();
+    });
+
+    const auto& result = device.GetResult();
+    const double frames = result.frames ? static_cast<double>(result.frames) : 1.0;
+    const double runs = frames * repeat;
+
+    std::printf("Frames: %" PRIu64 ", layers per frame: %.1f\n", result.frames, result.layers / frames);
+    std::printf("%-10s %-10s %8s %12s %12s %10s %12s\n", "Depths", "Way", "Passes", "Fragments", "Writes", "Time",
+        "Mismatches");
+
+    u64 errors = 0;
+
+    for (const auto* input : { &result.rendered, &result.layered }) {
+        const struct
+        {
+            const char* name;
+            const LayerComposite::Cost& cost;
+            double seconds;
+        } ways[] = {
+            { "per layer", input->multiPass, input->multiPassSeconds },
+            { "lookup", input->singlePass, input->singlePassSeconds },
+        };
+
+        // Per frame, mismatches are pixels over all frames
+        for (const auto& way : ways) {
+            std::printf("%-10s %-10s %8.1f %12.0f %12.0f %7.1f us %12" PRIu64 "\n",
+                input == &result.rendered ? "rendered" : "layered", way.name, way.cost.passes / frames,
+                way.cost.fragments / frames, way.cost.writes / frames, way.seconds * 1e6 / runs, input->mismatchedPixels);
+        }
+
+        errors += input->mismatchedFrames;
+    }
+
+    std::printf("Errors: %" PRIu64 "\n", errors);
+    return errors ? 1 : 0;
+}
+
+// What the wrappers used to do on every call, minus D3DPERF_BeginEvent()
+static void FormatEventEagerly(const wchar_t* format, ...)
+{
+    wchar_t buf[D3D_EVENT_NAME_SIZE];
+
+    va_list args;
+    va_start(args, format);
+    std::vswprintf(buf, D3D_EVENT_NAME_SIZE, format, args);
+    va_end(args);
+
+    volatile wchar_t first = buf[0];
+    (void)first;
+}
+
+static int EventBench(u32 calls)
+{
+    // Read on every call, so the arguments can't be folded into constants
+    volatile u32 arg = 0x12345678;
+
+    // The arguments of GfxFn_58, which has the most
+    auto measure = [&](auto&& event) {
+        const auto start = Clock::now();
+        for (u32 i = 0; i < calls; i++) {
+            event(arg, arg + 1, arg + 2, arg + 3, arg + 4, arg + 5);
+        }
+        return SecondsSince(start) / calls * 1e9;
+    };
+
+    const double eager = measure([](u32 a0, u32 a1, u32 a2, u32 a3, u32 a4, u32 a5) {
+        FormatEventEagerly(L"GfxFn_58(0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x)", a0, a1, a2, a3, a4, a5);
+    });
+
+    auto scoped = [](u32 a0, u32 a1, u32 a2, u32 a3, u32 a4, u32 a5) {
+        ScopedD3DEvent _(L"GfxFn_58", a0, a1, a2, a3, a4, a5);
+    };
+
+    SetD3DEventsEnabled(false);
+    const double disabled = measure(scoped);
+
+    SetD3DEventsEnabled(true);
+    const double enabled = measure(scoped);
+
+    SetD3DEventsEnabled(false);
+
+    wchar_t name[D3D_EVENT_NAME_SIZE];
+    const u64 args[] = { 0x12345678, 0, 0xffffffff };
+    FormatD3DEventName(name, D3D_EVENT_NAME_SIZE, L"GfxFn_58", args, 3);
+
+    std::printf("Formatted every call (before):  %.2f ns per call\n", eager);
+    std::printf("Events disabled:                %.2f ns per call\n", disabled);
+    std::printf("Events enabled:                 %.2f ns per call\n", enabled);
+    std::printf("Example name:                   %ls\n", name);
+
+    return 0;
+}
+
+// Stand-ins for the game's context and the renderer, laid out like the real ones, to time how a
+// hooked slot reaches the renderer. Only the pointers matter.
+namespace DispatchModel
+{
+    using SlotFn = u32 (*)(u32, u32);
+
+    struct Functions
+    {
+        SlotFn hooked;
+        SlotFn unhooked;
+        class ContextBase* rendererInstance;
+    };
+
+    // The game's original implementation of a slot
+    static u32 Original(u32 a0, u32 a1)
+    {
+        return a0 ^ a1;
+    }
+
+    // Set at runtime, so calls through them can't be inlined
+    static Functions* volatile g_originalFunctions;
+    static u32* volatile g_gameContext;
+
+    class ContextBase
+    {
+    public:
+        virtual ~ContextBase() = default;
+
+        virtual u32 Hooked(u32 a0, u32 a1)
+        {
+            return g_originalFunctions->hooked(a0, a1);
+        }
+
+        virtual u32 Unhooked(u32 a0, u32 a1)
+        {
+            return g_originalFunctions->unhooked(a0, a1);
+        }
+    };
+
+    class Context final : public ContextBase
+    {
+    public:
+        virtual u32 Hooked(u32 a0, u32 a1) override
+        {
+            return ContextBase::Hooked(a0, a1) + 1;
+        }
+    };
+
+    static Context* s_instance;
+
+    // FF7::GetGfxFunctions(): the context pointer, then the functions at GameContext+0x934
+    static Functions* GetFunctions()
+    {
+        u32* context = g_gameContext;
+        Functions* functions;
+        std::memcpy(&functions, reinterpret_cast<u8*>(context) + 0x934, sizeof(functions));
+        return functions;
+    }
+
+    template<bool Static, bool Hooked>
+    static u32 Wrapper(u32 a0, u32 a1)
+    {
+        ScopedD3DEvent _(L"GfxFn_68", a0, a1);
+        ProfileScope _profile("GfxFn_68");
+        if (auto recorder = GetTraceRecorder()) {
+            const u32 args[] = { TraceArg(a0), TraceArg(a1) };
+            recorder->Record(0x68, args, 2);
+        }
+
+        if (Static) {
+            return Hooked ? s_instance->Context::Hooked(a0, a1) : s_instance->Context::Unhooked(a0, a1);
+        }
+
+        auto instance = GetFunctions()->rendererInstance;
+        return Hooked ? instance->Hooked(a0, a1) : instance->Unhooked(a0, a1);
+    }
+}
+
+static int DispatchBench(u32 calls)
+{
+    using namespace DispatchModel;
+
+    Functions original = { Original, Original, nullptr };
+    g_originalFunctions = &original;
+
+    Context context;
+    s_instance = &context;
+
+    Functions hooked = original;
+    hooked.rendererInstance = &context;
+
+    std::vector<u8> gameContext(0x940);
+    Functions* hookedPtr = &hooked;
+    std::memcpy(&gameContext[0x934], &hookedPtr, sizeof(hookedPtr));
+    g_gameContext = reinterpret_cast<u32*>(gameContext.data());
+
+    // Called the way the game calls a slot, through a pointer it loads every time
+    auto measure = [&](SlotFn function) {
+        SlotFn volatile slot = function;
+        u32 sum = 0;
+
+        const auto start = Clock::now();
+        for (u32 i = 0; i < calls; i++) {
+            sum += slot(i, sum);
+        }
+        const double ns = SecondsSince(start) / calls * 1e9;
+
+        volatile u32 result = sum;
+        (void)result;
+        return ns;
+    };
+
+    SetD3DEventsEnabled(false);
+
+    const double virtualHooked = measure(Wrapper<false, true>);
+    const double staticHooked = measure(Wrapper<true, true>);
+    const double virtualUnhooked = measure(Wrapper<false, false>);
+    const double staticUnhooked = measure(Wrapper<true, false>);
+    const double bypassed = measure(Original);
+
+    std::printf("                         looked up + virtual   cached + static\n");
+    std::printf("Overridden slot:         %8.2f ns         %8.2f ns\n", virtualHooked, staticHooked);
+    std::printf("Not overridden slot:     %8.2f ns         %8.2f ns\n", virtualUnhooked, staticUnhooked);
+    std::printf("Bypassed slot:                                  %8.2f ns\n", bypassed);
+
+    return 0;
+}
+
+// Counts messages instead of writing them, so the benchmark measures the logger. The logger's
+// reports of dropped messages are warnings, and aren't counted.
+class CountingLogSink : public Logger::Sink
+{
+public:
+    virtual void Write(LogLevel level, const char* message) override
+    {
+        if (level == LogLevel::Debug) {
+            m_messages++;
+            m_bytes += std::strlen(message);
+        }
+    }
+
+    virtual void Flush() override
+    {
+    }
+
+    u64 m_messages = 0;
+    u64 m_bytes = 0;
+};
+
+// What DebugLog() used to do, minus OutputDebugStringA(), with a lock to keep messages whole
+class SynchronousLog
+{
+public:
+    void Log(const char* format, ...)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        char buf[512];
+
+        va_list args;
+        va_start(args, format);
+        std::vsnprintf(buf, sizeof(buf), format, args);
+        va_end(args);
+
+        m_sink.Write(LogLevel::Debug, buf);
+    }
+
+private:
+    std::mutex m_mutex;
+    CountingLogSink m_sink;
+};
+
+struct LogLatency
+{
+    double p50;
+    double p99;
+    double max;
+    double seconds;
+};
+
+// Runs log() from every thread at once. Latency is measured over batches of calls, since reading
+// the clock costs about as much as a call.
+template<typename LogFn>
+static LogLatency MeasureLogLatency(u32 threadCount, u32 messages, LogFn&& log)
+{
+    const u32 BATCH = 32;
+    const u32 batches = std::max(messages / BATCH, 1u);
+
+    std::vector<std::vector<double>> latencies(threadCount);
+    std::atomic<u32> ready(0);
+    std::atomic<bool> go(false);
+
+    auto body = [&](u32 thread) {
+        auto& batchNs = latencies[thread];
+        batchNs.reserve(batches);
+
+        ready.fetch_add(1);
+        while (!go.load()) {
+        }
+
+        for (u32 batch = 0; batch < batches; batch++) {
+            const auto start = Clock::now();
+            for (u32 i = 0; i < BATCH; i++) {
+                log(thread, batch * BATCH + i);
+            }
+            batchNs.push_back(SecondsSince(start) * 1e9 / BATCH);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (u32 i = 1; i < threadCount; i++) {
+        threads.emplace_back(body, i);
+    }
+
+    while (ready.load() != threadCount - 1) {
+        std::this_thread::yield();
+    }
+
+    const auto start = Clock::now();
+    go.store(true);
+    body(0);
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    LogLatency result;
+    result.seconds = SecondsSince(start);
+
+    std::vector<double> all;
+    for (const auto& batchNs : latencies) {
+        all.insert(all.end(), batchNs.begin(), batchNs.end());
+    }
+
+    std::sort(all.begin(), all.end());
+    result.p50 = all[all.size() / 2];
+    result.p99 = all[std::min(all.size() - 1, all.size() * 99 / 100)];
+    result.max = all.back();
+
+    return result;
+}
+
+static int LogBench(u32 maxThreads, u32 messages)
+{
+    const char* const FORMAT = "Thread %u: message %u, %s at %p took %.3f ms";
+    const char* const NAME = "GfxFn_58";
+
+    std::printf("threads   logger    p50 ns   p99 ns   max ns   Mmsg/s   dropped\n");
+
+    for (u32 threadCount = 1; threadCount <= maxThreads; threadCount *= 2) {
+        {
+            SynchronousLog log;
+            const auto latency = MeasureLogLatency(threadCount, messages, [&](u32 thread, u32 i) {
+                log.Log(FORMAT, thread, i, NAME, &log, i / 1e3);
+            });
+
+            std::printf("%7u   sync   %9.1f %8.1f %8.1f %8.2f %9u\n", threadCount,
+                latency.p50, latency.p99, latency.max, threadCount * messages / latency.seconds / 1e6, 0);
+        }
+
+        {
+            auto sink = std::make_unique<CountingLogSink>();
+            auto counts = sink.get();
+
+            // Messages are dropped if the writer thread falls behind by more than this, which
+            // happens when there are fewer cores than threads logging
+            Logger logger(std::move(sink), 65536, LogLevel::Debug, 0);
+
+            const auto latency = MeasureLogLatency(threadCount, messages, [&](u32 thread, u32 i) {
+                logger.Log(LogLevel::Debug, FORMAT, thread, i, NAME, &logger, i / 1e3);
+            });
+
+            logger.Flush();
+            const auto stats = logger.GetStats();
+
+            std::printf("%7u   async  %9.1f %8.1f %8.1f %8.2f %9" PRIu64 "\n", threadCount,
+                latency.p50, latency.p99, latency.max, threadCount * messages / latency.seconds / 1e6,
+                stats.droppedFull);
+
+            if (counts->m_messages != stats.written) {
+                std::fprintf(stderr, "The sink got %" PRIu64 " messages, %" PRIu64 " were written\n",
+                    counts->m_messages, stats.written);
+                return 1;
+            }
+        }
+    }
+
+    std::printf("Example message: %s\n", Logger::FormatNow(FORMAT, 1u, 2u, NAME, static_cast<void*>(nullptr), 3.25).c_str());
+
+    // Formats whose conversions don't match the arguments are written as is
+    struct FormatCheck
+    {
+        std::string formatted;
+        const char* expected;
+    };
+
+    const FormatCheck formatChecks[] = {
+        { Logger::FormatNow("%d and %s", 1), "<1 arguments for 2> %d and %s" },
+        { Logger::FormatNow("%d", 1, 2), "<2 arguments for 1> %d" },
+        { Logger::FormatNow("%*d", 5), "<1 arguments for 2> %*d" },
+        { Logger::FormatNow("%-*.*f%%", 8, 2, 1.5), "1.50    %" },
+        { Logger::FormatNow("100%% %I64u", 7ull), "100% 7" },
+    };
+
+    u32 errors = 0;
+    for (const auto& check : formatChecks) {
+        if (check.formatted != check.expected) {
+            std::fprintf(stderr, "Formatted \"%s\", expected \"%s\"\n", check.formatted.c_str(), check.expected);
+            errors++;
+        }
+    }
+
+    std::printf("Errors: %u\n", errors);
+
+    return errors ? 1 : 0;
+}
+
+static const char* GetKernelName(VertexTransformer::Kernel kernel)
+{
+    switch (kernel) {
+    case VertexTransformer::Kernel::AVX2:
+        return "AVX2";
+    case VertexTransformer::Kernel::SSE2:
+        return "SSE2";
+    default:
+        return "scalar";
+    }
+}
+
+// Vertices with random fields, with some of them replaced by the values kernels get wrong: zeros
+// of both signs, infinities, NaNs (signaling ones too, which float math would quiet), denormals,
+// and colors that are NaNs as floats
+static std::vector<FF7::Vertex> MakeTestVertices(u32 count, u64 seed)
+{
+    static const u32 SPECIALS[] = {
+        0x00000000, 0x80000000, 0x7f800000, 0xff800000, 0x7fc00000, 0x7f800001, 0xffbfffff, 0x00000001,
+        0x807fffff, 0x3f800000, 0x3b808081, 0x3b800000, 0x437f0000, 0x4f000000, 0xcf000000, 0xffffffff,
+    };
+
+    u64 state = seed;
+    auto next = [&] {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return static_cast<u32>(state >> 32);
+    };
+
+    std::vector<FF7::Vertex> vertices(count);
+    for (auto& vertex : vertices) {
+        u32 fields[8];
+        for (auto& field : fields) {
+            const u32 r = next();
+            if (r % 8 == 0) {
+                field = SPECIALS[(r >> 8) % 16];
+            } else {
+                // Floats between -2048 and 2048, and in 0..1 for z
+                const float value = (static_cast<float>(r >> 8) / (1 << 24) - 0.5f) * 4096.0f;
+                std::memcpy(&field, &value, sizeof(field));
+            }
+        }
+
+        const float z = static_cast<float>(next() >> 8) / (1 << 24);
+        std::memcpy(&fields[2], &z, sizeof(z));
+        fields[4] = next();
+
+        std::memcpy(&vertex, fields, sizeof(vertex));
+    }
+
+    return vertices;
+}
+
+static int VertexBench(u32 verticesPerCall)
+{
+    static const VertexTransformer::Kernel kernels[] = {
+        VertexTransformer::Kernel::Scalar, VertexTransformer::Kernel::SSE2, VertexTransformer::Kernel::AVX2,
+    };
+
+    const VertexTransformer::Affine2D position{ 0.5f, 0.5f, 0.0f, 0.0f };
+    const VertexTransformer::Affine2D texCoords{ 2.0f, 0.75f, -0.5f, 1.0f / 3.0f };
+    const u32 color = 0x80ff4001;
+
+    // Every count up to a few times the widest kernel, for the loop tails, and one large one
+    u32 mismatches = 0;
+    for (auto kernel : kernels) {
+        VertexTransformer transformer(kernel);
+        if (transformer.GetKernel() != kernel) {
+            continue;
+        }
+
+        VertexTransformer scalar(VertexTransformer::Kernel::Scalar);
+
+        for (u32 count = 0; count <= 4096; count = count < 40 ? count + 1 : count * 2) {
+            const auto src = MakeTestVertices(count, 1 + count);
+            std::vector<FF7::Vertex> expected(count);
+            std::vector<FF7::Vertex> actual(count);
+
+            auto check = [&](const char* name, auto&& transform) {
+                transform(scalar, expected.data(), src.data());
+                transform(transformer, actual.data(), src.data());
+
+                // In place too
+                auto inPlace = src;
+                transform(transformer, inPlace.data(), inPlace.data());
+
+                const std::size_t size = count * sizeof(FF7::Vertex);
+                if (std::memcmp(expected.data(), actual.data(), size) != 0 ||
+                    std::memcmp(expected.data(), inPlace.data(), size) != 0) {
+                    std::fprintf(stderr, "%s %s differs from scalar with %u vertices\n", GetKernelName(kernel), name,
+                        count);
+                    mismatches++;
+                }
+            };
+
+            check("TransformPositions", [&](const VertexTransformer& t, FF7::Vertex* dst, const FF7::Vertex* s) {
+                t.TransformPositions(dst, s, count, position);
+            });
+            check("TransformTexCoords", [&](const VertexTransformer& t, FF7::Vertex* dst, const FF7::Vertex* s) {
+                t.TransformTexCoords(dst, s, count, texCoords);
+            });
+            check("ModulateColors", [&](const VertexTransformer& t, FF7::Vertex* dst, const FF7::Vertex* s) {
+                t.ModulateColors(dst, s, count, color);
+            });
+
+            std::vector<u8> expectedDepths(count);
+            std::vector<u8> depths(count);
+            scalar.QuantizeDepths(expectedDepths.data(), src.data(), count);
+            transformer.QuantizeDepths(depths.data(), src.data(), count);
+
+            // The layer depths have to match the ones the renderer marks
+            LayerDepthSet marked;
+            LayerDepthSet quantized;
+            marked.Mark(src.data(), count);
+            for (auto depth : depths) {
+                quantized.Insert(depth);
+            }
+
+            if (depths != expectedDepths || !(marked == quantized)) {
+                std::fprintf(stderr, "%s QuantizeDepths differs with %u vertices\n", GetKernelName(kernel), count);
+                mismatches++;
+            }
+        }
+    }
+
+    std::printf("Kernel mismatches: %u\n", mismatches);
+
+    // Throughput over a buffer that fits in L2, like the batches DrawHook gets
+    const auto src = MakeTestVertices(verticesPerCall, 0x1234);
+    std::vector<FF7::Vertex> dst(verticesPerCall);
+    std::vector<u8> depths(verticesPerCall);
+    const u32 calls = std::max<u32>(256 * 1024 * 1024 / (verticesPerCall * sizeof(FF7::Vertex)), 1);
+
+    auto measure = [&](const VertexTransformer& transformer, auto&& transform) {
+        const auto start = Clock::now();
+        for (u32 i = 0; i < calls; i++) {
+            transform(transformer);
+        }
+
+        return static_cast<double>(calls) * verticesPerCall / SecondsSince(start) / 1e6;
+    };
+
+    std::printf("Mvertices/s with %u vertices per call:\n", verticesPerCall);
+    std::printf("%-8s %12s %12s %12s %12s\n", "", "positions", "texcoords", "colors", "depths");
+
+    for (auto kernel : kernels) {
+        VertexTransformer transformer(kernel);
+        if (transformer.GetKernel() != kernel) {
+            continue;
+        }
+
+        const double positions = measure(transformer, [&](const VertexTransformer& t) {
+            t.TransformPositions(dst.data(), src.data(), verticesPerCall, position);
+        });
+        const double texCoordsRate = measure(transformer, [&](const VertexTransformer& t) {
+            t.TransformTexCoords(dst.data(), src.data(), verticesPerCall, texCoords);
+        });
+        const double colors = measure(transformer, [&](const VertexTransformer& t) {
+            t.ModulateColors(dst.data(), src.data(), verticesPerCall, color);
+        });
+        const double depthRate = measure(transformer, [&](const VertexTransformer& t) {
+            t.QuantizeDepths(depths.data(), src.data(), verticesPerCall);
+        });
+
+        std::printf("%-8s %12.0f %12.0f %12.0f %12.0f\n", GetKernelName(kernel), positions, texCoordsRate, colors,
+            depthRate);
+    }
+
+    // Keeps the loops from being optimized out
+    u32 checksum = 0;
+    for (u32 i = 0; i < verticesPerCall; i++) {
+        checksum += dst[i].color + depths[i];
+    }
+
+    if (checksum == 1) {
+        std::printf("!\n");
+    }
+
+    return mismatches ? 1 : 0;
+}
+
+// The largest texture on most D3D9 hardware the game runs on
+static const u32 UPSCALE_MAX_SIZE = 8192;
+
+static int PrintUpscaleChain(const std::string& text, u32 scale)
+{
+    std::vector<UpscaleChain::Filter> filters;
+    if (!UpscaleChain::Parse(text, filters)) {
+        std::fprintf(stderr, "Invalid upscale chain %s\n", text.c_str());
+        return 1;
+    }
+
+    const UpscaleChain chain(320 * scale, 240 * scale, filters, UPSCALE_MAX_SIZE);
+
+    std::printf("%u of %zu steps fit in %ux%u\n", chain.GetSteps(), filters.size(), UPSCALE_MAX_SIZE,
+        UPSCALE_MAX_SIZE);
+
+    auto name = [](u32 target) {
+        return target == UpscaleChain::SOURCE ? std::string("source") : "target " + std::to_string(target);
+    };
+
+    const auto& passes = chain.GetPasses();
+    for (u32 i = 0; i < passes.size(); i++) {
+        const auto& pass = passes[i];
+        std::string inputs = name(pass.inputs[0]);
+        for (u32 j = 1; j < pass.inputCount; j++) {
+            inputs += ", " + name(pass.inputs[j]);
+        }
+
+        std::printf("Pass %u: %-15s %-20s -> %s (%ux%u)\n", i, UpscaleChain::GetShaderName(pass.shader),
+            inputs.c_str(), name(pass.output).c_str(), pass.width, pass.height);
+    }
+
+    const auto& targets = chain.GetTargets();
+    for (u32 i = 0; i < targets.size(); i++) {
+        std::printf("Target %u: %ux%u\n", i, targets[i].width, targets[i].height);
+    }
+
+    std::printf("Target memory: %.1f MiB\n", chain.GetTargetBytes() / (1024.0 * 1024.0));
+
+    const auto error = chain.Validate();
+    if (!error.empty()) {
+        std::printf("Invalid plan: %s\n", error.c_str());
+        return 1;
+    }
+
+    return 0;
+}
+
+static int CheckUpscaleChains()
+{
+    const char* const NAMES[] = { "superxbr", "bilinear" };
+
+    u32 chains = 0;
+    u32 failures = 0;
+
+    for (u32 scale = 1; scale <= 2; scale++) {
+        std::printf("From %ux%u:\n", 320 * scale, 240 * scale);
+        std::printf("%-40s %6s %8s %8s\n", "chain", "passes", "targets", "MiB");
+
+        for (u32 steps = 1; steps <= 4; steps++) {
+            for (u32 bits = 0; bits < (1u << steps); bits++) {
+                std::string text;
+                for (u32 i = 0; i < steps; i++) {
+                    text += std::string(i ? "," : "") + NAMES[(bits >> i) & 1];
+                }
+
+                std::vector<UpscaleChain::Filter> filters;
+                UpscaleChain::Parse(text, filters);
+
+                const UpscaleChain chain(320 * scale, 240 * scale, filters, UPSCALE_MAX_SIZE);
+
+                const auto error = chain.Validate();
+                std::printf("%-40s %6zu %8zu %8.1f%s%s\n", text.c_str(), chain.GetPasses().size(),
+                    chain.GetTargets().size(), chain.GetTargetBytes() / (1024.0 * 1024.0),
+                    error.empty() ? "" : " INVALID: ", error.c_str());
+
+                chains++;
+                failures += !error.empty();
+            }
+        }
+    }
+
+    std::printf("Chains checked: %u, invalid: %u\n", chains, failures);
+    return failures ? 1 : 0;
+}
+
+// Stands in for the D3D textures, and checks that the pool never creates a slot twice or
+// releases one it didn't create
+class MockTextureAllocator : public TexturePool::Allocator
+{
+public:
+    MockTextureAllocator() :
+        m_bytes(0),
+        m_errors(0)
+    {
+    }
+
+    virtual bool CreateTexture(u32 slot, const TexturePool::Desc& desc) override
+    {
+        m_errors += m_textures.count(slot);
+        m_textures[slot] = desc;
+        m_bytes += TexturePool::GetBytes(desc);
+        return true;
+    }
+
+    virtual void ReleaseTexture(u32 slot) override
+    {
+        auto it = m_textures.find(slot);
+        if (it == m_textures.end()) {
+            m_errors++;
+            return;
+        }
+
+        m_bytes -= TexturePool::GetBytes(it->second);
+        m_textures.erase(it);
+    }
+
+    const std::map<u32, TexturePool::Desc>& GetTextures() const
+    {
+        return m_textures;
+    }
+
+    u64 GetBytes() const
+    {
+        return m_bytes;
+    }
+
+    u64 GetErrors() const
+    {
+        return m_errors;
+    }
+
+private:
+    std::map<u32, TexturePool::Desc> m_textures;
+    u64 m_bytes;
+    u64 m_errors;
+};
+
+struct PoolRequest
+{
+    TexturePool::Desc desc;
+    u32 firstPass;
+    u32 lastPass;
+};
+
+// Checks the textures the pool gave a plan, returns the number of problems
+static u32 CheckTexturePlan(const TexturePool& pool, const MockTextureAllocator& allocator,
+    const std::vector<PoolRequest>& requests, const std::vector<u32>& handles)
+{
+    u32 errors = 0;
+    std::map<u32, u32> slotsUsed;
+
+    for (u32 i = 0; i < requests.size(); i++) {
+        const u32 slot = pool.GetSlot(handles[i]);
+        slotsUsed[slot]++;
+
+        // The texture exists and matches the request
+        auto it = allocator.GetTextures().find(slot);
+        errors += (it == allocator.GetTextures().end() || !(it->second == requests[i].desc));
+
+        // Requests sharing a texture don't overlap
+        for (u32 j = 0; j < i; j++) {
+            errors += pool.GetSlot(handles[j]) == slot && requests[i].firstPass <= requests[j].lastPass &&
+                requests[j].firstPass <= requests[i].lastPass;
+        }
+    }
+
+    // As few textures as the most requests of a descriptor alive at one pass
+    u32 needed = 0;
+    std::vector<TexturePool::Desc> descs;
+
+    for (const auto& request : requests) {
+        if (std::find(descs.begin(), descs.end(), request.desc) != descs.end()) {
+            continue;
+        }
+
+        descs.push_back(request.desc);
+
+        u32 most = 0;
+        for (const auto& at : requests) {
+            u32 alive = 0;
+            for (const auto& other : requests) {
+                alive += other.desc == request.desc && other.firstPass <= at.firstPass &&
+                    at.firstPass <= other.lastPass;
+            }
+
+            most = std::max(most, alive);
+        }
+
+        needed += most;
+    }
+
+    errors += slotsUsed.size() != needed;
+
+    // The tracked memory is what's created
+    const auto& stats = pool.GetStats();
+    errors += stats.bytes != allocator.GetBytes() || stats.textures != allocator.GetTextures().size() ||
+        stats.peakBytes < stats.bytes;
+
+    return errors;
+}
+
+static int TexturePoolCheck(u32 plans)
+{
+    const u32 MAX_IDLE_PLANS = 2;
+    const u32 PASSES = 8;
+
+    // The kinds of textures the renderer requests: background render targets at two scales, an
+    // upscaled background, and the layer lookup
+    const TexturePool::Desc DESCS[] = {
+        { 320, 240, 21, 1 },
+        { 640, 480, 21, 1 },
+        { 640, 480, 21, 0x200 },
+        { 256, 1, 21, 0x200 }
+    };
+
+    std::mt19937 random(1234);
+    MockTextureAllocator allocator;
+    u32 errors = 0;
+    u64 requestCount = 0;
+    u64 aliased = 0;
+    u64 peakBytes = 0;
+    u64 repeatCreations = 0;
+
+    {
+        TexturePool pool(allocator, MAX_IDLE_PLANS);
+        std::vector<PoolRequest> requests;
+        std::vector<u32> handles;
+
+        for (u32 plan = 0; plan < plans; plan++) {
+            // Every 4th plan repeats the previous one, and every 16th resets the device first
+            const bool repeat = plan % 4 == 3;
+            const bool reset = plan % 16 == 15;
+
+            if (!repeat) {
+                requests.clear();
+                const u32 count = 1 + random() % 12;
+
+                for (u32 i = 0; i < count; i++) {
+                    const u32 first = random() % PASSES;
+                    const u32 last = first + random() % (PASSES - first);
+                    requests.push_back({ DESCS[random() % 4], first, last });
+                }
+            }
+
+            if (reset) {
+                pool.ReleaseAll();
+                errors += !allocator.GetTextures().empty();
+            }
+
+            pool.BeginPlan();
+            handles.clear();
+            for (const auto& request : requests) {
+                handles.push_back(pool.Request(request.desc, request.firstPass, request.lastPass));
+            }
+
+            const u64 creations = pool.GetStats().creations;
+            errors += !pool.Allocate();
+
+            if (repeat && !reset) {
+                repeatCreations += pool.GetStats().creations - creations;
+            }
+
+            // After a reset, everything the plan uses is created again
+            if (reset) {
+                for (const u32 handle : handles) {
+                    errors += !pool.IsNew(handle);
+                }
+            }
+
+            errors += CheckTexturePlan(pool, allocator, requests, handles);
+
+            requestCount += requests.size();
+            aliased += pool.GetStats().aliased;
+            peakBytes = std::max(peakBytes, allocator.GetBytes());
+        }
+
+        errors += pool.GetStats().peakBytes != peakBytes;
+
+        std::printf("Plans: %u, requests: %" PRIu64 ", sharing a texture: %" PRIu64 " (%.1f%%)\n", plans, requestCount,
+            aliased, requestCount ? 100.0 * aliased / requestCount : 0.0);
+        std::printf("Textures created: %" PRIu64 ", released: %" PRIu64 ", created by repeated plans: %" PRIu64 "\n",
+            pool.GetStats().creations, pool.GetStats().releases, repeatCreations);
+        std::printf("Peak memory: %.1f MiB\n", pool.GetStats().peakBytes / (1024.0 * 1024.0));
+
+        // Planning nothing releases everything once it's been idle long enough
+        for (u32 plan = 0; plan <= MAX_IDLE_PLANS; plan++) {
+            pool.BeginPlan();
+            errors += !pool.Allocate();
+        }
+
+        errors += !allocator.GetTextures().empty();
+    }
+
+    errors += allocator.GetErrors() + !allocator.GetTextures().empty() + (repeatCreations != 0);
+
+    std::printf("Errors: %u\n", errors);
+    return errors ? 1 : 0;
+}
+
+// Relative GPU cost of drawing the background at a level: the pixels every pass writes, weighted
+// by how much the shader reads, and the layers drawn over the 640x480 backbuffer with 4 layers
+static double GetLevelCost(const QualityLevel& level)
+{
+    const u32 width = 320 * level.internalScale;
+    const u32 height = 240 * level.internalScale;
+    double cost = static_cast<double>(width) * height;
+
+    const UpscaleChain chain(width, height, level.filters, UPSCALE_MAX_SIZE);
+    for (const auto& pass : chain.GetPasses()) {
+        const double weight = (pass.shader == UpscaleChain::Shader::Bilinear) ? 1.0 : 4.0;
+        cost += weight * pass.width * pass.height;
+    }
+
+    cost += (level.singlePassLayers ? 2.0 : 4.0) * 640 * 480;
+    return cost;
+}
+
+// A synthetic frame time trace. load is the time a frame takes at the best level in % of the
+// target, of which a fifth doesn't depend on the level.
+struct QualityScenario
+{
+    const char* name;
+    u32 frames;
+    u32 noisePercent;               // Frame times vary by up to this much either way
+    u32 hitchInterval;              // A frame every this many takes 250 ms, if not 0
+    bool vsync;                     // Presenting waits for the next refresh, at 59.94 Hz for a 60 fps target
+    u32 (*load)(u32 frame);
+};
+
+struct QualityRun
+{
+    std::vector<u32> levels;        // Of every frame
+    u64 hash;                       // Of levels
+    QualityController::Stats stats;
+    u64 lateSlowFrames;             // Over the target in the second half
+    u64 presentWait;                // Time spent waiting for vsync
+};
+
+static QualityRun RunQualityScenario(const QualityScenario& scenario, const std::vector<double>& costs,
+    const QualityController::Params& params)
+{
+    const u32 levelCount = static_cast<u32>(costs.size());
+    QualityController controller(params, levelCount, levelCount - 1);
+
+    // std::mt19937 is the same everywhere, unlike the standard distributions
+    std::mt19937 random(5678);
+
+    QualityRun run;
+    run.hash = 0;
+    run.lateSlowFrames = 0;
+    run.presentWait = 0;
+
+    bool changed = false;
+
+    for (u32 frame = 0; frame < scenario.frames; frame++) {
+        const u32 level = controller.GetLevel();
+        run.levels.push_back(level);
+        run.hash = (run.hash ^ level) * 0x100000001b3ull;
+
+        const double share = 0.2 + 0.8 * costs[level] / costs.back();
+        double time = params.targetMicroseconds * scenario.load(frame) / 100.0 * share;
+
+        if (scenario.noisePercent) {
+            const i32 noise = static_cast<i32>(random() % (2 * scenario.noisePercent + 1)) -
+                static_cast<i32>(scenario.noisePercent);
+            time += time * noise / 100.0;
+        }
+
+        if (scenario.hitchInterval && frame % scenario.hitchInterval == scenario.hitchInterval - 1) {
+            time = 250000.0;
+        }
+
+        // The first frame of a level creates its textures
+        if (changed) {
+            time += 20000.0;
+        }
+
+        const u32 microseconds = static_cast<u32>(time);
+
+        // With vsync every frame lasts whole refresh periods, so timing through presenting would make
+        // frames at least as slow as the target. Renderer stops timing before presenting.
+        if (scenario.vsync) {
+            const u32 refresh = params.targetMicroseconds * 1001 / 1000;
+            run.presentWait += refresh - microseconds % refresh;
+        }
+
+        run.lateSlowFrames += frame >= scenario.frames / 2 && microseconds > params.targetMicroseconds;
+
+        changed = controller.AddFrame(microseconds);
+    }
+
+    run.stats = controller.GetStats();
+    return run;
+}
+
+static int QualityCheck(const std::string& text, u32 scale, u32 target)
+{
+    QualityLevel best;
+    best.internalScale = scale;
+    best.singlePassLayers = false;
+
+    if (!UpscaleChain::Parse(text, best.filters)) {
+        std::fprintf(stderr, "Invalid upscale chain %s\n", text.c_str());
+        return 1;
+    }
+
+    const auto levels = QualityLevel::MakeLevels(best);
+
+    std::vector<double> costs;
+    for (const auto& level : levels) {
+        costs.push_back(GetLevelCost(level));
+    }
+
+    u64 errors = 0;
+
+    std::printf("%-6s %6s %-30s %-7s %6s\n", "Level", "Scale", "Chain", "Layers", "Cost");
+    for (u32 i = 0; i < levels.size(); i++) {
+        std::printf("%-6u %6u %-30s %-7s %6.2f\n", i, levels[i].internalScale,
+            UpscaleChain::Format(levels[i].filters).c_str(), levels[i].singlePassLayers ? "single" : "multi",
+            costs[i] / costs.back());
+
+        // Every level is cheaper than the next
+        errors += i > 0 && costs[i - 1] >= costs[i];
+    }
+
+    const QualityScenario scenarios[] = {
+        { "light", 3600, 10, 0, false, [](u32) { return 50u; } },
+        { "borderline", 3600, 10, 0, false, [](u32) { return 95u; } },
+        { "hitches", 3600, 10, 45, false, [](u32) { return 60u; } },
+        { "vsync", 3600, 10, 0, true, [](u32) { return 60u; } },
+        { "heavy", 3600, 10, 0, false, [](u32) { return 160u; } },
+        { "overloaded", 3600, 10, 0, false, [](u32) { return 500u; } },
+        { "spike", 3600, 10, 0, false, [](u32 frame) { return (frame >= 600 && frame < 1200) ? 250u : 50u; } },
+        { "ramp", 3600, 10, 0, false, [](u32 frame) { return 40u + std::min(frame, 2400u) * 160 / 2400; } }
+    };
+
+    const auto params = QualityController::GetDefaultParams(target);
+    const u32 top = static_cast<u32>(levels.size()) - 1;
+
+    // The frame time of a level without noise, and the best level that holds the target
+    const auto nominal = [&](u32 load, u32 level) {
+        return target * load / 100.0 * (0.2 + 0.8 * costs[level] / costs.back());
+    };
+
+    std::printf("\n%-11s %7s %6s %6s %6s %6s %6s %10s %10s %5s\n", "Scenario", "Frames", "Down", "Up", "Final",
+        "Lowest", "Mean", "Slow", "Late slow", "Same");
+
+    for (const auto& scenario : scenarios) {
+        const auto run = RunQualityScenario(scenario, costs, params);
+        const auto again = RunQualityScenario(scenario, costs, params);
+
+        const u32 lowest = *std::min_element(run.levels.begin(), run.levels.end());
+        double mean = 0.0;
+        for (const u32 level : run.levels) {
+            mean += level;
+        }
+        mean /= run.levels.size();
+
+        const bool same = run.hash == again.hash && run.levels == again.levels;
+        const u32 final = run.levels.back();
+        const u64 changes = run.stats.stepsDown + run.stats.stepsUp;
+
+        std::printf("%-11s %7" PRIu64 " %6" PRIu64 " %6" PRIu64 " %6u %6u %6.2f %9.1f%% %9.1f%% %5s\n", scenario.name,
+            run.stats.frames, run.stats.stepsDown, run.stats.stepsUp, final, lowest, mean,
+            100.0 * run.stats.slowFrames / run.stats.frames, 200.0 * run.lateSlowFrames / scenario.frames,
+            same ? "yes" : "NO");
+
+        u32 scenarioErrors = !same;
+
+        // Never more than one change every 8 windows, on average
+        scenarioErrors += changes * params.windowFrames * 8 > scenario.frames;
+
+        const std::string name = scenario.name;
+        const u32 lastLoad = scenario.load(scenario.frames - 1);
+
+        if (name == "light" || name == "borderline" || name == "hitches" || name == "vsync") {
+            // Nothing to gain from a lower level, even if presenting waits for vsync
+            scenarioErrors += changes != 0 || (scenario.vsync && run.presentWait == 0);
+        } else if (name == "spike") {
+            scenarioErrors += lowest == top || final != top;
+        } else {
+            // Settled on a level that holds the target, not too far below the best one that does, and
+            // holding it for the median frame of the second half
+            u32 fitting = 0;
+            while (fitting < top && nominal(lastLoad, fitting + 1) <= target) {
+                fitting++;
+            }
+
+            // Even the lowest level may not hold it
+            const bool canHold = nominal(lastLoad, 0) <= target;
+            const bool holds = nominal(lastLoad, final) <= target;
+            scenarioErrors += canHold ? (!holds || final + 2 < fitting || run.lateSlowFrames * 2 > scenario.frames / 2) :
+                final != 0;
+        }
+
+        if (scenarioErrors) {
+            std::printf("  %s failed %u checks\n", scenario.name, scenarioErrors);
+        }
+
+        errors += scenarioErrors;
+    }
+
+    std::printf("Errors: %" PRIu64 "\n", errors);
+    return errors ? 1 : 0;
+}
+
+struct FrameAllocation
+{
+    u32 size;
+    u32 alignment;
+};
+
+// Allocations like a frame of the renderer makes: mostly small structs, some vertex and index arrays
+static std::vector<FrameAllocation> MakeFrameAllocations(std::mt19937& random, u32 count)
+{
+    std::vector<FrameAllocation> allocations(count);
+
+    for (auto& allocation : allocations) {
+        allocation.size = (random() % 8 == 0) ? 1 + random() % 16384 : 1 + random() % 256;
+        allocation.alignment = 1u << (random() % 7);
+    }
+
+    return allocations;
+}
+
+struct FrameAllocatorCycles
+{
+    u64 heapAllocations;    // Counted by operator new, over every frame
+    u64 heapFrees;
+    u64 allocatorHeapAllocations;   // Reported by the allocator
+    u64 misaligned;
+    double seconds;
+};
+
+// Allocates the frames in turn, and resets the allocator after every one, like EndFrame() does
+static FrameAllocatorCycles RunFrameAllocator(FrameAllocator& allocator,
+    const std::vector<const std::vector<FrameAllocation>*>& frames, u32 cycles)
+{
+    FrameAllocatorCycles result = {};
+    const u64 startAllocations = g_heapAllocations.load(std::memory_order_relaxed);
+    const u64 startFrees = g_heapFrees.load(std::memory_order_relaxed);
+    const auto start = Clock::now();
+
+    for (u32 cycle = 0; cycle < cycles; cycle++) {
+        for (const auto& allocation : *frames[cycle % frames.size()]) {
+            auto memory = static_cast<u8*>(allocator.Allocate(allocation.size, allocation.alignment));
+            result.misaligned += (reinterpret_cast<std::uintptr_t>(memory) & (allocation.alignment - 1)) != 0;
+
+            // Touched at both ends, so an allocation past the end of a block shows up in ASan builds
+            memory[0] = 1;
+            memory[allocation.size - 1] = 1;
+        }
+
+        result.allocatorHeapAllocations += allocator.GetStats().heapAllocations;
+        allocator.Reset();
+    }
+
+    result.seconds = SecondsSince(start);
+    result.heapAllocations = g_heapAllocations.load(std::memory_order_relaxed) - startAllocations;
+    result.heapFrees = g_heapFrees.load(std::memory_order_relaxed) - startFrees;
+    return result;
+}
+
+static int FrameAllocatorCheck(u32 frames)
+{
+    std::mt19937 random(4321);
+    const auto small = MakeFrameAllocations(random, 500);
+    const auto large = MakeFrameAllocations(random, 5000);
+    const auto other = MakeFrameAllocations(random, 500);
+
+    struct Scenario
+    {
+        const char* name;
+        u32 initialSize;
+        std::vector<const std::vector<FrameAllocation>*> warmUp;    // Frames allowed to make heap calls
+        std::vector<const std::vector<FrameAllocation>*> frames;    // Repeated without any
+        bool grows;     // During the warm-up
+    };
+
+    // The small frames take about 0.6 MiB and the large one 6 MiB
+    const Scenario scenarios[] = {
+        { "fits", 4 << 20, {}, { &small }, false },
+        { "grows", 4096, { &small }, { &small }, true },
+        { "alternating", 4096, { &small, &other }, { &small, &other }, true },
+        { "overflow frame", 4 << 20, { &small, &small, &large }, { &small, &large, &other }, true },
+        { "grows twice", 4096, { &small, &large }, { &large, &small }, true },
+    };
+
+    std::printf("scenario        warm-up heap calls   frames   heap calls   peak KiB   us/frame\n");
+
+    u32 errors = 0;
+
+    for (const auto& scenario : scenarios) {
+        u32 scenarioErrors = 0;
+        FrameAllocator allocator(scenario.initialSize);
+
+        // The constructor counts the block it allocates in the stats of the first frame
+        allocator.Reset();
+
+        // A warm-up frame that doesn't fit makes heap calls, counted by the allocator too
+        const auto warmUp = RunFrameAllocator(allocator, scenario.warmUp, static_cast<u32>(scenario.warmUp.size()));
+        scenarioErrors += warmUp.misaligned;
+        scenarioErrors += scenario.grows != (warmUp.allocatorHeapAllocations != 0);
+        scenarioErrors += scenario.grows != (warmUp.heapAllocations != 0);
+
+        const auto steady = RunFrameAllocator(allocator, scenario.frames, frames);
+        scenarioErrors += steady.misaligned;
+        scenarioErrors += steady.heapAllocations != 0 || steady.heapFrees != 0 || steady.allocatorHeapAllocations != 0;
+
+        std::printf("%-15s %18" PRIu64 " %8u %12" PRIu64 " %10u %10.2f\n", scenario.name,
+            warmUp.heapAllocations + warmUp.heapFrees, frames, steady.heapAllocations + steady.heapFrees,
+            allocator.GetStats().peakBytesUsed / 1024, frames ? steady.seconds * 1e6 / frames : 0.0);
+
+        if (scenarioErrors) {
+            std::printf("  %s failed %u checks\n", scenario.name, scenarioErrors);
+        }
+
+        errors += scenarioErrors;
+    }
+
+    std::printf("Errors: %u\n", errors);
+    return errors ? 1 : 0;
+}
+
+// The layers of a frame as Renderer found them before LayerDepthSet: ceilf() of every vertex inserted
+// into an unordered_set, copied to a vector and sorted, and walked from the end. Values past the int
+// range and NaNs were cast to int, which is undefined, so they're clamped first here like
+// LayerDepthSet clamps them. Other depths outside 0..255 are kept.
+static void GetOldLayerDepths(std::unordered_set<int>& set, std::vector<int>& layers, const FF7::Vertex* vertices,
+    u32 count)
+{
+    set.clear();
+
+    for (u32 i = 0; i < count; i++) {
+        const float depth = std::ceil(vertices[i].z * 255.0f);
+        set.insert(depth > -1e9f && depth < 1e9f ? static_cast<int>(depth) : (depth > 0.0f ? 255 : 0));
+    }
+
+    layers.assign(set.cbegin(), set.cend());
+    std::sort(layers.begin(), layers.end());
+    std::reverse(layers.begin(), layers.end());
+}
+
+// Depths that quantize to the edges of a layer or aren't numbers
+static float GetEdgeDepth(std::mt19937& random)
+{
+    const float k = static_cast<float>(random() % 256);
+
+    switch (random() % 12) {
+    case 0:
+        return std::numeric_limits<float>::quiet_NaN();
+    case 1:
+        return std::numeric_limits<float>::infinity();
+    case 2:
+        return -std::numeric_limits<float>::infinity();
+    case 3:
+        return -0.0f;
+    case 4:
+        return std::numeric_limits<float>::denorm_min();
+    case 5:
+        return (random() % 2 ? 1.0f : -1.0f) * 1e30f;
+    case 6:
+        return -k / 255.0f;
+    case 7:
+        return (k + 256.0f) / 255.0f;
+    case 8:
+        return std::nextafter(k / 255.0f, 2.0f);
+    case 9:
+        return std::nextafter(k / 255.0f, -1.0f);
+    case 10:
+        return k * (1.0f / 255.0f);
+    default:
+        return k / 255.0f;
+    }
+}
+
+static int LayerDepthCheck(u32 frames)
+{
+    const u32 FRAME_SETS = 64;
+    const u32 MAX_VERTICES = 4096;
+
+    enum class Depths
+    {
+        Uniform,        // Anywhere from a bit under 0 to a bit over 1
+        Multiples,      // Exact multiples of 1/255, like the game's layers
+        Edges,
+        Layers          // A few distinct depths shared by every vertex, like a real background
+    };
+
+    const struct
+    {
+        const char* name;
+        Depths depths;
+    } scenarios[] = {
+        { "uniform", Depths::Uniform },
+        { "multiples", Depths::Multiples },
+        { "edge cases", Depths::Edges },
+        { "few layers", Depths::Layers },
+    };
+
+    // std::mt19937 is the same everywhere, unlike the standard distributions
+    std::mt19937 random(2468);
+
+    std::printf("%-12s %8s %10s %8s %12s %14s %14s\n", "depths", "checked", "vertices", "layers", "mismatches",
+        "set ns/vertex", "bits ns/vertex");
+
+    u64 errors = 0;
+
+    for (const auto& scenario : scenarios) {
+        std::vector<std::vector<FF7::Vertex>> frameSets(FRAME_SETS);
+
+        for (auto& vertices : frameSets) {
+            // Not always a multiple of 4, so the scalar tail of Mark() is covered too
+            vertices.resize(1 + random() % MAX_VERTICES);
+
+            float layers[8];
+            for (auto& layer : layers) {
+                layer = static_cast<float>(random() % 256) / 255.0f;
+            }
+
+            for (auto& vertex : vertices) {
+                vertex = FF7::Vertex{};
+
+                switch (scenario.depths) {
+                case Depths::Uniform:
+                    vertex.z = static_cast<float>(random() / 4294967296.0 * 1.2 - 0.1);
+                    break;
+                case Depths::Multiples:
+                    vertex.z = static_cast<float>(random() % 256) / 255.0f;
+                    break;
+                case Depths::Edges:
+                    vertex.z = GetEdgeDepth(random);
+                    break;
+                case Depths::Layers:
+                    vertex.z = layers[random() % 8];
+                    break;
+                }
+            }
+        }
+
+        std::unordered_set<int> oldSet;
+        std::vector<int> oldLayers;
+        LayerDepthSet set;
+        std::vector<int> layers;
+        u64 mismatches = 0;
+        u64 vertexCount = 0;
+        u64 layerCount = 0;
+
+        for (const auto& vertices : frameSets) {
+            GetOldLayerDepths(oldSet, oldLayers, vertices.data(), static_cast<u32>(vertices.size()));
+
+            // The documented clamping, the old path let depths outside 0..255 through
+            for (auto& layer : oldLayers) {
+                layer = std::min(std::max(layer, 0), 255);
+            }
+            oldLayers.erase(std::unique(oldLayers.begin(), oldLayers.end()), oldLayers.end());
+
+            set.Clear();
+            set.Mark(vertices.data(), static_cast<u32>(vertices.size()));
+
+            layers.clear();
+            set.ForEachDescending([&](u32 layer) {
+                layers.push_back(static_cast<int>(layer));
+            });
+
+            mismatches += layers != oldLayers;
+            vertexCount += vertices.size();
+            layerCount += layers.size();
+        }
+
+        // Timed separately over the same frames, with a sum of the layers so neither is optimized away
+        u64 oldSum = 0;
+        u64 sum = 0;
+        u64 timedVertices = 0;
+
+        auto start = Clock::now();
+        for (u32 frame = 0; frame < frames; frame++) {
+            const auto& vertices = frameSets[frame % FRAME_SETS];
+            GetOldLayerDepths(oldSet, oldLayers, vertices.data(), static_cast<u32>(vertices.size()));
+
+            for (const int layer : oldLayers) {
+                oldSum += std::min(std::max(layer, 0), 255);
+            }
+
+            timedVertices += vertices.size();
+        }
+        const double oldSeconds = SecondsSince(start);
+
+        start = Clock::now();
+        for (u32 frame = 0; frame < frames; frame++) {
+            const auto& vertices = frameSets[frame % FRAME_SETS];
+            set.Clear();
+            set.Mark(vertices.data(), static_cast<u32>(vertices.size()));
+
+            set.ForEachDescending([&](u32 layer) {
+                sum += layer;
+            });
+        }
+        const double seconds = SecondsSince(start);
+
+        // Out of range depths are counted once per layer in the old sum, so it can only be larger
+        mismatches += sum > oldSum;
+
+        std::printf("%-12s %8u %10" PRIu64 " %8.1f %12" PRIu64 " %14.2f %14.2f\n", scenario.name, FRAME_SETS,
+            vertexCount, static_cast<double>(layerCount) / FRAME_SETS, mismatches,
+            timedVertices ? oldSeconds * 1e9 / timedVertices : 0.0, timedVertices ? seconds * 1e9 / timedVertices : 0.0);
+
+        errors += mismatches;
+    }
+
+    std::printf("Errors: %" PRIu64 "\n", errors);
+    return errors ? 1 : 0;
+}
+
+static void PrintUsage()
+{
+    std::fprintf(stderr,
+        "Usage:\n"
+        "  ff7gx-trace dump <trace> [max records]\n"
+        "  ff7gx-trace stats <trace>\n"
+        "  ff7gx-trace bench <output trace> [frames] [draws per frame]\n"
+        "  ff7gx-trace replay <trace> [repeat] [multi|single] [per-frame csv]\n"
+        "  ff7gx-trace render <trace> <width>x<height> [threads] [tga directory]\n"
+        "  ff7gx-trace rasterbench <trace> [max threads]\n"
+        "  ff7gx-trace profile <trace> [repeat] [chrome trace]\n"
+        "  ff7gx-trace statefilter <trace> [multi|single]\n"
+        "  ff7gx-trace statesave <trace> [multi|single] [upscale chain]\n"
+        "  ff7gx-trace skipcheck <trace> [multi|single]\n"
+        "  ff7gx-trace dirtyrects <trace> [repeat]\n"
+        "  ff7gx-trace batchcheck <trace> [multi|single]\n"
+        "  ff7gx-trace composite <trace> [repeat]\n"
+        "  ff7gx-trace eventbench [calls]\n"
+        "  ff7gx-trace dispatchbench [calls]\n"
+        "  ff7gx-trace logbench [max threads] [messages per thread]\n"
+        "  ff7gx-trace vertexbench [vertices per call]\n"
+        "  ff7gx-trace texturepool [plans]\n"
+        "  ff7gx-trace upscalechain [upscale chain] [internal scale]\n"
+        "  ff7gx-trace quality [upscale chain] [internal scale] [target us]\n"
+        "  ff7gx-trace frameallocator [frames]\n"
+        "  ff7gx-trace layerdepths [frames]\n");
+}
+
+int main(int argc, char* argv[])
+{
+    // The commands without a trace
+    if (argc >= 2 && std::string(argv[1]) == "eventbench") {
+        const u32 calls = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        return EventBench(calls ? calls : 10000000);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "dispatchbench") {
+        const u32 calls = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        return DispatchBench(calls ? calls : 100000000);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "logbench") {
+        const u32 maxThreads = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        const u32 messages = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+        return LogBench(maxThreads ? maxThreads : 4, messages ? messages : 100000);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "vertexbench") {
+        const u32 vertices = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        return VertexBench(vertices ? vertices : 256);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "texturepool") {
+        const u32 plans = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        return TexturePoolCheck(plans ? plans : 10000);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "upscalechain") {
+        const u32 scale = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+        return argc >= 3 ? PrintUpscaleChain(argv[2], scale ? scale : 1) : CheckUpscaleChains();
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "quality") {
+        const std::string chain = argc >= 3 ? argv[2] : "superxbr,bilinear";
+        const u32 scale = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+        const u32 target = argc >= 5 ? std::strtoul(argv[4], nullptr, 10) : 0;
+        return QualityCheck(chain, scale ? scale : 2, target ? target : 16667);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "frameallocator") {
+        const u32 frames = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        return FrameAllocatorCheck(frames ? frames : 10000);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "layerdepths") {
+        const u32 frames = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : 0;
+        return LayerDepthCheck(frames ? frames : 2000);
+    }
+
+    if (argc < 3) {
+        PrintUsage();
+        return 1;
+    }
+
+    const std::string command = argv[1];
+
+    if (command == "dump") {
+        u64 maxRecords = argc >= 4 ? std::strtoull(argv[3], nullptr, 10) : 0;
+        return Dump(argv[2], maxRecords ? maxRecords : UINT64_MAX);
+    }
+
+    if (command == "stats") {
+        return Stats(argv[2]);
+    }
+
+    if (command == "bench") {
+        const u32 frames = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+        const u32 draws = argc >= 5 ? std::strtoul(argv[4], nullptr, 10) : 0;
+
+        return Bench(argv[2], frames ? frames : 1000, draws ? draws : 100);
+    }
+
+    if (command == "replay") {
+        const u32 repeat = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+        const bool singlePassLayers = argc >= 5 && std::string(argv[4]) == "single";
+        const std::string csvPath = argc >= 6 ? argv[5] : "";
+
+        return Replay(argv[2], repeat ? repeat : 1, singlePassLayers, csvPath);
+    }
+
+    if (command == "render" && argc >= 4) {
+        u32 width, height;
+        if (!ParseResolution(argv[3], width, height)) {
+            std::fprintf(stderr, "Invalid resolution %s\n", argv[3]);
+            return 1;
+        }
+
+        const u32 threads = argc >= 5 ? std::strtoul(argv[4], nullptr, 10) : 0;
+        const std::string tgaDir = argc >= 6 ? argv[5] : "";
+
+        return Render(argv[2], width, height, threads, tgaDir);
+    }
+
+    if (command == "rasterbench") {
+        const u32 maxThreads = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+
+        return RasterBench(argv[2], maxThreads ? maxThreads : std::max(std::thread::hardware_concurrency(), 1u));
+    }
+
+    if (command == "profile") {
+        const u32 repeat = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+        const std::string chromePath = argc >= 5 ? argv[4] : "";
+
+        return Profile(argv[2], repeat ? repeat : 1, chromePath);
+    }
+
+    if (command == "statefilter") {
+        const bool singlePassLayers = argc >= 4 && std::string(argv[3]) == "single";
+
+        return StateFilterCheck(argv[2], singlePassLayers);
+    }
+
+    if (command == "statesave") {
+        const bool singlePassLayers = argc >= 4 && std::string(argv[3]) == "single";
+        const std::string upscaleChain = argc >= 5 ? argv[4] : "";
+
+        return StateSaveCheck(argv[2], singlePassLayers, upscaleChain);
+    }
+
+    if (command == "skipcheck") {
+        const bool singlePassLayers = argc >= 4 && std::string(argv[3]) == "single";
+
+        return ChangeDetectionCheck(argv[2], singlePassLayers);
+    }
+
+    if (command == "dirtyrects") {
+        const u32 repeat = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+
+        return DirtyRectCheck(argv[2], repeat ? repeat : 10);
+    }
+
+    if (command == "batchcheck") {
+        const bool singlePassLayers = argc >= 4 && std::string(argv[3]) == "single";
+
+        return BatchCheck(argv[2], singlePassLayers);
+    }
+
+    if (command == "composite") {
+        const u32 repeat = argc >= 4 ? std::strtoul(argv[3], nullptr, 10) : 0;
+
+        return CompositeCheck(argv[2], repeat ? repeat : 10);
+    }
+
+    PrintUsage();
+    return 1;
+}
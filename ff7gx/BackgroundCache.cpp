@@ -0,0 +1,196 @@
+#include "stdafx.h"
+
+#include "BackgroundCache.h"
+#include "TextureHash.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <utility>
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+// Header of a cached background on disk, followed by width * height A8R8G8B8 pixels
+struct DiskHeader
+{
+    u32 magic;
+    u32 version;
+    u64 key;
+    u32 width;
+    u32 height;
+};
+
+static const u32 DISK_MAGIC = 0x43424746; // "FGBC"
+static const u32 DISK_VERSION = 2;
+
+// Anything bigger than this is a corrupted file
+static const u32 MAX_DIMENSION = 8192;
+
+// Replaces to with from, in a single step if both are on the same volume
+static bool RenameOver(const std::string& from, const std::string& to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+static std::size_t GetEntryBytes(const BackgroundCache::Entry& entry)
+{
+    return entry.pixels.size() * sizeof(u32);
+}
+
+BackgroundCache::BackgroundCache(std::size_t budgetBytes, std::string diskPath) :
+    m_budgetBytes(budgetBytes),
+    m_diskPath(std::move(diskPath)),
+    m_stats()
+{
+}
+
+u64 BackgroundCache::MakeKey(const u32* pixels, u32 width, u32 height, const LayerDepthSet& layers)
+{
+    TextureHasher hasher((static_cast<u64>(width) << 32) | height);
+    hasher.Update(pixels, width * height * sizeof(u32));
+    hasher.Update(layers.GetBits(), LayerDepthSet::WORDS * sizeof(u32));
+
+    return hasher.Finish();
+}
+
+const BackgroundCache::Entry* BackgroundCache::Find(u64 key)
+{
+    auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_stats.hits++;
+
+        // Move to the front of the LRU list
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return &it->second->second;
+    }
+
+    Entry entry;
+    if (ReadFromDisk(key, entry)) {
+        m_stats.hits++;
+        m_stats.diskHits++;
+        return &InsertInMemory(key, std::move(entry));
+    }
+
+    m_stats.misses++;
+    return nullptr;
+}
+
+const BackgroundCache::Entry& BackgroundCache::Insert(u64 key, u32 width, u32 height, std::vector<u32> pixels)
+{
+    Entry entry;
+    entry.width = width;
+    entry.height = height;
+    entry.pixels = std::move(pixels);
+
+    WriteToDisk(key, entry);
+
+    return InsertInMemory(key, std::move(entry));
+}
+
+const BackgroundCache::Entry& BackgroundCache::InsertInMemory(u64 key, Entry entry)
+{
+    auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_stats.bytes -= GetEntryBytes(it->second->second);
+        m_entries.erase(it->second);
+        m_index.erase(it);
+    }
+
+    const std::size_t bytes = GetEntryBytes(entry);
+
+    // Always keep at least the new entry, even if it alone is over the budget
+    while (!m_entries.empty() && m_stats.bytes + bytes > m_budgetBytes) {
+        auto& last = m_entries.back();
+
+        m_stats.bytes -= GetEntryBytes(last.second);
+        m_stats.evictions++;
+
+        m_index.erase(last.first);
+        m_entries.pop_back();
+    }
+
+    m_entries.emplace_front(key, std::move(entry));
+    m_index[key] = m_entries.begin();
+    m_stats.bytes += bytes;
+
+    return m_entries.front().second;
+}
+
+std::string BackgroundCache::GetDiskPath(u64 key) const
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016" PRIx64 ".bin", key);
+
+    return m_diskPath + "/" + name;
+}
+
+bool BackgroundCache::ReadFromDisk(u64 key, Entry& entry) const
+{
+    if (m_diskPath.empty()) {
+        return false;
+    }
+
+    std::ifstream file(GetDiskPath(key), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    DiskHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return false;
+    }
+
+    if (header.magic != DISK_MAGIC || header.version != DISK_VERSION || header.key != key ||
+        header.width > MAX_DIMENSION || header.height > MAX_DIMENSION) {
+        return false;
+    }
+
+    entry.width = header.width;
+    entry.height = header.height;
+    entry.pixels.resize(header.width * header.height);
+
+    return !!file.read(reinterpret_cast<char*>(entry.pixels.data()), GetEntryBytes(entry));
+}
+
+void BackgroundCache::WriteToDisk(u64 key, const Entry& entry)
+{
+    if (m_diskPath.empty()) {
+        return;
+    }
+
+    // Written next to the entry and renamed over it, so a crash or a full disk doesn't leave a
+    // truncated entry for later sessions to read
+    const std::string path = GetDiskPath(key);
+    const std::string tempPath = path + ".tmp";
+
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return;
+    }
+
+    DiskHeader header;
+    header.magic = DISK_MAGIC;
+    header.version = DISK_VERSION;
+    header.key = key;
+    header.width = entry.width;
+    header.height = entry.height;
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(entry.pixels.data()), GetEntryBytes(entry));
+
+    // Closing flushes, which can fail too
+    file.close();
+
+    if (!file || !RenameOver(tempPath, path)) {
+        std::remove(tempPath.c_str());
+        return;
+    }
+
+    m_stats.diskWrites++;
+}
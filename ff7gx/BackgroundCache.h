@@ -0,0 +1,73 @@
+#pragma once
+
+#include "Common.h"
+#include "LayerDepthSet.h"
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Cache of upscaled backgrounds keyed by the contents of the composed background and its layers.
+// Entries are kept in memory up to a byte budget, evicting the least recently used ones first.
+// If a directory is given, entries are also written there and read back on a memory miss,
+// so a field that has been seen before doesn't need to be upscaled again in later sessions.
+class BackgroundCache
+{
+public:
+    struct Entry
+    {
+        u32 width;
+        u32 height;
+        std::vector<u32> pixels;
+    };
+
+    struct Stats
+    {
+        u32 hits;
+        u32 misses;
+        u32 evictions;
+        u32 diskHits;
+        u32 diskWrites;
+        std::size_t bytes;  // Memory used by cached pixels
+    };
+
+    BackgroundCache(std::size_t budgetBytes, std::string diskPath);
+    ~BackgroundCache() = default;
+
+    BackgroundCache(BackgroundCache&) = delete;
+    BackgroundCache(BackgroundCache&&) = delete;
+
+    static u64 MakeKey(const u32* pixels, u32 width, u32 height, const LayerDepthSet& layers);
+
+    // Returns nullptr on a miss. The entry stays valid until the next Find() or Insert(), since an
+    // entry read from disk is inserted in memory and can evict any other.
+    const Entry* Find(u64 key);
+
+    // The entry stays valid until the next Find() or Insert(), like the one returned by Find()
+    const Entry& Insert(u64 key, u32 width, u32 height, std::vector<u32> pixels);
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    using List = std::list<std::pair<u64, Entry>>;
+
+    std::string GetDiskPath(u64 key) const;
+    bool ReadFromDisk(u64 key, Entry& entry) const;
+    void WriteToDisk(u64 key, const Entry& entry);
+
+    const Entry& InsertInMemory(u64 key, Entry entry);
+
+    std::size_t m_budgetBytes;
+    std::string m_diskPath;
+
+    // Most recently used entry first
+    List m_entries;
+    std::unordered_map<u64, List::iterator> m_index;
+
+    Stats m_stats;
+};
@@ -0,0 +1,84 @@
+#include "stdafx.h"
+
+#include "BackgroundDump.h"
+
+#include <fstream>
+
+struct DumpHeader
+{
+    u32 magic;
+    u32 version;
+    u64 key;
+    u32 width;
+    u32 height;
+    u32 layers[LayerDepthSet::WORDS];
+};
+
+static const u32 DUMP_MAGIC = 0x44424746; // "FGBD"
+static const u32 DUMP_VERSION = 2;
+
+// Anything bigger than this is a corrupted file
+static const u32 MAX_DIMENSION = 4096;
+
+bool WriteBackgroundDump(const std::string& path, u64 key, const u32* pixels, u32 width, u32 height,
+    const LayerDepthSet& layers)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+
+    DumpHeader header;
+    header.magic = DUMP_MAGIC;
+    header.version = DUMP_VERSION;
+    header.key = key;
+    header.width = width;
+    header.height = height;
+
+    for (u32 i = 0; i < LayerDepthSet::WORDS; i++) {
+        header.layers[i] = layers.GetBits()[i];
+    }
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(pixels), width * height * sizeof(u32));
+
+    return !!file;
+}
+
+bool ReadBackgroundDump(const std::string& path, BackgroundDump& dump, bool headerOnly)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    DumpHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return false;
+    }
+
+    if (header.magic != DUMP_MAGIC || header.version != DUMP_VERSION ||
+        header.width == 0 || header.width > MAX_DIMENSION ||
+        header.height == 0 || header.height > MAX_DIMENSION) {
+        return false;
+    }
+
+    dump.key = header.key;
+    dump.width = header.width;
+    dump.height = header.height;
+
+    dump.layers.Clear();
+    for (u32 depth = 0; depth < LayerDepthSet::MAX_DEPTHS; depth++) {
+        if ((header.layers[depth / 32] >> (depth % 32)) & 1) {
+            dump.layers.Insert(depth);
+        }
+    }
+
+    if (headerOnly) {
+        dump.pixels.clear();
+        return true;
+    }
+
+    dump.pixels.resize(header.width * header.height);
+    return !!file.read(reinterpret_cast<char*>(dump.pixels.data()), dump.pixels.size() * sizeof(u32));
+}
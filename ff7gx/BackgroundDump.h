@@ -0,0 +1,24 @@
+#pragma once
+
+#include "Common.h"
+#include "LayerDepthSet.h"
+
+#include <string>
+#include <vector>
+
+// A composed background as read back from the background render target, saved by the renderer
+// for upscaling offline with ff7gx-pack. The alpha channel holds the depth of each pixel.
+struct BackgroundDump
+{
+    u64 key;    // BackgroundCache::MakeKey() of the pixels and layers
+    u32 width;
+    u32 height;
+    LayerDepthSet layers;
+    std::vector<u32> pixels;
+};
+
+bool WriteBackgroundDump(const std::string& path, u64 key, const u32* pixels, u32 width, u32 height,
+    const LayerDepthSet& layers);
+
+// If headerOnly is set, the pixels are not read
+bool ReadBackgroundDump(const std::string& path, BackgroundDump& dump, bool headerOnly = false);
@@ -0,0 +1,407 @@
+#include "stdafx.h"
+
+#include "BackgroundRenderer.h"
+#include "Profiler.h"
+#include "StateSet.h"
+#include "UpscaleChain.h"
+
+#include <array>
+
+// Initial size of the per-frame scratch memory, enough for the tiles of a busy field screen.
+// The allocator grows itself if a frame needs more.
+static const std::size_t FRAME_ALLOCATOR_SIZE = 256 * 1024;
+
+// Builds a quad covering the whole background at the given depth
+static std::array<FF7::Vertex, 4> MakeLayerQuad(float width, float height, float depth)
+{
+    return { {
+        {
+            width, 0.0f, depth, 1.0f,    // x, y, z, w
+            0xffffffff, 0.0f,           // color, unknown,
+            1.0f, 0.0f                  // u, v
+        },
+        {
+            width, height, depth, 1.0f,  // x, y, z, w
+            0xffffffff, 0.0f,           // color, unknown,
+            1.0f, 1.0f                  // u, v
+        },
+        {
+            0.0f, height, depth, 1.0f,   // x, y, z, w
+            0xffffffff, 0.0f,           // color, unknown,
+            0.0f, 1.0f                  // u, v
+        },
+        {
+            0.0f, 0.0f, depth, 1.0f,     // x, y, z, w
+            0xffffffff, 0.0f,           // color, unknown,
+            0.0f, 0.0f                  // u, v
+        }
+    } };
+}
+
+BackgroundRenderer::BackgroundRenderer(Device& device, bool singlePassLayers) :
+    m_device(device),
+    m_singlePassLayers(singlePassLayers),
+    m_tileScale(0.5f),
+    m_skipUnchanged(false),
+    m_trackDirtyRects(false),
+    m_inTiles(false),
+    m_tilesPassBegun(false),
+    m_holding(false),
+    m_drawMode(DrawMode::Dialog),
+    m_frameAllocator(FRAME_ALLOCATOR_SIZE),
+    m_tileBatcher([this](const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+        const u16* indices, u32 indexCount) {
+        m_device.Draw(state, vertices, vertexCount, indices, indexCount);
+    })
+{
+}
+
+// Includes the states the game's Draw() changes while drawing the tiles. Draw() also sets blending
+// and the vertex format, but it sets them again on every call, so they're left alone.
+void BackgroundRenderer::GetPassStates(StateSet& states, bool upscaleChain)
+{
+    states.AddTransform(D3D::TS_PROJECTION);
+    states.AddViewport();
+    states.AddScissorRect();
+    states.AddVertexShader();
+    states.AddPixelShader();
+
+    // c0 is the layer and c1 the texture flag
+    states.AddPixelShaderConstants(0, 2);
+
+    states.AddRenderState(D3D::RS_ZENABLE);
+    states.AddRenderState(D3D::RS_ZWRITEENABLE);
+    states.AddRenderState(D3D::RS_ALPHABLENDENABLE);
+    states.AddRenderState(D3D::RS_SCISSORTESTENABLE);
+
+    // The tiles, the original background and the layer lookup
+    for (u32 stage = 0; stage < 3; stage++) {
+        states.AddTexture(stage);
+        states.AddSamplerState(stage, D3D::SAMP_MINFILTER);
+        states.AddSamplerState(stage, D3D::SAMP_MAGFILTER);
+    }
+
+    states.AddSamplerState(2, D3D::SAMP_ADDRESSU);
+    states.AddSamplerState(2, D3D::SAMP_ADDRESSV);
+
+    if (upscaleChain) {
+        // The chain draws its quads without Draw(), and sets the super-xBR constants
+        states.AddVertexShaderConstants(UpscaleChain::VS_MATRIX_REGISTER,
+            UpscaleChain::VS_INPUT_REGISTER + UpscaleChain::INPUT_REGISTERS);
+        states.AddVertexDeclaration();
+        states.AddRenderState(D3D::RS_ALPHATESTENABLE);
+        states.AddRenderState(D3D::RS_CULLMODE);
+
+        for (u32 stage = 0; stage < UpscaleChain::MAX_INPUTS; stage++) {
+            states.AddSamplerState(stage, D3D::SAMP_ADDRESSU);
+            states.AddSamplerState(stage, D3D::SAMP_ADDRESSV);
+        }
+    }
+}
+
+void BackgroundRenderer::GfxFn_84(u32 drawMode, u32 gameMode)
+{
+    if (gameMode == FF7::GameMode::Field) {
+        if (drawMode == 1) {
+            m_drawMode = DrawMode::Dialog;
+        }
+    } else {
+        // At least in main menu dialogs are drawn with drawMode = 0
+        if (drawMode == 0) {
+            m_drawMode = DrawMode::Dialog;
+        }
+    }
+}
+
+void BackgroundRenderer::GfxFn_88(u32 drawMode, u32 result)
+{
+    if (result) {
+        if (drawMode == 0) {
+            m_drawMode = DrawMode::Background;
+        } else if (drawMode == 1) {
+            m_drawMode = DrawMode::Dialog;
+        }
+    }
+}
+
+void BackgroundRenderer::InvalidateBackground()
+{
+    m_changeDetector.Invalidate();
+    m_dirtyRectTracker.Invalidate();
+
+    if (m_holding) {
+        DrawHeldEvents();
+    }
+}
+
+void BackgroundRenderer::BeginTiles()
+{
+    m_inTiles = true;
+
+    // Held back tiles don't need the pass, it's set when one doesn't match
+    if (!m_holding) {
+        BeginTilesPass();
+    }
+}
+
+void BackgroundRenderer::EndTiles()
+{
+    if (m_tilesPassBegun) {
+        EndTilesPass();
+    }
+
+    m_inTiles = false;
+}
+
+void BackgroundRenderer::BeginTilesPass()
+{
+    m_device.CaptureState();
+    m_device.SetRenderTarget(Target::Background);
+    m_device.BeginPass(Pass::Tiles, m_layerDepths);
+    m_tilesPassBegun = true;
+}
+
+void BackgroundRenderer::EndTilesPass()
+{
+    m_tileBatcher.Flush();
+    m_device.EndPass();
+
+    m_device.ApplyState();
+
+    // The render target is not saved with the state block, so restore it separately
+    m_device.SetRenderTarget(Target::Backbuffer);
+    m_tilesPassBegun = false;
+}
+
+void BackgroundRenderer::DrawHeldEvents()
+{
+    ProfileScope _profile("DrawHeldEvents");
+
+    m_holding = false;
+
+    // The game's texture is bound again after drawing the held back tiles with theirs
+    const void* gameTexture = m_device.GetTexture();
+    const void* texture = gameTexture;
+
+    // Batches never span textures, so the pending one is drawn before switching
+    const auto bindTexture = [&](const void* next) {
+        if (next != texture) {
+            m_tileBatcher.Flush();
+            texture = next;
+            m_device.SetTexture(texture);
+        }
+    };
+
+    for (const auto& event : m_heldEvents) {
+        if (event.clear) {
+            if (m_tilesPassBegun) {
+                bindTexture(gameTexture);
+                EndTilesPass();
+            }
+
+            // The depth buffer is shared with the backbuffer, which was cleared at the time, and
+            // may have been drawn to since
+            m_device.SetRenderTarget(Target::Background);
+            m_device.ClearTarget(event.clearRenderTarget, 0);
+            m_device.SetRenderTarget(Target::Backbuffer);
+            continue;
+        }
+
+        if (!m_tilesPassBegun) {
+            BeginTilesPass();
+        }
+
+        bindTexture(event.state.texture);
+        m_tileBatcher.Add(event.state, event.vertices, event.vertexCount, &m_heldIndices[event.firstIndex],
+            event.indexCount);
+    }
+
+    m_heldEvents.clear();
+    m_heldIndices.clear();
+    bindTexture(gameTexture);
+
+    // Inside DrawTiles the rest of the tiles are drawn normally, otherwise the pass ends here
+    if (m_inTiles && !m_tilesPassBegun) {
+        BeginTilesPass();
+    } else if (!m_inTiles && m_tilesPassBegun) {
+        EndTilesPass();
+    }
+}
+
+void BackgroundRenderer::DrawHook(FF7::PrimitiveType primType, u32 drawType, const FF7::Vertex* vertices,
+    u32 vertexBufferSize, const u16* indices, u32 vertexCount, u32 a7, u32 scissor)
+{
+    if (m_drawMode != DrawMode::Background) {
+        // Not drawing background tiles, just draw normally.
+        const TileBatcher::DrawState state{ primType, drawType, nullptr, a7, scissor };
+        m_device.Draw(state, vertices, vertexBufferSize, indices, vertexCount);
+        return;
+    }
+
+    auto transformed = m_frameAllocator.Allocate<FF7::Vertex>(vertexBufferSize);
+
+    // The original vertices are generated for a 640x480 render target, so they need to be scaled to
+    // the background render target, otherwise only the upper left corner of the background is rendered.
+    // TODO: Check if using the game's own projection matrix would work.
+    const VertexTransformer::Affine2D scale{ m_tileScale, m_tileScale, 0.0f, 0.0f };
+    m_vertexTransformer.TransformPositions(transformed, vertices, vertexBufferSize, scale);
+
+    // Held back tiles are marked too, so an unchanged frame has the same layers as the previous one
+    m_layerDepths.Mark(transformed, vertexBufferSize);
+
+    // The bound texture is part of the batch state, since the game binds the tile texture before calling Draw()
+    const TileBatcher::DrawState state{ primType, drawType, m_device.GetTexture(), a7, scissor };
+
+    if (m_trackDirtyRects) {
+        m_dirtyRectTracker.AddDraw(state, transformed, vertexBufferSize, indices, vertexCount);
+    }
+
+    if (m_skipUnchanged) {
+        m_changeDetector.AddDraw(state, vertices, vertexBufferSize, indices, vertexCount);
+
+        if (m_holding && m_changeDetector.IsMatching()) {
+            // The game may reuse its index buffer for the next batch
+            const auto firstIndex = static_cast<u32>(m_heldIndices.size());
+            m_heldIndices.insert(m_heldIndices.end(), indices, indices + vertexCount);
+
+            m_heldEvents.push_back({ false, 0, state, transformed, vertexBufferSize, firstIndex, vertexCount });
+            return;
+        }
+
+        if (m_holding) {
+            DrawHeldEvents();
+        }
+    }
+
+    m_tileBatcher.Add(state, transformed, vertexBufferSize, indices, vertexCount);
+}
+
+void BackgroundRenderer::FlushTiles()
+{
+    ProfileScope _profile("FlushTiles");
+
+    m_tileBatcher.Flush();
+}
+
+void BackgroundRenderer::BeforeSetTexture(const void* texture)
+{
+    m_tileBatcher.FlushTexture(texture);
+}
+
+void BackgroundRenderer::DrawLayers()
+{
+    ProfileScope _profile("DrawLayers");
+
+    m_device.CaptureState();
+
+    // Upscaling on the GPU changes the render target and the pass states
+    m_device.PrepareLayers(m_layerDepths, m_dirtyRects);
+
+    const std::array<u16, 6> indices{ {
+            3, 0, 2, 0, 1, 2
+        } };
+
+    float width, height;
+    m_device.GetRenderDimensions(&width, &height);
+    width /= 2.0f;
+    height /= 2.0f;
+
+    const TileBatcher::DrawState state{ FF7::PrimitiveType::TriangleList, FF7::DrawType::Ortho, nullptr, 0, 0 };
+
+    m_device.SetRenderTarget(Target::Backbuffer);
+
+    if (m_singlePassLayers) {
+        if (!m_layerDepths.Empty()) {
+            m_device.BeginPass(Pass::Composite, m_layerDepths);
+
+            // The depth is written by the pixel shader
+            const auto vertices = MakeLayerQuad(width, height, 0.0f);
+            m_device.Draw(state, vertices.data(), vertices.size(), indices.data(), indices.size());
+        } else {
+            m_device.BeginPass(Pass::Layers, m_layerDepths);
+        }
+    } else {
+        m_device.BeginPass(Pass::Layers, m_layerDepths);
+
+        m_layerDepths.ForEachDescending([&](u32 layer) {
+            const auto vertices = MakeLayerQuad(width, height, static_cast<float>(layer / 255.0f));
+
+            m_device.SetLayer(layer);
+            m_device.Draw(state, vertices.data(), vertices.size(), indices.data(), indices.size());
+        });
+    }
+
+    m_device.EndPass();
+    m_device.ApplyState();
+}
+
+void BackgroundRenderer::EndFrame()
+{
+    bool backgroundChanged = true;
+
+    if (m_skipUnchanged) {
+        backgroundChanged = !m_changeDetector.EndFrame();
+
+        // The frame matched as far as it went, but had fewer events than the previous one
+        if (m_holding && backgroundChanged) {
+            DrawHeldEvents();
+        }
+
+        m_heldEvents.clear();
+        m_heldIndices.clear();
+        m_holding = m_changeDetector.IsMatching();
+    }
+
+    float width, height;
+    m_device.GetRenderDimensions(&width, &height);
+    const u32 targetWidth = static_cast<u32>(width * m_tileScale);
+    const u32 targetHeight = static_cast<u32>(height * m_tileScale);
+
+    m_dirtyRects.Clear();
+
+    if (m_trackDirtyRects) {
+        m_dirtyRectTracker.SetSize(targetWidth, targetHeight);
+        m_dirtyRectTracker.EndFrame(m_dirtyRects);
+    } else {
+        m_dirtyRects.AddAll(targetWidth, targetHeight);
+    }
+
+    // A skipped background wasn't drawn to at all
+    if (!backgroundChanged) {
+        m_dirtyRects.Clear();
+    }
+
+    DrawLayers();
+
+    m_layerDepths.Clear();
+    m_frameAllocator.Reset();
+}
+
+u32 BackgroundRenderer::Clear(u32 clearRenderTarget, u32 clearDepthBuffer)
+{
+    bool drawBackground = true;
+
+    if (m_trackDirtyRects) {
+        m_dirtyRectTracker.AddClear(clearRenderTarget, clearDepthBuffer);
+    }
+
+    if (m_skipUnchanged) {
+        m_changeDetector.AddClear(clearRenderTarget, clearDepthBuffer);
+
+        if (m_holding && m_changeDetector.IsMatching()) {
+            m_heldEvents.push_back({ true, clearRenderTarget, {}, nullptr, 0, 0, 0 });
+            drawBackground = false;
+        } else if (m_holding) {
+            DrawHeldEvents();
+        }
+    }
+
+    if (drawBackground) {
+        m_device.SetRenderTarget(Target::Background);
+        m_device.ClearTarget(clearRenderTarget, clearDepthBuffer);
+    }
+
+    m_device.SetRenderTarget(Target::Backbuffer);
+
+    return m_device.ClearTarget(clearRenderTarget, clearDepthBuffer);
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "Common.h"
+#include "DirtyRects.h"
+#include "FrameAllocator.h"
+#include "FrameChangeDetector.h"
+#include "GameTypes.h"
+#include "LayerDepthSet.h"
+#include "TileBatcher.h"
+#include "VertexTransform.h"
+
+#include <vector>
+
+class StateSet;
+
+// The part of Renderer that decides what gets drawn where: the draw mode state machine driven by
+// GfxFn_84 and GfxFn_88, the background tile path of DrawTiles and DrawHook, and the layers drawn
+// at the end of a frame. It doesn't touch D3D, so ff7gx-trace can replay traces through it with a
+// mock Device. Renderer implements Device with D3D9.
+class BackgroundRenderer
+{
+public:
+    enum class Target
+    {
+        Background, // The background render target, 320x240 times the internal scale
+        Backbuffer
+    };
+
+    enum class Pass
+    {
+        Tiles,      // Background tiles drawn to the background render target
+        Layers,     // One quad per layer, drawn to the backbuffer
+        Composite   // A single quad compositing all layers, drawn to the backbuffer
+    };
+
+    class Device
+    {
+    public:
+        virtual ~Device() = default;
+
+        // Saves and restores the state changed by the passes, except for the render target
+        virtual void CaptureState() = 0;
+        virtual void ApplyState() = 0;
+
+        virtual void SetRenderTarget(Target target) = 0;
+
+        // Sets the shaders and states of a pass. EndPass() undoes what the state block doesn't cover.
+        virtual void BeginPass(Pass pass, const LayerDepthSet& layers) = 0;
+        virtual void EndPass() = 0;
+
+        // Sets the depth of the layer drawn next in the Layers pass
+        virtual void SetLayer(u32 layer) = 0;
+
+        // Called after capturing the state and before drawing the layers, e.g. to upscale the background.
+        // May change the render target and the states saved by CaptureState(). dirty is the part of the
+        // background that changed since the previous frame. Outside of it, whatever was made from the
+        // background can be reused, and if it's empty the background is unchanged.
+        virtual void PrepareLayers(const LayerDepthSet& layers, const DirtyRects& dirty) = 0;
+
+        // The game's own Draw()
+        virtual void Draw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+            const u16* indices, u32 indexCount) = 0;
+
+        // The texture bound to stage 0 by the game
+        virtual const void* GetTexture() = 0;
+
+        // Binds a texture returned by GetTexture() to stage 0, to draw skipped tiles with their own texture
+        virtual void SetTexture(const void* texture) = 0;
+
+        // Clears the current render target with the game's own Clear()
+        virtual u32 ClearTarget(u32 clearRenderTarget, u32 clearDepthBuffer) = 0;
+
+        virtual void GetRenderDimensions(float* width, float* height) = 0;
+    };
+
+    BackgroundRenderer(Device& device, bool singlePassLayers);
+    ~BackgroundRenderer() = default;
+
+    BackgroundRenderer(BackgroundRenderer&) = delete;
+    BackgroundRenderer(BackgroundRenderer&&) = delete;
+
+    // Every state the passes change, which Device::CaptureState() saves and ApplyState() restores.
+    // upscaleChain adds the states changed by running an UpscaleChain in PrepareLayers().
+    static void GetPassStates(StateSet& states, bool upscaleChain);
+
+    // Draw mode changes, gameMode is FF7::GameState::mode and result is what the game's GfxFn_88 returned
+    void GfxFn_84(u32 drawMode, u32 gameMode);
+    void GfxFn_88(u32 drawMode, u32 result);
+
+    // Composites the layers in a single pass instead of one per layer
+    void SetSinglePassLayers(bool singlePassLayers)
+    {
+        m_singlePassLayers = singlePassLayers;
+    }
+
+    // Merges consecutive tile draws with the same state, enabled by default
+    void SetBatchTiles(bool batch)
+    {
+        m_tileBatcher.SetMerging(batch);
+    }
+
+    // Scale from the game's 640x480 coordinates to the background render target, 0.5 for 320x240
+    void SetTileScale(float scale)
+    {
+        m_tileScale = scale;
+    }
+
+    // If enabled, the tiles and clears of the background are held back while they match the previous
+    // frame, and a background that turns out unchanged isn't drawn again. Held back events are drawn
+    // as soon as one doesn't match.
+    void SetSkipUnchanged(bool skip)
+    {
+        m_skipUnchanged = skip;
+    }
+
+    // If enabled, the background is compared to the previous frame tile by tile, and PrepareLayers() gets
+    // the parts that changed. Otherwise it gets the whole background, or nothing if it was skipped as unchanged.
+    void SetTrackDirtyRects(bool track)
+    {
+        m_trackDirtyRects = track;
+    }
+
+    // The background target lost its contents or a texture may have changed in place, so the
+    // background is drawn in full this frame and the next
+    void InvalidateBackground();
+
+    bool IsDrawingBackground() const
+    {
+        return m_drawMode == DrawMode::Background;
+    }
+
+    // Bracket the game's DrawTiles when drawing the background. Otherwise the tiles are drawn normally.
+    void BeginTiles();
+    void EndTiles();
+
+    // Called instead of the game's Draw() by DrawTilesImpl
+    void DrawHook(FF7::PrimitiveType primType, u32 drawType, const FF7::Vertex* vertices,
+        u32 vertexBufferSize, const u16* indices, u32 vertexCount, u32 a7, u32 scissor);
+
+    // Draws the queued tiles, must be called before the game changes any render state
+    void FlushTiles();
+
+    // Must be called before the game binds a texture to stage 0. The queued tiles are drawn with the
+    // bound texture, so those queued with another one are drawn first.
+    void BeforeSetTexture(const void* texture);
+
+    // Draws the layers and resets the per-frame state
+    void EndFrame();
+
+    u32 Clear(u32 clearRenderTarget, u32 clearDepthBuffer);
+
+    const TileBatcher::Stats& GetTileStats() const
+    {
+        return m_tileBatcher.GetStats();
+    }
+
+    const FrameAllocator::Stats& GetFrameAllocatorStats() const
+    {
+        return m_frameAllocator.GetStats();
+    }
+
+    const FrameChangeDetector::Stats& GetChangeStats() const
+    {
+        return m_changeDetector.GetStats();
+    }
+
+    const DirtyRectTracker::Stats& GetDirtyRectStats() const
+    {
+        return m_dirtyRectTracker.GetStats();
+    }
+
+private:
+    // DrawMode is used to determine what part of the scene the game is currently drawing.
+    // This affects z-buffering and blending among others.
+    enum DrawMode
+    {
+        Background, // Draw to a separate texture and upscale later
+        Dialog      // Draw directly to back buffer
+    };
+
+    // A clear of the background or a batch of tiles held back while the frame matches the previous one
+    struct HeldEvent
+    {
+        bool clear;
+        u32 clearRenderTarget;
+        TileBatcher::DrawState state;
+        const FF7::Vertex* vertices;
+        u32 vertexCount;
+        u32 firstIndex;     // In m_heldIndices
+        u32 indexCount;
+    };
+
+    void BeginTilesPass();
+    void EndTilesPass();
+
+    // Draws the held back events, once the frame turned out different
+    void DrawHeldEvents();
+
+    void DrawLayers();
+
+    Device& m_device;
+    bool m_singlePassLayers;
+    float m_tileScale;
+    bool m_skipUnchanged;
+    bool m_trackDirtyRects;
+
+    bool m_inTiles;         // Between BeginTiles() and EndTiles()
+    bool m_tilesPassBegun;  // The background is the render target and the Tiles pass is set
+
+    FrameChangeDetector m_changeDetector;
+
+    // What changed in the background this frame, for PrepareLayers()
+    DirtyRectTracker m_dirtyRectTracker;
+    DirtyRects m_dirtyRects;
+
+    // True while this frame's events are held back. The vertices are in m_frameAllocator, and the
+    // indices apart from them so the vertices of consecutive tiles stay contiguous for TileBatcher.
+    bool m_holding;
+    std::vector<HeldEvent> m_heldEvents;
+    std::vector<u16> m_heldIndices;
+
+    DrawMode m_drawMode;
+    LayerDepthSet m_layerDepths;
+
+    // Scratch memory for transformed vertices etc., reset at the end of every frame
+    FrameAllocator m_frameAllocator;
+    VertexTransformer m_vertexTransformer;
+
+    // Merges consecutive tile draws done by DrawTiles
+    TileBatcher m_tileBatcher;
+};
@@ -24,6 +24,11 @@ static bool GetConfigBool(const CHAR* key, bool defaultValue)
     return uintVal != 0;
 }
 
+static UINT GetConfigUInt(const CHAR* key, UINT defaultValue)
+{
+    return GetPrivateProfileInt(INI_SECTION, key, defaultValue, INI_PATH);
+}
+
 void InitConfig()
 {
     g_config.loadFrida = GetConfigBool("LoadFrida", false);
@@ -33,6 +38,44 @@ void InitConfig()
     g_config.apitracePath = GetConfigString("ApitracePath", "apitrace-d3d9.dll");
 
     g_config.waitForDebugger = GetConfigBool("WaitForDebugger", false);
+    g_config.d3dEvents = GetConfigBool("D3DEvents", false);
+
+    g_config.singlePassLayers = GetConfigBool("SinglePassLayers", false);
+    g_config.filterStateChanges = GetConfigBool("FilterStateChanges", false);
+    g_config.restoreAllStates = GetConfigBool("RestoreAllStates", false);
+    g_config.skipUnchangedBackgrounds = GetConfigBool("SkipUnchangedBackgrounds", false);
+
+    g_config.internalScale = GetConfigUInt("InternalScale", 1);
+    g_config.upscaleChain = GetConfigString("UpscaleChain", "");
+    g_config.partialUpscale = GetConfigBool("PartialUpscale", false);
+    g_config.dynamicQuality = GetConfigBool("DynamicQuality", false);
+    g_config.targetFrameTime = GetConfigUInt("TargetFrameTime", 16667);
+
+    g_config.cpuUpscale = GetConfigBool("CpuUpscale", false);
+    g_config.backgroundCacheSize = GetConfigUInt("BackgroundCacheSize", 64);
+    g_config.backgroundCachePath = GetConfigString("BackgroundCachePath", "");
+
+    g_config.backgroundPackPath = GetConfigString("BackgroundPackPath", "");
+    g_config.backgroundDumpPath = GetConfigString("BackgroundDumpPath", "");
+
+    g_config.texturePackPath = GetConfigString("TexturePackPath", "");
+    g_config.textureDumpPath = GetConfigString("TextureDumpPath", "");
+    g_config.textureDecodeThreads = GetConfigUInt("TextureDecodeThreads", 2);
+    g_config.textureUploadBudget = GetConfigUInt("TextureUploadBudget", 4096);
+    g_config.textureUploadTime = GetConfigUInt("TextureUploadTime", 2);
+
+    g_config.tracePath = GetConfigString("TracePath", "");
+    g_config.traceBufferSize = GetConfigUInt("TraceBufferSize", 16);
+
+    g_config.profilePath = GetConfigString("ProfilePath", "");
+    g_config.profileBufferSize = GetConfigUInt("ProfileBufferSize", 4);
+    g_config.profileKey = GetConfigUInt("ProfileKey", VK_F11);
+
+    g_config.logPath = GetConfigString("LogPath", "");
+    g_config.logLevel = GetConfigUInt("LogLevel", 0);
+    g_config.logRateLimit = GetConfigUInt("LogRateLimit", 1000);
+    g_config.logBufferSize = GetConfigUInt("LogBufferSize", 4096);
+    g_config.gameDebugLog = GetConfigBool("GameDebugLog", true);
 }
 
 const Config& GetConfig()
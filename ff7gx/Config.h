@@ -11,6 +11,44 @@ struct Config
     std::string apitracePath;
 
     bool waitForDebugger;
+    bool d3dEvents;
+
+    bool singlePassLayers;
+    bool filterStateChanges;
+    bool restoreAllStates;
+    bool skipUnchangedBackgrounds;
+
+    unsigned int internalScale;         // Background render target size in multiples of 320x240
+    std::string upscaleChain;
+    bool partialUpscale;
+    bool dynamicQuality;
+    unsigned int targetFrameTime;       // In microseconds
+
+    bool cpuUpscale;
+    unsigned int backgroundCacheSize;   // In MiB
+    std::string backgroundCachePath;
+
+    std::string backgroundPackPath;
+    std::string backgroundDumpPath;
+
+    std::string texturePackPath;
+    std::string textureDumpPath;
+    unsigned int textureDecodeThreads;
+    unsigned int textureUploadBudget;   // In KiB
+    unsigned int textureUploadTime;     // In milliseconds
+
+    std::string tracePath;
+    unsigned int traceBufferSize;       // In MiB
+
+    std::string profilePath;
+    unsigned int profileBufferSize;     // In MiB, per thread
+    unsigned int profileKey;            // Virtual key code
+
+    std::string logPath;
+    unsigned int logLevel;              // 0 debug, 1 info, 2 warnings, 3 errors
+    unsigned int logRateLimit;          // Messages per second
+    unsigned int logBufferSize;         // In messages
+    bool gameDebugLog;
 };
 
 void InitConfig();
@@ -0,0 +1,70 @@
+#include "stdafx.h"
+
+#include "CpuFeatures.h"
+#include "Common.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+static void CpuId(u32 leaf, u32 subleaf, u32 regs[4])
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+
+    for (int i = 0; i < 4; i++) {
+        regs[i] = static_cast<u32>(info[i]);
+    }
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static u32 GetXCR0()
+{
+#ifdef _MSC_VER
+    return static_cast<u32>(_xgetbv(0));
+#else
+    u32 eax, edx;
+    __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax;
+#endif
+}
+
+namespace CpuFeatures
+{
+    bool HasSSE2()
+    {
+        u32 regs[4];
+        CpuId(1, 0, regs);
+
+        return (regs[3] & (1u << 26)) != 0;
+    }
+
+    bool HasAVX2()
+    {
+        static const bool hasAVX2 = [] {
+            u32 regs[4];
+            CpuId(0, 0, regs);
+            if (regs[0] < 7) {
+                return false;
+            }
+
+            // The OS has to save the YMM registers on context switches, which is checked with XGETBV
+            CpuId(1, 0, regs);
+            const bool osxsave = (regs[2] & (1u << 27)) != 0;
+            const bool avx = (regs[2] & (1u << 28)) != 0;
+            if (!osxsave || !avx || (GetXCR0() & 0x6) != 0x6) {
+                return false;
+            }
+
+            CpuId(7, 0, regs);
+            return (regs[1] & (1u << 5)) != 0;
+        }();
+
+        return hasAVX2;
+    }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Runtime CPU feature detection for picking SIMD kernels
+namespace CpuFeatures
+{
+    bool HasSSE2();
+
+    // True if both the CPU and the OS support AVX2
+    bool HasAVX2();
+}
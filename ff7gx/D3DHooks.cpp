@@ -0,0 +1,25 @@
+#include "stdafx.h"
+
+#include "D3DHooks.h"
+
+#include <Windows.h>
+
+namespace D3DHooks
+{
+    void* HookMethod(void* object, u32 index, const void* hook)
+    {
+        auto vtable = *static_cast<void***>(object);
+        auto entry = &vtable[index];
+
+        // The vtables live in read-only memory in d3d9.dll
+        DWORD oldProtect;
+        VirtualProtect(entry, sizeof(void*), PAGE_READWRITE, &oldProtect);
+
+        void* original = *entry;
+        *entry = const_cast<void*>(hook);
+
+        VirtualProtect(entry, sizeof(void*), oldProtect, &oldProtect);
+
+        return original;
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "Common.h"
+
+// Hooks for D3D9 interface methods, for the few things the game does directly on the device
+// instead of through the GfxFunctions table.
+namespace D3DHooks
+{
+    // Indices in the vtables of the D3D9 interfaces, in declaration order in d3d9.h
+    namespace DeviceMethod
+    {
+        const u32 Reset = 16;
+        const u32 UpdateTexture = 31;
+        const u32 SetRenderTarget = 37;
+        const u32 SetViewport = 47;
+        const u32 SetRenderState = 57;
+        const u32 BeginStateBlock = 60;
+        const u32 EndStateBlock = 61;
+        const u32 SetTexture = 65;
+        const u32 SetSamplerState = 69;
+        const u32 SetScissorRect = 75;
+        const u32 SetVertexShader = 92;
+        const u32 SetPixelShader = 107;
+        const u32 SetPixelShaderConstantF = 109;
+    }
+
+    namespace TextureMethod
+    {
+        const u32 LockRect = 19;
+        const u32 UnlockRect = 20;
+    }
+
+    namespace StateBlockMethod
+    {
+        const u32 Apply = 5;
+    }
+
+    // Replaces a method in the vtable of a COM object and returns the original.
+    // All objects of the same class share the vtable, so this hooks every one of them.
+    void* HookMethod(void* object, u32 index, const void* hook);
+}
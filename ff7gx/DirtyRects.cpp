@@ -0,0 +1,346 @@
+#include "stdafx.h"
+
+#include "DirtyRects.h"
+
+#include <algorithm>
+#include <cstring>
+
+// FNV-1a over 32-bit words for draw states and whole draws
+static const u64 FNV_OFFSET = 0xcbf29ce484222325ull;
+static const u64 FNV_PRIME = 0x100000001b3ull;
+
+// Vertices further out than this are treated as covering the whole target, as are NaNs
+static const float MAX_COORDINATE = 65536.0f;
+
+// How far ahead in the previous frame an item is looked for
+static const u32 MATCH_WINDOW = 64;
+
+// Bounds of the items covering the whole target, whatever its size
+static const DirtyRects::Rect EVERYWHERE = { INT32_MIN / 2, INT32_MIN / 2, INT32_MAX / 2, INT32_MAX / 2 };
+
+static u64 HashWords(u64 hash, const void* data, std::size_t size)
+{
+    const u8* bytes = static_cast<const u8*>(data);
+
+    for (std::size_t i = 0; i + sizeof(u32) <= size; i += sizeof(u32)) {
+        u32 word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static u64 RotateLeft(u64 value, u32 bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Triangles are hashed from the hashes of their vertices, which are most of the work of tracking
+// the tiles. The four words of a vertex are multiplied independently, so they can overlap.
+static u64 HashVertex(u64 hash, const FF7::Vertex& vertex)
+{
+    static_assert(sizeof(FF7::Vertex) == 4 * sizeof(u64), "A vertex is hashed as four 64-bit words");
+
+    u64 words[4];
+    std::memcpy(words, &vertex, sizeof(words));
+
+    const u64 mixed = (words[0] * 0x9e3779b97f4a7c15ull) ^ RotateLeft(words[1] * 0xc2b2ae3d27d4eb4full, 17) ^
+        RotateLeft(words[2] * 0x165667b19e3779f9ull, 31) ^ RotateLeft(words[3] * 0xd6e8feb86659fd93ull, 47);
+
+    return RotateLeft(hash ^ mixed, 27) * 0x9e3779b97f4a7c15ull;
+}
+
+static bool Touches(const DirtyRects::Rect& a, const DirtyRects::Rect& b)
+{
+    return a.left <= b.right && b.left <= a.right && a.top <= b.bottom && b.top <= a.bottom;
+}
+
+static DirtyRects::Rect Union(const DirtyRects::Rect& a, const DirtyRects::Rect& b)
+{
+    return {
+        std::min(a.left, b.left), std::min(a.top, b.top), std::max(a.right, b.right), std::max(a.bottom, b.bottom)
+    };
+}
+
+static DirtyRects::Rect Clip(const DirtyRects::Rect& rect, u32 width, u32 height)
+{
+    return {
+        std::max(rect.left, 0), std::max(rect.top, 0),
+        std::min(rect.right, static_cast<i32>(width)), std::min(rect.bottom, static_cast<i32>(height))
+    };
+}
+
+// Bounds of the vertices, not clipped since the size of the target may only be known at the end of the frame
+static DirtyRects::Rect GetBounds(const FF7::Vertex* vertices, const u16* indices, u32 count, u32 vertexCount)
+{
+    float minX = MAX_COORDINATE;
+    float minY = MAX_COORDINATE;
+    float maxX = -MAX_COORDINATE;
+    float maxY = -MAX_COORDINATE;
+
+    for (u32 i = 0; i < count; i++) {
+        if (indices[i] >= vertexCount) {
+            return EVERYWHERE;
+        }
+
+        const auto& vertex = vertices[indices[i]];
+
+        // Written so NaNs fail it
+        if (!(vertex.x > -MAX_COORDINATE && vertex.x < MAX_COORDINATE && vertex.y > -MAX_COORDINATE &&
+            vertex.y < MAX_COORDINATE)) {
+            return EVERYWHERE;
+        }
+
+        minX = std::min(minX, vertex.x);
+        minY = std::min(minY, vertex.y);
+        maxX = std::max(maxX, vertex.x);
+        maxY = std::max(maxY, vertex.y);
+    }
+
+    // A pixel of margin for the rasterization rules and the half pixel offset of D3D9, and one more
+    // since the casts round towards zero. std::floor() and std::ceil() are library calls without SSE4.1.
+    const DirtyRects::Rect bounds = {
+        static_cast<i32>(minX) - 2, static_cast<i32>(minY) - 2,
+        static_cast<i32>(maxX) + 2, static_cast<i32>(maxY) + 2
+    };
+
+    return bounds;
+}
+
+void DirtyRects::Add(const Rect& rect)
+{
+    if (rect.Empty()) {
+        return;
+    }
+
+    // The union may reach rectangles the new one didn't, so start over after every merge
+    Rect merged = rect;
+
+    for (std::size_t i = 0; i < m_rects.size();) {
+        if (Touches(m_rects[i], merged)) {
+            merged = Union(m_rects[i], merged);
+            m_rects[i] = m_rects.back();
+            m_rects.pop_back();
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    if (m_rects.size() < MAX_RECTS) {
+        m_rects.push_back(merged);
+        return;
+    }
+
+    std::size_t best = 0;
+    u64 bestGrowth = UINT64_MAX;
+
+    for (std::size_t i = 0; i < m_rects.size(); i++) {
+        const u64 growth = Union(m_rects[i], merged).Area() - m_rects[i].Area() - merged.Area();
+        if (growth < bestGrowth) {
+            best = i;
+            bestGrowth = growth;
+        }
+    }
+
+    merged = Union(m_rects[best], merged);
+    m_rects[best] = m_rects.back();
+    m_rects.pop_back();
+
+    // One less rectangle each time, so this ends
+    Add(merged);
+}
+
+void DirtyRects::AddAll(u32 width, u32 height)
+{
+    Add({ 0, 0, static_cast<i32>(width), static_cast<i32>(height) });
+}
+
+void DirtyRects::AddScaled(const DirtyRects& source, u32 border, u32 scale, u32 width, u32 height)
+{
+    const i32 b = static_cast<i32>(border);
+    const i32 s = static_cast<i32>(scale);
+
+    for (const auto& rect : source.m_rects) {
+        const Rect scaled = { (rect.left - b) * s, (rect.top - b) * s, (rect.right + b) * s, (rect.bottom + b) * s };
+        Add(Clip(scaled, width, height));
+    }
+}
+
+u64 DirtyRects::GetArea() const
+{
+    u64 area = 0;
+
+    for (const auto& rect : m_rects) {
+        area += rect.Area();
+    }
+
+    return area;
+}
+
+bool DirtyRects::Contains(i32 x, i32 y) const
+{
+    for (const auto& rect : m_rects) {
+        if (x >= rect.left && x < rect.right && y >= rect.top && y < rect.bottom) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool DirtyRects::Contains(const Rect& rect) const
+{
+    for (const auto& other : m_rects) {
+        if (rect.left >= other.left && rect.right <= other.right && rect.top >= other.top &&
+            rect.bottom <= other.bottom) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+DirtyRectTracker::DirtyRectTracker() :
+    m_width(0),
+    m_height(0),
+    m_invalidFrames(1),
+    m_stats{}
+{
+}
+
+void DirtyRectTracker::SetSize(u32 width, u32 height)
+{
+    if (width != m_width || height != m_height) {
+        m_width = width;
+        m_height = height;
+        Invalidate();
+    }
+}
+
+void DirtyRectTracker::AddClear(u32 clearRenderTarget, u32 clearDepthBuffer)
+{
+    const u32 event[] = { clearRenderTarget, clearDepthBuffer };
+
+    Item item;
+    item.hash = HashWords(FNV_OFFSET, event, sizeof(event));
+    item.bounds = EVERYWHERE;
+    m_current.push_back(item);
+}
+
+void DirtyRectTracker::AddDraw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+    const u16* indices, u32 indexCount)
+{
+    // Field by field, DrawState has padding
+    const u64 event[] = {
+        static_cast<u64>(state.primType), state.drawType, reinterpret_cast<std::uintptr_t>(state.texture),
+        state.a7, state.scissor
+    };
+
+    const u64 stateHash = HashWords(FNV_OFFSET, event, sizeof(event));
+    const bool ortho = state.drawType == FF7::DrawType::Ortho;
+
+    if (state.primType == FF7::PrimitiveType::TriangleList && ortho) {
+        for (u32 i = 0; i + 3 <= indexCount; i += 3) {
+            Item item;
+            item.hash = stateHash;
+
+            for (u32 j = i; j < i + 3; j++) {
+                // GetBounds() covers the whole target for an index past the vertices
+                item.hash = (indices[j] < vertexCount) ? HashVertex(item.hash, vertices[indices[j]]) :
+                    (item.hash ^ indices[j]) * FNV_PRIME;
+            }
+
+            item.bounds = GetBounds(vertices, indices + i, 3, vertexCount);
+            m_current.push_back(item);
+        }
+
+        return;
+    }
+
+    // Strips and fans share vertices between triangles, and perspective draws can't be bounded
+    // without the game's matrices, so the whole draw is one item
+    Item item;
+    item.hash = HashWords((stateHash ^ vertexCount) * FNV_PRIME, vertices, vertexCount * sizeof(FF7::Vertex));
+
+    for (u32 i = 0; i < indexCount; i++) {
+        item.hash = (item.hash ^ indices[i]) * FNV_PRIME;
+    }
+
+    item.bounds = ortho ? GetBounds(vertices, indices, indexCount, vertexCount) : EVERYWHERE;
+    m_current.push_back(item);
+}
+
+void DirtyRectTracker::EndFrame(DirtyRects& dirty)
+{
+    dirty.Clear();
+
+    m_stats.frames++;
+    m_stats.items += m_current.size();
+    m_stats.pixels += static_cast<u64>(m_width) * m_height;
+
+    if (m_invalidFrames) {
+        m_invalidFrames--;
+        m_stats.dirtyItems += m_current.size();
+        dirty.AddAll(m_width, m_height);
+    } else {
+        // Each item takes the first item of the previous frame with the same hash within
+        // MATCH_WINDOW of the one after the last match, so the matched items keep their order and
+        // the ones skipped over are dirty. Tiles are drawn in the same order from frame to frame,
+        // so this is nearly always the next one. A tile moved further matches nothing, which only
+        // costs a larger dirty area.
+        const u32 previousCount = static_cast<u32>(m_previous.size());
+        u32 next = 0;
+
+        for (const auto& item : m_current) {
+            // Not looking for an item already inside the dirty area changes nothing but the time
+            // taken, the item it would have matched has the same bounds
+            const auto bounds = Clip(item.bounds, m_width, m_height);
+            if (dirty.Contains(bounds)) {
+                m_stats.dirtyItems++;
+                continue;
+            }
+
+            const u32 end = std::min(next + MATCH_WINDOW, previousCount);
+            u32 match = next;
+
+            while (match < end && m_previous[match].hash != item.hash) {
+                match++;
+            }
+
+            if (match == end) {
+                AddDirty(item, dirty);
+                continue;
+            }
+
+            for (; next < match; next++) {
+                AddDirty(m_previous[next], dirty);
+            }
+
+            next = match + 1;
+        }
+
+        for (; next < previousCount; next++) {
+            AddDirty(m_previous[next], dirty);
+        }
+    }
+
+    m_stats.dirtyPixels += dirty.GetArea();
+
+    // swap() keeps the capacity of both, so they stop reallocating after the first frames
+    m_previous.swap(m_current);
+    m_current.clear();
+}
+
+void DirtyRectTracker::AddDirty(const Item& item, DirtyRects& dirty)
+{
+    m_stats.dirtyItems++;
+    dirty.Add(Clip(item.bounds, m_width, m_height));
+}
+
+void DirtyRectTracker::Invalidate()
+{
+    // The current frame may have been drawn partly before, so the next one can't be compared to it
+    m_invalidFrames = 2;
+}
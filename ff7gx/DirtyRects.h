@@ -0,0 +1,132 @@
+#pragma once
+
+#include "Common.h"
+#include "GameTypes.h"
+#include "TileBatcher.h"
+
+#include <vector>
+
+// The parts of a render target that changed, as a short list of rectangles in pixels. A rectangle
+// is merged with every one it overlaps or touches as it's added, so they never overlap. Past
+// MAX_RECTS the new one is merged with the one whose union with it adds the fewest pixels, which
+// keeps passes drawing once per rectangle cheap.
+class DirtyRects
+{
+public:
+    static const u32 MAX_RECTS = 8;
+
+    // right and bottom are outside the rectangle
+    struct Rect
+    {
+        i32 left;
+        i32 top;
+        i32 right;
+        i32 bottom;
+
+        bool Empty() const
+        {
+            return right <= left || bottom <= top;
+        }
+
+        u64 Area() const
+        {
+            return Empty() ? 0 : static_cast<u64>(right - left) * static_cast<u64>(bottom - top);
+        }
+    };
+
+    void Add(const Rect& rect);
+
+    // The whole width x height target
+    void AddAll(u32 width, u32 height);
+
+    // Adds what a pass reading source writes: every rectangle grown by the border the pass reads
+    // around each input pixel, scaled by the ratio of its output to its input and clipped to the output
+    void AddScaled(const DirtyRects& source, u32 border, u32 scale, u32 width, u32 height);
+
+    void Clear()
+    {
+        m_rects.clear();
+    }
+
+    bool Empty() const
+    {
+        return m_rects.empty();
+    }
+
+    const std::vector<Rect>& GetRects() const
+    {
+        return m_rects;
+    }
+
+    // Pixels covered, the rectangles don't overlap
+    u64 GetArea() const;
+
+    bool Contains(i32 x, i32 y) const;
+
+    // True if one of the rectangles contains all of rect
+    bool Contains(const Rect& rect) const;
+
+private:
+    std::vector<Rect> m_rects;
+};
+
+// Finds the parts of the background that changed since the previous frame. Every triangle of the
+// tiles is an item with its bounds and a hash of its vertices and draw state, and a clear is an
+// item covering the whole target. Items found in both frames in the same order are unchanged,
+// and the bounds of all others, from both frames, are dirty. A pixel outside them is covered by
+// the same items drawn in the same order, so it's the same as in the previous frame.
+//
+// Like FrameChangeDetector, textures are compared by address. Invalidate() when the contents of
+// the target or of a texture may have changed.
+class DirtyRectTracker
+{
+public:
+    struct Stats
+    {
+        u64 frames;
+        u64 items;
+        u64 dirtyItems;     // Items of both frames without a match
+        u64 pixels;         // Of the target, over all frames
+        u64 dirtyPixels;
+    };
+
+    DirtyRectTracker();
+    ~DirtyRectTracker() = default;
+
+    // Size of the background target, vertices are in its pixels. Items are clipped to it at the end of the frame.
+    void SetSize(u32 width, u32 height);
+
+    void AddClear(u32 clearRenderTarget, u32 clearDepthBuffer);
+    void AddDraw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+        const u16* indices, u32 indexCount);
+
+    // Sets dirty to what changed since the previous frame, and starts the next one
+    void EndFrame(DirtyRects& dirty);
+
+    // The current and next frames are dirty in full
+    void Invalidate();
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    struct Item
+    {
+        u64 hash;
+        DirtyRects::Rect bounds;
+    };
+
+    void AddDirty(const Item& item, DirtyRects& dirty);
+
+    u32 m_width;
+    u32 m_height;
+
+    std::vector<Item> m_previous;
+    std::vector<Item> m_current;
+
+    u32 m_invalidFrames;    // Frames left to report dirty in full
+
+    Stats m_stats;
+};
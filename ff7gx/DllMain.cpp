@@ -8,8 +8,10 @@
 #include "Renderer.h"
 
 #include <windows.h>
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
+#include <memory>
 
 #define DLLEXPORT extern "C" __declspec(dllexport)
 
@@ -45,9 +47,33 @@ static bool g_initialized = false;
 static HMODULE g_fridaDll = nullptr;
 static HMODULE g_apitraceDll = nullptr;
 
+static void InitLogger()
+{
+    const auto& config = GetConfig();
+
+    std::unique_ptr<Logger::Sink> sink;
+    if (!config.logPath.empty()) {
+        sink = CreateFileLogSink(config.logPath);
+        if (!sink) {
+            LogWarning("Couldn't open the log file %s, logging to the debugger", config.logPath);
+        }
+    }
+
+    if (!sink) {
+        sink = CreateDebugLogSink();
+    }
+
+    const auto level = static_cast<LogLevel>(std::min(config.logLevel, static_cast<unsigned int>(LogLevel::Error)));
+
+    // Never deleted, joining the writer thread while the DLL is being unloaded would deadlock.
+    // Shutdown() flushes it instead.
+    SetLogger(new Logger(std::move(sink), config.logBufferSize, level, config.logRateLimit));
+}
+
 static void DoInit()
 {
     InitConfig();
+    InitLogger();
 
     if (GetConfig().waitForDebugger) {
         while (!IsDebuggerPresent()) {
@@ -85,8 +111,10 @@ static void DoInit()
     DebugLog("Init done");
 
     // Enable debug logging
-    FF7::GameInternals internals(g_originalDll);
-    internals.SetDebugLogFlag(1);
+    if (GetConfig().gameDebugLog) {
+        FF7::GameInternals internals(g_originalDll);
+        internals.SetDebugLogFlag(1);
+    }
 
     g_initialized = true;
 }
@@ -98,6 +126,10 @@ static u32 __cdecl Shutdown(u32 a0)
 
     delete instance;
 
+    if (auto logger = GetLogger()) {
+        logger->Flush();
+    }
+
     return ret;
 }
 
@@ -159,7 +191,7 @@ DLLEXPORT u32 __stdcall dotemuRegQueryValueExA(u32 a0, const char* valueName, u3
     Initialize();
 
     // Enable debug logging in the game
-    if (!strcmp(valueName, "SSI_DEBUG")) {
+    if (GetConfig().gameDebugLog && !strcmp(valueName, "SSI_DEBUG")) {
         strcpy_s(static_cast<char*>(data), 16, "SHOWMETHEAPPLOG");
         *dataSize = 16;
         return 0;
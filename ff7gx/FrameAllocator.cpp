@@ -0,0 +1,79 @@
+#include "stdafx.h"
+
+#include "FrameAllocator.h"
+
+#include <algorithm>
+#include <cstdint>
+
+FrameAllocator::FrameAllocator(std::size_t initialSize) :
+    m_block(new u8[initialSize]),
+    m_blockSize(initialSize),
+    m_current(m_block.get()),
+    m_currentSize(initialSize),
+    m_offset(0),
+    m_stats{}
+{
+    m_stats.heapAllocations = 1;
+    m_stats.totalHeapAllocations = 1;
+}
+
+void FrameAllocator::NewChunk(std::size_t minSize)
+{
+    auto size = std::max(minSize, m_blockSize);
+
+    m_overflow.emplace_back(new u8[size]);
+    m_current = m_overflow.back().get();
+    m_currentSize = size;
+    m_offset = 0;
+
+    m_stats.heapAllocations++;
+    m_stats.totalHeapAllocations++;
+}
+
+void* FrameAllocator::Allocate(std::size_t size, std::size_t alignment)
+{
+    auto base = reinterpret_cast<std::uintptr_t>(m_current);
+    auto start = (base + m_offset + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+
+    if (start + size > base + m_currentSize) {
+        // Reserve room for the alignment padding as well, new[] only guarantees the fundamental alignment
+        NewChunk(size + alignment);
+
+        base = reinterpret_cast<std::uintptr_t>(m_current);
+        start = (base + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+    }
+
+    auto end = start + size;
+    m_stats.bytesUsed += static_cast<u32>(end - (base + m_offset));
+    m_stats.allocations++;
+    m_offset = end - base;
+
+    return reinterpret_cast<void*>(start);
+}
+
+void FrameAllocator::Reset()
+{
+    m_stats.peakBytesUsed = std::max(m_stats.peakBytesUsed, m_stats.bytesUsed);
+
+    if (!m_overflow.empty()) {
+        // The frame didn't fit, so grow the block to fit the whole frame next time
+        auto newSize = m_blockSize;
+        while (newSize < m_stats.peakBytesUsed) {
+            newSize *= 2;
+        }
+
+        m_overflow.clear();
+        m_block.reset(new u8[newSize]);
+        m_blockSize = newSize;
+
+        m_stats.totalHeapAllocations++;
+    }
+
+    m_current = m_block.get();
+    m_currentSize = m_blockSize;
+    m_offset = 0;
+
+    m_stats.allocations = 0;
+    m_stats.heapAllocations = 0;
+    m_stats.bytesUsed = 0;
+}
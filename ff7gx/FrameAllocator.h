@@ -0,0 +1,64 @@
+#pragma once
+
+#include "Common.h"
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Bump allocator for data that only has to live until the end of the current frame.
+// Everything is handed out linearly from one block and reclaimed at once by Reset().
+// If a frame doesn't fit in the block, overflow chunks are allocated from the heap and
+// the block is grown on the next Reset(), so a steady state frame does no heap calls.
+class FrameAllocator
+{
+public:
+    struct Stats
+    {
+        u32 allocations;            // Allocate() calls since the last Reset()
+        u32 heapAllocations;        // Heap blocks allocated since the last Reset()
+        u32 bytesUsed;              // Bytes handed out since the last Reset(), including padding
+        u32 peakBytesUsed;          // Largest bytesUsed of any frame so far
+        u32 totalHeapAllocations;   // Heap blocks allocated over the lifetime of the allocator
+    };
+
+    explicit FrameAllocator(std::size_t initialSize);
+    ~FrameAllocator() = default;
+
+    FrameAllocator(FrameAllocator&) = delete;
+    FrameAllocator(FrameAllocator&&) = delete;
+
+    void* Allocate(std::size_t size, std::size_t alignment);
+
+    template<typename T>
+    T* Allocate(std::size_t count)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "T must be trivially destructible");
+        return static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+    }
+
+    // Releases everything allocated during the frame. Pointers returned by Allocate() are invalid after this.
+    void Reset();
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    void NewChunk(std::size_t minSize);
+
+    std::unique_ptr<u8[]> m_block;
+    std::size_t m_blockSize;
+
+    // Chunks allocated when the block ran out during the current frame
+    std::vector<std::unique_ptr<u8[]>> m_overflow;
+
+    // The chunk allocations are currently made from, either m_block or the last overflow chunk
+    u8* m_current;
+    std::size_t m_currentSize;
+    std::size_t m_offset;
+
+    Stats m_stats;
+};
@@ -0,0 +1,76 @@
+#include "stdafx.h"
+
+#include "FrameChangeDetector.h"
+
+// Tags keeping a clear from hashing like a draw with the same bytes
+static const u32 CLEAR_EVENT = 1;
+static const u32 DRAW_EVENT = 2;
+
+FrameChangeDetector::FrameChangeDetector() :
+    m_valid(true),
+    m_matching(false),
+    m_stats{}
+{
+}
+
+void FrameChangeDetector::AddClear(u32 clearRenderTarget, u32 clearDepthBuffer)
+{
+    const u32 event[] = { CLEAR_EVENT, clearRenderTarget, clearDepthBuffer };
+    m_hasher.Update(event, sizeof(event));
+
+    EndEvent();
+}
+
+void FrameChangeDetector::AddDraw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+    const u16* indices, u32 indexCount)
+{
+    // Field by field, DrawState has padding
+    const u64 event[] = {
+        DRAW_EVENT, static_cast<u64>(state.primType), state.drawType, reinterpret_cast<std::uintptr_t>(state.texture),
+        state.a7, state.scissor, vertexCount, indexCount
+    };
+
+    m_hasher.Update(event, sizeof(event));
+    m_hasher.Update(vertices, vertexCount * sizeof(FF7::Vertex));
+    m_hasher.Update(indices, indexCount * sizeof(u16));
+
+    EndEvent();
+}
+
+void FrameChangeDetector::EndEvent()
+{
+    const u64 hash = m_hasher.Finish();
+    const std::size_t index = m_current.size();
+
+    m_matching = m_matching && index < m_previous.size() && m_previous[index] == hash;
+    m_current.push_back(hash);
+
+    m_stats.events++;
+}
+
+bool FrameChangeDetector::EndFrame()
+{
+    const bool unchanged = m_matching && m_current.size() == m_previous.size();
+
+    m_stats.frames++;
+    if (unchanged) {
+        m_stats.unchangedFrames++;
+    }
+
+    // swap() keeps the capacity of both, so they stop reallocating after the first frames
+    m_previous.swap(m_current);
+    m_current.clear();
+
+    // A frame drawn partly before Invalidate() can't be compared either
+    m_matching = m_valid;
+    m_valid = true;
+    m_hasher = TextureHasher();
+
+    return unchanged;
+}
+
+void FrameChangeDetector::Invalidate()
+{
+    m_valid = false;
+    m_matching = false;
+}
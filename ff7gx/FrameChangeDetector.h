@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Common.h"
+#include "GameTypes.h"
+#include "TextureHash.h"
+#include "TileBatcher.h"
+
+#include <vector>
+
+// Tells whether the background of a frame is the same as in the previous frame while it's being
+// drawn. Every event that changes the background render target (a clear or a batch of tiles) is
+// added to a rolling hash, and the hash after each event is compared to the hash after the same
+// event in the previous frame. The frame is unchanged if every event matched and there were as
+// many as in the previous frame.
+//
+// Textures are compared by address, so a texture whose contents change in place isn't noticed.
+// Invalidate() when that may have happened.
+class FrameChangeDetector
+{
+public:
+    struct Stats
+    {
+        u64 frames;
+        u64 unchangedFrames;
+        u64 events;
+    };
+
+    FrameChangeDetector();
+    ~FrameChangeDetector() = default;
+
+    void AddClear(u32 clearRenderTarget, u32 clearDepthBuffer);
+    void AddDraw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+        const u16* indices, u32 indexCount);
+
+    // True while every event of this frame matched the previous frame. False for the first frame
+    // after Invalidate().
+    bool IsMatching() const
+    {
+        return m_matching;
+    }
+
+    // Returns true if the frame was unchanged, and starts the next one
+    bool EndFrame();
+
+    // Forgets the previous frame, so the current and next frames are treated as changed
+    void Invalidate();
+
+    // Hash of the events of the current frame so far
+    u64 GetHash() const
+    {
+        return m_hasher.Finish();
+    }
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    void EndEvent();
+
+    TextureHasher m_hasher;
+
+    // Hash after every event of the previous and the current frame
+    std::vector<u64> m_previous;
+    std::vector<u64> m_current;
+
+    bool m_valid;       // Not invalidated during the current frame
+    bool m_matching;
+
+    Stats m_stats;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Common.h"
+#include "GameTypes.h"
 #include <d3d9.h>
 
 class Module;
@@ -28,21 +29,9 @@ namespace FF7
         const u32 TlMainVS = 0x2d180;
     }
 
-    enum DrawType : u32
-    {
-        Perspective = 2,    // worldviewproj_matrix is used in the vertex shader 
-        Ortho = 3           // ortho_matrix is used in the vertex shader
-    };
-
     // TODO: Fill in the huge context struct.
     struct GameContext;
 
-    enum GameMode
-    {
-        Field = 0,
-        MainMenu = 3
-    };
-
     struct GameState
     {
         u32 index;
@@ -52,14 +41,6 @@ namespace FF7
         u32 (__cdecl *FuncPtr)(GameContext*);
     };
 
-    struct Vertex
-    {
-        float x, y, z, w;
-        u32 color;
-        float unknown;
-        float u, v;
-    };
-
     struct GfxFunctions;
 
     GameContext* GetGameContext();
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "Common.h"
+
+// Game types that don't depend on D3D or Windows, so code using them can also be built into the tools
+namespace FF7
+{
+    enum DrawType : u32
+    {
+        Perspective = 2,    // worldviewproj_matrix is used in the vertex shader
+        Ortho = 3           // ortho_matrix is used in the vertex shader
+    };
+
+    enum GameMode
+    {
+        Field = 0,
+        MainMenu = 3
+    };
+
+    // Same values as D3DPRIMITIVETYPE
+    enum PrimitiveType : u32
+    {
+        PointList = 1,
+        LineList = 2,
+        LineStrip = 3,
+        TriangleList = 4,
+        TriangleStrip = 5,
+        TriangleFan = 6
+    };
+
+    struct Vertex
+    {
+        float x, y, z, w;
+        u32 color;
+        float unknown;
+        float u, v;
+    };
+}
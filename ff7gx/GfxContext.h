@@ -0,0 +1,9 @@
+#pragma once
+
+#include "Common.h"
+#include "GfxContextBase.h"
+#include "Profiler.h"
+#include "ScopedD3DEvent.h"
+#include "TraceRecorder.h"
+
+#include "Generated/GfxContext.h"
@@ -2,7 +2,9 @@
 
 #include "Common.h"
 #include "Game.h"
+#include "Profiler.h"
 #include "ScopedD3DEvent.h"
+#include "TraceRecorder.h"
 
 #include "GfxContextBase.h"
 
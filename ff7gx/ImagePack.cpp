@@ -0,0 +1,170 @@
+#include "stdafx.h"
+
+#include "ImagePack.h"
+
+#include <algorithm>
+#include <fstream>
+#include <utility>
+
+using namespace ImagePack;
+
+static u64 AlignToPage(u64 offset)
+{
+    return (offset + PAYLOAD_ALIGNMENT - 1) / PAYLOAD_ALIGNMENT * PAYLOAD_ALIGNMENT;
+}
+
+static u64 GetPayloadSize(const IndexEntry& entry)
+{
+    return static_cast<u64>(entry.width) * entry.height * sizeof(u32);
+}
+
+static bool KeyLess(const IndexEntry& entry, u64 key)
+{
+    return entry.key < key;
+}
+
+ImagePackWriter::ImagePackWriter(std::string path, Contents contents) :
+    m_path(std::move(path)),
+    m_contents(contents),
+    m_fileSize(0)
+{
+}
+
+void ImagePackWriter::Add(u64 key, u32 width, u32 height)
+{
+    IndexEntry entry;
+    entry.key = key;
+    entry.offset = 0;
+    entry.width = width;
+    entry.height = height;
+
+    m_entries.push_back(entry);
+}
+
+bool ImagePackWriter::Create()
+{
+    std::sort(m_entries.begin(), m_entries.end(), [](const IndexEntry& a, const IndexEntry& b) {
+        return a.key < b.key;
+    });
+
+    m_entries.erase(std::unique(m_entries.begin(), m_entries.end(), [](const IndexEntry& a, const IndexEntry& b) {
+        return a.key == b.key;
+    }), m_entries.end());
+
+    u64 offset = AlignToPage(sizeof(Header) + m_entries.size() * sizeof(IndexEntry));
+    for (auto& entry : m_entries) {
+        entry.offset = offset;
+        offset = AlignToPage(offset + GetPayloadSize(entry));
+    }
+
+    m_fileSize = offset;
+
+    std::ofstream file(m_path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+
+    Header header;
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.contents = m_contents;
+    header.entryCount = static_cast<u32>(m_entries.size());
+    header.payloadAlignment = PAYLOAD_ALIGNMENT;
+    header.reserved = 0;
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(m_entries.data()), m_entries.size() * sizeof(IndexEntry));
+
+    // Extend the file to its final size, so payloads can be written at their offsets
+    if (m_fileSize > sizeof(header)) {
+        file.seekp(static_cast<std::streamoff>(m_fileSize - 1));
+        file.put(0);
+    }
+
+    return !!file;
+}
+
+bool ImagePackWriter::WritePayload(u64 key, const u32* pixels) const
+{
+    auto it = std::lower_bound(m_entries.begin(), m_entries.end(), key, KeyLess);
+    if (it == m_entries.end() || it->key != key) {
+        return false;
+    }
+
+    // Every call opens its own stream, so threads can write different payloads at the same time
+    std::fstream file(m_path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!file) {
+        return false;
+    }
+
+    file.seekp(static_cast<std::streamoff>(it->offset));
+    file.write(reinterpret_cast<const char*>(pixels), static_cast<std::streamsize>(GetPayloadSize(*it)));
+
+    return !!file;
+}
+
+ImagePackReader::ImagePackReader() :
+    m_index(nullptr),
+    m_entryCount(0)
+{
+}
+
+bool ImagePackReader::Open(const char* path, Contents contents)
+{
+    m_index = nullptr;
+    m_entryCount = 0;
+
+    if (!m_file.Open(path)) {
+        return false;
+    }
+
+    const u8* data = m_file.GetData();
+    const u64 size = m_file.GetSize();
+
+    if (size < sizeof(Header)) {
+        m_file.Close();
+        return false;
+    }
+
+    auto header = reinterpret_cast<const Header*>(data);
+    if (header->magic != MAGIC || header->version != VERSION || header->contents != contents ||
+        header->payloadAlignment != PAYLOAD_ALIGNMENT ||
+        sizeof(Header) + static_cast<u64>(header->entryCount) * sizeof(IndexEntry) > size) {
+        m_file.Close();
+        return false;
+    }
+
+    auto index = reinterpret_cast<const IndexEntry*>(data + sizeof(Header));
+
+    // Validate everything once here, so Find() can trust the index
+    for (u32 i = 0; i < header->entryCount; i++) {
+        const auto& entry = index[i];
+
+        if ((i > 0 && index[i - 1].key >= entry.key) || entry.offset % PAYLOAD_ALIGNMENT != 0 ||
+            entry.offset > size || GetPayloadSize(entry) > size - entry.offset) {
+            m_file.Close();
+            return false;
+        }
+    }
+
+    m_index = index;
+    m_entryCount = header->entryCount;
+
+    return true;
+}
+
+bool ImagePackReader::Find(u64 key, Image& image) const
+{
+    auto end = m_index + m_entryCount;
+    auto it = std::lower_bound(m_index, end, key, KeyLess);
+
+    if (it == end || it->key != key) {
+        return false;
+    }
+
+    image.width = it->width;
+    image.height = it->height;
+    image.pixels = reinterpret_cast<const u32*>(m_file.GetData() + it->offset);
+
+    return true;
+}
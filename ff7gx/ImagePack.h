@@ -0,0 +1,122 @@
+#pragma once
+
+#include "Common.h"
+#include "MappedFile.h"
+
+#include <string>
+#include <vector>
+
+// Pack of replacement images built offline by ff7gx-pack: upscaled backgrounds or replacement textures.
+//
+// Layout:
+//   Header
+//   IndexEntry[entryCount], sorted by key
+//   Payloads, each starting on a PAYLOAD_ALIGNMENT boundary: width * height A8R8G8B8 pixels
+//
+// Payloads are page aligned so they can be used directly from the mapped file.
+namespace ImagePack
+{
+    static const u32 MAGIC = 0x50494746; // "FGIP"
+    static const u32 VERSION = 2;
+    static const u32 PAYLOAD_ALIGNMENT = 4096;  // Page size
+
+    // What the images replace, which also determines how the keys are computed
+    enum class Contents : u32
+    {
+        Backgrounds = 1,    // Keys from BackgroundCache::MakeKey()
+        Textures = 2        // Keys from HashTexture()
+    };
+
+    struct Header
+    {
+        u32 magic;
+        u32 version;
+        Contents contents;
+        u32 entryCount;
+        u32 payloadAlignment;
+        u32 reserved;       // Keeps the index 8 byte aligned
+    };
+
+    struct IndexEntry
+    {
+        u64 key;
+        u64 offset;     // From the start of the file
+        u32 width;
+        u32 height;
+    };
+
+    struct Image
+    {
+        u32 width;
+        u32 height;
+        const u32* pixels;
+    };
+}
+
+// Writes a pack in two steps: the images are first declared with Add() and laid out with Create(),
+// after which the payloads can be written in any order with WritePayload(), also from multiple threads.
+class ImagePackWriter
+{
+public:
+    ImagePackWriter(std::string path, ImagePack::Contents contents);
+    ~ImagePackWriter() = default;
+
+    ImagePackWriter(ImagePackWriter&) = delete;
+    ImagePackWriter(ImagePackWriter&&) = delete;
+
+    void Add(u64 key, u32 width, u32 height);
+
+    // Writes the header and index and sizes the file. Duplicate keys are only stored once.
+    bool Create();
+
+    // pixels must be width * height as given to Add()
+    bool WritePayload(u64 key, const u32* pixels) const;
+
+    u64 GetFileSize() const
+    {
+        return m_fileSize;
+    }
+
+    const std::vector<ImagePack::IndexEntry>& GetEntries() const
+    {
+        return m_entries;
+    }
+
+private:
+    std::string m_path;
+    ImagePack::Contents m_contents;
+    std::vector<ImagePack::IndexEntry> m_entries;
+    u64 m_fileSize;
+};
+
+// Read-only view of a pack
+class ImagePackReader
+{
+public:
+    ImagePackReader();
+    ~ImagePackReader() = default;
+
+    ImagePackReader(ImagePackReader&) = delete;
+    ImagePackReader(ImagePackReader&&) = delete;
+
+    // Fails if the pack doesn't have the expected contents
+    bool Open(const char* path, ImagePack::Contents contents);
+
+    // The pixels point into the mapped file and stay valid as long as the reader is open
+    bool Find(u64 key, ImagePack::Image& image) const;
+
+    u32 GetEntryCount() const
+    {
+        return m_entryCount;
+    }
+
+    const ImagePack::IndexEntry& GetEntry(u32 index) const
+    {
+        return m_index[index];
+    }
+
+private:
+    MappedFile m_file;
+    const ImagePack::IndexEntry* m_index;
+    u32 m_entryCount;
+};
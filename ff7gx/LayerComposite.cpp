@@ -0,0 +1,79 @@
+#include "stdafx.h"
+
+#include "LayerComposite.h"
+
+namespace LayerComposite
+{
+    static const u32 VALID_LAYER = 0xff000000;
+
+    void BuildLookup(const LayerDepthSet& layers, u32* lookup)
+    {
+        u32 nearest = 0;
+
+        for (u32 depth = LOOKUP_SIZE; depth-- > 0;) {
+            if (layers.Contains(depth)) {
+                nearest = VALID_LAYER | (depth << 16);
+            }
+
+            lookup[depth] = nearest;
+        }
+    }
+
+    static bool DepthTest(u32 layer, float sceneDepth)
+    {
+        return static_cast<float>(layer / 255.0f) <= sceneDepth;
+    }
+
+    Cost CompositeMultiPass(const Frame& frame, const LayerDepthSet& layers)
+    {
+        const u32 pixels = frame.width * frame.height;
+        Cost cost{};
+
+        layers.ForEachDescending([&](u32 layer) {
+            cost.passes++;
+
+            for (u32 i = 0; i < pixels; i++) {
+                cost.fragments++;
+
+                const u32 pixelDepth = frame.background[i] >> 24;
+                if (pixelDepth > layer || !DepthTest(layer, frame.sceneDepth[i])) {
+                    continue;
+                }
+
+                frame.output[i] = frame.background[i] | VALID_LAYER;
+                cost.writes++;
+            }
+        });
+
+        return cost;
+    }
+
+    Cost CompositeSinglePass(const Frame& frame, const LayerDepthSet& layers)
+    {
+        u32 lookup[LOOKUP_SIZE];
+        BuildLookup(layers, lookup);
+
+        const u32 pixels = frame.width * frame.height;
+        Cost cost{};
+
+        if (layers.Empty()) {
+            return cost;
+        }
+
+        cost.passes = 1;
+
+        for (u32 i = 0; i < pixels; i++) {
+            cost.fragments++;
+
+            const u32 layer = lookup[frame.background[i] >> 24];
+            if (!layer || !DepthTest((layer >> 16) & 0xff, frame.sceneDepth[i])) {
+                continue;
+            }
+
+            frame.output[i] = frame.background[i] | VALID_LAYER;
+            cost.writes++;
+        }
+
+        return cost;
+    }
+}
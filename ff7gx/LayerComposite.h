@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Common.h"
+#include "LayerDepthSet.h"
+
+// Layer compositing helpers shared by the single-pass compositor and its CPU reference.
+namespace LayerComposite
+{
+    const u32 LOOKUP_SIZE = LayerDepthSet::MAX_DEPTHS;
+
+    // Fills a 256 entry A8R8G8B8 lookup for backgroundcomposite.pixel.hlsl. Entry i has the depth
+    // of the nearest layer >= i in red and 0xff in alpha, or is 0 if there's no such layer.
+    void BuildLookup(const LayerDepthSet& layers, u32* lookup);
+
+    // CPU reference implementations of DrawLayers(), for checking the single-pass compositor
+    // against the multi-pass one without a GPU. The background is point sampled at its own
+    // resolution, and the depth test is D3DCMP_LESSEQUAL against sceneDepth.
+    struct Frame
+    {
+        u32 width;
+        u32 height;
+        const u32* background;  // A8R8G8B8, depth in alpha
+        const float* sceneDepth;
+        u32* output;            // A8R8G8B8, initialized with the scene color
+    };
+
+    struct Cost
+    {
+        u32 passes;
+        u32 fragments;  // Pixel shader invocations
+        u32 writes;     // Fragments that passed all tests
+    };
+
+    Cost CompositeMultiPass(const Frame& frame, const LayerDepthSet& layers);
+    Cost CompositeSinglePass(const Frame& frame, const LayerDepthSet& layers);
+}
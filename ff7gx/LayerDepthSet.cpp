@@ -0,0 +1,53 @@
+#include "stdafx.h"
+
+#include "LayerDepthSet.h"
+
+#include <cmath>
+#include <emmintrin.h>
+
+static u32 QuantizeDepth(float z)
+{
+    const float depth = std::ceil(z * 255.0f);
+
+    if (!(depth > 0.0f)) {
+        return 0;
+    }
+
+    return depth < 255.0f ? static_cast<u32>(depth) : 255;
+}
+
+void LayerDepthSet::Mark(const FF7::Vertex* vertices, u32 count)
+{
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 limit = _mm_set1_ps(256.0f);
+
+    u32 i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 z = _mm_mul_ps(
+            _mm_setr_ps(vertices[i].z, vertices[i + 1].z, vertices[i + 2].z, vertices[i + 3].z), scale);
+
+        // Keep huge values from overflowing the integer conversion. NaNs pass through (minps returns
+        // its second operand) and convert to INT_MIN, which clamps to 0 below.
+        z = _mm_min_ps(limit, z);
+
+        // SSE2 has no ceil, so truncate and add 1 where truncation rounded down.
+        // The compare mask is -1 for those lanes, so subtracting it adds 1.
+        __m128i depth = _mm_cvttps_epi32(z);
+        const __m128 rounded = _mm_cmplt_ps(_mm_cvtepi32_ps(depth), z);
+        depth = _mm_sub_epi32(depth, _mm_castps_si128(rounded));
+
+        // Saturating packs clamp to 0..255
+        depth = _mm_packs_epi32(depth, depth);
+        depth = _mm_packus_epi16(depth, depth);
+
+        const u32 packed = static_cast<u32>(_mm_cvtsi128_si32(depth));
+        Insert(packed & 0xff);
+        Insert((packed >> 8) & 0xff);
+        Insert((packed >> 16) & 0xff);
+        Insert(packed >> 24);
+    }
+
+    for (; i < count; i++) {
+        Insert(QuantizeDepth(vertices[i].z));
+    }
+}
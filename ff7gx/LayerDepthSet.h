@@ -0,0 +1,98 @@
+#pragma once
+
+#include "Common.h"
+#include "GameTypes.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Set of the quantized depths (0..255) used by background tiles during a frame.
+// Each depth corresponds to one background layer to be composited in DrawLayers().
+class LayerDepthSet
+{
+public:
+    static const u32 MAX_DEPTHS = 256;
+    static const u32 WORDS = MAX_DEPTHS / 32;
+
+    LayerDepthSet()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        for (auto& word : m_bits) {
+            word = 0;
+        }
+    }
+
+    bool Empty() const
+    {
+        u32 any = 0;
+        for (auto word : m_bits) {
+            any |= word;
+        }
+
+        return any == 0;
+    }
+
+    bool Contains(u32 depth) const
+    {
+        return (m_bits[depth / 32] >> (depth % 32)) & 1;
+    }
+
+    void Insert(u32 depth)
+    {
+        m_bits[depth / 32] |= 1u << (depth % 32);
+    }
+
+    // Inserts ceil(z * 255) of every vertex, clamped to 0..255
+    void Mark(const FF7::Vertex* vertices, u32 count);
+
+    // Calls func(depth) for every depth in the set, from the largest to the smallest
+    template<typename Func>
+    void ForEachDescending(Func func) const
+    {
+        for (u32 word = WORDS; word-- > 0;) {
+            u32 bits = m_bits[word];
+
+            while (bits) {
+                const u32 bit = HighestBit(bits);
+                func(word * 32 + bit);
+                bits &= ~(1u << bit);
+            }
+        }
+    }
+
+    // Raw bits, 32 depths per word
+    const u32* GetBits() const
+    {
+        return m_bits;
+    }
+
+    bool operator==(const LayerDepthSet& other) const
+    {
+        for (u32 i = 0; i < WORDS; i++) {
+            if (m_bits[i] != other.m_bits[i]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    static u32 HighestBit(u32 bits)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse(&index, bits);
+        return index;
+#else
+        return 31 - __builtin_clz(bits);
+#endif
+    }
+
+    u32 m_bits[WORDS];
+};
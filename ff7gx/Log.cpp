@@ -1,18 +1,656 @@
 #include "stdafx.h"
 
+#include "Log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
 #include <cstdio>
-#include <windows.h>
+#include <fstream>
+
+static Logger* g_logger;
+
+Logger* GetLogger()
+{
+    return g_logger;
+}
+
+void SetLogger(Logger* logger)
+{
+    g_logger = logger;
+}
+
+// Debug and info messages have no prefix, like the messages from before there were levels
+static const char* GetLevelPrefix(LogLevel level)
+{
+    switch (level) {
+    case LogLevel::Warning:
+        return "W: ";
+    case LogLevel::Error:
+        return "E: ";
+    default:
+        return "";
+    }
+}
+
+static void WriteDebugString(LogLevel level, const char* message)
+{
+#ifdef _WIN32
+    const std::string line = std::string(GetLevelPrefix(level)) + message;
+    OutputDebugStringA(line.c_str());
+#else
+    std::fprintf(stderr, "%s%s\n", GetLevelPrefix(level), message);
+#endif
+}
+
+void LogSynchronously(LogLevel level, const std::string& message)
+{
+    WriteDebugString(level, message.c_str());
+}
+
+class DebugLogSink : public Logger::Sink
+{
+public:
+    virtual void Write(LogLevel level, const char* message) override
+    {
+        WriteDebugString(level, message);
+    }
+
+    virtual void Flush() override
+    {
+    }
+};
+
+class FileLogSink : public Logger::Sink
+{
+public:
+    explicit FileLogSink(const std::string& path) :
+        m_file(path, std::ios::trunc)
+    {
+    }
+
+    bool IsOpen() const
+    {
+        return m_file.is_open();
+    }
+
+    virtual void Write(LogLevel level, const char* message) override
+    {
+        m_file << GetLevelPrefix(level) << message << '\n';
+    }
+
+    virtual void Flush() override
+    {
+        m_file.flush();
+    }
+
+private:
+    std::ofstream m_file;
+};
+
+std::unique_ptr<Logger::Sink> CreateFileLogSink(const std::string& path)
+{
+    auto sink = std::make_unique<FileLogSink>(path);
+    if (!sink->IsOpen()) {
+        return nullptr;
+    }
+
+    return sink;
+}
+
+std::unique_ptr<Logger::Sink> CreateDebugLogSink()
+{
+    return std::make_unique<DebugLogSink>();
+}
+
+Logger::Logger(std::unique_ptr<Sink> sink, std::size_t slots, LogLevel minLevel, u32 rateLimit) :
+    m_sink(std::move(sink)),
+    m_slotMask(0),
+    m_enqueuePosition(0),
+    m_dequeuePosition(0),
+    m_minLevel(minLevel),
+    m_rateLimit(rateLimit),
+    m_rateSecond(0),
+    m_rateCount(0),
+    m_stopping(false),
+    m_wakePending(false),
+    m_writerWaiting(false),
+    m_droppedFull(0),
+    m_droppedRateLimit(0),
+    m_filtered(0),
+    m_reportedDrops(0)
+{
+    std::size_t size = 16;
+    while (size < slots) {
+        size *= 2;
+    }
+
+    m_slots = std::make_unique<Slot[]>(size);
+    m_slotMask = size - 1;
+
+    // A slot is free for the producer whose position equals its sequence
+    for (std::size_t i = 0; i < size; i++) {
+        m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    m_writer = std::thread([this] { WriterMain(); });
+}
+
+Logger::~Logger()
+{
+    m_stopping.store(true);
+    Wake();
+    m_writer.join();
+}
+
+Logger::Slot* Logger::Claim(LogLevel level)
+{
+    if (level < m_minLevel) {
+        m_filtered.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    if (m_rateLimit) {
+        const u64 second = static_cast<u64>(
+            std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+
+        // Whoever sees the new second first starts counting again. A few messages may be counted
+        // against the wrong second, which doesn't matter for a limit.
+        u64 current = m_rateSecond.load(std::memory_order_relaxed);
+        if (current != second && m_rateSecond.compare_exchange_strong(current, second, std::memory_order_relaxed)) {
+            m_rateCount.store(0, std::memory_order_relaxed);
+        }
+
+        if (m_rateCount.fetch_add(1, std::memory_order_relaxed) >= m_rateLimit) {
+            m_droppedRateLimit.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+    }
+
+    // A bounded multi-producer queue: a producer owns a slot once it has moved the enqueue
+    // position past it, and the slot's sequence tells whether the writer is done with it
+    u64 position = m_enqueuePosition.load(std::memory_order_relaxed);
+
+    for (;;) {
+        Slot& slot = m_slots[position & m_slotMask];
+        const u64 sequence = slot.sequence.load(std::memory_order_acquire);
+        const i64 difference = static_cast<i64>(sequence - position);
+
+        if (difference == 0) {
+            if (m_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                return &slot;
+            }
+        } else if (difference < 0) {
+            // The writer hasn't written the message that was in the slot a lap ago
+            m_droppedFull.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        } else {
+            position = m_enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void Logger::Publish(Slot& slot)
+{
+    // The slot was claimed at the position equal to its sequence
+    slot.sequence.store(slot.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+    // Pairs with the fence in WriterMain(): either the writer sees this message before waiting,
+    // or this sees it waiting. It only waits with the ring empty, so this is the first message.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (m_writerWaiting.load(std::memory_order_relaxed)) {
+        Wake();
+    }
+}
+
+void Logger::Wake()
+{
+    std::lock_guard<std::mutex> lock(m_wakeMutex);
+    m_wakePending = true;
+    m_wake.notify_one();
+}
+
+bool Logger::HasMessage() const
+{
+    const u64 position = m_dequeuePosition.load(std::memory_order_relaxed);
+    return m_slots[position & m_slotMask].sequence.load(std::memory_order_acquire) == position + 1;
+}
+
+bool Logger::Append(Slot& slot, ArgType type, const void* value, std::size_t size)
+{
+    if (slot.size + 1 + size > SLOT_DATA_SIZE) {
+        return false;
+    }
+
+    slot.data[slot.size] = static_cast<u8>(type);
+    std::memcpy(&slot.data[slot.size + 1], value, size);
+    slot.size = static_cast<u16>(slot.size + 1 + size);
+
+    return true;
+}
+
+void Logger::StoreString(Slot& slot, const char* text, std::size_t length)
+{
+    // Truncated to what's left of the slot
+    const std::size_t header = 1 + sizeof(u16);
+    if (slot.size + header > SLOT_DATA_SIZE) {
+        return;
+    }
+
+    const u16 stored = static_cast<u16>(std::min(length, SLOT_DATA_SIZE - slot.size - header));
+
+    slot.data[slot.size] = static_cast<u8>(ArgType::String);
+    std::memcpy(&slot.data[slot.size + 1], &stored, sizeof(stored));
+    std::memcpy(&slot.data[slot.size + header], text, stored);
+    slot.size = static_cast<u16>(slot.size + header + stored);
+}
+
+namespace
+{
+    struct Arg
+    {
+        Logger::ArgType type;
+        u64 bits;
+        double real;
+        std::string text;
+    };
+
+    // Reads arguments in the order they were stored
+    class ArgReader
+    {
+    public:
+        ArgReader(const u8* data, std::size_t size) :
+            m_data(data),
+            m_size(size),
+            m_offset(0)
+        {
+        }
+
+        // Returns false if the argument was truncated away or the format has more than were given
+        bool Next(Arg& arg)
+        {
+            if (m_offset >= m_size) {
+                return false;
+            }
+
+            arg.type = static_cast<Logger::ArgType>(m_data[m_offset++]);
+
+            // Never reads past the stored data, even if a slot was corrupted
+            if (m_offset + GetSize(arg.type) > m_size) {
+                m_offset = m_size;
+                return false;
+            }
 
-static const std::size_t BUF_SIZE = 512;
+            switch (arg.type) {
+            case Logger::ArgType::Signed32: {
+                i32 value;
+                Read(&value, sizeof(value));
+                arg.bits = static_cast<u64>(static_cast<i64>(value));
+                arg.real = value;
+                break;
+            }
 
-void DebugLog(const char* format, ...)
+            case Logger::ArgType::Unsigned32: {
+                u32 value;
+                Read(&value, sizeof(value));
+                arg.bits = value;
+                arg.real = value;
+                break;
+            }
+
+            case Logger::ArgType::Signed64:
+                Read(&arg.bits, sizeof(arg.bits));
+                arg.real = static_cast<double>(static_cast<i64>(arg.bits));
+                break;
+
+            case Logger::ArgType::Unsigned64:
+            case Logger::ArgType::Pointer:
+                Read(&arg.bits, sizeof(arg.bits));
+                arg.real = static_cast<double>(arg.bits);
+                break;
+
+            case Logger::ArgType::Double:
+                Read(&arg.real, sizeof(arg.real));
+                arg.bits = static_cast<u64>(static_cast<i64>(arg.real));
+                break;
+
+            case Logger::ArgType::String: {
+                u16 length;
+                Read(&length, sizeof(length));
+                if (m_offset + length > m_size) {
+                    m_offset = m_size;
+                    return false;
+                }
+
+                arg.text.assign(reinterpret_cast<const char*>(m_data + m_offset), length);
+                m_offset += length;
+                arg.bits = 0;
+                arg.real = 0.0;
+                break;
+            }
+            }
+
+            return true;
+        }
+
+    private:
+        // Of the value following the type, only the length for strings
+        static std::size_t GetSize(Logger::ArgType type)
+        {
+            switch (type) {
+            case Logger::ArgType::Signed32:
+            case Logger::ArgType::Unsigned32:
+                return sizeof(u32);
+            case Logger::ArgType::String:
+                return sizeof(u16);
+            default:
+                return sizeof(u64);
+            }
+        }
+
+        void Read(void* value, std::size_t size)
+        {
+            std::memcpy(value, m_data + m_offset, size);
+            m_offset += size;
+        }
+
+        const u8* m_data;
+        std::size_t m_size;
+        std::size_t m_offset;
+    };
+}
+
+// snprintf() into a string, for one conversion at a time
+template<typename T>
+static void AppendFormatted(std::string& out, const std::string& spec, T value)
+{
+    char buf[128];
+    const int length = std::snprintf(buf, sizeof(buf), spec.c_str(), value);
+    if (length < 0) {
+        return;
+    }
+
+    if (static_cast<std::size_t>(length) < sizeof(buf)) {
+        out.append(buf, length);
+        return;
+    }
+
+    std::string large(length + 1, '\0');
+    std::snprintf(&large[0], large.size(), spec.c_str(), value);
+    out.append(large.c_str(), length);
+}
+
+// Skips the flags, width, precision and length of a conversion, c is past the '%'. Returns the
+// conversion character, or the terminator. Widths and precisions given as '*' are passed to star().
+template<typename StarFn>
+static const char* SkipConversionSpec(const char* c, std::string* spec, StarFn&& star)
+{
+    while (*c && std::strchr("-+ #0", *c)) {
+        if (spec) {
+            *spec += *c;
+        }
+        c++;
+    }
+
+    auto number = [&]() {
+        if (*c == '*') {
+            c++;
+            star();
+            return;
+        }
+
+        while (*c >= '0' && *c <= '9') {
+            if (spec) {
+                *spec += *c;
+            }
+            c++;
+        }
+    };
+
+    number();
+
+    if (*c == '.') {
+        if (spec) {
+            *spec += *c;
+        }
+        c++;
+        number();
+    }
+
+    // The stored types decide the length, so the original modifiers are skipped
+    while (*c && std::strchr("hljztLI", *c)) {
+        if (*c == 'I' && (std::strncmp(c, "I64", 3) == 0 || std::strncmp(c, "I32", 3) == 0)) {
+            c += 2;
+        }
+        c++;
+    }
+
+    return c;
+}
+
+u32 Logger::CountArgs(const char* format)
+{
+    u32 count = 0;
+
+    for (const char* c = format; *c; c++) {
+        if (*c != '%') {
+            continue;
+        }
+
+        if (c[1] == '%') {
+            c++;
+            continue;
+        }
+
+        c = SkipConversionSpec(c + 1, nullptr, [&]() { count++; });
+        if (!*c) {
+            break;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+std::string Logger::Format(const char* format, const u8* data, std::size_t size, u32 argCount)
+{
+    // Written as is rather than formatted with arguments of the wrong types or none at all
+    const u32 expected = CountArgs(format);
+    if (expected != argCount) {
+        return "<" + std::to_string(argCount) + " arguments for " + std::to_string(expected) + "> " + format;
+    }
+
+    std::string out;
+    ArgReader reader(data, size);
+    Arg arg;
+
+    for (const char* c = format; *c; c++) {
+        if (*c != '%') {
+            out += *c;
+            continue;
+        }
+
+        if (c[1] == '%') {
+            out += '%';
+            c++;
+            continue;
+        }
+
+        // Rebuilds the conversion with the length modifier of the stored type. Widths and
+        // precisions given as arguments become part of the spec.
+        std::string spec = "%";
+        c = SkipConversionSpec(c + 1, &spec, [&]() {
+            if (reader.Next(arg)) {
+                spec += std::to_string(static_cast<i64>(arg.bits));
+            }
+        });
+
+        if (!*c) {
+            break;
+        }
+
+        const char conversion = *c;
+
+        if (!reader.Next(arg)) {
+            out += "<missing>";
+            continue;
+        }
+
+        switch (conversion) {
+        case 'd':
+        case 'i':
+            AppendFormatted(out, spec + "lld", static_cast<long long>(arg.bits));
+            break;
+
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X': {
+            // 32-bit values are printed as such, so negative ints in hex don't grow to 16 digits
+            const bool narrow = arg.type == ArgType::Signed32 || arg.type == ArgType::Unsigned32;
+            const unsigned long long value = narrow ? static_cast<u32>(arg.bits) : arg.bits;
+            AppendFormatted(out, spec + "ll" + conversion, value);
+            break;
+        }
+
+        case 'c':
+            AppendFormatted(out, spec + 'c', static_cast<int>(arg.bits));
+            break;
+
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            AppendFormatted(out, spec + conversion, arg.real);
+            break;
+
+        case 'p':
+            AppendFormatted(out, spec + 'p', reinterpret_cast<void*>(static_cast<std::uintptr_t>(arg.bits)));
+            break;
+
+        case 's':
+            if (arg.type == ArgType::String) {
+                AppendFormatted(out, spec + 's', arg.text.c_str());
+            } else {
+                out += "<not a string>";
+            }
+            break;
+
+        default:
+            out += spec;
+            out += conversion;
+            break;
+        }
+    }
+
+    return out;
+}
+
+bool Logger::WriteMessages()
 {
-    char buf[BUF_SIZE];
+    bool wrote = false;
+
+    // Only this thread moves the dequeue position
+    u64 position = m_dequeuePosition.load(std::memory_order_relaxed);
+
+    for (;;) {
+        Slot& slot = m_slots[position & m_slotMask];
+        if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+            break;
+        }
+
+        const std::string message = Format(slot.format, slot.data, slot.size, slot.argCount);
+        const LogLevel level = slot.level;
 
-    va_list args;
-    va_start(args, format);
-    vsnprintf(buf, BUF_SIZE, format, args);
-    va_end(args);
+        // Hands the slot back to the producers a lap later
+        slot.sequence.store(position + m_slotMask + 1, std::memory_order_release);
 
-    OutputDebugStringA(buf);
+        m_sink->Write(level, message.c_str());
+        wrote = true;
+
+        // Flush() waits for this, so it's only moved once the message is in the sink
+        position++;
+        m_dequeuePosition.store(position, std::memory_order_release);
+    }
+
+    return wrote;
+}
+
+void Logger::WriterMain()
+{
+    for (;;) {
+        // Checked before writing, so everything logged before stopping gets written
+        const bool stopping = m_stopping.load();
+
+        bool wrote = WriteMessages();
+
+        const u64 droppedFull = m_droppedFull.load(std::memory_order_relaxed);
+        const u64 droppedRateLimit = m_droppedRateLimit.load(std::memory_order_relaxed);
+
+        if (droppedFull + droppedRateLimit != m_reportedDrops) {
+            char message[128];
+            std::snprintf(message, sizeof(message),
+                "%" PRIu64 " log messages dropped so far, %" PRIu64 " with the buffer full, %" PRIu64 " over the rate limit",
+                droppedFull + droppedRateLimit, droppedFull, droppedRateLimit);
+            m_sink->Write(LogLevel::Warning, message);
+
+            m_reportedDrops = droppedFull + droppedRateLimit;
+            wrote = true;
+        }
+
+        if (wrote) {
+            m_sink->Flush();
+
+            // Taking the mutex orders this after a Flush() that checked the position and is waiting
+            {
+                std::lock_guard<std::mutex> lock(m_wakeMutex);
+            }
+            m_written.notify_all();
+        }
+
+        if (stopping) {
+            break;
+        }
+
+        std::unique_lock<std::mutex> lock(m_wakeMutex);
+        m_writerWaiting.store(true, std::memory_order_relaxed);
+
+        // Pairs with the fence in Publish()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (!HasMessage()) {
+            m_wake.wait(lock, [this] { return m_wakePending; });
+        }
+
+        m_wakePending = false;
+        m_writerWaiting.store(false, std::memory_order_relaxed);
+    }
+}
+
+void Logger::Flush()
+{
+    const u64 target = m_enqueuePosition.load(std::memory_order_acquire);
+
+    // Claimed messages not published yet wake the writer thread when they are
+    Wake();
+
+    std::unique_lock<std::mutex> lock(m_wakeMutex);
+    m_written.wait(lock, [&] { return m_dequeuePosition.load(std::memory_order_acquire) >= target; });
+}
+
+Logger::Stats Logger::GetStats() const
+{
+    Stats stats;
+    stats.logged = m_enqueuePosition.load(std::memory_order_relaxed);
+    stats.written = m_dequeuePosition.load(std::memory_order_relaxed);
+    stats.droppedFull = m_droppedFull.load(std::memory_order_relaxed);
+    stats.droppedRateLimit = m_droppedRateLimit.load(std::memory_order_relaxed);
+    stats.filtered = m_filtered.load(std::memory_order_relaxed);
+    return stats;
 }
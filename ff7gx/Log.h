@@ -1 +1,277 @@
-void DebugLog(const char* format, ...);
+#pragma once
+
+#include "Common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+enum class LogLevel : u8
+{
+    Debug,
+    Info,
+    Warning,
+    Error
+};
+
+// Formats log messages on a background thread, so logging from the render thread costs a copy
+// of the arguments instead of a vsnprintf() and an OutputDebugStringA(), which is very slow with a
+// debugger attached.
+//
+// Log() stores the format string by pointer and the arguments as raw bytes in a slot of a
+// lock-free ring that any thread can write to. Strings are copied, and truncated if the slot is
+// full. The format string must be a literal, and one whose conversions don't match the arguments
+// is written as is. If the ring is full or more messages than the rate limit are logged in a
+// second, the message is dropped and counted, and the writer thread reports the count with the
+// next message it writes.
+//
+// The writer thread sleeps while the ring is empty, and the message filling it wakes it up.
+class Logger
+{
+public:
+    // Called on the writer thread
+    class Sink
+    {
+    public:
+        virtual ~Sink() = default;
+        virtual void Write(LogLevel level, const char* message) = 0;
+        virtual void Flush() = 0;
+    };
+
+    struct Stats
+    {
+        u64 logged;
+        u64 written;
+        u64 droppedFull;        // The ring was full
+        u64 droppedRateLimit;   // Over the rate limit
+        u64 filtered;           // Below the minimum level
+    };
+
+    // Bytes of arguments a slot holds
+    static const std::size_t SLOT_DATA_SIZE = 232;
+
+    // Types of the arguments stored in a slot, followed by their value
+    enum class ArgType : u8
+    {
+        Signed32,
+        Unsigned32,
+        Signed64,
+        Unsigned64,
+        Double,
+        Pointer,
+        String      // A u16 length and the characters, without the terminator
+    };
+
+    // slots is rounded up to a power of two, 0 for rateLimit means no limit
+    Logger(std::unique_ptr<Sink> sink, std::size_t slots, LogLevel minLevel, u32 rateLimit);
+    ~Logger();
+
+    Logger(Logger&) = delete;
+    Logger(Logger&&) = delete;
+
+    template<typename... Args>
+    void Log(LogLevel level, const char* format, const Args&... args)
+    {
+        Slot* slot = Claim(level);
+        if (!slot) {
+            return;
+        }
+
+        Fill(*slot, level, format, args...);
+        Publish(*slot);
+    }
+
+    // Formats a message on the calling thread, the way the writer thread would
+    template<typename... Args>
+    static std::string FormatNow(const char* format, const Args&... args)
+    {
+        Slot slot;
+        Fill(slot, LogLevel::Debug, format, args...);
+        return Format(slot.format, slot.data, slot.size, slot.argCount);
+    }
+
+    // Waits for every message logged so far to reach the sink
+    void Flush();
+
+    Stats GetStats() const;
+
+private:
+    struct Slot
+    {
+        std::atomic<u64> sequence;
+        const char* format;
+        LogLevel level;
+        u8 argCount;
+        u16 size;
+        u8 data[SLOT_DATA_SIZE];
+    };
+
+    // Formats the arguments stored in a slot, like snprintf() would have
+    static std::string Format(const char* format, const u8* data, std::size_t size, u32 argCount);
+
+    // Arguments the conversions of a format read, counting widths and precisions given as '*'
+    static u32 CountArgs(const char* format);
+
+    // Returns a slot to write the message to, or null if it's dropped
+    Slot* Claim(LogLevel level);
+    void Publish(Slot& slot);
+
+    template<typename... Args>
+    static void Fill(Slot& slot, LogLevel level, const char* format, const Args&... args)
+    {
+        slot.format = format;
+        slot.level = level;
+        slot.argCount = static_cast<u8>(sizeof...(Args));
+        slot.size = 0;
+
+        // Stores the arguments in order, the extra element keeps the array from being empty
+        const int stored[] = { (Store(slot, args), 0)..., 0 };
+        (void)stored;
+    }
+
+    static bool Append(Slot& slot, ArgType type, const void* value, std::size_t size);
+    static void StoreString(Slot& slot, const char* text, std::size_t length);
+
+    template<typename T>
+    static void Store(Slot& slot, const T& value, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type* = nullptr)
+    {
+        if (sizeof(T) <= 4) {
+            const u32 bits = static_cast<u32>(value);
+            Append(slot, std::is_signed<T>::value ? ArgType::Signed32 : ArgType::Unsigned32, &bits, sizeof(bits));
+        } else {
+            const u64 bits = static_cast<u64>(value);
+            Append(slot, std::is_signed<T>::value ? ArgType::Signed64 : ArgType::Unsigned64, &bits, sizeof(bits));
+        }
+    }
+
+    template<typename T>
+    static void Store(Slot& slot, const T& value, typename std::enable_if<std::is_floating_point<T>::value>::type* = nullptr)
+    {
+        const double bits = static_cast<double>(value);
+        Append(slot, ArgType::Double, &bits, sizeof(bits));
+    }
+
+    template<typename T>
+    static void Store(Slot& slot, T* const& value)
+    {
+        const u64 bits = static_cast<u64>(reinterpret_cast<std::uintptr_t>(value));
+        Append(slot, ArgType::Pointer, &bits, sizeof(bits));
+    }
+
+    static void Store(Slot& slot, const char* const& value)
+    {
+        StoreString(slot, value, value ? std::strlen(value) : 0);
+    }
+
+    static void Store(Slot& slot, char* const& value)
+    {
+        StoreString(slot, value, value ? std::strlen(value) : 0);
+    }
+
+    template<std::size_t N>
+    static void Store(Slot& slot, const char (&value)[N])
+    {
+        StoreString(slot, value, std::strlen(value));
+    }
+
+    static void Store(Slot& slot, const std::string& value)
+    {
+        StoreString(slot, value.c_str(), value.size());
+    }
+
+    void WriterMain();
+
+    // Wakes the writer thread if it's waiting
+    void Wake();
+
+    // True if the next message for the writer thread is published
+    bool HasMessage() const;
+
+    // Writes the messages published so far, returns false if there were none
+    bool WriteMessages();
+
+    std::unique_ptr<Sink> m_sink;
+
+    std::unique_ptr<Slot[]> m_slots;
+    std::size_t m_slotMask;
+
+    // Positions of the next slot to claim and to write to the sink
+    std::atomic<u64> m_enqueuePosition;
+    std::atomic<u64> m_dequeuePosition;
+
+    const LogLevel m_minLevel;
+
+    // Messages logged in the current second
+    const u32 m_rateLimit;
+    std::atomic<u64> m_rateSecond;
+    std::atomic<u32> m_rateCount;
+
+    std::atomic<bool> m_stopping;
+    std::thread m_writer;
+
+    // The writer thread waits on m_wake until m_wakePending is set. Producers only take the mutex
+    // when m_writerWaiting is set, which it only is with the ring empty. Flush() waits on m_written.
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_written;
+    bool m_wakePending;
+    std::atomic<bool> m_writerWaiting;
+
+    // Messages logged and written are the positions, only drops are counted separately
+    std::atomic<u64> m_droppedFull;
+    std::atomic<u64> m_droppedRateLimit;
+    std::atomic<u64> m_filtered;
+
+    // Drops already reported by the writer thread
+    u64 m_reportedDrops;
+};
+
+// A sink writing to a file, or null if it can't be created
+std::unique_ptr<Logger::Sink> CreateFileLogSink(const std::string& path);
+
+// OutputDebugStringA() on Windows, stderr elsewhere
+std::unique_ptr<Logger::Sink> CreateDebugLogSink();
+
+// The logger used by the Log functions. Without one, messages are formatted and written
+// synchronously, which is what happens before the config is read.
+Logger* GetLogger();
+void SetLogger(Logger* logger);
+
+// Writes a message immediately, for when there's no logger
+void LogSynchronously(LogLevel level, const std::string& message);
+
+template<typename... Args>
+void Log(LogLevel level, const char* format, const Args&... args)
+{
+    if (auto logger = GetLogger()) {
+        logger->Log(level, format, args...);
+        return;
+    }
+
+    LogSynchronously(level, Logger::FormatNow(format, args...));
+}
+
+template<typename... Args>
+void DebugLog(const char* format, const Args&... args)
+{
+    Log(LogLevel::Debug, format, args...);
+}
+
+template<typename... Args>
+void LogWarning(const char* format, const Args&... args)
+{
+    Log(LogLevel::Warning, format, args...);
+}
+
+template<typename... Args>
+void LogError(const char* format, const Args&... args)
+{
+    Log(LogLevel::Error, format, args...);
+}
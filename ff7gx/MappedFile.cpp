@@ -0,0 +1,128 @@
+#include "stdafx.h"
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() :
+    m_data(nullptr),
+    m_size(0),
+    m_file(INVALID_HANDLE_VALUE),
+    m_mapping(nullptr)
+{
+}
+
+bool MappedFile::Open(const char* path)
+{
+    Close();
+
+    m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0 ||
+        static_cast<u64>(size.QuadPart) > static_cast<u64>(SIZE_MAX)) {
+        Close();
+        return false;
+    }
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping) {
+        Close();
+        return false;
+    }
+
+    m_data = static_cast<const u8*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_data) {
+        Close();
+        return false;
+    }
+
+    m_size = static_cast<std::size_t>(size.QuadPart);
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+        m_data = nullptr;
+    }
+
+    if (m_mapping) {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+
+    if (m_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+
+    m_size = 0;
+}
+
+#else
+
+MappedFile::MappedFile() :
+    m_data(nullptr),
+    m_size(0)
+{
+}
+
+bool MappedFile::Open(const char* path)
+{
+    Close();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    // The mapping keeps the file referenced, so the descriptor isn't needed after this
+    void* data = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    m_data = static_cast<const u8*>(data);
+    m_size = static_cast<std::size_t>(st.st_size);
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (m_data) {
+        munmap(const_cast<u8*>(m_data), m_size);
+        m_data = nullptr;
+    }
+
+    m_size = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
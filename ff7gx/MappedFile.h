@@ -0,0 +1,43 @@
+#pragma once
+
+#include "Common.h"
+
+#include <cstddef>
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(MappedFile&) = delete;
+    MappedFile(MappedFile&&) = delete;
+
+    bool Open(const char* path);
+    void Close();
+
+    bool IsOpen() const
+    {
+        return m_data != nullptr;
+    }
+
+    const u8* GetData() const
+    {
+        return m_data;
+    }
+
+    std::size_t GetSize() const
+    {
+        return m_size;
+    }
+
+private:
+    const u8* m_data;
+    std::size_t m_size;
+
+#ifdef _WIN32
+    void* m_file;
+    void* m_mapping;
+#endif
+};
@@ -81,7 +81,7 @@ void** Module::FindImport(const char* targetLib, const char* targetFunc)
             );
 
             if (originalFirstThunk[idx].u1.Ordinal & IMAGE_ORDINAL_FLAG) {
-                DebugLog("W: Function exported only by ordinal, skipping...");
+                LogWarning("Function exported only by ordinal, skipping...");
             } else if (!strcmp(targetFunc, reinterpret_cast<const char*>(import->Name))) {
                 DebugLog("Found %s!%s at %p", targetLib, targetFunc, &firstThunk[idx]);
                 return &firstThunk[idx];
@@ -89,7 +89,7 @@ void** Module::FindImport(const char* targetLib, const char* targetFunc)
         }
     }
 
-    DebugLog("Couldn't find %s!%s", targetLib, targetFunc);
+    LogWarning("Couldn't find %s!%s", targetLib, targetFunc);
     return nullptr;
 }
 
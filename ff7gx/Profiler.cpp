@@ -0,0 +1,236 @@
+#include "stdafx.h"
+
+#include "Profiler.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <fstream>
+
+static Profiler* g_profiler;
+
+// The ring of the current thread. A thread can outlive a profiler, so the ring is only used if
+// it belongs to the current one.
+struct CurrentRing
+{
+    u64 instance;
+    void* ring;
+};
+
+static thread_local CurrentRing t_currentRing;
+
+static std::atomic<u64> g_nextInstance(1);
+
+Profiler* GetProfiler()
+{
+    return g_profiler;
+}
+
+void SetProfiler(Profiler* profiler)
+{
+    g_profiler = profiler;
+}
+
+Profiler::ThreadRing::ThreadRing(std::size_t size, u32 id) :
+    events(size),
+    written(0),
+    depth(0),
+    id(id)
+{
+}
+
+Profiler::Profiler(std::size_t eventsPerThread) :
+    m_start(Clock::now()),
+    m_ringSize([eventsPerThread] {
+        std::size_t size = 1024;
+        while (size < eventsPerThread) {
+            size *= 2;
+        }
+        return size;
+    }()),
+    m_instance(g_nextInstance.fetch_add(1)),
+    m_frameStart(0),
+    m_frameStartTime(0),
+    m_frames(0),
+    m_overwritten(0),
+    m_lastFrameNs(0)
+{
+}
+
+Profiler::ThreadRing* Profiler::RegisterThread()
+{
+    if (t_currentRing.instance == m_instance) {
+        return static_cast<ThreadRing*>(t_currentRing.ring);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_rings.push_back(std::make_unique<ThreadRing>(m_ringSize, static_cast<u32>(m_rings.size())));
+
+    t_currentRing.instance = m_instance;
+    t_currentRing.ring = m_rings.back().get();
+
+    return m_rings.back().get();
+}
+
+void Profiler::EnterScope()
+{
+    RegisterThread()->depth++;
+}
+
+void Profiler::LeaveScope(const char* name, u64 begin)
+{
+    const u64 end = Now();
+
+    auto ring = RegisterThread();
+    ring->depth--;
+
+    // Only this thread writes to the ring, readers check for events overwritten while they copy
+    const u64 position = ring->written.load(std::memory_order_relaxed);
+    ring->events[position & (m_ringSize - 1)] = Event{ name, begin, end, ring->depth };
+    ring->written.store(position + 1, std::memory_order_release);
+}
+
+void Profiler::CopyEvents(const ThreadRing& ring, u64 from, std::vector<Event>& events) const
+{
+    events.clear();
+
+    const u64 end = ring.written.load(std::memory_order_acquire);
+    const u64 begin = std::max(from, end > m_ringSize ? end - m_ringSize : 0);
+
+    for (u64 i = begin; i < end; i++) {
+        events.push_back(ring.events[i & (m_ringSize - 1)]);
+    }
+
+    // The owner may have wrapped around while we were copying
+    const u64 written = ring.written.load(std::memory_order_acquire);
+    const u64 oldest = written > m_ringSize ? written - m_ringSize : 0;
+
+    if (oldest > begin) {
+        events.erase(events.begin(), events.begin() + static_cast<std::ptrdiff_t>(std::min(oldest - begin, end - begin)));
+    }
+}
+
+void Profiler::AddScope(std::vector<ScopeStats>& stats, const char* name, u32 depth, u64 calls, u64 totalNs, u64 maxNs)
+{
+    // Only a few dozen scopes, so a linear search is fine. The same name may have different
+    // addresses in different translation units.
+    for (auto& scope : stats) {
+        if (scope.depth == depth && (scope.name == name || std::strcmp(scope.name, name) == 0)) {
+            scope.calls += calls;
+            scope.totalNs += totalNs;
+            scope.maxNs = std::max(scope.maxNs, maxNs);
+            return;
+        }
+    }
+
+    stats.push_back(ScopeStats{ name, depth, calls, totalNs, maxNs });
+}
+
+void Profiler::EndFrame()
+{
+    const auto& ring = *RegisterThread();
+    const u64 now = Now();
+
+    const u64 written = ring.written.load(std::memory_order_relaxed);
+    if (written - m_frameStart > m_ringSize) {
+        m_overwritten += written - m_frameStart - m_ringSize;
+    }
+
+    CopyEvents(ring, m_frameStart, m_frameEvents);
+    m_frameStart = written;
+
+    m_frameStats.clear();
+    for (const auto& event : m_frameEvents) {
+        const u64 duration = event.end - event.begin;
+        AddScope(m_frameStats, event.name, event.depth, 1, duration, duration);
+    }
+
+    std::sort(m_frameStats.begin(), m_frameStats.end(), [](const ScopeStats& a, const ScopeStats& b) {
+        return a.depth != b.depth ? a.depth < b.depth : a.totalNs > b.totalNs;
+    });
+
+    for (const auto& scope : m_frameStats) {
+        AddScope(m_totalStats, scope.name, scope.depth, scope.calls, scope.totalNs, scope.maxNs);
+    }
+
+    std::sort(m_totalStats.begin(), m_totalStats.end(), [](const ScopeStats& a, const ScopeStats& b) {
+        return a.depth != b.depth ? a.depth < b.depth : a.totalNs > b.totalNs;
+    });
+
+    m_lastFrameNs = m_frames ? now - m_frameStartTime : 0;
+    m_frameStartTime = now;
+    m_frames++;
+}
+
+Profiler::Stats Profiler::GetStats() const
+{
+    Stats stats;
+    stats.frames = m_frames;
+    stats.events = 0;
+    stats.overwritten = m_overwritten;
+    stats.lastFrameNs = m_lastFrameNs;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto& ring : m_rings) {
+        stats.events += ring->written.load(std::memory_order_relaxed);
+    }
+
+    return stats;
+}
+
+static void WriteJsonString(std::ofstream& file, const char* text)
+{
+    file << '"';
+
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') {
+            file << '\\';
+        }
+
+        if (static_cast<u8>(*text) >= 0x20) {
+            file << *text;
+        }
+    }
+
+    file << '"';
+}
+
+bool Profiler::WriteChromeTrace(const std::string& path) const
+{
+    std::ofstream file(path, std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+
+    // Registering threads is the only thing that changes m_rings
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+
+    bool first = true;
+    std::vector<Event> events;
+    char buf[128];
+
+    for (const auto& ring : m_rings) {
+        std::snprintf(buf, sizeof(buf), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"Thread %u\"}}",
+            first ? "" : ",\n", ring->id, ring->id);
+        file << buf;
+        first = false;
+
+        CopyEvents(*ring, 0, events);
+
+        for (const auto& event : events) {
+            // Complete events, timestamps in microseconds
+            file << ",\n{\"name\":";
+            WriteJsonString(file, event.name);
+            std::snprintf(buf, sizeof(buf), ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                ring->id, event.begin / 1e3, (event.end - event.begin) / 1e3);
+            file << buf;
+        }
+    }
+
+    file << "\n]}\n";
+
+    return file.good();
+}
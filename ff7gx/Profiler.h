@@ -0,0 +1,158 @@
+#pragma once
+
+#include "Common.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Measures how long scopes take on every thread, to see where the CPU time of a frame goes.
+//
+// Each thread records into its own fixed-size ring, so recording takes no locks and never
+// allocates after a thread's first scope. When a ring is full the oldest events are overwritten.
+// EndFrame() sums up the render thread's events of the frame per scope, and WriteChromeTrace()
+// writes what's left in the rings as Chrome trace_event JSON, for chrome://tracing or Perfetto.
+//
+// Scope names must be string literals or otherwise live as long as the profiler.
+class Profiler
+{
+public:
+    struct Event
+    {
+        const char* name;
+        u64 begin;      // Nanoseconds since the profiler was created
+        u64 end;
+        u32 depth;      // Number of scopes this one is nested in
+    };
+
+    // One scope of the last frame, or of every frame so far
+    struct ScopeStats
+    {
+        const char* name;
+        u32 depth;
+        u64 calls;
+        u64 totalNs;
+        u64 maxNs;
+    };
+
+    struct Stats
+    {
+        u64 frames;
+        u64 events;         // Recorded by every thread
+        u64 overwritten;    // Events of the render thread overwritten before EndFrame() saw them
+        u64 lastFrameNs;
+    };
+
+    // eventsPerThread is rounded up to a power of two
+    explicit Profiler(std::size_t eventsPerThread);
+    ~Profiler() = default;
+
+    Profiler(Profiler&) = delete;
+    Profiler(Profiler&&) = delete;
+
+    u64 Now() const
+    {
+        return static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - m_start).count());
+    }
+
+    // Used by ProfileScope
+    void EnterScope();
+    void LeaveScope(const char* name, u64 begin);
+
+    // Sums up the events recorded by the calling thread since the last call
+    void EndFrame();
+
+    // Scopes of the last frame and of every frame so far, outermost first
+    const std::vector<ScopeStats>& GetFrameStats() const
+    {
+        return m_frameStats;
+    }
+
+    const std::vector<ScopeStats>& GetTotalStats() const
+    {
+        return m_totalStats;
+    }
+
+    Stats GetStats() const;
+
+    // Can be called while other threads are recording
+    bool WriteChromeTrace(const std::string& path) const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct ThreadRing
+    {
+        explicit ThreadRing(std::size_t size, u32 id);
+
+        std::vector<Event> events;
+        std::atomic<u64> written;
+        u32 depth;
+        u32 id;
+    };
+
+    ThreadRing* RegisterThread();
+
+    // Copies the events of a ring that haven't been overwritten yet
+    void CopyEvents(const ThreadRing& ring, u64 from, std::vector<Event>& events) const;
+
+    static void AddScope(std::vector<ScopeStats>& stats, const char* name, u32 depth, u64 calls, u64 totalNs, u64 maxNs);
+
+    const Clock::time_point m_start;
+    const std::size_t m_ringSize;
+
+    // Tells profilers allocated at the same address apart, see RegisterThread()
+    const u64 m_instance;
+
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<ThreadRing>> m_rings;
+
+    // Only touched by the thread calling EndFrame()
+    u64 m_frameStart;
+    u64 m_frameStartTime;
+    std::vector<Event> m_frameEvents;
+    std::vector<ScopeStats> m_frameStats;
+    std::vector<ScopeStats> m_totalStats;
+    u64 m_frames;
+    u64 m_overwritten;
+    u64 m_lastFrameNs;
+};
+
+// The profiler used by ProfileScope, or null if profiling is disabled
+Profiler* GetProfiler();
+void SetProfiler(Profiler* profiler);
+
+// Records the time between its construction and destruction. Only checks for a null pointer
+// when profiling is disabled.
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char* name) :
+        m_profiler(GetProfiler()),
+        m_name(name),
+        m_begin(0)
+    {
+        if (m_profiler) {
+            m_profiler->EnterScope();
+            m_begin = m_profiler->Now();
+        }
+    }
+
+    ~ProfileScope()
+    {
+        if (m_profiler) {
+            m_profiler->LeaveScope(m_name, m_begin);
+        }
+    }
+
+    ProfileScope(ProfileScope&) = delete;
+    ProfileScope(ProfileScope&&) = delete;
+
+private:
+    Profiler* const m_profiler;
+    const char* const m_name;
+    u64 m_begin;
+};
@@ -0,0 +1,130 @@
+#include "stdafx.h"
+
+#include "QualityController.h"
+
+#include <algorithm>
+
+std::vector<QualityLevel> QualityLevel::MakeLevels(const QualityLevel& best)
+{
+    // Built from the best down, then reversed
+    std::vector<QualityLevel> levels;
+    QualityLevel level = best;
+    levels.push_back(level);
+
+    if (!level.singlePassLayers) {
+        level.singlePassLayers = true;
+        levels.push_back(level);
+    }
+
+    for (auto filter = level.filters.rbegin(); filter != level.filters.rend(); ++filter) {
+        if (*filter == UpscaleChain::Filter::SuperXBR) {
+            *filter = UpscaleChain::Filter::Bilinear;
+            levels.push_back(level);
+        }
+    }
+
+    while (!level.filters.empty()) {
+        level.filters.pop_back();
+        levels.push_back(level);
+    }
+
+    while (level.internalScale > 1) {
+        level.internalScale--;
+        levels.push_back(level);
+    }
+
+    std::reverse(levels.begin(), levels.end());
+    return levels;
+}
+
+QualityController::Params QualityController::GetDefaultParams(u32 targetMicroseconds)
+{
+    Params params;
+    params.targetMicroseconds = targetMicroseconds;
+    params.windowFrames = 15;
+    params.downPercent = 100;
+    params.upPercent = 75;
+    params.downWindows = 2;
+    params.upWindows = 2;
+    params.maxUpWindows = 64;
+    return params;
+}
+
+QualityController::QualityController(const Params& params, u32 levelCount, u32 level) :
+    m_params(params),
+    m_level(std::min(level, levelCount - 1)),
+    m_upWindows(levelCount, params.upWindows),
+    m_windowFrames(0),
+    m_windowSlow(0),
+    m_windowFast(0),
+    m_slowWindows(0),
+    m_fastWindows(0),
+    m_stats{}
+{
+    m_params.windowFrames = std::max(m_params.windowFrames, 1u);
+    m_params.downWindows = std::max(m_params.downWindows, 1u);
+    m_params.upWindows = std::max(m_params.upWindows, 1u);
+    m_params.maxUpWindows = std::max(m_params.maxUpWindows, m_params.upWindows);
+}
+
+bool QualityController::AddFrame(u32 microseconds)
+{
+    const u64 time = static_cast<u64>(microseconds) * 100;
+    const u64 target = m_params.targetMicroseconds;
+
+    m_stats.frames++;
+    m_stats.slowFrames += microseconds > m_params.targetMicroseconds;
+
+    m_windowFrames++;
+    m_windowSlow += time > target * m_params.downPercent;
+    m_windowFast += time < target * m_params.upPercent;
+
+    if (m_windowFrames < m_params.windowFrames) {
+        return false;
+    }
+
+    const bool changed = EndWindow();
+
+    m_windowFrames = 0;
+    m_windowSlow = 0;
+    m_windowFast = 0;
+
+    return changed;
+}
+
+bool QualityController::EndWindow()
+{
+    m_stats.windows++;
+
+    // The median frame is slow
+    if (m_windowSlow * 2 > m_windowFrames) {
+        m_fastWindows = 0;
+
+        if (m_level == 0 || ++m_slowWindows < m_params.downWindows) {
+            return false;
+        }
+
+        m_slowWindows = 0;
+        m_upWindows[m_level] = std::min(m_upWindows[m_level] * 2, m_params.maxUpWindows);
+        m_level--;
+        m_stats.stepsDown++;
+        return true;
+    }
+
+    m_slowWindows = 0;
+
+    // 7 frames in 8 have room, so the next level has some even if it takes a third longer
+    if (m_windowFast * 8 < m_windowFrames * 7) {
+        m_fastWindows = 0;
+        return false;
+    }
+
+    if (m_level + 1 >= m_upWindows.size() || ++m_fastWindows < m_upWindows[m_level + 1]) {
+        return false;
+    }
+
+    m_fastWindows = 0;
+    m_level++;
+    m_stats.stepsUp++;
+    return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "Common.h"
+#include "UpscaleChain.h"
+
+#include <vector>
+
+// What the background is drawn with at one step of DynamicQuality
+struct QualityLevel
+{
+    u32 internalScale;
+    std::vector<UpscaleChain::Filter> filters;
+    bool singlePassLayers;
+
+    // Levels from the cheapest to best, the configured one. Each is one change cheaper than the
+    // next: compositing the layers in a single pass, then super-xBR steps turned into bilinear ones
+    // from the last, then steps dropped from the last, then a smaller internal scale.
+    static std::vector<QualityLevel> MakeLevels(const QualityLevel& best);
+};
+
+// Picks the quality level to draw at from the time frames take, to hold a target frame time.
+// Levels are numbered from the cheapest, 0. Frames are looked at in windows: consecutive windows
+// whose median frame is over the target step down a level, and consecutive windows with nearly
+// every frame well under it step up a level. A few slow frames, like one loading a field or the
+// first one of a level creating its textures, change nothing.
+//
+// Every step down from a level doubles the windows needed to step up to it again, so a level that
+// can't hold the target isn't retried every few seconds.
+//
+// Frame times are passed in and only integers are used, so the same frame times always give the
+// same levels.
+class QualityController
+{
+public:
+    struct Params
+    {
+        u32 targetMicroseconds;
+        u32 windowFrames;
+        u32 downPercent;    // Frames over this share of the target are slow
+        u32 upPercent;      // Frames under it leave room for the next level
+        u32 downWindows;    // Slow windows needed to step down
+        u32 upWindows;      // Windows with room needed to step up, before any step down
+        u32 maxUpWindows;
+    };
+
+    struct Stats
+    {
+        u64 frames;
+        u64 slowFrames;     // Over the target
+        u64 windows;
+        u64 stepsDown;
+        u64 stepsUp;
+    };
+
+    static Params GetDefaultParams(u32 targetMicroseconds);
+
+    QualityController(const Params& params, u32 levelCount, u32 level);
+    ~QualityController() = default;
+
+    // Adds the time a frame took. Returns true if the level changed, starting with the next frame.
+    bool AddFrame(u32 microseconds);
+
+    u32 GetLevel() const
+    {
+        return m_level;
+    }
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    // Decides on a full window, returns true if the level changed
+    bool EndWindow();
+
+    Params m_params;
+    u32 m_level;
+
+    // Indexed by level, the windows with room needed below it to step up to it
+    std::vector<u32> m_upWindows;
+
+    u32 m_windowFrames;
+    u32 m_windowSlow;       // Frames of the window over downPercent
+    u32 m_windowFast;       // Under upPercent
+    u32 m_slowWindows;      // Consecutive windows with a slow median
+    u32 m_fastWindows;      // Consecutive windows with room
+
+    Stats m_stats;
+};
@@ -1,12 +1,20 @@
 #include "stdafx.h"
 #include "Renderer.h"
 
+#include "BackgroundCache.h"
+#include "BackgroundDump.h"
+#include "Config.h"
+#include "D3DHooks.h"
 #include "Game.h"
+#include "ImagePack.h"
+#include "LayerComposite.h"
+#include "Log.h"
 #include "Module.h"
 #include "ScopedD3DEvent.h"
+#include "StateSet.h"
+#include "SuperXBR.h"
 
 #include <assert.h>
-#include <array>
 #include <d3dcommon.h>
 #include <DirectXMath.h>
 #include <functional>
@@ -15,10 +23,18 @@
 #include <vector>
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 
 #include "Generated/Background_PS.h"
+#include "Generated/BackgroundComposite_PS.h"
 #include "Generated/BackgroundLayer_PS.h"
 #include "Generated/Background_VS.h"
+#include "Generated/SuperXBR_Pass0_PS.h"
+#include "Generated/SuperXBR_Pass0_VS.h"
+#include "Generated/SuperXBR_Pass1_PS.h"
+#include "Generated/SuperXBR_Pass1_VS.h"
+#include "Generated/UpscaleBilinear_PS.h"
 
 #define VERIFY(hr) assert(SUCCEEDED((hr)))
 
@@ -34,10 +50,31 @@ struct MethodWrapper
     template<RendererMethodPtr<TResult, TArgs...> Method>
     static TResult __cdecl Func(TArgs... args)
     {
-        return (static_cast<Renderer*>(FF7::GetGfxFunctions()->rendererInstance)->*Method)(args...);
+        return (Renderer::GetInstance()->*Method)(args...);
     }
 };
 
+// The quads drawn by the upscale chain are already in clip space
+struct UpscaleVertex
+{
+    float x, y, z;
+    D3DCOLOR color;
+    float u, v;
+};
+
+static const DWORD UPSCALE_VERTEX_FVF = D3DFVF_XYZ | D3DFVF_DIFFUSE | D3DFVF_TEX1;
+
+// Pooled textures no plan requests are kept this many plans, in case the next one needs them again
+static const u32 TEXTURE_POOL_IDLE_PLANS = 2;
+
+// The original Reset(), called by Renderer::ResetHook()
+using ResetFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, D3DPRESENT_PARAMETERS*);
+static ResetFunc g_reset;
+
+// The original SetTexture(), called by Renderer::SetTextureHook()
+using SetTextureFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, DWORD, IDirect3DBaseTexture9*);
+static SetTextureFunc g_setTexture;
+
 // Sets the name of a D3D9 resource, visible in a graphics debugger
 static void SetD3DResourceName(IDirect3DResource9* resource, const char* name)
 {
@@ -49,8 +86,8 @@ void Renderer::InitViewport()
     // The game sets the viewport min and max Z to 0.0f and 1.0f
     m_viewport.X = 0;
     m_viewport.Y = 0;
-    m_viewport.Width = 320;
-    m_viewport.Height = 240;
+    m_viewport.Width = m_backgroundWidth;
+    m_viewport.Height = m_backgroundHeight;
     m_viewport.MinZ = 0.0f;
     m_viewport.MaxZ = 1.0f;
 }
@@ -58,198 +95,911 @@ void Renderer::InitViewport()
 void Renderer::InitProjectionMatrix()
 {
     // Take the D3D9 pixel center offset into account when computing the projection matrix.
-    auto matrix = XMMatrixOrthographicOffCenterLH(0.5f, 320.5f, 240.5, 0.5f, 0.0f, 1.0f);
+    const float width = static_cast<float>(m_backgroundWidth);
+    const float height = static_cast<float>(m_backgroundHeight);
+    auto matrix = XMMatrixOrthographicOffCenterLH(0.5f, width + 0.5f, height + 0.5f, 0.5f, 0.0f, 1.0f);
     XMStoreFloat4x4(reinterpret_cast<XMFLOAT4X4*>(&m_projectionMatrix), matrix);
 }
 
-void Renderer::DrawLayers()
+void Renderer::InitStateBlock()
 {
-    m_stateBlock->Capture();
+    if (GetConfig().restoreAllStates) {
+        VERIFY(m_d3dDevice->CreateStateBlock(D3DSBT_ALL, &m_stateBlock));
+        return;
+    }
+
+    StateSet states;
+    BackgroundRenderer::GetPassStates(states, m_upscaleChain != nullptr);
+
+    // A recorded state block captures and applies only the states set while recording it. The values don't
+    // matter since Capture() replaces them, they only have to be valid.
+    const float zeros[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    const RECT scissor = { 0, 0, static_cast<LONG>(m_backgroundWidth), static_cast<LONG>(m_backgroundHeight) };
+
+    VERIFY(m_d3dDevice->BeginStateBlock());
+
+    for (const auto& state : states.GetStates()) {
+        switch (state.kind) {
+        case StateSet::Kind::RenderState:
+            // FALSE is valid for every render state in the set except the cull mode
+            m_d3dDevice->SetRenderState(static_cast<D3DRENDERSTATETYPE>(state.index),
+                state.index == D3DRS_CULLMODE ? D3DCULL_NONE : FALSE);
+            break;
+        case StateSet::Kind::SamplerState:
+            // D3DTEXF_POINT and D3DTADDRESS_WRAP are both 1
+            m_d3dDevice->SetSamplerState(state.index, static_cast<D3DSAMPLERSTATETYPE>(state.type), 1);
+            break;
+        case StateSet::Kind::Texture:
+            m_d3dDevice->SetTexture(state.index, nullptr);
+            break;
+        case StateSet::Kind::VertexShader:
+            m_d3dDevice->SetVertexShader(nullptr);
+            break;
+        case StateSet::Kind::PixelShader:
+            m_d3dDevice->SetPixelShader(nullptr);
+            break;
+        case StateSet::Kind::PixelShaderConstant:
+            m_d3dDevice->SetPixelShaderConstantF(state.index, zeros, 1);
+            break;
+        case StateSet::Kind::VertexShaderConstant:
+            m_d3dDevice->SetVertexShaderConstantF(state.index, zeros, 1);
+            break;
+        case StateSet::Kind::VertexDeclaration:
+            m_d3dDevice->SetFVF(UPSCALE_VERTEX_FVF);
+            break;
+        case StateSet::Kind::Transform:
+            m_d3dDevice->SetTransform(static_cast<D3DTRANSFORMSTATETYPE>(state.index), &m_projectionMatrix);
+            break;
+        case StateSet::Kind::Viewport:
+            m_d3dDevice->SetViewport(&m_viewport);
+            break;
+        case StateSet::Kind::ScissorRect:
+            m_d3dDevice->SetScissorRect(&scissor);
+            break;
+        }
+    }
+
+    VERIFY(m_d3dDevice->EndStateBlock(&m_stateBlock));
+}
+
+void Renderer::InitUpscaleChain(u32 maxSize)
+{
+    const auto& text = GetConfig().upscaleChain;
+
+    std::vector<UpscaleChain::Filter> filters;
+    if (!UpscaleChain::Parse(text, filters)) {
+        LogWarning("Invalid UpscaleChain \"%s\", upscaling on the GPU is disabled", text);
+        return;
+    }
+
+    if (filters.empty()) {
+        return;
+    }
+
+    auto chain = std::make_unique<UpscaleChain>(m_backgroundWidth, m_backgroundHeight, filters, maxSize);
+    if (chain->GetSteps() < filters.size()) {
+        LogWarning("Only %u of the %u upscale steps fit in %ux%u textures", chain->GetSteps(),
+            static_cast<u32>(filters.size()), maxSize, maxSize);
+    }
+
+    if (chain->GetSteps() == 0) {
+        return;
+    }
+
+    m_upscaleChain = std::move(chain);
+
+    VERIFY(m_d3dDevice->CreatePixelShader(reinterpret_cast<const DWORD*>(SuperXBR_Pass0_PS), &m_superXBRPass0PS));
+    VERIFY(m_d3dDevice->CreatePixelShader(reinterpret_cast<const DWORD*>(SuperXBR_Pass1_PS), &m_superXBRPass1PS));
+    VERIFY(m_d3dDevice->CreatePixelShader(reinterpret_cast<const DWORD*>(UpscaleBilinear_PS), &m_upscaleBilinearPS));
+    VERIFY(m_d3dDevice->CreateVertexShader(reinterpret_cast<const DWORD*>(SuperXBR_Pass0_VS), &m_superXBRPass0VS));
+    VERIFY(m_d3dDevice->CreateVertexShader(reinterpret_cast<const DWORD*>(SuperXBR_Pass1_VS), &m_superXBRPass1VS));
+
+    DebugLog("Upscale chain: %u passes, %u targets, %u KiB", static_cast<u32>(m_upscaleChain->GetPasses().size()),
+        static_cast<u32>(m_upscaleChain->GetTargets().size()),
+        static_cast<u32>(m_upscaleChain->GetTargetBytes() / 1024));
+}
+
+IDirect3DTexture9* Renderer::RunUpscaleChain(const DirtyRects& dirty)
+{
+    ScopedD3DEvent _(L"UpscaleChain");
+    ProfileScope _profile("UpscaleChain");
+
+    const auto getTexture = [this](u32 target) {
+        return GetPooledTexture(target == UpscaleChain::SOURCE ? m_backgroundHandle : m_upscaleHandles[target]);
+    };
+
+    // The shaders take clip space positions, so the matrix is the identity
+    const float identity[16] = {
+        1.0f, 0.0f, 0.0f, 0.0f,
+        0.0f, 1.0f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f,
+        0.0f, 0.0f, 0.0f, 1.0f
+    };
+
+    m_d3dDevice->SetVertexShaderConstantF(UpscaleChain::VS_MATRIX_REGISTER, identity, 4);
+    m_d3dDevice->SetFVF(UPSCALE_VERTEX_FVF);
+    m_d3dDevice->SetRenderState(D3DRS_ZENABLE, FALSE);
+    m_d3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
+    m_d3dDevice->SetRenderState(D3DRS_ALPHATESTENABLE, FALSE);
+    m_d3dDevice->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+
+    for (u32 stage = 0; stage < UpscaleChain::MAX_INPUTS; stage++) {
+        m_d3dDevice->SetSamplerState(stage, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+        m_d3dDevice->SetSamplerState(stage, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+    }
+
+    m_upscaleChain->GetDirtyRects(dirty, m_upscaleDirtyRects);
+
+    for (const auto& pass : m_upscaleChain->GetPasses()) {
+        // Nothing the pass reads changed, so its target already has what it would draw
+        const auto& rects = m_upscaleDirtyRects[pass.output];
+        if (rects.Empty()) {
+            continue;
+        }
+
+        // Also sets the viewport to the whole target
+        m_d3dDevice->SetRenderTarget(0, GetPooledSurface(m_upscaleHandles[pass.output]));
+
+        // super-xBR does its own filtering and expects to sample texel centers
+        const DWORD filter = (pass.shader == UpscaleChain::Shader::Bilinear) ? D3DTEXF_LINEAR : D3DTEXF_POINT;
+
+        for (u32 stage = 0; stage < UpscaleChain::MAX_INPUTS; stage++) {
+            m_d3dDevice->SetTexture(stage, stage < pass.inputCount ? getTexture(pass.inputs[stage]) : nullptr);
+            m_d3dDevice->SetSamplerState(stage, D3DSAMP_MINFILTER, filter);
+            m_d3dDevice->SetSamplerState(stage, D3DSAMP_MAGFILTER, filter);
+        }
+
+        switch (pass.shader) {
+        case UpscaleChain::Shader::SuperXBRPass0:
+            m_d3dDevice->SetVertexShader(m_superXBRPass0VS.Get());
+            m_d3dDevice->SetPixelShader(m_superXBRPass0PS.Get());
+            break;
+        case UpscaleChain::Shader::SuperXBRPass1:
+            m_d3dDevice->SetVertexShader(m_superXBRPass1VS.Get());
+            m_d3dDevice->SetPixelShader(m_superXBRPass1PS.Get());
+            break;
+        case UpscaleChain::Shader::Bilinear:
+            m_d3dDevice->SetVertexShader(m_superXBRPass1VS.Get());
+            m_d3dDevice->SetPixelShader(m_upscaleBilinearPS.Get());
+            break;
+        }
+
+        const float inputSize[UpscaleChain::INPUT_REGISTERS][4] = {
+            { static_cast<float>(pass.inputWidth), static_cast<float>(pass.inputHeight), 0.0f, 0.0f },
+            { static_cast<float>(pass.inputWidth), static_cast<float>(pass.inputHeight), 0.0f, 0.0f }
+        };
+
+        m_d3dDevice->SetVertexShaderConstantF(UpscaleChain::VS_INPUT_REGISTER, inputSize[0],
+            UpscaleChain::INPUT_REGISTERS);
+        m_d3dDevice->SetPixelShaderConstantF(UpscaleChain::PS_INPUT_REGISTER, inputSize[0],
+            UpscaleChain::INPUT_REGISTERS);
 
-    const std::array<u16, 6> indices{ {
-            3, 0, 2, 0, 1, 2
-        } };
+        // Offset by half a pixel so pixel centers land on texel centers
+        const float dx = 1.0f / pass.width;
+        const float dy = 1.0f / pass.height;
+        const UpscaleVertex quad[4] = {
+            { -1.0f - dx, 1.0f + dy, 0.0f, 0xffffffff, 0.0f, 0.0f },
+            { 1.0f - dx, 1.0f + dy, 0.0f, 0xffffffff, 1.0f, 0.0f },
+            { -1.0f - dx, -1.0f + dy, 0.0f, 0xffffffff, 0.0f, 1.0f },
+            { 1.0f - dx, -1.0f + dy, 0.0f, 0xffffffff, 1.0f, 1.0f }
+        };
+
+        // Without PartialUpscale every pass draws its whole target
+        const bool whole = rects.GetArea() == static_cast<u64>(pass.width) * pass.height;
+        m_d3dDevice->SetRenderState(D3DRS_SCISSORTESTENABLE, whole ? FALSE : TRUE);
+
+        if (whole) {
+            m_d3dDevice->DrawPrimitiveUP(D3DPT_TRIANGLESTRIP, 2, quad, sizeof(UpscaleVertex));
+            continue;
+        }
 
-    float width, height;
-    m_internals.GetRenderDimensions(&width, &height);
-    width /= 2.0f;
-    height /= 2.0f;
+        for (const auto& rect : rects.GetRects()) {
+            const RECT scissor = { rect.left, rect.top, rect.right, rect.bottom };
+            m_d3dDevice->SetScissorRect(&scissor);
+            m_d3dDevice->DrawPrimitiveUP(D3DPT_TRIANGLESTRIP, 2, quad, sizeof(UpscaleVertex));
+        }
+    }
+
+    // BackgroundRenderer sets the backbuffer again before drawing the layers
+    return getTexture(m_upscaleChain->GetOutput());
+}
+
+void Renderer::InitQualityController()
+{
+    // The upscaled background of the readback doesn't depend on the level
+    if (m_backgroundReadback) {
+        LogWarning("DynamicQuality is disabled with CpuUpscale, BackgroundPackPath and BackgroundDumpPath");
+        return;
+    }
+
+    QualityLevel best;
+    best.internalScale = m_backgroundWidth / 320;
+    best.singlePassLayers = GetConfig().singlePassLayers;
+
+    // Only the steps that fit. Lower levels only simplify or drop steps, so they need no other shaders.
+    if (m_upscaleChain) {
+        UpscaleChain::Parse(GetConfig().upscaleChain, best.filters);
+        best.filters.resize(m_upscaleChain->GetSteps());
+    }
 
-    std::vector<int> layers(m_layerDepths.cbegin(), m_layerDepths.cend());
-    std::sort(layers.begin(), layers.end());
+    m_qualityLevels = QualityLevel::MakeLevels(best);
 
-    auto oldVS = m_internals.GetTlmainVS();
+    const auto params = QualityController::GetDefaultParams(GetConfig().targetFrameTime);
+    const u32 levelCount = static_cast<u32>(m_qualityLevels.size());
+    m_qualityController = std::make_unique<QualityController>(params, levelCount, levelCount - 1);
+
+    DebugLog("Dynamic quality: %u levels, targeting %u us per frame", levelCount, GetConfig().targetFrameTime);
+}
+
+void Renderer::ApplyQualityLevel(const QualityLevel& level)
+{
+    m_backgroundWidth = 320 * level.internalScale;
+    m_backgroundHeight = 240 * level.internalScale;
+    m_background.SetTileScale(0.5f * level.internalScale);
+    m_background.SetSinglePassLayers(level.singlePassLayers);
+
+    m_upscaleChain.reset();
+    if (!level.filters.empty()) {
+        m_upscaleChain = std::make_unique<UpscaleChain>(m_backgroundWidth, m_backgroundHeight, level.filters,
+            m_maxTextureSize);
+    }
+
+    m_background.SetTrackDirtyRects(GetConfig().partialUpscale && m_upscaleChain);
+
+    InitViewport();
+    InitProjectionMatrix();
+
+    // The pool keeps the previous level's textures for a few plans, so stepping back creates nothing
+    PlanTextures();
+    if (!m_texturePool.Allocate()) {
+        LogError("Couldn't create the pooled textures");
+    }
+
+    // Even a target the pool kept holds the background of an earlier frame
+    m_layerTexture = nullptr;
+    m_upscaleChainValid = false;
+    m_background.InvalidateBackground();
+}
+
+void Renderer::UpdateQuality(std::chrono::steady_clock::time_point frameEnd)
+{
+    if (!m_frameStarted) {
+        return;
+    }
+
+    m_frameStarted = false;
+
+    const auto elapsed = frameEnd - m_frameStart;
+    const auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+
+    if (!m_qualityController->AddFrame(static_cast<u32>(std::min<long long>(microseconds, UINT32_MAX)))) {
+        return;
+    }
+
+    const u32 index = m_qualityController->GetLevel();
+    const auto& level = m_qualityLevels[index];
+    ApplyQualityLevel(level);
+
+    DebugLog("Quality level %u of %u: InternalScale %u, UpscaleChain \"%s\", %s layers", index,
+        static_cast<u32>(m_qualityLevels.size()), level.internalScale, UpscaleChain::Format(level.filters).c_str(),
+        level.singlePassLayers ? "single pass" : "multi pass");
+}
+
+void Renderer::UpdateLayerLookup(const LayerDepthSet& layers)
+{
+    D3DLOCKED_RECT rect;
+    auto texture = GetPooledTexture(m_layerLookupHandle);
+    VERIFY(texture->LockRect(0, &rect, nullptr, D3DLOCK_DISCARD));
+    LayerComposite::BuildLookup(layers, static_cast<u32*>(rect.pBits));
+    texture->UnlockRect(0);
+}
+
+bool Renderer::UpscaleBackground(const LayerDepthSet& layers)
+{
+    ScopedD3DEvent _(L"UpscaleBackground");
+    ProfileScope _profile("UpscaleBackground");
+
+    const u32 width = 320;
+    const u32 height = 240;
+
+    // This waits for the GPU to finish drawing the background, but the background has to be
+    // on the CPU to find it in the cache anyway
+    if (FAILED(m_d3dDevice->GetRenderTargetData(GetPooledSurface(m_backgroundHandle), m_backgroundReadback.Get()))) {
+        return false;
+    }
+
+    D3DLOCKED_RECT src;
+    if (FAILED(m_backgroundReadback->LockRect(&src, nullptr, D3DLOCK_READONLY))) {
+        return false;
+    }
+
+    m_backgroundPixels.resize(width * height);
+    for (u32 y = 0; y < height; y++) {
+        std::memcpy(&m_backgroundPixels[y * width], static_cast<const u8*>(src.pBits) + y * src.Pitch, width * sizeof(u32));
+    }
+
+    m_backgroundReadback->UnlockRect();
+
+    const u64 key = BackgroundCache::MakeKey(m_backgroundPixels.data(), width, height, layers);
+
+    const auto& dumpPath = GetConfig().backgroundDumpPath;
+    if (!dumpPath.empty() && key != m_lastDumpedKey) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "\\%016llx.bgd", static_cast<unsigned long long>(key));
+        WriteBackgroundDump(dumpPath + name, key, m_backgroundPixels.data(), width, height, layers);
+        m_lastDumpedKey = key;
+    }
+
+    // Prefer the pack, which is served straight from the mapped file
+    ImagePack::Image image;
+    if (!m_backgroundPack || !m_backgroundPack->Find(key, image)) {
+        if (!m_backgroundCache) {
+            return false;
+        }
+
+        auto entry = m_backgroundCache->Find(key);
+        if (!entry) {
+            std::vector<u32> upscaled(width * 2 * height * 2);
+            m_upscaler->Upscale(m_backgroundPixels.data(), width, height, upscaled.data());
+            entry = &m_backgroundCache->Insert(key, width * 2, height * 2, std::move(upscaled));
+        }
+
+        image.width = entry->width;
+        image.height = entry->height;
+        image.pixels = entry->pixels.data();
+    }
+
+    // Most frames draw the same background as the previous one, which is already uploaded
+    if (m_upscaledBackgroundValid && key == m_upscaledBackgroundKey) {
+        return true;
+    }
+
+    m_upscaledBackgroundValid = false;
+
+    if (image.width != width * 2 || image.height != height * 2) {
+        return false;
+    }
+
+    D3DLOCKED_RECT dst;
+    auto upscaledTexture = GetPooledTexture(m_upscaledBackgroundHandle);
+    if (FAILED(upscaledTexture->LockRect(0, &dst, nullptr, D3DLOCK_DISCARD))) {
+        return false;
+    }
+
+    for (u32 y = 0; y < image.height; y++) {
+        std::memcpy(static_cast<u8*>(dst.pBits) + y * dst.Pitch, &image.pixels[y * image.width], image.width * sizeof(u32));
+    }
+
+    upscaledTexture->UnlockRect(0);
+
+    m_upscaledBackgroundKey = key;
+    m_upscaledBackgroundValid = true;
+
+    return true;
+}
+
+void Renderer::CaptureState()
+{
+    m_stateBlock->Capture();
+}
+
+void Renderer::ApplyState()
+{
+    m_stateBlock->Apply();
+}
+
+void Renderer::SetRenderTarget(BackgroundRenderer::Target target)
+{
+    if (target == BackgroundRenderer::Target::Background) {
+        m_d3dDevice->SetRenderTarget(0, GetPooledSurface(m_backgroundHandle));
+    } else {
+        m_d3dDevice->SetRenderTarget(0, m_backbuffer.Get());
+    }
+}
+
+void Renderer::BeginPass(BackgroundRenderer::Pass pass, const LayerDepthSet& layers)
+{
+    // Draw() is stupid and sets the vertex shader on every call, so we need to swap out the original
+    // object OR rewrite the function.
+    m_passOldVS = m_internals.GetTlmainVS();
     m_internals.SetTlmainVS(m_backgroundVS.Get());
 
-    m_d3dDevice->SetRenderTarget(0, m_backbuffer.Get());
-    m_d3dDevice->SetTexture(0, m_backgroundTexture.Get());
-    m_d3dDevice->SetTexture(1, m_backgroundTexture.Get());
+    if (pass == BackgroundRenderer::Pass::Tiles) {
+        m_d3dDevice->SetTransform(D3DTS_PROJECTION, &m_projectionMatrix);
+        m_d3dDevice->SetViewport(&m_viewport);
+        m_d3dDevice->SetPixelShader(m_backgroundPS.Get());
+
+        // Depth writes have to be disabled to avoid interfering with other drawing done by the game
+        m_d3dDevice->SetRenderState(D3DRS_ZWRITEENABLE, FALSE);
+        m_d3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
+        return;
+    }
+
+    // Depth always comes from the original background, since upscaling doesn't preserve alpha
+    m_d3dDevice->SetTexture(0, m_layerTexture);
+    m_d3dDevice->SetTexture(1, GetPooledTexture(m_backgroundHandle));
     m_d3dDevice->SetSamplerState(1, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
     m_d3dDevice->SetPixelShader(m_backgroundLayerPS.Get());
     m_internals.SetTextureFilteringFlag(1);
     m_d3dDevice->SetRenderState(D3DRS_ZENABLE, TRUE);
     m_d3dDevice->SetRenderState(D3DRS_ZWRITEENABLE, FALSE);
 
-    for (auto it = layers.crbegin(); it != layers.crend(); it++) {
-        const float depth = static_cast<float>(*it / 255.0f);
-
-        const std::array<FF7::Vertex, 4> vertices{ {
-            {
-                width, 0.0f, depth, 1.0f,    // x, y, z, w
-                0xffffffff, 0.0f,           // color, unknown,
-                1.0f, 0.0f                  // u, v
-            },
-            {
-                width, height, depth, 1.0f,  // x, y, z, w
-                0xffffffff, 0.0f,           // color, unknown,
-                1.0f, 1.0f                  // u, v
-            },
-            {
-                0.0f, height, depth, 1.0f,   // x, y, z, w
-                0xffffffff, 0.0f,           // color, unknown,
-                0.0f, 1.0f                  // u, v
-            },
-            {
-                0.0f, 0.0f, depth, 1.0f,     // x, y, z, w
-                0xffffffff, 0.0f,           // color, unknown,
-                0.0f, 0.0f                  // u, v
-            }
-            } };
-
-        float psConstant[4] = { std::roundf(static_cast<float>(*it)), 0.0f, 0.0f, 0.0f };
-        m_d3dDevice->SetPixelShaderConstantF(0, psConstant, 1);
-        m_internals.Draw(D3DPT_TRIANGLELIST, FF7::DrawType::Ortho, vertices.data(), vertices.size(), indices.data(), indices.size(), 0, 0);
-    }
-
-    m_internals.SetTlmainVS(oldVS);
-    m_stateBlock->Apply();
+    if (pass == BackgroundRenderer::Pass::Composite) {
+        UpdateLayerLookup(layers);
+
+        m_d3dDevice->SetTexture(2, GetPooledTexture(m_layerLookupHandle));
+        m_d3dDevice->SetSamplerState(2, D3DSAMP_MINFILTER, D3DTEXF_POINT);
+        m_d3dDevice->SetSamplerState(2, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
+        m_d3dDevice->SetSamplerState(2, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+        m_d3dDevice->SetSamplerState(2, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+        m_d3dDevice->SetPixelShader(m_backgroundCompositePS.Get());
+    }
 }
 
-Renderer::Renderer(Module& module, FF7::GfxFunctions* functions) :
-    GfxContextBase(functions),
-    m_drawMode(DrawMode::Dialog),
-    m_originalDll(module),
-    m_internals(module)
+void Renderer::EndPass()
 {
-    m_d3dDevice.Attach(m_internals.GetD3DDevice());
+    // The vertex shader is a global in the game, not device state
+    m_internals.SetTlmainVS(m_passOldVS);
+}
 
+void Renderer::SetLayer(u32 layer)
+{
+    float psConstant[4] = { static_cast<float>(layer), 0.0f, 0.0f, 0.0f };
+    m_d3dDevice->SetPixelShaderConstantF(0, psConstant, 1);
+}
+
+void Renderer::PrepareLayers(const LayerDepthSet& layers, const DirtyRects& dirty)
+{
+    // Nothing was drawn to the background, so neither the readback nor the upscale chain would change anything
+    if (dirty.Empty() && m_layerTexture) {
+        return;
+    }
+
+    m_layerTexture = GetPooledTexture(m_backgroundHandle);
+
+    // Only the dirty part has to be upscaled if the chain ran for the previous background
+    const bool upscaleChainValid = m_upscaleChainValid;
+    m_upscaleChainValid = false;
+
+    if (layers.Empty()) {
+        return;
+    }
+
+    if (m_backgroundReadback && UpscaleBackground(layers)) {
+        m_layerTexture = GetPooledTexture(m_upscaledBackgroundHandle);
+    } else if (m_upscaleChain) {
+        if (upscaleChainValid) {
+            m_layerTexture = RunUpscaleChain(dirty);
+        } else {
+            DirtyRects all;
+            all.AddAll(m_backgroundWidth, m_backgroundHeight);
+            m_layerTexture = RunUpscaleChain(all);
+        }
+
+        m_upscaleChainValid = true;
+    }
+}
+
+void Renderer::Draw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+    const u16* indices, u32 indexCount)
+{
+    m_internals.Draw(static_cast<D3DPRIMITIVETYPE>(state.primType), state.drawType, vertices, vertexCount,
+        indices, indexCount, state.a7, state.scissor);
+}
+
+const void* Renderer::GetTexture()
+{
+    // Only used to tell textures apart, so the reference doesn't have to be kept
+    ComPtr<IDirect3DBaseTexture9> texture;
+    m_d3dDevice->GetTexture(0, &texture);
+    return texture.Get();
+}
+
+void Renderer::SetTexture(const void* texture)
+{
+    // Only called with textures the game bound earlier in the frame
+    m_d3dDevice->SetTexture(0, static_cast<IDirect3DBaseTexture9*>(const_cast<void*>(texture)));
+}
+
+u32 Renderer::ClearTarget(u32 clearRenderTarget, u32 clearDepthBuffer)
+{
+    return GfxContextBase::Clear(clearRenderTarget, clearDepthBuffer);
+}
+
+void Renderer::GetRenderDimensions(float* width, float* height)
+{
+    m_internals.GetRenderDimensions(width, height);
+}
+
+bool Renderer::CreateTexture(u32 slot, const TexturePool::Desc& desc)
+{
+    if (slot >= m_pooledTextures.size()) {
+        m_pooledTextures.resize(slot + 1);
+    }
+
+    auto& pooled = m_pooledTextures[slot];
+
+    if (FAILED(m_d3dDevice->CreateTexture(desc.width, desc.height, 1, desc.usage, static_cast<D3DFORMAT>(desc.format),
+        D3DPOOL_DEFAULT, &pooled.texture, nullptr))) {
+        LogError("Couldn't create a %ux%u texture with format %u and usage %u", desc.width, desc.height,
+            desc.format, desc.usage);
+        return false;
+    }
+
+    SetD3DResourceName(pooled.texture.Get(), "PooledTexture");
+
+    if (desc.usage & D3DUSAGE_RENDERTARGET) {
+        VERIFY(pooled.texture->GetSurfaceLevel(0, &pooled.surface));
+        SetD3DResourceName(pooled.surface.Get(), "PooledRenderTarget");
+    }
+
+    return true;
+}
+
+void Renderer::ReleaseTexture(u32 slot)
+{
+    m_pooledTextures[slot] = PooledTexture();
+}
+
+HRESULT STDMETHODCALLTYPE Renderer::ResetHook(IDirect3DDevice9* device, D3DPRESENT_PARAMETERS* parameters)
+{
+    // Reset() fails while D3DPOOL_DEFAULT resources or state blocks are alive
+    auto renderer = GetInstance();
+    renderer->ReleaseDeviceResources();
+
+    const HRESULT result = g_reset(device, parameters);
+    if (SUCCEEDED(result)) {
+        renderer->CreateDeviceResources();
+    }
+
+    return result;
+}
+
+HRESULT STDMETHODCALLTYPE Renderer::SetTextureHook(IDirect3DDevice9* device, DWORD stage,
+    IDirect3DBaseTexture9* texture)
+{
+    // Queued tiles are drawn with the bound texture, so the game's next one mustn't replace theirs
+    if (stage == 0) {
+        GetInstance()->m_background.BeforeSetTexture(texture);
+    }
+
+    return g_setTexture(device, stage, texture);
+}
+
+void Renderer::ReleaseDeviceResources()
+{
+    m_texturePool.ReleaseAll();
+    m_stateBlock.Reset();
+    m_backbuffer.Reset();
+    m_layerTexture = nullptr;
+    m_upscaleChainValid = false;
+}
+
+void Renderer::CreateDeviceResources()
+{
     // 3D models etc. are drawn directly to the backbuffer, so save it here to avoid
     // having to call GetRenderTarget() before switcing render targets
     VERIFY(m_d3dDevice->GetBackBuffer(0, 0, D3DBACKBUFFER_TYPE_MONO, &m_backbuffer));
     SetD3DResourceName(m_backbuffer.Get(), "Backbuffer");
 
-    // The backgrounds are drawn at ~320x240
-    VERIFY(m_d3dDevice->CreateTexture(320, 240, 1, D3DUSAGE_RENDERTARGET, D3DFMT_A8R8G8B8,
-        D3DPOOL_DEFAULT, &m_backgroundTexture, nullptr));
-    SetD3DResourceName(m_backgroundTexture.Get(), "BackgroundTexture");
+    if (!m_texturePool.Allocate()) {
+        LogError("Couldn't create the pooled textures");
+    }
+
+    // A recreated texture has lost its contents
+    if (m_backgroundReadback && m_texturePool.IsNew(m_upscaledBackgroundHandle)) {
+        m_upscaledBackgroundValid = false;
+    }
+
+    if (m_texturePool.IsNew(m_backgroundHandle)) {
+        m_background.InvalidateBackground();
+    }
+
+    InitStateBlock();
+}
+
+void Renderer::PlanTextures()
+{
+    // The passes of a frame: the tiles, the passes of the upscale chain, then the layers
+    const u32 tilesPass = 0;
+    const u32 chainPasses = m_upscaleChain ? static_cast<u32>(m_upscaleChain->GetPasses().size()) : 0;
+    const u32 layersPass = chainPasses + 1;
+
+    m_texturePool.BeginPlan();
+
+    m_backgroundHandle = m_texturePool.Request(
+        { m_backgroundWidth, m_backgroundHeight, D3DFMT_A8R8G8B8, D3DUSAGE_RENDERTARGET }, tilesPass, layersPass);
+    m_layerLookupHandle = m_texturePool.Request(
+        { LayerComposite::LOOKUP_SIZE, 1, D3DFMT_A8R8G8B8, D3DUSAGE_DYNAMIC }, layersPass, layersPass);
+
+    // Kept for the whole frame, so it's never shared and the upscaled background stays in it from frame to frame
+    if (m_backgroundReadback) {
+        m_upscaledBackgroundHandle = m_texturePool.Request(
+            { 640, 480, D3DFMT_A8R8G8B8, D3DUSAGE_DYNAMIC }, tilesPass, layersPass);
+    }
+
+    m_upscaleHandles.clear();
+
+    if (m_upscaleChain) {
+        const auto& targets = m_upscaleChain->GetTargets();
+
+        // Target i is written by chain pass i. When unchanged backgrounds are skipped, the output is
+        // kept for the whole frame like the upscaled background, so it's still there in the next frame.
+        // PartialUpscale keeps every target, since passes only draw over part of them.
+        for (u32 i = 0; i < targets.size(); i++) {
+            const bool keep = GetConfig().partialUpscale ||
+                (GetConfig().skipUnchangedBackgrounds && i == m_upscaleChain->GetOutput());
+
+            m_upscaleHandles.push_back(m_texturePool.Request(
+                { targets[i].width, targets[i].height, D3DFMT_A8R8G8B8, D3DUSAGE_RENDERTARGET },
+                keep ? tilesPass : tilesPass + 1 + i, tilesPass + 1 + m_upscaleChain->GetLastRead(i)));
+        }
+    }
+}
+
+Renderer::Renderer(Module& module, FF7::GfxFunctions* functions) :
+    GfxContext(functions),
+    m_background(*this, GetConfig().singlePassLayers),
+    m_layerTexture(nullptr),
+    m_backgroundWidth(320),
+    m_backgroundHeight(240),
+    m_upscaleChainValid(false),
+    m_maxTextureSize(0),
+    m_frameStarted(false),
+    m_passOldVS(nullptr),
+    m_upscaledBackgroundKey(0),
+    m_upscaledBackgroundValid(false),
+    m_lastDumpedKey(0),
+    m_originalDll(module),
+    m_internals(module),
+    m_texturePool(*this, TEXTURE_POOL_IDLE_PLANS),
+    m_backgroundHandle(0),
+    m_layerLookupHandle(0),
+    m_upscaledBackgroundHandle(0)
+{
+    m_d3dDevice.Attach(m_internals.GetD3DDevice());
+
+    // D3DPERF_GetStatus() is nonzero if PIX or a similar tool is attached, and apitrace records the events too
+    SetD3DEventsEnabled(GetConfig().d3dEvents || GetConfig().loadApitrace || D3DPERF_GetStatus() != 0);
+
+    D3DCAPS9 caps;
+    VERIFY(m_d3dDevice->GetDeviceCaps(&caps));
+    const u32 maxTextureSize = std::min(caps.MaxTextureWidth, caps.MaxTextureHeight);
+    m_maxTextureSize = maxTextureSize;
+
+    // The backgrounds are drawn at ~320x240, or a multiple of it for more detail
+    const u32 internalScale = std::max(1u, std::min(GetConfig().internalScale, maxTextureSize / 320));
+    if (internalScale != GetConfig().internalScale) {
+        LogWarning("InternalScale %u is not supported, using %u", GetConfig().internalScale, internalScale);
+    }
+
+    m_backgroundWidth = 320 * internalScale;
+    m_backgroundHeight = 240 * internalScale;
+    m_background.SetTileScale(0.5f * internalScale);
+    m_background.SetSkipUnchanged(GetConfig().skipUnchangedBackgrounds);
+
+    const auto& packPath = GetConfig().backgroundPackPath;
+    if (!packPath.empty()) {
+        m_backgroundPack = std::make_unique<ImagePackReader>();
+        if (!m_backgroundPack->Open(packPath.c_str(), ImagePack::Contents::Backgrounds)) {
+            m_backgroundPack.reset();
+        }
+    }
+
+    // Readback and the CPU upscaler work on 320x240 backgrounds only
+    const bool readback = GetConfig().cpuUpscale || m_backgroundPack || !GetConfig().backgroundDumpPath.empty();
+    if (readback && internalScale != 1) {
+        LogWarning("CpuUpscale, BackgroundPackPath and BackgroundDumpPath are disabled when InternalScale isn't 1");
+    }
+
+    if (readback && internalScale == 1) {
+        VERIFY(m_d3dDevice->CreateOffscreenPlainSurface(320, 240, D3DFMT_A8R8G8B8, D3DPOOL_SYSTEMMEM,
+            &m_backgroundReadback, nullptr));
+        SetD3DResourceName(m_backgroundReadback.Get(), "BackgroundReadback");
+    }
+
+    if (!GetConfig().backgroundDumpPath.empty()) {
+        CreateDirectoryA(GetConfig().backgroundDumpPath.c_str(), nullptr);
+    }
+
+    if (GetConfig().cpuUpscale && m_backgroundReadback) {
+        const auto& cachePath = GetConfig().backgroundCachePath;
+        if (!cachePath.empty()) {
+            CreateDirectoryA(cachePath.c_str(), nullptr);
+        }
+
+        m_upscaler = std::make_unique<SuperXBR>();
+        m_backgroundCache = std::make_unique<BackgroundCache>(
+            static_cast<std::size_t>(GetConfig().backgroundCacheSize) * 1024 * 1024, cachePath);
+    }
+
+    if (GetConfig().filterStateChanges) {
+        m_stateFilter = std::make_unique<StateFilter>(m_d3dDevice.Get());
+    }
+
+    // Hooked before TextureReplacer, so this sees the replacements that GetTexture() returns
+    g_setTexture = reinterpret_cast<SetTextureFunc>(D3DHooks::HookMethod(m_d3dDevice.Get(),
+        D3DHooks::DeviceMethod::SetTexture, reinterpret_cast<const void*>(&SetTextureHook)));
+
+    if (!GetConfig().texturePackPath.empty() || !GetConfig().textureDumpPath.empty()) {
+        m_textureReplacer = std::make_unique<TextureReplacer>(m_d3dDevice.Get(), GetConfig().texturePackPath,
+            GetConfig().textureDumpPath, GetConfig().textureDecodeThreads);
+    }
+
+    if (!GetConfig().tracePath.empty()) {
+        m_traceRecorder = std::make_unique<TraceRecorder>(GetConfig().tracePath,
+            static_cast<std::size_t>(GetConfig().traceBufferSize) * 1024 * 1024);
 
-    VERIFY(m_backgroundTexture->GetSurfaceLevel(0, &m_backgroundRenderTarget));
-    SetD3DResourceName(m_backgroundRenderTarget.Get(), "BackgroundRenderTarget");
+        if (m_traceRecorder->IsOpen()) {
+            SetTraceRecorder(m_traceRecorder.get());
+        } else {
+            m_traceRecorder.reset();
+        }
+    }
 
-    VERIFY(m_d3dDevice->CreateStateBlock(D3DSBT_ALL, &m_stateBlock));
+    if (!GetConfig().profilePath.empty()) {
+        m_profiler = std::make_unique<Profiler>(
+            static_cast<std::size_t>(GetConfig().profileBufferSize) * 1024 * 1024 / sizeof(Profiler::Event));
+        SetProfiler(m_profiler.get());
+    }
 
     VERIFY(m_d3dDevice->CreatePixelShader(reinterpret_cast<const DWORD*>(Background_PS), &m_backgroundPS));
     VERIFY(m_d3dDevice->CreatePixelShader(reinterpret_cast<const DWORD*>(BackgroundLayer_PS), &m_backgroundLayerPS));
+    VERIFY(m_d3dDevice->CreatePixelShader(reinterpret_cast<const DWORD*>(BackgroundComposite_PS), &m_backgroundCompositePS));
     VERIFY(m_d3dDevice->CreateVertexShader(reinterpret_cast<const DWORD*>(Background_VS), &m_backgroundVS));
 
+    InitUpscaleChain(maxTextureSize);
+
+    if (GetConfig().partialUpscale && !m_upscaleChain) {
+        LogWarning("PartialUpscale needs an UpscaleChain");
+    }
+
+    m_background.SetTrackDirtyRects(GetConfig().partialUpscale && m_upscaleChain);
+
+    if (GetConfig().dynamicQuality) {
+        InitQualityController();
+    }
+
     InitViewport();
     InitProjectionMatrix();
 
+    PlanTextures();
+    CreateDeviceResources();
+
+    // Hooked after StateFilter, which is unhooked after this
+    g_reset = reinterpret_cast<ResetFunc>(D3DHooks::HookMethod(m_d3dDevice.Get(), D3DHooks::DeviceMethod::Reset,
+        reinterpret_cast<const void*>(&ResetHook)));
+
     // Patch DrawTilesImpl to call DrawHook to transform vertices before drawing them
     auto drawHook =
         &MethodWrapper<void, D3DPRIMITIVETYPE, u32, const FF7::Vertex*, u32, const u16*, u32, u32, u32>::Func<&Renderer::DrawHook>;
     m_originalDll.PatchCall(FF7::Offsets::TileDrawCall, static_cast<const void*>(drawHook));
+
+    // Only traces, profiles and D3D events need to see the calls the renderer doesn't override
+    if (!m_traceRecorder && !m_profiler && !AreD3DEventsEnabled()) {
+        BypassUnhookedSlots();
+    }
+}
+
+Renderer::~Renderer()
+{
+    D3DHooks::HookMethod(m_d3dDevice.Get(), D3DHooks::DeviceMethod::Reset, reinterpret_cast<const void*>(g_reset));
+
+    // TextureReplacer's SetTexture() hook was installed after this one's, so it's removed first
+    m_textureReplacer.reset();
+    D3DHooks::HookMethod(m_d3dDevice.Get(), D3DHooks::DeviceMethod::SetTexture,
+        reinterpret_cast<const void*>(g_setTexture));
+
+    m_texturePool.ReleaseAll();
+
+    // The generated wrappers must not use the recorder after it's gone
+    if (m_traceRecorder) {
+        SetTraceRecorder(nullptr);
+    }
+
+    // m_profiler is destroyed last, after the threads that may still be inside a scope
+    if (m_profiler) {
+        SetProfiler(nullptr);
+    }
+}
+
+void Renderer::RecordReturn(u16 slot, u32 value)
+{
+    if (m_traceRecorder) {
+        const u32 args[] = { slot, value };
+        m_traceRecorder->Record(Trace::Slot::Return, args, 2);
+    }
 }
 
 void Renderer::DrawTiles(void* a0, void* a1)
 {
-    if (m_drawMode != DrawMode::Background) {
+    if (!m_background.IsDrawingBackground()) {
         // Not drawing background tiles, just draw normally.
         GfxContextBase::DrawTiles(a0, a1);
+        RecordReturn(0xB4, 0);
         return;
     }
 
-    ScopedD3DEvent _(L"DrawTiles_hook(0x%p, 0x%p)", a0, a1);
+    ScopedD3DEvent _(L"DrawTiles_hook", a0, a1);
+    ProfileScope _profile("DrawTiles_hook");
 
-    m_stateBlock->Capture();
-
-    m_d3dDevice->SetTransform(D3DTS_PROJECTION, &m_projectionMatrix);
-    m_d3dDevice->SetViewport(&m_viewport);
+    m_background.BeginTiles();
+    GfxContextBase::DrawTiles(a0, a1);
+    m_background.EndTiles();
+    RecordReturn(0xB4, 0);
+}
 
-    m_d3dDevice->SetRenderTarget(0, m_backgroundRenderTarget.Get());
-    m_d3dDevice->SetPixelShader(m_backgroundPS.Get());
+void Renderer::DrawHook(D3DPRIMITIVETYPE primType, u32 drawType, const FF7::Vertex* vertices,
+    u32 vertexBufferSize, const u16* indices, u32 vertexCount, u32 a7, u32 scissor)
+{
+    ProfileScope _profile("DrawHook");
 
-    // Depth writes have to be disabled to avoid interfering with other drawing done by the game
-    m_d3dDevice->SetRenderState(D3DRS_ZWRITEENABLE, FALSE);
-    m_d3dDevice->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
+    if (m_traceRecorder) {
+        const u32 args[] = {
+            TraceArg(static_cast<u32>(primType)), TraceArg(drawType), TraceArg(vertices), TraceArg(vertexBufferSize),
+            TraceArg(indices), TraceArg(vertexCount), TraceArg(a7), TraceArg(scissor), TraceArg(GetTexture())
+        };
 
-    // Draw() is stupid and sets the vertex shader on every call, so we need to swap out the original
-    // object OR rewrite the function.
-    auto oldVS = m_internals.GetTlmainVS();
-    m_internals.SetTlmainVS(m_backgroundVS.Get());
-    GfxContextBase::DrawTiles(a0, a1);
-    m_internals.SetTlmainVS(oldVS);
+        // vertexCount is actually the number of indices
+        TraceRecorder::Payload payloads[] = {
+            { vertices, static_cast<u32>(vertexBufferSize * sizeof(FF7::Vertex)) },
+            { indices, static_cast<u32>(vertexCount * sizeof(u16)) }
+        };
 
-    m_stateBlock->Apply();
+        m_traceRecorder->Record(Trace::Slot::DrawHook, args, 9, payloads, 2);
+    }
 
-    // The render target is not saved with the state block, so restore it separately
-    m_d3dDevice->SetRenderTarget(0, m_backbuffer.Get());
+    m_background.DrawHook(static_cast<FF7::PrimitiveType>(primType), drawType, vertices, vertexBufferSize,
+        indices, vertexCount, a7, scissor);
 }
 
-void Renderer::DrawHook(D3DPRIMITIVETYPE primType, u32 drawType, const FF7::Vertex* vertices,
-    u32 vertexBufferSize, const u16* indices, u32 vertexCount, u32 a7, u32 scissor)
+void* Renderer::GfxFn_50(void* a0, void* a1, void* a2)
 {
-    if (m_drawMode != DrawMode::Background) {
-        // Not drawing background tiles, just draw normally.
-        m_internals.Draw(primType, drawType, vertices, vertexBufferSize, indices, vertexCount, a7, scissor);
-        return;
+    // The new texture may reuse the address of one the background was drawn with
+    m_background.InvalidateBackground();
+
+    if (!m_textureReplacer) {
+        return GfxContextBase::GfxFn_50(a0, a1, a2);
     }
 
-    std::vector<FF7::Vertex> transformed(vertexBufferSize);
+    ProfileScope _profile("GfxFn_50_hook");
 
-    // The original vertices are generated for a 640x480 render target, so they
-    // need to be scaled to 320x240, otherwise only the upper left corner of the background is rendered.
-    // TODO: Check if using the game's own projection matrix would work.
-    for (u32 i = 0; i < vertexBufferSize; i++) {
-        transformed[i] = vertices[i];
-        transformed[i].x *= 0.5f;
-        transformed[i].y *= 0.5f;
+    m_textureReplacer->BeginLoad();
+    auto ret = GfxContextBase::GfxFn_50(a0, a1, a2);
+    m_textureReplacer->EndLoad();
 
-        m_layerDepths.insert(static_cast<int>(std::ceilf(transformed[i].z * 255.0f)));
-    }
+    return ret;
+}
+
+u32 Renderer::SetRenderState(u32 a0, u32 a1, u32 a2)
+{
+    // Queued tiles must be drawn with the render state they were queued with
+    m_background.FlushTiles();
 
-    m_internals.Draw(primType, drawType, transformed.data(), vertexBufferSize, indices, vertexCount, a7, scissor);
+    return GfxContextBase::SetRenderState(a0, a1, a2);
 }
 
 void Renderer::GfxFn_84(u32 drawMode, FF7::GameContext* context)
 {
     auto gameMode = m_internals.GetGameState()->mode;
 
-    if (gameMode == FF7::GameMode::Field) {
-        if (drawMode == 1) {
-            m_drawMode = DrawMode::Dialog;
-        }
-    } else {
-        // At least in main menu dialogs are drawn with drawMode = 0
-        if (drawMode == 0) {
-            m_drawMode = DrawMode::Dialog;
-        }
+    // The draw mode depends on the game mode, which isn't passed to any of the functions
+    if (m_traceRecorder) {
+        const u32 args[] = { gameMode };
+        m_traceRecorder->Record(Trace::Slot::GameMode, args, 1);
     }
 
+    m_background.GfxFn_84(drawMode, gameMode);
+
     GfxContextBase::GfxFn_84(drawMode, context);
 }
 
 u32 Renderer::GfxFn_88(u32 drawMode, FF7::GameContext* context)
 {
     auto ret = GfxContextBase::GfxFn_88(drawMode, context);
+    RecordReturn(0x88, ret);
 
-    if (ret) {
-        if (drawMode == 0) {
-            m_drawMode = DrawMode::Background;
-        } else if (drawMode == 1) {
-            m_drawMode = DrawMode::Dialog;
-        }
-    }
+    m_background.GfxFn_88(drawMode, ret);
 
     return ret;
 }
@@ -264,27 +1014,104 @@ void Renderer::SetShaderTextureFlag(bool value)
 
 u32 Renderer::EndFrame(u32 a0)
 {
-    ScopedD3DEvent _(L"EndFrame_hook(0x%p)", a0);
+    ScopedD3DEvent _(L"EndFrame_hook", a0);
+
+    m_background.EndFrame();
+
+    if (m_textureReplacer) {
+        ProfileScope _profile("ApplyUploads");
+
+        UploadScheduler::Budget budget;
+        budget.bytes = static_cast<std::size_t>(GetConfig().textureUploadBudget) * 1024;
+        budget.milliseconds = GetConfig().textureUploadTime;
+
+        m_textureReplacer->ApplyUploads(budget);
+        m_textureReplacer->Purge();
+    }
+
+    // The EndFrame wrapper's own scope, which includes presenting, ends up in the next frame
+    if (m_profiler) {
+        EndProfilerFrame();
+    }
+
+    // Timed up to presenting, which waits for the next refresh with vsync. Counting the wait would
+    // make every frame take at least the refresh period, and the quality would only ever go down.
+    const auto frameEnd = std::chrono::steady_clock::now();
+
+    const u32 ret = GfxContextBase::EndFrame(a0);
+
+    // Applied after presenting, between frames
+    if (m_qualityController) {
+        UpdateQuality(frameEnd);
+    }
+
+    return ret;
+}
+
+void Renderer::EndProfilerFrame()
+{
+    m_profiler->EndFrame();
+
+    // The low bit is set if the key was pressed since the last call
+    if (!(GetAsyncKeyState(static_cast<int>(GetConfig().profileKey)) & 1)) {
+        return;
+    }
+
+    const auto& path = GetConfig().profilePath;
+    if (!m_profiler->WriteChromeTrace(path)) {
+        LogError("Couldn't write the profile to %s", path.c_str());
+        return;
+    }
+
+    const auto stats = m_profiler->GetStats();
+    DebugLog("Wrote the profile to %s, the last frame took %.3f ms", path.c_str(), stats.lastFrameNs / 1e6);
 
-    float width, height;
-    m_internals.GetRenderDimensions(&width, &height);
-    width /= 2.0f;
-    height /= 2.0f;
+    for (const auto& scope : m_profiler->GetTotalStats()) {
+        DebugLog("%*s%s: %.3f ms per frame, %.1f calls per frame, %.3f ms max", scope.depth * 2, "",
+            scope.name, scope.totalNs / 1e6 / stats.frames, static_cast<double>(scope.calls) / stats.frames,
+            scope.maxNs / 1e6);
+    }
 
-    DrawLayers();
+    if (m_stateFilter) {
+        const auto& filterStats = m_stateFilter->GetStats();
+        DebugLog("Dropped %llu of %llu state changes, invalidated %llu times", filterStats.TotalFiltered(),
+            filterStats.TotalCalls(), filterStats.invalidations);
+    }
 
-    m_layerDepths.clear();
+    if (GetConfig().skipUnchangedBackgrounds) {
+        const auto& changeStats = m_background.GetChangeStats();
+        DebugLog("Skipped %llu of %llu backgrounds as unchanged", changeStats.unchangedFrames, changeStats.frames);
+    }
 
-    return GfxContextBase::EndFrame(a0);
+    if (GetConfig().partialUpscale && m_upscaleChain) {
+        const auto& dirtyStats = m_background.GetDirtyRectStats();
+        DebugLog("Found %.1f%% of the background pixels changed, %llu of %llu tile triangles unmatched",
+            dirtyStats.pixels ? 100.0 * dirtyStats.dirtyPixels / dirtyStats.pixels : 0.0, dirtyStats.dirtyItems,
+            dirtyStats.items);
+    }
+
+    if (m_qualityController) {
+        const auto& qualityStats = m_qualityController->GetStats();
+        DebugLog("Quality level %u of %u, stepped down %llu and up %llu times, %llu of %llu frames over the target",
+            m_qualityController->GetLevel(), static_cast<u32>(m_qualityLevels.size()), qualityStats.stepsDown,
+            qualityStats.stepsUp, qualityStats.slowFrames, qualityStats.frames);
+    }
+
+    const auto& poolStats = m_texturePool.GetStats();
+    DebugLog("Pooled %u textures for %u requests, %llu KiB, %llu KiB peak", poolStats.textures, poolStats.requests,
+        poolStats.bytes / 1024, poolStats.peakBytes / 1024);
 }
 
 u32 Renderer::Clear(u32 clearRenderTarget, u32 clearDepthBuffer)
 {
-    m_d3dDevice->SetRenderTarget(0, m_backgroundRenderTarget.Get());
-    GfxContextBase::Clear(clearRenderTarget, clearDepthBuffer);
-    m_d3dDevice->SetRenderTarget(0, m_backbuffer.Get());
+    // Timed from here rather than from the previous EndFrame(), so the game waiting for the next
+    // frame's turn isn't counted
+    if (m_qualityController && !m_frameStarted) {
+        m_frameStart = std::chrono::steady_clock::now();
+        m_frameStarted = true;
+    }
 
-    return GfxContextBase::Clear(clearRenderTarget, clearDepthBuffer);
+    return m_background.Clear(clearRenderTarget, clearDepthBuffer);
 }
 
 u32 Renderer::ClearAll()
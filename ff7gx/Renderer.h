@@ -1,43 +1,104 @@
 #pragma once
 
+#include "BackgroundCache.h"
+#include "BackgroundRenderer.h"
 #include "Game.h"
-#include "GfxContextBase.h"
-
+#include "GfxContext.h"
+#include "ImagePack.h"
+#include "Profiler.h"
+#include "QualityController.h"
+#include "StateFilter.h"
+#include "SuperXBR.h"
+#include "TexturePool.h"
+#include "TextureReplacer.h"
+#include "TraceRecorder.h"
+#include "UpscaleChain.h"
+
+#include <chrono>
 #include <d3d9.h>
 #include <functional>
 #include <memory>
+#include <vector>
 #include <Windows.h>
 #include <wrl.h>
-#include <unordered_set>
 
-class Renderer : public GfxContextBase
+class Renderer final : public GfxContext<Renderer>, private BackgroundRenderer::Device, private TexturePool::Allocator
 {
 public:
     Renderer(class Module& module, FF7::GfxFunctions* functions);
+    virtual ~Renderer();
 
     virtual u32 EndFrame(u32 a0) override;
     virtual u32 Clear(u32 clearRenderTarget, u32 clearDepthBuffer) override;
     virtual u32 ClearAll() override;
     virtual void DrawTiles(void* a0, void* a1) override;
 
+    // Creates a texture and fills it in with the game's texture data
+    virtual void* GfxFn_50(void* a0, void* a1, void* a2) override;
+
     // DrawTilesImpl is patched to call this instead of the original Draw()
     void DrawHook(D3DPRIMITIVETYPE primType, u32 drawType, const FF7::Vertex* vertices,
         u32 vertexBufferSize, const u16* indices, u32 vertexCount, u32 a7, u32 scissor);
 
+    virtual u32 SetRenderState(u32 a0, u32 a1, u32 a2) override;
     virtual void GfxFn_84(u32 drawMode, FF7::GameContext* context) override;
     virtual u32 GfxFn_88(u32 drawMode, FF7::GameContext* context) override;
 
+    const TileBatcher::Stats& GetTileStats() const
+    {
+        return m_background.GetTileStats();
+    }
+
+    // Only valid if CPU upscaling is enabled
+    const BackgroundCache::Stats& GetBackgroundCacheStats() const
+    {
+        return m_backgroundCache->GetStats();
+    }
+
     Renderer(Renderer&) = delete;
     Renderer(Renderer&&) = delete;
 
 private:
-    // DrawMode is used to determine what part of the scene the game is currently drawing.
-    // This affects z-buffering and blending among others.
-    enum DrawMode
+    // BackgroundRenderer::Device
+    virtual void CaptureState() override;
+    virtual void ApplyState() override;
+    virtual void SetRenderTarget(BackgroundRenderer::Target target) override;
+    virtual void BeginPass(BackgroundRenderer::Pass pass, const LayerDepthSet& layers) override;
+    virtual void EndPass() override;
+    virtual void SetLayer(u32 layer) override;
+    virtual void PrepareLayers(const LayerDepthSet& layers, const DirtyRects& dirty) override;
+    virtual void Draw(const TileBatcher::DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+        const u16* indices, u32 indexCount) override;
+    virtual const void* GetTexture() override;
+    virtual void SetTexture(const void* texture) override;
+    virtual u32 ClearTarget(u32 clearRenderTarget, u32 clearDepthBuffer) override;
+    virtual void GetRenderDimensions(float* width, float* height) override;
+
+    // TexturePool::Allocator
+    virtual bool CreateTexture(u32 slot, const TexturePool::Desc& desc) override;
+    virtual void ReleaseTexture(u32 slot) override;
+
+    // Releases the D3DPOOL_DEFAULT resources before a device reset and creates them again after it
+    static HRESULT STDMETHODCALLTYPE ResetHook(IDirect3DDevice9* device, D3DPRESENT_PARAMETERS* parameters);
+    void ReleaseDeviceResources();
+    void CreateDeviceResources();
+
+    // Lets m_background draw the tiles queued with the previous texture before the game binds the next one
+    static HRESULT STDMETHODCALLTYPE SetTextureHook(IDirect3DDevice9* device, DWORD stage,
+        IDirect3DBaseTexture9* texture);
+
+    // Requests the textures used in a frame from m_texturePool
+    void PlanTextures();
+
+    IDirect3DTexture9* GetPooledTexture(u32 handle) const
     {
-        Background, // Draw to a separate texture and upscale later
-        Dialog      // Draw directly to back buffer
-    };
+        return m_pooledTextures[m_texturePool.GetSlot(handle)].texture.Get();
+    }
+
+    IDirect3DSurface9* GetPooledSurface(u32 handle) const
+    {
+        return m_pooledTextures[m_texturePool.GetSlot(handle)].surface.Get();
+    }
 
     // Sets the flag used by the pixel shader to determine whether to sample from a texture.
     void SetShaderTextureFlag(bool value);
@@ -48,11 +109,98 @@ private:
     void InitViewport();
     void InitProjectionMatrix();
 
-    void DrawLayers();
+    // Creates the state block saving and restoring the states the background passes change
+    void InitStateBlock();
+
+    // Plans the upscale chain from the config and creates its shaders
+    void InitUpscaleChain(u32 maxSize);
+
+    // Draws the passes of the upscale chain where dirty, a part of the background, reaches them.
+    // Returns the texture holding the upscaled background.
+    IDirect3DTexture9* RunUpscaleChain(const DirtyRects& dirty);
+
+    void UpdateLayerLookup(const LayerDepthSet& layers);
+
+    // Builds the quality levels down from the configured one and starts at it
+    void InitQualityController();
+
+    // Switches the background target, the upscale chain and the layer passes to a level, between frames
+    void ApplyQualityLevel(const QualityLevel& level);
+
+    // Passes the time from the frame's start to frameEnd to m_qualityController, and applies the level it picks
+    void UpdateQuality(std::chrono::steady_clock::time_point frameEnd);
+
+    // Records the return value of a call to the trace, for the calls that replaying depends on
+    void RecordReturn(u16 slot, u32 value);
+
+    // Sums up the frame's scopes, and writes the profile if its key was pressed
+    void EndProfilerFrame();
+
+    // Updates the upscaled background texture from the background render target, using the
+    // background pack or the CPU upscaler. Also dumps the background if enabled.
+    // Returns false if the upscaled texture can't be used this frame.
+    bool UpscaleBackground(const LayerDepthSet& layers);
+
+    // Draw mode, background tiles and layers
+    BackgroundRenderer m_background;
+
+    // Set by PrepareLayers() to the texture the layers are drawn from this frame: the background
+    // render target, the output of the upscale chain or the upscaled background texture. Kept for
+    // the next frame if its background is unchanged.
+    IDirect3DTexture9* m_layerTexture;
 
-    // Drawing state
-    DrawMode m_drawMode;
-    std::unordered_set<int> m_layerDepths;
+    // Size of the background render target, 320x240 times InternalScale
+    u32 m_backgroundWidth;
+    u32 m_backgroundHeight;
+
+    // Upscales the background on the GPU, only created if enabled in the config
+    std::unique_ptr<UpscaleChain> m_upscaleChain;
+
+    // The targets of the chain hold what it made from the previous frame's background, so it can
+    // draw only what changed. Cleared when a frame doesn't run it or the targets are lost.
+    bool m_upscaleChainValid;
+    std::vector<DirtyRects> m_upscaleDirtyRects;    // Indexed like UpscaleChain::GetTargets()
+
+    // Upscale chains are planned up to this size
+    u32 m_maxTextureSize;
+
+    // Lowers and raises the quality to hold TargetFrameTime, only created if enabled in the config
+    std::unique_ptr<QualityController> m_qualityController;
+    std::vector<QualityLevel> m_qualityLevels;
+
+    // Set at the first clear of a frame. Frames without one, like movies, aren't timed.
+    std::chrono::steady_clock::time_point m_frameStart;
+    bool m_frameStarted;
+
+    // The game's vertex shader, swapped out during a pass
+    IDirect3DVertexShader9* m_passOldVS;
+
+    // Times the hooks and the renderer, only created if enabled in the config. Declared before
+    // the objects owning threads, so it outlives them.
+    std::unique_ptr<Profiler> m_profiler;
+
+    // Upscaled backgrounds, only created if enabled in the config
+    std::unique_ptr<ImagePackReader> m_backgroundPack;
+    std::unique_ptr<SuperXBR> m_upscaler;
+    std::unique_ptr<BackgroundCache> m_backgroundCache;
+    std::vector<u32> m_backgroundPixels;
+
+    // Drops redundant state changes, only created if enabled in the config. Declared before
+    // m_textureReplacer, whose SetTexture() hook has to be installed after this one's.
+    std::unique_ptr<StateFilter> m_stateFilter;
+
+    // Replaces game textures, only created if enabled in the config
+    std::unique_ptr<TextureReplacer> m_textureReplacer;
+
+    // Records every call from the game, only created if enabled in the config
+    std::unique_ptr<TraceRecorder> m_traceRecorder;
+
+    // Key of the background currently in the upscaled background texture
+    u64 m_upscaledBackgroundKey;
+    bool m_upscaledBackgroundValid;
+
+    // Consecutive frames usually have the same background, so only dump when it changes
+    u64 m_lastDumpedKey;
 
     // Game internals
     class Module& m_originalDll;
@@ -63,15 +211,38 @@ private:
     using ComPtr = Microsoft::WRL::ComPtr<T>;
 
     ComPtr<IDirect3DDevice9> m_d3dDevice;
-    ComPtr<IDirect3DTexture9> m_backgroundTexture;
-    ComPtr<IDirect3DSurface9> m_backgroundRenderTarget;
     ComPtr<IDirect3DSurface9> m_backbuffer;
     ComPtr<IDirect3DStateBlock9> m_stateBlock;
 
+    ComPtr<IDirect3DSurface9> m_backgroundReadback;
+
+    // The D3DPOOL_DEFAULT textures, indexed by TexturePool slot. Render targets keep their surface.
+    struct PooledTexture
+    {
+        ComPtr<IDirect3DTexture9> texture;
+        ComPtr<IDirect3DSurface9> surface;
+    };
+
+    std::vector<PooledTexture> m_pooledTextures;
+    TexturePool m_texturePool;
+
+    // Handles of the textures requested by PlanTextures()
+    u32 m_backgroundHandle;
+    u32 m_layerLookupHandle;
+    u32 m_upscaledBackgroundHandle;     // Only requested with m_backgroundReadback
+    std::vector<u32> m_upscaleHandles;  // Indexed like UpscaleChain::GetTargets()
+
+    ComPtr<IDirect3DPixelShader9> m_backgroundCompositePS;
     ComPtr<IDirect3DPixelShader9> m_backgroundLayerPS;
     ComPtr<IDirect3DPixelShader9> m_backgroundPS;
     ComPtr<IDirect3DVertexShader9> m_backgroundVS;
 
+    ComPtr<IDirect3DPixelShader9> m_superXBRPass0PS;
+    ComPtr<IDirect3DPixelShader9> m_superXBRPass1PS;
+    ComPtr<IDirect3DPixelShader9> m_upscaleBilinearPS;
+    ComPtr<IDirect3DVertexShader9> m_superXBRPass0VS;
+    ComPtr<IDirect3DVertexShader9> m_superXBRPass1VS;
+
     D3DMATRIX m_projectionMatrix;
     D3DVIEWPORT9 m_viewport;
 };
@@ -0,0 +1,84 @@
+#include "stdafx.h"
+
+#include "ScopedD3DEvent.h"
+
+bool g_d3dEventsEnabled;
+
+void SetD3DEventsEnabled(bool enabled)
+{
+    g_d3dEventsEnabled = enabled;
+}
+
+void FormatD3DEventName(wchar_t* buffer, std::size_t size, const wchar_t* name, const u64* args, u32 argCount)
+{
+    std::size_t length = 0;
+
+    // Leaves room for the terminator
+    auto append = [&](wchar_t c) {
+        if (length + 1 < size) {
+            buffer[length++] = c;
+        }
+    };
+
+    for (; *name; name++) {
+        append(*name);
+    }
+
+    append(L'(');
+
+    for (u32 i = 0; i < argCount; i++) {
+        if (i) {
+            append(L',');
+            append(L' ');
+        }
+
+        append(L'0');
+        append(L'x');
+
+        // Hex digits without leading zeros, most significant first
+        int shift = 60;
+        while (shift > 0 && !((args[i] >> shift) & 0xf)) {
+            shift -= 4;
+        }
+
+        for (; shift >= 0; shift -= 4) {
+            append(L"0123456789abcdef"[(args[i] >> shift) & 0xf]);
+        }
+    }
+
+    append(L')');
+
+    if (size) {
+        buffer[length] = 0;
+    }
+}
+
+// The tools only format the names, there's no D3D to send them to
+#ifdef _WIN32
+void BeginD3DEvent(const wchar_t* name, const u64* args, u32 argCount)
+{
+    WCHAR buf[D3D_EVENT_NAME_SIZE];
+    FormatD3DEventName(buf, D3D_EVENT_NAME_SIZE, name, args, argCount);
+
+    D3DPERF_BeginEvent(0, buf);
+}
+
+void EndD3DEvent()
+{
+    D3DPERF_EndEvent();
+}
+#else
+void BeginD3DEvent(const wchar_t* name, const u64* args, u32 argCount)
+{
+    wchar_t buf[D3D_EVENT_NAME_SIZE];
+    FormatD3DEventName(buf, D3D_EVENT_NAME_SIZE, name, args, argCount);
+
+    // Keeps the formatting from being optimized away in benchmarks
+    volatile wchar_t first = buf[0];
+    (void)first;
+}
+
+void EndD3DEvent()
+{
+}
+#endif
@@ -1,28 +1,71 @@
 #pragma once
 
-#include <utility>
-#include <Windows.h>
-#include <d3d9.h>
+#include "Common.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Names are formatted into a buffer of this many characters
+static const std::size_t D3D_EVENT_NAME_SIZE = 128;
+
+// Set once by Renderer, see SetD3DEventsEnabled()
+extern bool g_d3dEventsEnabled;
+
+// Events are only sent if a capture tool is attached or they're enabled in the config
+inline bool AreD3DEventsEnabled()
+{
+    return g_d3dEventsEnabled;
+}
+
+void SetD3DEventsEnabled(bool enabled);
+
+// Writes "name(0x1, 0x2)", truncated to fit the buffer
+void FormatD3DEventName(wchar_t* buffer, std::size_t size, const wchar_t* name, const u64* args, u32 argCount);
+
+// Formats the name and begins the event. Out of line so the wrappers stay small.
+void BeginD3DEvent(const wchar_t* name, const u64* args, u32 argCount);
+void EndD3DEvent();
+
+// Arguments are kept as raw values until the name is formatted
+inline u64 D3DEventArg(u32 value)
+{
+    return value;
+}
+
+template<typename T>
+u64 D3DEventArg(T* pointer)
+{
+    return static_cast<u64>(reinterpret_cast<std::uintptr_t>(pointer));
+}
 
 // Helper class to visibly separate different parts of the rendering code
-// when running in a graphics debugger
+// when running in a graphics debugger.
+//
+// The name must be a literal. When events are disabled this is a flag check, nothing is formatted.
 class ScopedD3DEvent
 {
 public:
-    ScopedD3DEvent(const WCHAR* format, ...)
+    template<typename... Args>
+    explicit ScopedD3DEvent(const wchar_t* name, Args... args) :
+        m_active(AreD3DEventsEnabled())
     {
-        WCHAR buf[128];
-
-        va_list args;
-        va_start(args, format);
-        std::vswprintf(buf, 128, format, args);
-        va_end(args);
-
-        D3DPERF_BeginEvent(0, buf);
+        if (m_active) {
+            // The extra element keeps the array from being empty
+            const u64 values[] = { D3DEventArg(args)..., 0 };
+            BeginD3DEvent(name, values, sizeof...(Args));
+        }
     }
 
     ~ScopedD3DEvent()
     {
-        D3DPERF_EndEvent();
+        if (m_active) {
+            EndD3DEvent();
+        }
     }
+
+    ScopedD3DEvent(ScopedD3DEvent&) = delete;
+    ScopedD3DEvent(ScopedD3DEvent&&) = delete;
+
+private:
+    const bool m_active;
 };
@@ -0,0 +1,38 @@
+#include "background.hlsli"
+
+sampler2D background : register(s0);
+sampler2D backgroundPoint : register(s1);
+
+// 256x1 lookup indexed by pixel depth. r is the depth of the nearest layer at or behind
+// that depth, a is 0 if there's no such layer.
+sampler2D layerLookup : register(s2);
+
+struct PsOutput
+{
+    float4 color : COLOR0;
+    float depth : DEPTH;
+};
+
+// Resolves all background layers in a single pass. The multi-pass path draws each layer
+// at its own depth, from back to front, and the last layer to pass both the depth test
+// and the layer test wins. All layers output the same color, so that's equivalent to
+// drawing once at the depth of the nearest layer that passes the layer test.
+PsOutput main(in PsInput vertex)
+{
+    float4 texColor = tex2D(background, vertex.texcoord.xy);
+    float4 pointTexColor = tex2D(backgroundPoint, vertex.texcoord.xy);
+    float pixelDepth = ceil(pointTexColor.a * 255.0f);
+
+    float4 layer = tex2D(layerLookup, float2((pixelDepth + 0.5f) / 256.0f, 0.5f));
+
+    if (layer.a == 0.0f)
+    {
+        discard;
+    }
+
+    PsOutput output;
+    output.color = float4(texColor.rgb, 1.0f);
+    output.depth = layer.r;
+
+    return output;
+}
\ No newline at end of file
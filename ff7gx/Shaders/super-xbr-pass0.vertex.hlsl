@@ -19,16 +19,17 @@ struct out_vertex
     float4 t3 : TEXCOORD3;
     float4 t4 : TEXCOORD4;
 };
+
+// Bound as globals at fixed registers, set by Renderer::RunUpscaleChain()
+uniform float4x4 modelViewProj : register(c0);
+uniform input IN : register(c4);
  
 /*    VERTEX_SHADER    */
 out_vertex main_vertex
 (
     float4 position : POSITION,
     float4 color : COLOR,
-    float2 texCoord : TEXCOORD0,
- 
-    uniform float4x4 modelViewProj,
-    uniform input IN
+    float2 texCoord : TEXCOORD0
 )
 {
     float2 ps = float2(1.0 / IN.texture_size.x, 1.0 / IN.texture_size.y);
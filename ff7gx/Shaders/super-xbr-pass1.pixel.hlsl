@@ -107,8 +107,11 @@ struct out_vertex
     float4 color : COLOR;
     float2 texCoord : TEXCOORD0;
 };
+
+// Bound as a global at a fixed register, set by Renderer::RunUpscaleChain()
+uniform input IN : register(c0);
  
-float4 main_fragment(in out_vertex VAR, uniform sampler2D s0 : TEXUNIT0, uniform sampler2D prevTexture : TEXUNIT1, uniform prev PASSPREV2, uniform input IN) : COLOR
+float4 main_fragment(in out_vertex VAR, uniform sampler2D s0 : TEXUNIT0, uniform sampler2D prevTexture : TEXUNIT1) : COLOR
 {
     //Skip pixels on wrong grid
     float2 fp = frac(VAR.texCoord * IN.texture_size);
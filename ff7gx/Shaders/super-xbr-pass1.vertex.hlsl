@@ -21,17 +21,16 @@ struct out_vertex
     float4 color : COLOR;
     float2 texCoord : TEXCOORD0;
 };
+
+// Bound as a global at a fixed register, set by Renderer::RunUpscaleChain()
+uniform float4x4 modelViewProj : register(c0);
  
 /*    VERTEX_SHADER    */
 out_vertex main_vertex
 (
     float4 position : POSITION,
     float4 color : COLOR,
-    float2 texCoord : TEXCOORD0,
- 
-    uniform float4x4 modelViewProj,
-    uniform prev PASSPREV2,
-    uniform input IN
+    float2 texCoord : TEXCOORD0
 )
 {
     out_vertex OUT =
@@ -0,0 +1,7 @@
+// The cheap upscale step, drawn with the vertex shader of super-xBR pass 1
+sampler2D source : register(s0);
+
+float4 main(float4 color : COLOR, float2 texCoord : TEXCOORD0) : COLOR0
+{
+    return tex2D(source, texCoord);
+}
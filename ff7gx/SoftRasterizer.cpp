@@ -0,0 +1,512 @@
+#include "stdafx.h"
+
+#include "SoftRasterizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Vertices further out than this many pixels don't fit the fixed point edge functions, and the
+// triangles using them are dropped
+static const float GUARD_BAND = 16384.0f;
+
+static const u32 ATTRIBUTES = 6;
+
+struct Color
+{
+    float r, g, b, a;
+};
+
+static Color UnpackColor(u32 color)
+{
+    return Color{
+        static_cast<float>((color >> 16) & 0xff) / 255.0f,
+        static_cast<float>((color >> 8) & 0xff) / 255.0f,
+        static_cast<float>(color & 0xff) / 255.0f,
+        static_cast<float>(color >> 24) / 255.0f
+    };
+}
+
+static u32 PackChannel(float value)
+{
+    return static_cast<u32>(std::min(std::max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+static u32 PackColor(const Color& color)
+{
+    return (PackChannel(color.a) << 24) | (PackChannel(color.r) << 16) | (PackChannel(color.g) << 8) | PackChannel(color.b);
+}
+
+static u32 WrapCoordinate(i32 coordinate, u32 size)
+{
+    const i32 wrapped = coordinate % static_cast<i32>(size);
+    return static_cast<u32>(wrapped < 0 ? wrapped + static_cast<i32>(size) : wrapped);
+}
+
+static u32 FetchPoint(const SoftRasterizer::Texture& texture, float u, float v)
+{
+    const u32 x = WrapCoordinate(static_cast<i32>(std::floor(u * texture.width)), texture.width);
+    const u32 y = WrapCoordinate(static_cast<i32>(std::floor(v * texture.height)), texture.height);
+    return texture.pixels[y * texture.width + x];
+}
+
+// Unbound samplers return opaque black, like D3D9
+static Color Sample(const SoftRasterizer::Texture& texture, SoftRasterizer::Filter filter, float u, float v)
+{
+    if (!texture.pixels) {
+        return Color{ 0.0f, 0.0f, 0.0f, 1.0f };
+    }
+
+    if (filter == SoftRasterizer::Filter::Point) {
+        return UnpackColor(FetchPoint(texture, u, v));
+    }
+
+    // Texel centers are at half-integer coordinates
+    const float x = u * texture.width - 0.5f;
+    const float y = v * texture.height - 0.5f;
+    const float x0 = std::floor(x);
+    const float y0 = std::floor(y);
+    const float fx = x - x0;
+    const float fy = y - y0;
+
+    const u32 left = WrapCoordinate(static_cast<i32>(x0), texture.width);
+    const u32 right = WrapCoordinate(static_cast<i32>(x0) + 1, texture.width);
+    const u32 top = WrapCoordinate(static_cast<i32>(y0), texture.height);
+    const u32 bottom = WrapCoordinate(static_cast<i32>(y0) + 1, texture.height);
+
+    const Color c00 = UnpackColor(texture.pixels[top * texture.width + left]);
+    const Color c10 = UnpackColor(texture.pixels[top * texture.width + right]);
+    const Color c01 = UnpackColor(texture.pixels[bottom * texture.width + left]);
+    const Color c11 = UnpackColor(texture.pixels[bottom * texture.width + right]);
+
+    auto lerp2 = [&](float a, float b, float c, float d) {
+        return (a * (1.0f - fx) + b * fx) * (1.0f - fy) + (c * (1.0f - fx) + d * fx) * fy;
+    };
+
+    return Color{
+        lerp2(c00.r, c10.r, c01.r, c11.r),
+        lerp2(c00.g, c10.g, c01.g, c11.g),
+        lerp2(c00.b, c10.b, c01.b, c11.b),
+        lerp2(c00.a, c10.a, c01.a, c11.a)
+    };
+}
+
+SoftRasterizer::State SoftRasterizer::State::Default(float viewWidth, float viewHeight)
+{
+    State state{};
+    state.primType = FF7::PrimitiveType::TriangleList;
+    state.drawType = FF7::DrawType::Ortho;
+    state.shader = Shader::Game;
+    state.filter = Filter::Point;
+    state.depthTest = true;
+    state.depthWrite = true;
+    state.alphaBlend = false;
+    state.viewWidth = viewWidth;
+    state.viewHeight = viewHeight;
+
+    for (u32 i = 0; i < 4; i++) {
+        state.transform[i * 5] = 1.0f;
+    }
+
+    return state;
+}
+
+SoftRasterizer::Target::Target(u32 width, u32 height) :
+    m_width(width),
+    m_height(height),
+    m_color(width * height, 0),
+    m_depth(width * height, 1.0f)
+{
+}
+
+SoftRasterizer::SoftRasterizer(ThreadPool& pool) :
+    m_pool(pool),
+    m_target(nullptr),
+    m_tilesX(0),
+    m_tilesY(0),
+    m_stats{}
+{
+}
+
+void SoftRasterizer::SetTarget(Target* target)
+{
+    if (target == m_target) {
+        return;
+    }
+
+    Flush();
+
+    m_target = target;
+    m_tilesX = target ? (target->m_width + TILE_SIZE - 1) / TILE_SIZE : 0;
+    m_tilesY = target ? (target->m_height + TILE_SIZE - 1) / TILE_SIZE : 0;
+
+    m_bins.resize(m_tilesX * m_tilesY);
+    m_tileStats.resize(m_tilesX * m_tilesY);
+}
+
+void SoftRasterizer::Clear(bool clearColor, u32 color, bool clearDepth, float depth)
+{
+    if (!m_target) {
+        return;
+    }
+
+    Flush();
+
+    const u32 width = m_target->m_width;
+    m_pool.Run(m_target->m_height, [&](u32 y) {
+        if (clearColor) {
+            std::fill_n(&m_target->m_color[y * width], width, color);
+        }
+
+        if (clearDepth) {
+            std::fill_n(&m_target->m_depth[y * width], width, depth);
+        }
+    });
+}
+
+void SoftRasterizer::Draw(const State& state, const FF7::Vertex* vertices, u32 vertexCount, const u16* indices, u32 indexCount)
+{
+    if (!m_target) {
+        return;
+    }
+
+    m_stats.draws++;
+
+    const u32 draw = static_cast<u32>(m_draws.size());
+    m_draws.push_back(state);
+
+    const float width = static_cast<float>(m_target->m_width);
+    const float height = static_cast<float>(m_target->m_height);
+
+    m_transformed.resize(vertexCount);
+
+    for (u32 i = 0; i < vertexCount; i++) {
+        const auto& in = vertices[i];
+        auto& out = m_transformed[i];
+
+        if (state.drawType == FF7::DrawType::Perspective) {
+            const float* m = state.transform;
+            const float x = in.x * m[0] + in.y * m[4] + in.z * m[8] + m[12];
+            const float y = in.x * m[1] + in.y * m[5] + in.z * m[9] + m[13];
+            const float z = in.x * m[2] + in.y * m[6] + in.z * m[10] + m[14];
+            const float w = in.x * m[3] + in.y * m[7] + in.z * m[11] + m[15];
+
+            // Marks the vertex as unusable, since there's no clipping
+            out.invW = w > 1e-6f ? 1.0f / w : 0.0f;
+            out.x = (x * out.invW + 1.0f) * 0.5f * width;
+            out.y = (1.0f - y * out.invW) * 0.5f * height;
+            out.z = z * out.invW;
+        } else {
+            // Pre-transformed, w is already 1 / w
+            out.invW = in.w > 0.0f ? in.w : 1.0f;
+            out.x = in.x * width / state.viewWidth;
+            out.y = in.y * height / state.viewHeight;
+            out.z = in.z;
+        }
+
+        const Color color = UnpackColor(in.color);
+        const float attributes[ATTRIBUTES] = { color.r, color.g, color.b, color.a, in.u, in.v };
+        for (u32 a = 0; a < ATTRIBUTES; a++) {
+            out.attributes[a] = attributes[a] * out.invW;
+        }
+    }
+
+    auto triangle = [&](u32 i0, u32 i1, u32 i2) {
+        if (i0 >= vertexCount || i1 >= vertexCount || i2 >= vertexCount) {
+            m_stats.culled++;
+            return;
+        }
+
+        SetupTriangle(draw, m_transformed[i0], m_transformed[i1], m_transformed[i2]);
+    };
+
+    switch (state.primType) {
+    case FF7::PrimitiveType::TriangleList:
+        for (u32 i = 0; i + 2 < indexCount; i += 3) {
+            triangle(indices[i], indices[i + 1], indices[i + 2]);
+        }
+        break;
+
+    case FF7::PrimitiveType::TriangleStrip:
+        for (u32 i = 0; i + 2 < indexCount; i++) {
+            // Every other triangle is flipped to keep the winding, which only matters for culling
+            if (i % 2) {
+                triangle(indices[i + 1], indices[i], indices[i + 2]);
+            } else {
+                triangle(indices[i], indices[i + 1], indices[i + 2]);
+            }
+        }
+        break;
+
+    case FF7::PrimitiveType::TriangleFan:
+        for (u32 i = 1; i + 1 < indexCount; i++) {
+            triangle(indices[0], indices[i], indices[i + 1]);
+        }
+        break;
+
+    default:
+        // Points and lines aren't used for anything that matters
+        break;
+    }
+}
+
+void SoftRasterizer::SetupTriangle(u32 draw, const TransformedVertex& v0, const TransformedVertex& v1,
+    const TransformedVertex& v2)
+{
+    m_stats.triangles++;
+
+    const TransformedVertex* v[3] = { &v0, &v1, &v2 };
+
+    for (auto vertex : v) {
+        if (vertex->invW == 0.0f || !(std::abs(vertex->x) < GUARD_BAND) || !(std::abs(vertex->y) < GUARD_BAND)) {
+            m_stats.culled++;
+            return;
+        }
+    }
+
+    const float scale = static_cast<float>(1 << SUBPIXEL_BITS);
+    i64 x[3], y[3];
+    for (u32 i = 0; i < 3; i++) {
+        x[i] = static_cast<i64>(std::lround(v[i]->x * scale));
+        y[i] = static_cast<i64>(std::lround(v[i]->y * scale));
+    }
+
+    // Twice the signed area, made positive so the inside is where all edge functions are positive
+    i64 area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area == 0) {
+        m_stats.culled++;
+        return;
+    }
+
+    if (area < 0) {
+        std::swap(v[1], v[2]);
+        std::swap(x[1], x[2]);
+        std::swap(y[1], y[2]);
+        area = -area;
+    }
+
+    const i32 maxX = static_cast<i32>(m_target->m_width) - 1;
+    const i32 maxY = static_cast<i32>(m_target->m_height) - 1;
+
+    Triangle triangle;
+    triangle.draw = draw;
+    triangle.invArea = 1.0f / static_cast<float>(area);
+
+    // Pixels whose centers might be inside
+    const float minVX = std::min(v[0]->x, std::min(v[1]->x, v[2]->x));
+    const float maxVX = std::max(v[0]->x, std::max(v[1]->x, v[2]->x));
+    const float minVY = std::min(v[0]->y, std::min(v[1]->y, v[2]->y));
+    const float maxVY = std::max(v[0]->y, std::max(v[1]->y, v[2]->y));
+    triangle.minX = std::max(static_cast<i32>(std::floor(minVX)), 0);
+    triangle.maxX = std::min(static_cast<i32>(std::ceil(maxVX)), maxX);
+    triangle.minY = std::max(static_cast<i32>(std::floor(minVY)), 0);
+    triangle.maxY = std::min(static_cast<i32>(std::ceil(maxVY)), maxY);
+
+    if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY) {
+        m_stats.culled++;
+        return;
+    }
+
+    for (u32 i = 0; i < 3; i++) {
+        // Edge i goes from vertex i + 1 to vertex i + 2
+        const u32 j = (i + 1) % 3;
+        const u32 k = (i + 2) % 3;
+
+        triangle.a[i] = y[j] - y[k];
+        triangle.b[i] = x[k] - x[j];
+        triangle.c[i] = -(triangle.a[i] * x[j] + triangle.b[i] * y[j]);
+
+        // Top-left fill rule: pixel centers exactly on other edges belong to the neighbouring triangle
+        const bool topLeft = triangle.a[i] > 0 || (triangle.a[i] == 0 && triangle.b[i] > 0);
+        if (!topLeft) {
+            triangle.c[i]--;
+        }
+
+        triangle.z[i] = v[i]->z;
+        triangle.invW[i] = v[i]->invW;
+        std::copy(v[i]->attributes, v[i]->attributes + ATTRIBUTES, triangle.attributes[i]);
+    }
+
+    const u32 index = static_cast<u32>(m_triangles.size());
+    m_triangles.push_back(triangle);
+
+    for (i32 tileY = triangle.minY / static_cast<i32>(TILE_SIZE); tileY <= triangle.maxY / static_cast<i32>(TILE_SIZE); tileY++) {
+        for (i32 tileX = triangle.minX / static_cast<i32>(TILE_SIZE); tileX <= triangle.maxX / static_cast<i32>(TILE_SIZE); tileX++) {
+            m_bins[tileY * m_tilesX + tileX].push_back(index);
+            m_stats.binned++;
+        }
+    }
+}
+
+void SoftRasterizer::Flush()
+{
+    if (m_triangles.empty()) {
+        m_draws.clear();
+        return;
+    }
+
+    m_stats.flushes++;
+
+    m_pool.Run(m_tilesX * m_tilesY, [this](u32 tile) { RasterizeTile(tile); });
+
+    for (auto& stats : m_tileStats) {
+        m_stats.fragments += stats.fragments;
+        m_stats.writes += stats.writes;
+        stats = TileStats{};
+    }
+
+    // clear() keeps the capacity, so steady state frames don't allocate
+    for (auto& bin : m_bins) {
+        bin.clear();
+    }
+
+    m_triangles.clear();
+    m_draws.clear();
+}
+
+void SoftRasterizer::RasterizeTile(u32 tile)
+{
+    const auto& bin = m_bins[tile];
+    if (bin.empty()) {
+        return;
+    }
+
+    const i32 tileX0 = static_cast<i32>((tile % m_tilesX) * TILE_SIZE);
+    const i32 tileY0 = static_cast<i32>((tile / m_tilesX) * TILE_SIZE);
+    const i32 tileX1 = std::min(tileX0 + static_cast<i32>(TILE_SIZE), static_cast<i32>(m_target->m_width)) - 1;
+    const i32 tileY1 = std::min(tileY0 + static_cast<i32>(TILE_SIZE), static_cast<i32>(m_target->m_height)) - 1;
+
+    auto& stats = m_tileStats[tile];
+
+    for (auto index : bin) {
+        const auto& triangle = m_triangles[index];
+        RasterizeTriangle(triangle, std::max(triangle.minX, tileX0), std::max(triangle.minY, tileY0),
+            std::min(triangle.maxX, tileX1), std::min(triangle.maxY, tileY1), stats);
+    }
+}
+
+void SoftRasterizer::RasterizeTriangle(const Triangle& triangle, i32 x0, i32 y0, i32 x1, i32 y1, TileStats& stats)
+{
+    const State& state = m_draws[triangle.draw];
+    const u32 width = m_target->m_width;
+
+    const i64 half = 1 << (SUBPIXEL_BITS - 1);
+    const i64 px = (static_cast<i64>(x0) << SUBPIXEL_BITS) + half;
+    const i64 py = (static_cast<i64>(y0) << SUBPIXEL_BITS) + half;
+
+    i64 row[3], stepX[3], stepY[3];
+    for (u32 i = 0; i < 3; i++) {
+        row[i] = triangle.a[i] * px + triangle.b[i] * py + triangle.c[i];
+        stepX[i] = triangle.a[i] << SUBPIXEL_BITS;
+        stepY[i] = triangle.b[i] << SUBPIXEL_BITS;
+    }
+
+    for (i32 y = y0; y <= y1; y++) {
+        i64 e[3] = { row[0], row[1], row[2] };
+
+        for (i32 x = x0; x <= x1; x++) {
+            const bool inside = (e[0] | e[1] | e[2]) >= 0;
+
+            if (inside) {
+                stats.fragments++;
+
+                const float l1 = static_cast<float>(e[1]) * triangle.invArea;
+                const float l2 = static_cast<float>(e[2]) * triangle.invArea;
+                const float l0 = 1.0f - l1 - l2;
+
+                float z = l0 * triangle.z[0] + l1 * triangle.z[1] + l2 * triangle.z[2];
+                const std::size_t pixel = static_cast<std::size_t>(y) * width + x;
+                float& depth = m_target->m_depth[pixel];
+
+                // The composite shader writes its own depth, so it's tested after shading
+                const bool earlyDepth = state.shader != Shader::BackgroundComposite;
+                bool discard = (z < 0.0f || z > 1.0f) || (earlyDepth && state.depthTest && !(z <= depth));
+
+                Color color{};
+
+                if (!discard) {
+                    const float invW = l0 * triangle.invW[0] + l1 * triangle.invW[1] + l2 * triangle.invW[2];
+                    const float w = 1.0f / invW;
+
+                    float attributes[ATTRIBUTES];
+                    for (u32 a = 0; a < ATTRIBUTES; a++) {
+                        attributes[a] = (l0 * triangle.attributes[0][a] + l1 * triangle.attributes[1][a] +
+                            l2 * triangle.attributes[2][a]) * w;
+                    }
+
+                    const float u = attributes[4];
+                    const float v = attributes[5];
+
+                    switch (state.shader) {
+                    case Shader::Game: {
+                        color = Color{ attributes[0], attributes[1], attributes[2], attributes[3] };
+
+                        if (state.texture.pixels) {
+                            const Color texColor = Sample(state.texture, state.filter, u, v);
+                            discard = texColor.a == 0.0f;
+                            color = Color{ color.r * texColor.r, color.g * texColor.g, color.b * texColor.b, color.a * texColor.a };
+                        }
+                        break;
+                    }
+
+                    case Shader::Background: {
+                        const Color texColor = Sample(state.texture, state.filter, u, v);
+                        discard = texColor.a == 0.0f;
+                        color = Color{ texColor.r, texColor.g, texColor.b, (z - 0.9f) * 10.0f };
+                        break;
+                    }
+
+                    case Shader::BackgroundLayer: {
+                        const Color texColor = Sample(state.texture, state.filter, u, v);
+                        const u32 pixelDepth = state.pointTexture.pixels ? FetchPoint(state.pointTexture, u, v) >> 24 : 255;
+                        discard = static_cast<float>(pixelDepth) > state.layerDepth;
+                        color = Color{ texColor.r, texColor.g, texColor.b, 1.0f };
+                        break;
+                    }
+
+                    case Shader::BackgroundComposite: {
+                        const Color texColor = Sample(state.texture, state.filter, u, v);
+                        const u32 pixelDepth = state.pointTexture.pixels ? FetchPoint(state.pointTexture, u, v) >> 24 : 255;
+                        const u32 layer = state.layerLookup ? state.layerLookup[pixelDepth] : 0;
+
+                        z = static_cast<float>((layer >> 16) & 0xff) / 255.0f;
+                        discard = (layer >> 24) == 0 || (state.depthTest && !(z <= depth));
+                        color = Color{ texColor.r, texColor.g, texColor.b, 1.0f };
+                        break;
+                    }
+                    }
+                }
+
+                if (!discard) {
+                    u32& target = m_target->m_color[pixel];
+
+                    if (state.alphaBlend) {
+                        const Color dst = UnpackColor(target);
+                        const float a = std::min(std::max(color.a, 0.0f), 1.0f);
+                        color = Color{
+                            color.r * a + dst.r * (1.0f - a),
+                            color.g * a + dst.g * (1.0f - a),
+                            color.b * a + dst.b * (1.0f - a),
+                            color.a * a + dst.a * (1.0f - a)
+                        };
+                    }
+
+                    target = PackColor(color);
+
+                    if (state.depthWrite) {
+                        depth = z;
+                    }
+
+                    stats.writes++;
+                }
+            }
+
+            for (u32 i = 0; i < 3; i++) {
+                e[i] += stepX[i];
+            }
+        }
+
+        for (u32 i = 0; i < 3; i++) {
+            row[i] += stepY[i];
+        }
+    }
+}
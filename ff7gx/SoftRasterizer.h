@@ -0,0 +1,200 @@
+#pragma once
+
+#include "Common.h"
+#include "GameTypes.h"
+#include "ThreadPool.h"
+
+#include <vector>
+
+// CPU implementation of what GameInternals::Draw() and the background shaders do, for rendering
+// traces without a GPU.
+//
+// Draw() transforms and sets up triangles on the calling thread and bins them into screen tiles.
+// Flush() rasterizes the tiles on a ThreadPool. Every tile draws its triangles in the order they
+// were submitted, so the output doesn't depend on the number of threads.
+//
+// Pixel centers are at half-integer coordinates. Ortho vertices are pre-transformed, with w being
+// 1 / w like D3DFVF_XYZRHW, and are scaled from the view size to the target size. Perspective
+// vertices are transformed by the matrix in the state and triangles crossing w = 0 are dropped,
+// since there's no clipping. Depth testing is D3DCMP_LESSEQUAL.
+class SoftRasterizer
+{
+public:
+    static const u32 TILE_SIZE = 64;
+
+    // A8R8G8B8, top row first. Sampled with wrapping, like the D3D9 default.
+    struct Texture
+    {
+        u32 width;
+        u32 height;
+        const u32* pixels;  // Null if no texture is bound
+    };
+
+    class Target
+    {
+    public:
+        Target(u32 width, u32 height);
+        ~Target() = default;
+
+        u32 GetWidth() const
+        {
+            return m_width;
+        }
+
+        u32 GetHeight() const
+        {
+            return m_height;
+        }
+
+        const u32* GetColor() const
+        {
+            return m_color.data();
+        }
+
+        const float* GetDepth() const
+        {
+            return m_depth.data();
+        }
+
+        Texture AsTexture() const
+        {
+            return Texture{ m_width, m_height, m_color.data() };
+        }
+
+    private:
+        friend class SoftRasterizer;
+
+        u32 m_width;
+        u32 m_height;
+        std::vector<u32> m_color;
+        std::vector<float> m_depth;
+    };
+
+    enum class Shader
+    {
+        Game,               // The texture modulated by the vertex color, texels with 0 alpha are discarded
+        Background,         // background.pixel.hlsl
+        BackgroundLayer,    // backgroundlayer.pixel.hlsl
+        BackgroundComposite // backgroundcomposite.pixel.hlsl
+    };
+
+    enum class Filter
+    {
+        Point,
+        Linear
+    };
+
+    struct State
+    {
+        FF7::PrimitiveType primType;
+        u32 drawType;           // FF7::DrawType
+        Shader shader;
+
+        Texture texture;        // s0
+        Filter filter;
+        Texture pointTexture;   // s1 of the layer shaders, always point sampled
+        const u32* layerLookup; // s2 of the composite shader, LayerComposite::LOOKUP_SIZE entries
+        float layerDepth;       // The constant of the layer shader
+
+        bool depthTest;
+        bool depthWrite;
+        bool alphaBlend;        // D3DBLEND_SRCALPHA, D3DBLEND_INVSRCALPHA
+
+        // Ortho: the coordinates that map to the edges of the target
+        float viewWidth;
+        float viewHeight;
+
+        // Perspective: row vector * matrix, like D3D
+        float transform[16];
+
+        // A state with nothing bound, depth testing and writing enabled and no blending
+        static State Default(float viewWidth, float viewHeight);
+    };
+
+    struct Stats
+    {
+        u64 draws;
+        u64 triangles;
+        u64 culled;         // Degenerate, offscreen or crossing w = 0
+        u64 binned;         // Triangle-tile pairs
+        u64 fragments;      // Pixel shader invocations
+        u64 writes;         // Fragments that passed all tests
+        u64 flushes;
+    };
+
+    explicit SoftRasterizer(ThreadPool& pool);
+    ~SoftRasterizer() = default;
+
+    SoftRasterizer(SoftRasterizer&) = delete;
+    SoftRasterizer(SoftRasterizer&&) = delete;
+
+    // Flushes the draws made to the previous target
+    void SetTarget(Target* target);
+
+    void Clear(bool clearColor, u32 color, bool clearDepth, float depth);
+
+    // Triangle lists, strips and fans. Textures must stay valid until the next Flush().
+    void Draw(const State& state, const FF7::Vertex* vertices, u32 vertexCount, const u16* indices, u32 indexCount);
+
+    void Flush();
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    static const u32 SUBPIXEL_BITS = 8;
+
+    struct TransformedVertex
+    {
+        float x, y;         // Pixels
+        float z;
+        float invW;
+        float attributes[6];    // r, g, b, a, u, v, divided by w
+    };
+
+    struct Triangle
+    {
+        u32 draw;
+
+        // Edge functions in fixed point, e(x, y) = a * x + b * y + c at pixel centers
+        i64 a[3];
+        i64 b[3];
+        i64 c[3];
+        float invArea;
+
+        // Pixel bounds, inclusive
+        i32 minX, minY, maxX, maxY;
+
+        // Vertex 0 is opposite edge 0 etc.
+        float z[3];
+        float invW[3];
+        float attributes[3][6];
+    };
+
+    struct TileStats
+    {
+        u64 fragments;
+        u64 writes;
+    };
+
+    void SetupTriangle(u32 draw, const TransformedVertex& v0, const TransformedVertex& v1, const TransformedVertex& v2);
+    void RasterizeTile(u32 tile);
+    void RasterizeTriangle(const Triangle& triangle, i32 x0, i32 y0, i32 x1, i32 y1, TileStats& stats);
+
+    ThreadPool& m_pool;
+    Target* m_target;
+
+    u32 m_tilesX;
+    u32 m_tilesY;
+
+    std::vector<State> m_draws;
+    std::vector<Triangle> m_triangles;
+    std::vector<std::vector<u32>> m_bins;
+    std::vector<TileStats> m_tileStats;
+
+    std::vector<TransformedVertex> m_transformed;
+
+    Stats m_stats;
+};
@@ -0,0 +1,168 @@
+#include "stdafx.h"
+
+#include "StateCache.h"
+
+#include <cstring>
+
+u64 StateCache::Stats::TotalCalls() const
+{
+    u64 total = 0;
+    for (auto count : calls) {
+        total += count;
+    }
+
+    return total;
+}
+
+u64 StateCache::Stats::TotalFiltered() const
+{
+    u64 total = 0;
+    for (auto count : filtered) {
+        total += count;
+    }
+
+    return total;
+}
+
+StateCache::StateCache() :
+    m_recording(false),
+    m_stats()
+{
+    Invalidate();
+    m_stats.invalidations = 0;
+}
+
+bool StateCache::Count(Kind kind, bool changed)
+{
+    m_stats.calls[static_cast<u32>(kind)]++;
+
+    if (!changed) {
+        m_stats.filtered[static_cast<u32>(kind)]++;
+    }
+
+    return changed;
+}
+
+// Updates a cached value, returns true if it wasn't known or was different
+template<typename T, typename Bits>
+static bool Update(T& cached, Bits&& known, T value)
+{
+    if (known && cached == value) {
+        return false;
+    }
+
+    cached = value;
+    known = true;
+    return true;
+}
+
+bool StateCache::SetRenderState(u32 state, u32 value)
+{
+    if (m_recording || state >= MAX_RENDER_STATES) {
+        return Count(Kind::RenderState, true);
+    }
+
+    return Count(Kind::RenderState, Update(m_renderStates[state], m_renderStatesKnown[state], value));
+}
+
+bool StateCache::SetSamplerState(u32 sampler, u32 type, u32 value)
+{
+    if (m_recording || sampler >= MAX_SAMPLERS || type >= MAX_SAMPLER_STATES) {
+        return Count(Kind::SamplerState, true);
+    }
+
+    return Count(Kind::SamplerState, Update(m_samplerStates[sampler][type],
+        m_samplerStatesKnown[sampler * MAX_SAMPLER_STATES + type], value));
+}
+
+bool StateCache::SetTexture(u32 stage, const void* texture)
+{
+    if (m_recording || stage >= MAX_SAMPLERS) {
+        return Count(Kind::Texture, true);
+    }
+
+    return Count(Kind::Texture, Update(m_textures[stage], m_texturesKnown[stage], texture));
+}
+
+bool StateCache::SetVertexShader(const void* shader)
+{
+    if (m_recording) {
+        return Count(Kind::VertexShader, true);
+    }
+
+    return Count(Kind::VertexShader, Update(m_vertexShader, m_vertexShaderKnown, shader));
+}
+
+bool StateCache::SetPixelShader(const void* shader)
+{
+    if (m_recording) {
+        return Count(Kind::PixelShader, true);
+    }
+
+    return Count(Kind::PixelShader, Update(m_pixelShader, m_pixelShaderKnown, shader));
+}
+
+bool StateCache::SetPixelShaderConstantF(u32 start, const float* values, u32 count)
+{
+    if (m_recording || start >= MAX_PS_CONSTANTS || count > MAX_PS_CONSTANTS - start) {
+        return Count(Kind::PixelShaderConstant, true);
+    }
+
+    // Compared as bits, like the device gets them: -0.0f and 0.0f differ, and a NaN equals itself
+    bool changed = false;
+    for (u32 i = 0; i < count && !changed; i++) {
+        changed = !m_psConstantsKnown[start + i] ||
+            std::memcmp(m_psConstants[start + i], &values[i * 4], sizeof(m_psConstants[0])) != 0;
+    }
+
+    if (changed) {
+        std::memcpy(m_psConstants[start], values, count * sizeof(m_psConstants[0]));
+        for (u32 i = 0; i < count; i++) {
+            m_psConstantsKnown[start + i] = true;
+        }
+    }
+
+    return Count(Kind::PixelShaderConstant, changed);
+}
+
+bool StateCache::SetRenderTarget(u32 index, const void* target)
+{
+    if (m_recording || index >= MAX_RENDER_TARGETS) {
+        return Count(Kind::RenderTarget, true);
+    }
+
+    bool changed = Update(m_renderTargets[index], m_renderTargetsKnown[index], target);
+
+    if (index == 0) {
+        changed |= !m_viewportFromTarget;
+        m_viewportFromTarget = true;
+    }
+
+    return Count(Kind::RenderTarget, changed);
+}
+
+void StateCache::ViewportChanged()
+{
+    if (!m_recording) {
+        m_viewportFromTarget = false;
+    }
+}
+
+void StateCache::Invalidate()
+{
+    m_renderStatesKnown.reset();
+    m_samplerStatesKnown.reset();
+    m_texturesKnown.reset();
+    m_vertexShaderKnown = false;
+    m_pixelShaderKnown = false;
+    m_psConstantsKnown.reset();
+    m_renderTargetsKnown.reset();
+    m_viewportFromTarget = false;
+
+    m_stats.invalidations++;
+}
+
+void StateCache::SetRecording(bool recording)
+{
+    m_recording = recording;
+}
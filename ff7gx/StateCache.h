@@ -0,0 +1,112 @@
+#pragma once
+
+#include "Common.h"
+
+#include <bitset>
+
+// A shadow copy of the D3D9 device state that tells which state changes are redundant, so they
+// can be dropped before reaching the device. Values are kept as the raw numbers and pointers
+// passed to D3D9, which keeps this portable.
+//
+// Every state starts out unknown, so the first change of each one goes through. Invalidate()
+// forgets everything, for when the device state changed without the cache seeing it, like when
+// a state block is applied. States outside the cached ranges always go through.
+class StateCache
+{
+public:
+    enum class Kind : u8
+    {
+        RenderState,
+        SamplerState,
+        Texture,
+        VertexShader,
+        PixelShader,
+        PixelShaderConstant,
+        RenderTarget,
+        Count
+    };
+
+    struct Stats
+    {
+        u64 calls[static_cast<u32>(Kind::Count)];
+        u64 filtered[static_cast<u32>(Kind::Count)];
+        u64 invalidations;
+
+        u64 TotalCalls() const;
+        u64 TotalFiltered() const;
+    };
+
+    // D3DRENDERSTATETYPE values are all below this
+    static const u32 MAX_RENDER_STATES = 256;
+
+    // Pixel shader samplers. The vertex texture samplers come after D3DDMAPSAMPLER and aren't cached.
+    static const u32 MAX_SAMPLERS = 16;
+
+    // D3DSAMP_ADDRESSU is 1 and D3DSAMP_DMAPOFFSET 13
+    static const u32 MAX_SAMPLER_STATES = 14;
+
+    // What ps_3_0 has
+    static const u32 MAX_PS_CONSTANTS = 224;
+
+    static const u32 MAX_RENDER_TARGETS = 4;
+
+    StateCache();
+    ~StateCache() = default;
+
+    StateCache(StateCache&) = delete;
+    StateCache(StateCache&&) = delete;
+
+    // Each of these records the new state and returns true if the call has to reach the device
+    bool SetRenderState(u32 state, u32 value);
+    bool SetSamplerState(u32 sampler, u32 type, u32 value);
+    bool SetTexture(u32 stage, const void* texture);
+    bool SetVertexShader(const void* shader);
+    bool SetPixelShader(const void* shader);
+
+    // Goes through whole if any of the registers changes
+    bool SetPixelShaderConstantF(u32 start, const float* values, u32 count);
+
+    // Setting render target 0 also resets the viewport and the scissor rect to the size of the
+    // target, so setting the same target again is only redundant if neither changed since.
+    bool SetRenderTarget(u32 index, const void* target);
+    void ViewportChanged();
+
+    void Invalidate();
+
+    // While a state block is being recorded, changes don't reach the device state and the
+    // recording needs every one of them
+    void SetRecording(bool recording);
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    // Records a call of the kind, and whether it was dropped
+    bool Count(Kind kind, bool changed);
+
+    u32 m_renderStates[MAX_RENDER_STATES];
+    u32 m_samplerStates[MAX_SAMPLERS][MAX_SAMPLER_STATES];
+    const void* m_textures[MAX_SAMPLERS];
+    const void* m_vertexShader;
+    const void* m_pixelShader;
+    float m_psConstants[MAX_PS_CONSTANTS][4];
+    const void* m_renderTargets[MAX_RENDER_TARGETS];
+
+    // Which of the above are known
+    std::bitset<MAX_RENDER_STATES> m_renderStatesKnown;
+    std::bitset<MAX_SAMPLERS * MAX_SAMPLER_STATES> m_samplerStatesKnown;
+    std::bitset<MAX_SAMPLERS> m_texturesKnown;
+    bool m_vertexShaderKnown;
+    bool m_pixelShaderKnown;
+    std::bitset<MAX_PS_CONSTANTS> m_psConstantsKnown;
+    std::bitset<MAX_RENDER_TARGETS> m_renderTargetsKnown;
+
+    // The viewport and scissor rect are what setting render target 0 made them
+    bool m_viewportFromTarget;
+
+    bool m_recording;
+
+    Stats m_stats;
+};
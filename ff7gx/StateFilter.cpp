@@ -0,0 +1,218 @@
+#include "stdafx.h"
+
+#include "StateFilter.h"
+#include "D3DHooks.h"
+
+#define VERIFY(hr) assert(SUCCEEDED((hr)))
+
+using ResetFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, D3DPRESENT_PARAMETERS*);
+using SetRenderTargetFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, DWORD, IDirect3DSurface9*);
+using SetViewportFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, const D3DVIEWPORT9*);
+using SetRenderStateFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, D3DRENDERSTATETYPE, DWORD);
+using BeginStateBlockFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*);
+using EndStateBlockFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, IDirect3DStateBlock9**);
+using SetTextureFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, DWORD, IDirect3DBaseTexture9*);
+using SetSamplerStateFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, DWORD, D3DSAMPLERSTATETYPE, DWORD);
+using SetScissorRectFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, const RECT*);
+using SetVertexShaderFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, IDirect3DVertexShader9*);
+using SetPixelShaderFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, IDirect3DPixelShader9*);
+using SetPixelShaderConstantFFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, UINT, const float*, UINT);
+using ApplyFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DStateBlock9*);
+
+// The hooks are static functions, so they need a way to find the instance
+static StateFilter* g_instance;
+
+static ResetFunc g_reset;
+static SetRenderTargetFunc g_setRenderTarget;
+static SetViewportFunc g_setViewport;
+static SetRenderStateFunc g_setRenderState;
+static BeginStateBlockFunc g_beginStateBlock;
+static EndStateBlockFunc g_endStateBlock;
+static SetTextureFunc g_setTexture;
+static SetSamplerStateFunc g_setSamplerState;
+static SetScissorRectFunc g_setScissorRect;
+static SetVertexShaderFunc g_setVertexShader;
+static SetPixelShaderFunc g_setPixelShader;
+static SetPixelShaderConstantFFunc g_setPixelShaderConstantF;
+static ApplyFunc g_apply;
+
+// Replaces a method and stores the original in a typed pointer
+template<typename T, typename F>
+static void Hook(T* object, u32 index, F& original, F hook)
+{
+    original = reinterpret_cast<F>(D3DHooks::HookMethod(object, index, reinterpret_cast<const void*>(hook)));
+}
+
+template<typename T, typename F>
+static void Unhook(T* object, u32 index, F original)
+{
+    D3DHooks::HookMethod(object, index, reinterpret_cast<const void*>(original));
+}
+
+StateFilter::StateFilter(IDirect3DDevice9* device) :
+    m_device(device)
+{
+    g_instance = this;
+
+    auto d = m_device.Get();
+    Hook(d, D3DHooks::DeviceMethod::Reset, g_reset, &ResetHook);
+    Hook(d, D3DHooks::DeviceMethod::SetRenderTarget, g_setRenderTarget, &SetRenderTargetHook);
+    Hook(d, D3DHooks::DeviceMethod::SetViewport, g_setViewport, &SetViewportHook);
+    Hook(d, D3DHooks::DeviceMethod::SetRenderState, g_setRenderState, &SetRenderStateHook);
+    Hook(d, D3DHooks::DeviceMethod::BeginStateBlock, g_beginStateBlock, &BeginStateBlockHook);
+    Hook(d, D3DHooks::DeviceMethod::EndStateBlock, g_endStateBlock, &EndStateBlockHook);
+    Hook(d, D3DHooks::DeviceMethod::SetTexture, g_setTexture, &SetTextureHook);
+    Hook(d, D3DHooks::DeviceMethod::SetSamplerState, g_setSamplerState, &SetSamplerStateHook);
+    Hook(d, D3DHooks::DeviceMethod::SetScissorRect, g_setScissorRect, &SetScissorRectHook);
+    Hook(d, D3DHooks::DeviceMethod::SetVertexShader, g_setVertexShader, &SetVertexShaderHook);
+    Hook(d, D3DHooks::DeviceMethod::SetPixelShader, g_setPixelShader, &SetPixelShaderHook);
+    Hook(d, D3DHooks::DeviceMethod::SetPixelShaderConstantF, g_setPixelShaderConstantF, &SetPixelShaderConstantFHook);
+
+    // Any state block will do for finding the state block vtable
+    ComPtr<IDirect3DStateBlock9> stateBlock;
+    VERIFY(m_device->CreateStateBlock(D3DSBT_PIXELSTATE, &stateBlock));
+    Hook(stateBlock.Get(), D3DHooks::StateBlockMethod::Apply, g_apply, &ApplyHook);
+}
+
+StateFilter::~StateFilter()
+{
+    ComPtr<IDirect3DStateBlock9> stateBlock;
+    if (SUCCEEDED(m_device->CreateStateBlock(D3DSBT_PIXELSTATE, &stateBlock))) {
+        Unhook(stateBlock.Get(), D3DHooks::StateBlockMethod::Apply, g_apply);
+    }
+
+    auto d = m_device.Get();
+    Unhook(d, D3DHooks::DeviceMethod::Reset, g_reset);
+    Unhook(d, D3DHooks::DeviceMethod::SetRenderTarget, g_setRenderTarget);
+    Unhook(d, D3DHooks::DeviceMethod::SetViewport, g_setViewport);
+    Unhook(d, D3DHooks::DeviceMethod::SetRenderState, g_setRenderState);
+    Unhook(d, D3DHooks::DeviceMethod::BeginStateBlock, g_beginStateBlock);
+    Unhook(d, D3DHooks::DeviceMethod::EndStateBlock, g_endStateBlock);
+    Unhook(d, D3DHooks::DeviceMethod::SetTexture, g_setTexture);
+    Unhook(d, D3DHooks::DeviceMethod::SetSamplerState, g_setSamplerState);
+    Unhook(d, D3DHooks::DeviceMethod::SetScissorRect, g_setScissorRect);
+    Unhook(d, D3DHooks::DeviceMethod::SetVertexShader, g_setVertexShader);
+    Unhook(d, D3DHooks::DeviceMethod::SetPixelShader, g_setPixelShader);
+    Unhook(d, D3DHooks::DeviceMethod::SetPixelShaderConstantF, g_setPixelShaderConstantF);
+
+    g_instance = nullptr;
+}
+
+HRESULT StateFilter::Check(HRESULT result)
+{
+    if (FAILED(result)) {
+        m_cache.Invalidate();
+    }
+
+    return result;
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::ResetHook(IDirect3DDevice9* device, D3DPRESENT_PARAMETERS* parameters)
+{
+    // Resetting sets every state back to its default
+    g_instance->m_cache.Invalidate();
+    return g_reset(device, parameters);
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::SetRenderTargetHook(IDirect3DDevice9* device, DWORD index,
+    IDirect3DSurface9* target)
+{
+    if (!g_instance->m_cache.SetRenderTarget(index, target)) {
+        return D3D_OK;
+    }
+
+    return g_instance->Check(g_setRenderTarget(device, index, target));
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::SetViewportHook(IDirect3DDevice9* device, const D3DVIEWPORT9* viewport)
+{
+    g_instance->m_cache.ViewportChanged();
+    return g_setViewport(device, viewport);
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::SetRenderStateHook(IDirect3DDevice9* device, D3DRENDERSTATETYPE state,
+    DWORD value)
+{
+    if (!g_instance->m_cache.SetRenderState(state, value)) {
+        return D3D_OK;
+    }
+
+    return g_instance->Check(g_setRenderState(device, state, value));
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::BeginStateBlockHook(IDirect3DDevice9* device)
+{
+    auto result = g_beginStateBlock(device);
+    if (SUCCEEDED(result)) {
+        g_instance->m_cache.SetRecording(true);
+    }
+
+    return result;
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::EndStateBlockHook(IDirect3DDevice9* device, IDirect3DStateBlock9** stateBlock)
+{
+    g_instance->m_cache.SetRecording(false);
+    return g_endStateBlock(device, stateBlock);
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::SetTextureHook(IDirect3DDevice9* device, DWORD stage,
+    IDirect3DBaseTexture9* texture)
+{
+    if (!g_instance->m_cache.SetTexture(stage, texture)) {
+        return D3D_OK;
+    }
+
+    return g_instance->Check(g_setTexture(device, stage, texture));
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::SetSamplerStateHook(IDirect3DDevice9* device, DWORD sampler,
+    D3DSAMPLERSTATETYPE type, DWORD value)
+{
+    if (!g_instance->m_cache.SetSamplerState(sampler, type, value)) {
+        return D3D_OK;
+    }
+
+    return g_instance->Check(g_setSamplerState(device, sampler, type, value));
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::SetScissorRectHook(IDirect3DDevice9* device, const RECT* rect)
+{
+    g_instance->m_cache.ViewportChanged();
+    return g_setScissorRect(device, rect);
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::SetVertexShaderHook(IDirect3DDevice9* device, IDirect3DVertexShader9* shader)
+{
+    if (!g_instance->m_cache.SetVertexShader(shader)) {
+        return D3D_OK;
+    }
+
+    return g_instance->Check(g_setVertexShader(device, shader));
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::SetPixelShaderHook(IDirect3DDevice9* device, IDirect3DPixelShader9* shader)
+{
+    if (!g_instance->m_cache.SetPixelShader(shader)) {
+        return D3D_OK;
+    }
+
+    return g_instance->Check(g_setPixelShader(device, shader));
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::SetPixelShaderConstantFHook(IDirect3DDevice9* device, UINT start,
+    const float* values, UINT count)
+{
+    if (!g_instance->m_cache.SetPixelShaderConstantF(start, values, count)) {
+        return D3D_OK;
+    }
+
+    return g_instance->Check(g_setPixelShaderConstantF(device, start, values, count));
+}
+
+HRESULT STDMETHODCALLTYPE StateFilter::ApplyHook(IDirect3DStateBlock9* stateBlock)
+{
+    // The cache doesn't know what the state block contains
+    g_instance->m_cache.Invalidate();
+    return g_apply(stateBlock);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Common.h"
+#include "StateCache.h"
+
+#include <d3d9.h>
+#include <wrl.h>
+
+// Drops redundant state changes before they reach the device, whether they come from the game or
+// from the renderer. The game's Draw() sets the vertex shader, texture and a few states on every
+// call, and the background passes set theirs on every flush.
+//
+// The device's Set methods are hooked and checked against a StateCache. Applying a state block
+// and resetting the device invalidate the cache, and nothing is filtered while a state block is
+// being recorded. Hooks installed after this one see only the changes that get through, so
+// TextureReplacer has to be created after this to swap textures before they're filtered.
+class StateFilter
+{
+public:
+    explicit StateFilter(IDirect3DDevice9* device);
+    ~StateFilter();
+
+    StateFilter(StateFilter&) = delete;
+    StateFilter(StateFilter&&) = delete;
+
+    const StateCache::Stats& GetStats() const
+    {
+        return m_cache.GetStats();
+    }
+
+private:
+    template<typename T>
+    using ComPtr = Microsoft::WRL::ComPtr<T>;
+
+    static HRESULT STDMETHODCALLTYPE ResetHook(IDirect3DDevice9* device, D3DPRESENT_PARAMETERS* parameters);
+    static HRESULT STDMETHODCALLTYPE SetRenderTargetHook(IDirect3DDevice9* device, DWORD index,
+        IDirect3DSurface9* target);
+    static HRESULT STDMETHODCALLTYPE SetViewportHook(IDirect3DDevice9* device, const D3DVIEWPORT9* viewport);
+    static HRESULT STDMETHODCALLTYPE SetRenderStateHook(IDirect3DDevice9* device, D3DRENDERSTATETYPE state,
+        DWORD value);
+    static HRESULT STDMETHODCALLTYPE BeginStateBlockHook(IDirect3DDevice9* device);
+    static HRESULT STDMETHODCALLTYPE EndStateBlockHook(IDirect3DDevice9* device, IDirect3DStateBlock9** stateBlock);
+    static HRESULT STDMETHODCALLTYPE SetTextureHook(IDirect3DDevice9* device, DWORD stage,
+        IDirect3DBaseTexture9* texture);
+    static HRESULT STDMETHODCALLTYPE SetSamplerStateHook(IDirect3DDevice9* device, DWORD sampler,
+        D3DSAMPLERSTATETYPE type, DWORD value);
+    static HRESULT STDMETHODCALLTYPE SetScissorRectHook(IDirect3DDevice9* device, const RECT* rect);
+    static HRESULT STDMETHODCALLTYPE SetVertexShaderHook(IDirect3DDevice9* device, IDirect3DVertexShader9* shader);
+    static HRESULT STDMETHODCALLTYPE SetPixelShaderHook(IDirect3DDevice9* device, IDirect3DPixelShader9* shader);
+    static HRESULT STDMETHODCALLTYPE SetPixelShaderConstantFHook(IDirect3DDevice9* device, UINT start,
+        const float* values, UINT count);
+    static HRESULT STDMETHODCALLTYPE ApplyHook(IDirect3DStateBlock9* stateBlock);
+
+    // Forgets the cached state if a call that got through failed, since the device may not have
+    // changed
+    HRESULT Check(HRESULT result);
+
+    ComPtr<IDirect3DDevice9> m_device;
+    StateCache m_cache;
+};
@@ -0,0 +1,77 @@
+#include "stdafx.h"
+
+#include "StateSet.h"
+
+#include <algorithm>
+
+void StateSet::Add(Kind kind, u32 index, u32 type)
+{
+    const State state{ kind, index, type };
+    if (!Contains(state)) {
+        m_states.push_back(state);
+    }
+}
+
+bool StateSet::Contains(const State& state) const
+{
+    return std::find(m_states.begin(), m_states.end(), state) != m_states.end();
+}
+
+void StateSet::AddRenderState(u32 state)
+{
+    Add(Kind::RenderState, state, 0);
+}
+
+void StateSet::AddSamplerState(u32 sampler, u32 type)
+{
+    Add(Kind::SamplerState, sampler, type);
+}
+
+void StateSet::AddTexture(u32 stage)
+{
+    Add(Kind::Texture, stage, 0);
+}
+
+void StateSet::AddVertexShader()
+{
+    Add(Kind::VertexShader, 0, 0);
+}
+
+void StateSet::AddPixelShader()
+{
+    Add(Kind::PixelShader, 0, 0);
+}
+
+void StateSet::AddPixelShaderConstants(u32 start, u32 count)
+{
+    for (u32 i = 0; i < count; i++) {
+        Add(Kind::PixelShaderConstant, start + i, 0);
+    }
+}
+
+void StateSet::AddVertexShaderConstants(u32 start, u32 count)
+{
+    for (u32 i = 0; i < count; i++) {
+        Add(Kind::VertexShaderConstant, start + i, 0);
+    }
+}
+
+void StateSet::AddVertexDeclaration()
+{
+    Add(Kind::VertexDeclaration, 0, 0);
+}
+
+void StateSet::AddTransform(u32 transform)
+{
+    Add(Kind::Transform, transform, 0);
+}
+
+void StateSet::AddViewport()
+{
+    Add(Kind::Viewport, 0, 0);
+}
+
+void StateSet::AddScissorRect()
+{
+    Add(Kind::ScissorRect, 0, 0);
+}
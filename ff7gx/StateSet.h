@@ -0,0 +1,92 @@
+#pragma once
+
+#include "Common.h"
+
+#include <vector>
+
+// The values from d3d9types.h that portable code adding states or modeling a device uses, since
+// d3d9types.h isn't available off Windows
+namespace D3D
+{
+    const u32 RS_ZENABLE = 7;
+    const u32 RS_ZWRITEENABLE = 14;
+    const u32 RS_ALPHATESTENABLE = 15;
+    const u32 RS_CULLMODE = 22;
+    const u32 RS_ALPHABLENDENABLE = 27;
+    const u32 RS_SCISSORTESTENABLE = 174;
+
+    const u32 SAMP_ADDRESSU = 1;
+    const u32 SAMP_ADDRESSV = 2;
+    const u32 SAMP_MAGFILTER = 5;
+    const u32 SAMP_MINFILTER = 6;
+
+    const u32 TEXF_POINT = 1;
+    const u32 TEXF_LINEAR = 2;
+    const u32 TADDRESS_CLAMP = 3;
+
+    const u32 CULL_NONE = 1;
+
+    const u32 TS_PROJECTION = 3;
+}
+
+// A set of device states, for saving and restoring just the states a pass changes instead of the
+// whole device state. Indices and types are the raw D3D9 numbers, which keeps this portable.
+class StateSet
+{
+public:
+    enum class Kind : u8
+    {
+        RenderState,            // index is the D3DRENDERSTATETYPE
+        SamplerState,           // index is the sampler, type the D3DSAMPLERSTATETYPE
+        Texture,                // index is the stage
+        VertexShader,
+        PixelShader,
+        PixelShaderConstant,    // index is the register
+        VertexShaderConstant,   // index is the register
+        VertexDeclaration,      // Also set by SetFVF()
+        Transform,              // index is the D3DTRANSFORMSTATETYPE
+        Viewport,
+        ScissorRect
+    };
+
+    struct State
+    {
+        Kind kind;
+        u32 index;
+        u32 type;
+
+        bool operator==(const State& other) const
+        {
+            return kind == other.kind && index == other.index && type == other.type;
+        }
+    };
+
+    StateSet() = default;
+    ~StateSet() = default;
+
+    // Adding a state that's already in the set does nothing
+    void AddRenderState(u32 state);
+    void AddSamplerState(u32 sampler, u32 type);
+    void AddTexture(u32 stage);
+    void AddVertexShader();
+    void AddPixelShader();
+    void AddPixelShaderConstants(u32 start, u32 count);
+    void AddVertexShaderConstants(u32 start, u32 count);
+    void AddVertexDeclaration();
+    void AddTransform(u32 transform);
+    void AddViewport();
+    void AddScissorRect();
+
+    bool Contains(const State& state) const;
+
+    const std::vector<State>& GetStates() const
+    {
+        return m_states;
+    }
+
+private:
+    void Add(Kind kind, u32 index, u32 type);
+
+    // Only a few dozen states, so a linear search is fine
+    std::vector<State> m_states;
+};
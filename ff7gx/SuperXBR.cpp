@@ -0,0 +1,313 @@
+#include "stdafx.h"
+
+#include "SuperXBR.h"
+#include "CpuFeatures.h"
+#include "SuperXBRKernel.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    struct F32x1
+    {
+        static const u32 LANES = 1;
+
+        float v;
+
+        F32x1() = default;
+        F32x1(float f) : v(f) {}
+
+        static F32x1 Load(const float* p)
+        {
+            return *p;
+        }
+
+        void Store(float* p) const
+        {
+            *p = v;
+        }
+    };
+
+    F32x1 operator+(F32x1 a, F32x1 b) { return a.v + b.v; }
+    F32x1 operator-(F32x1 a, F32x1 b) { return a.v - b.v; }
+    F32x1 operator*(F32x1 a, F32x1 b) { return a.v * b.v; }
+    F32x1 operator/(F32x1 a, F32x1 b) { return a.v / b.v; }
+    F32x1 Abs(F32x1 a) { return std::fabs(a.v); }
+    F32x1 Min(F32x1 a, F32x1 b) { return std::min(a.v, b.v); }
+    F32x1 Max(F32x1 a, F32x1 b) { return std::max(a.v, b.v); }
+    F32x1 Round(F32x1 a) { return std::nearbyint(a.v); }
+    bool GeZero(F32x1 a) { return a.v >= 0.0f; }
+    F32x1 Select(bool mask, F32x1 a, F32x1 b) { return mask ? a : b; }
+
+    struct F32x4
+    {
+        static const u32 LANES = 4;
+
+        __m128 v;
+
+        F32x4() = default;
+        F32x4(__m128 m) : v(m) {}
+        F32x4(float f) : v(_mm_set1_ps(f)) {}
+
+        static F32x4 Load(const float* p)
+        {
+            return _mm_loadu_ps(p);
+        }
+
+        void Store(float* p) const
+        {
+            _mm_storeu_ps(p, v);
+        }
+    };
+
+    F32x4 operator+(F32x4 a, F32x4 b) { return _mm_add_ps(a.v, b.v); }
+    F32x4 operator-(F32x4 a, F32x4 b) { return _mm_sub_ps(a.v, b.v); }
+    F32x4 operator*(F32x4 a, F32x4 b) { return _mm_mul_ps(a.v, b.v); }
+    F32x4 operator/(F32x4 a, F32x4 b) { return _mm_div_ps(a.v, b.v); }
+    F32x4 Abs(F32x4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+    F32x4 Min(F32x4 a, F32x4 b) { return _mm_min_ps(a.v, b.v); }
+    F32x4 Max(F32x4 a, F32x4 b) { return _mm_max_ps(a.v, b.v); }
+    F32x4 GeZero(F32x4 a) { return _mm_cmpge_ps(a.v, _mm_setzero_ps()); }
+
+    // Only used on values in 0..255, well within the range of the integer conversion
+    F32x4 Round(F32x4 a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a.v)); }
+
+    F32x4 Select(F32x4 mask, F32x4 a, F32x4 b)
+    {
+        return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+    }
+}
+
+// Kernels are run over the image width rounded up to this, the widest vector
+static const u32 ROW_ALIGNMENT = 8;
+
+// Below this many rows per thread, handing them to another thread costs more than it saves
+static const u32 MIN_ROWS_PER_THREAD = 16;
+
+namespace SuperXBRKernel
+{
+    PassParams GetPassParams(const SuperXBR::Params& params, int pass)
+    {
+        PassParams result;
+
+        // The two passes swap the weights around
+        const float diagonalWeight = pass == 0 ? 1.29633f : 1.75068f;
+        const float hvWeight = pass == 0 ? 1.75068f : 1.29633f;
+
+        result.weight1 = params.weight * diagonalWeight / 10.0f;
+        result.weight2 = params.weight * hvWeight / 10.0f / 2.0f;
+        result.edgeLimit = params.edgeStrength + 0.000001f;
+        result.ringing = 1.0f - params.antiRinging;
+
+        return result;
+    }
+}
+
+static u32 ToUnorm8(float value)
+{
+    return static_cast<u32>(std::nearbyint(std::min(std::max(value, 0.0f), 1.0f) * 255.0f));
+}
+
+static void ResizePlanes(SuperXBR::Planes& planes, u32 paddedWidth, u32 height)
+{
+    planes.stride = paddedWidth + 2 * SuperXBR::PADDING;
+    planes.rows = height + 2 * SuperXBR::PADDING;
+    planes.data.resize(planes.stride * planes.rows * 4);
+}
+
+// Replicates the edge pixels of a width x height image into the padding, like clamp addressing
+static void PadPlanes(SuperXBR::Planes& planes, u32 width, u32 height)
+{
+    const int stride = static_cast<int>(planes.stride);
+    const int padding = SuperXBR::PADDING;
+    const int right = stride - 2 * padding;
+
+    for (u32 c = 0; c < 4; c++) {
+        auto plane = planes.Plane(c);
+
+        for (int y = 0; y < static_cast<int>(height); y++) {
+            auto row = plane + y * stride;
+
+            std::fill(row - padding, row, row[0]);
+            std::fill(row + width, row + right + padding, row[width - 1]);
+        }
+
+        for (int y = 1; y <= padding; y++) {
+            std::copy(plane - padding, plane + right + padding, plane - y * stride - padding);
+
+            auto lastRow = plane + (height - 1) * stride;
+            std::copy(lastRow - padding, lastRow + right + padding, lastRow + y * stride - padding);
+        }
+    }
+}
+
+SuperXBR::SuperXBR(const Params& params, Kernel kernel, u32 threads) :
+    m_params(params),
+    m_kernel(kernel),
+    m_threads(threads ? threads : std::max(std::thread::hardware_concurrency(), 1u)),
+    m_width(0),
+    m_height(0),
+    m_paddedWidth(0),
+    m_sourcePixels(nullptr)
+{
+    if (m_kernel == Kernel::AVX2 && !CpuFeatures::HasAVX2()) {
+        m_kernel = Kernel::Auto;
+    }
+
+    if (m_kernel == Kernel::Auto) {
+        if (CpuFeatures::HasAVX2()) {
+            m_kernel = Kernel::AVX2;
+        } else if (CpuFeatures::HasSSE2()) {
+            m_kernel = Kernel::SSE2;
+        } else {
+            m_kernel = Kernel::Scalar;
+        }
+    }
+
+    if (m_threads > 1) {
+        m_pool = std::make_unique<ThreadPool>(m_threads);
+    }
+}
+
+// Out of line, ThreadPool is incomplete in the header
+SuperXBR::~SuperXBR() = default;
+
+template<typename Func>
+void SuperXBR::ForEachRowBand(u32 height, Func func)
+{
+    const u32 bands = std::min(m_threads, std::max(height / MIN_ROWS_PER_THREAD, 1u));
+    const u32 rowsPerBand = (height + bands - 1) / bands;
+
+    if (bands == 1 || !m_pool) {
+        func(0, height);
+        return;
+    }
+
+    // The calling thread works on the bands too
+    m_pool->Run(bands, [&](u32 band) {
+        const u32 y0 = band * rowsPerBand;
+        const u32 y1 = std::min(y0 + rowsPerBand, height);
+
+        if (y0 < y1) {
+            func(y0, y1);
+        }
+    });
+}
+
+void SuperXBR::Pass0(u32 y0, u32 y1)
+{
+    const auto params = SuperXBRKernel::GetPassParams(m_params, 0);
+
+    for (u32 y = y0; y < y1; y++) {
+        const int row = static_cast<int>(y);
+
+        switch (m_kernel) {
+        case Kernel::AVX2:
+            SuperXBRKernel::Pass0RowAVX2(m_source, m_diagonal, m_paddedWidth, row, params);
+            break;
+        case Kernel::SSE2:
+            SuperXBRKernel::Pass0Row<F32x4>(m_source, m_diagonal, m_paddedWidth, row, params);
+            break;
+        default:
+            SuperXBRKernel::Pass0Row<F32x1>(m_source, m_diagonal, m_width, row, params);
+            break;
+        }
+    }
+}
+
+void SuperXBR::Pass1(u32 y0, u32 y1, u32* dst)
+{
+    const auto params = SuperXBRKernel::GetPassParams(m_params, 1);
+    const u32 dstWidth = m_width * 2;
+
+    std::vector<float> outA(3 * m_paddedWidth);
+    std::vector<float> outB(3 * m_paddedWidth);
+
+    for (u32 y = y0; y < y1; y++) {
+        const int row = static_cast<int>(y);
+
+        switch (m_kernel) {
+        case Kernel::AVX2:
+            SuperXBRKernel::Pass1RowAVX2(m_source, m_diagonal, m_paddedWidth, row, params, outA.data(), outB.data());
+            break;
+        case Kernel::SSE2:
+            SuperXBRKernel::Pass1Row<F32x4>(m_source, m_diagonal, m_paddedWidth, row, params, outA.data(), outB.data());
+            break;
+        default:
+            SuperXBRKernel::Pass1Row<F32x1>(m_source, m_diagonal, m_paddedWidth, row, params, outA.data(), outB.data());
+            break;
+        }
+
+        // Each source pixel becomes a 2x2 block: the source pixel, pass 1 results to the right and
+        // below it, and the pass 0 result diagonally from it
+        const float* a[3] = { outA.data(), outA.data() + m_paddedWidth, outA.data() + 2 * m_paddedWidth };
+        const float* b[3] = { outB.data(), outB.data() + m_paddedWidth, outB.data() + 2 * m_paddedWidth };
+        const int diagonalRow = row * static_cast<int>(m_diagonal.stride);
+        const float* diagonal[3] = {
+            m_diagonal.Plane(0) + diagonalRow, m_diagonal.Plane(1) + diagonalRow, m_diagonal.Plane(2) + diagonalRow
+        };
+
+        u32* top = dst + (2 * y) * dstWidth;
+        u32* bottom = top + dstWidth;
+        const u32* source = m_sourcePixels + y * m_width;
+
+        for (u32 x = 0; x < m_width; x++) {
+            top[2 * x] = source[x] | 0xff000000;
+            top[2 * x + 1] = 0xff000000 | (ToUnorm8(a[0][x]) << 16) | (ToUnorm8(a[1][x]) << 8) | ToUnorm8(a[2][x]);
+            bottom[2 * x] = 0xff000000 | (ToUnorm8(b[0][x]) << 16) | (ToUnorm8(b[1][x]) << 8) | ToUnorm8(b[2][x]);
+            bottom[2 * x + 1] = 0xff000000 | (ToUnorm8(diagonal[0][x]) << 16) | (ToUnorm8(diagonal[1][x]) << 8) |
+                ToUnorm8(diagonal[2][x]);
+        }
+    }
+}
+
+void SuperXBR::Upscale(const u32* src, u32 width, u32 height, u32* dst)
+{
+    if (!width || !height) {
+        return;
+    }
+
+    if (width != m_width || height != m_height) {
+        m_width = width;
+        m_height = height;
+        m_paddedWidth = (width + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+
+        ResizePlanes(m_source, m_paddedWidth, height);
+        ResizePlanes(m_diagonal, m_paddedWidth, height);
+    }
+
+    m_sourcePixels = src;
+
+    for (u32 y = 0; y < height; y++) {
+        const int row = static_cast<int>(y * m_source.stride);
+
+        for (u32 x = 0; x < width; x++) {
+            const u32 pixel = src[y * width + x];
+            const float r = ((pixel >> 16) & 0xff) / 255.0f;
+            const float g = ((pixel >> 8) & 0xff) / 255.0f;
+            const float b = (pixel & 0xff) / 255.0f;
+
+            m_source.Plane(0)[row + x] = r;
+            m_source.Plane(1)[row + x] = g;
+            m_source.Plane(2)[row + x] = b;
+            m_source.Plane(3)[row + x] = r * 0.2126f + g * 0.7152f + b * 0.0722f;
+        }
+    }
+
+    PadPlanes(m_source, width, height);
+
+    ForEachRowBand(height, [this](u32 y0, u32 y1) { Pass0(y0, y1); });
+
+    // Pass 1 reads pass 0 results from the neighboring rows, so the padding can only be
+    // filled in after all of pass 0 is done
+    PadPlanes(m_diagonal, width, height);
+
+    ForEachRowBand(height, [this, dst](u32 y0, u32 y1) { Pass1(y0, y1, dst); });
+
+    m_sourcePixels = nullptr;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "Common.h"
+
+#include <memory>
+#include <vector>
+
+class ThreadPool;
+
+// CPU implementation of the two-pass super-xBR 2x upscaler in Shaders/super-xbr-pass*.hlsl.
+// Pass 0 computes a new pixel at the corner between every 2x2 block of source pixels,
+// pass 1 fills in the remaining pixels of the 2x grid from the source and pass 0 pixels.
+// Sampling matches the shaders with point filtering and clamp addressing, and the pass 0
+// result is quantized to 8 bits per channel like it would be in an A8R8G8B8 render target.
+class SuperXBR
+{
+public:
+    // Defaults are the ones given by the #pragma parameter lines in super-xbr-pass0.pixel.hlsl, which the
+    // shaders are compiled with
+    struct Params
+    {
+        float edgeStrength;     // XBR_EDGE_STR
+        float weight;           // XBR_WEIGHT
+        float antiRinging;      // XBR_ANTI_RINGING
+
+        Params() :
+            edgeStrength(2.0f),
+            weight(1.0f),
+            antiRinging(1.0f)
+        {
+        }
+    };
+
+    enum class Kernel
+    {
+        Auto,   // Best kernel supported by the CPU
+        Scalar,
+        SSE2,
+        AVX2
+    };
+
+    // threads = 0 uses one thread per hardware thread. The threads are started here and kept until
+    // the upscaler is destroyed.
+    SuperXBR(const Params& params = Params(), Kernel kernel = Kernel::Auto, u32 threads = 0);
+    ~SuperXBR();
+
+    SuperXBR(SuperXBR&) = delete;
+    SuperXBR(SuperXBR&&) = delete;
+
+    // Upscales a width x height A8R8G8B8 image to 2 * width x 2 * height. Output alpha is 0xff.
+    void Upscale(const u32* src, u32 width, u32 height, u32* dst);
+
+    Kernel GetKernel() const
+    {
+        return m_kernel;
+    }
+
+    const Params& GetParams() const
+    {
+        return m_params;
+    }
+
+    void SetParams(const Params& params)
+    {
+        m_params = params;
+    }
+
+    // The taps reach two pixels past the edges of the source image
+    static const int PADDING = 2;
+
+    // Planar float copy of an image, padded by replicating the edge pixels
+    struct Planes
+    {
+        u32 stride;
+        u32 rows;
+        std::vector<float> data;
+
+        float* Plane(u32 channel)
+        {
+            return data.data() + channel * stride * rows + PADDING * stride + PADDING;
+        }
+
+        const float* Plane(u32 channel) const
+        {
+            return data.data() + channel * stride * rows + PADDING * stride + PADDING;
+        }
+    };
+
+private:
+    template<typename Func>
+    void ForEachRowBand(u32 height, Func func);
+
+    void Pass0(u32 y0, u32 y1);
+    void Pass1(u32 y0, u32 y1, u32* dst);
+
+    Params m_params;
+    Kernel m_kernel;
+    u32 m_threads;
+
+    // Only with more than one thread
+    std::unique_ptr<ThreadPool> m_pool;
+
+    u32 m_width;
+    u32 m_height;
+
+    // Width rounded up to the widest kernel, so rows can be processed without a scalar tail
+    u32 m_paddedWidth;
+
+    // Only valid during Upscale()
+    const u32* m_sourcePixels;
+
+    Planes m_source;
+    Planes m_diagonal;
+};
@@ -0,0 +1,274 @@
+#pragma once
+
+// Shared super-xBR filter code, written once against a small vector type interface and
+// instantiated for scalar floats, SSE2 and AVX2. A vector type V must provide:
+//  - LANES, construction from a float (broadcast), V::Load(const float*) and Store(float*)
+//  - operators + - * /, and Abs, Min, Max, Round (to nearest integer)
+//  - GeZero(V) returning a mask, and Select(mask, a, b) returning a where the mask is set
+// Only include this from SuperXBR*.cpp.
+
+#include "Common.h"
+#include "SuperXBR.h"
+
+namespace SuperXBRKernel
+{
+    // Per-pass values derived from SuperXBR::Params
+    struct PassParams
+    {
+        float weight1;      // weight1 in the shaders
+        float weight2;      // weight2 in the shaders
+        float edgeLimit;    // XBR_EDGE_STR + 0.000001
+        float ringing;      // 1 - XBR_ANTI_RINGING
+    };
+
+    PassParams GetPassParams(const SuperXBR::Params& params, int pass);
+
+    // AVX2 kernels, compiled separately with AVX2 code generation enabled
+    void Pass0RowAVX2(const SuperXBR::Planes& src, SuperXBR::Planes& dst, u32 width, int y, const PassParams& params);
+    void Pass1RowAVX2(const SuperXBR::Planes& src, const SuperXBR::Planes& diagonal, u32 width, int y,
+        const PassParams& params, float* outA, float* outB);
+
+    // The templates have internal linkage on purpose: this header is compiled with different
+    // instruction sets in different files, and the linker must not merge those instantiations.
+    namespace
+    {
+        enum Channel
+        {
+            R, G, B, Y, CHANNELS
+        };
+
+        // Tap names follow the shaders
+        enum Tap
+        {
+            TAP_P0, TAP_P1, TAP_P2, TAP_P3,
+            TAP_B, TAP_C, TAP_D, TAP_E, TAP_F, TAP_G, TAP_H, TAP_I,
+            TAP_F4, TAP_I4, TAP_H5, TAP_I5,
+            TAP_COUNT
+        };
+
+        enum TapSource
+        {
+            SOURCE,     // Source image, s0 in pass 0 and prevTexture in pass 1
+            DIAGONAL    // Pass 0 output, s0 in pass 1
+        };
+
+        struct TapOffset
+        {
+            TapSource source;
+            int dx;
+            int dy;
+        };
+
+        // Texel offsets from super-xbr-pass0.vertex.hlsl
+        const TapOffset PASS0_TAPS[TAP_COUNT] = {
+            { SOURCE, -1, -1 }, { SOURCE, 2, -1 }, { SOURCE, -1, 2 }, { SOURCE, 2, 2 },
+            { SOURCE, 0, -1 }, { SOURCE, 1, -1 }, { SOURCE, -1, 0 }, { SOURCE, 0, 0 },
+            { SOURCE, 1, 0 }, { SOURCE, -1, 1 }, { SOURCE, 0, 1 }, { SOURCE, 1, 1 },
+            { SOURCE, 2, 0 }, { SOURCE, 2, 1 }, { SOURCE, 0, 2 }, { SOURCE, 1, 2 },
+        };
+
+        // Texels hit by the g1/g2 offsets in super-xbr-pass1.pixel.hlsl for the output pixel to the
+        // right of a source pixel. The pixel below it uses the same taps with dx and dy swapped.
+        const TapOffset PASS1_TAPS[TAP_COUNT] = {
+            { SOURCE, -1, 0 }, { DIAGONAL, 0, -2 }, { DIAGONAL, 0, 1 }, { SOURCE, 2, 0 },
+            { DIAGONAL, -1, -1 }, { SOURCE, 0, -1 }, { DIAGONAL, -1, 0 }, { SOURCE, 0, 0 },
+            { DIAGONAL, 0, -1 }, { SOURCE, 0, 1 }, { DIAGONAL, 0, 0 }, { SOURCE, 1, 0 },
+            { SOURCE, 1, -1 }, { DIAGONAL, 1, -1 }, { SOURCE, 1, 1 }, { DIAGONAL, 1, 0 },
+        };
+
+        // wp1..wp6 of each pass
+        template<int PASS>
+        struct Weights;
+
+        template<>
+        struct Weights<0>
+        {
+            static constexpr float wp1 = 2.0f, wp2 = 1.0f, wp3 = -1.0f, wp4 = 4.0f, wp5 = -1.0f, wp6 = 1.0f;
+        };
+
+        template<>
+        struct Weights<1>
+        {
+            static constexpr float wp1 = 8.0f, wp2 = 0.0f, wp3 = 0.0f, wp4 = 0.0f, wp5 = 0.0f, wp6 = 0.0f;
+        };
+
+        template<typename V>
+        V Df(V a, V b)
+        {
+            return Abs(a - b);
+        }
+
+        // d_wd() in the shaders. Terms with a zero weight are skipped at compile time.
+        template<typename V, int PASS>
+        V DiagonalWeight(V b0, V b1, V c0, V c1, V c2, V d0, V d1, V d2, V d3, V e1, V e2, V e3, V f2, V f3)
+        {
+            using W = Weights<PASS>;
+
+            V sum = V(W::wp1) * (Df(c1, c2) + Df(c1, c0) + Df(e2, e1) + Df(e2, e3));
+
+            if (W::wp2 != 0.0f) {
+                sum = sum + V(W::wp2) * (Df(d2, d3) + Df(d0, d1));
+            }
+
+            if (W::wp3 != 0.0f) {
+                sum = sum + V(W::wp3) * (Df(d1, d3) + Df(d0, d2));
+            }
+
+            if (W::wp4 != 0.0f) {
+                sum = sum + V(W::wp4) * Df(d1, d2);
+            }
+
+            if (W::wp5 != 0.0f) {
+                sum = sum + V(W::wp5) * (Df(c0, c2) + Df(e1, e3));
+            }
+
+            if (W::wp6 != 0.0f) {
+                sum = sum + V(W::wp6) * (Df(b0, b1) + Df(f2, f3));
+            }
+
+            return sum;
+        }
+
+        // hv_wd() in the shaders
+        template<typename V, int PASS>
+        V HorizontalVerticalWeight(V i1, V i2, V i3, V i4, V e1, V e2, V e3, V e4)
+        {
+            using W = Weights<PASS>;
+
+            V sum = V(W::wp1) * (Df(i1, e1) + Df(i2, e2) + Df(i3, e3) + Df(i4, e4));
+
+            if (W::wp4 != 0.0f) {
+                sum = sum + V(W::wp4) * (Df(i1, i2) + Df(i3, i4));
+            }
+
+            return sum;
+        }
+
+        // The body of main_fragment() in the shaders, from the edge detection to anti-ringing
+        template<typename V, int PASS>
+        void Filter(const V (&t)[TAP_COUNT][CHANNELS], const PassParams& params, V (&out)[3])
+        {
+            const V dEdge =
+                DiagonalWeight<V, PASS>(t[TAP_D][Y], t[TAP_B][Y], t[TAP_G][Y], t[TAP_E][Y], t[TAP_C][Y],
+                    t[TAP_P2][Y], t[TAP_H][Y], t[TAP_F][Y], t[TAP_P1][Y], t[TAP_H5][Y], t[TAP_I][Y],
+                    t[TAP_F4][Y], t[TAP_I5][Y], t[TAP_I4][Y]) -
+                DiagonalWeight<V, PASS>(t[TAP_C][Y], t[TAP_F4][Y], t[TAP_B][Y], t[TAP_F][Y], t[TAP_I4][Y],
+                    t[TAP_P0][Y], t[TAP_E][Y], t[TAP_I][Y], t[TAP_P3][Y], t[TAP_D][Y], t[TAP_H][Y],
+                    t[TAP_I5][Y], t[TAP_G][Y], t[TAP_H5][Y]);
+
+            const V hvEdge =
+                HorizontalVerticalWeight<V, PASS>(t[TAP_F][Y], t[TAP_I][Y], t[TAP_E][Y], t[TAP_H][Y],
+                    t[TAP_C][Y], t[TAP_I5][Y], t[TAP_B][Y], t[TAP_H5][Y]) -
+                HorizontalVerticalWeight<V, PASS>(t[TAP_E][Y], t[TAP_F][Y], t[TAP_H][Y], t[TAP_I][Y],
+                    t[TAP_D][Y], t[TAP_F4][Y], t[TAP_G][Y], t[TAP_I4][Y]);
+
+            // smoothstep(0.0, limits, abs(d_edge))
+            const V s = Min(Max(Abs(dEdge) / V(params.edgeLimit), V(0.0f)), V(1.0f));
+            const V edgeStrength = s * s * (V(3.0f) - V(2.0f) * s);
+            const V blend = V(1.0f) - edgeStrength;
+
+            // step(0.0, x) only ever selects one of two values, so it's done with masks
+            const auto diagonalMask = GeZero(dEdge);
+            const auto hvMask = GeZero(hvEdge);
+
+            const V w1Outer = V(-params.weight1);
+            const V w1Inner = V(params.weight1 + 0.5f);
+            const V w2Outer = V(-params.weight2);
+            const V w2Inner = V(params.weight2 + 0.25f);
+            const V ringing = V(params.ringing);
+
+            for (int c = 0; c < 3; c++) {
+                const V P0 = t[TAP_P0][c], P1 = t[TAP_P1][c], P2 = t[TAP_P2][c], P3 = t[TAP_P3][c];
+                const V B = t[TAP_B][c], C = t[TAP_C][c], D = t[TAP_D][c], E = t[TAP_E][c];
+                const V F = t[TAP_F][c], G = t[TAP_G][c], H = t[TAP_H][c], I = t[TAP_I][c];
+                const V F4 = t[TAP_F4][c], I4 = t[TAP_I4][c], H5 = t[TAP_H5][c], I5 = t[TAP_I5][c];
+
+                // Filtering and normalization in four directions
+                const V c1 = w1Outer * (P2 + P1) + w1Inner * (H + F);
+                const V c2 = w1Outer * (P0 + P3) + w1Inner * (E + I);
+                const V c3 = w2Outer * (D + G + F4 + I4) + w2Inner * (E + H + F + I);
+                const V c4 = w2Outer * (C + B + I5 + H5) + w2Inner * (F + E + I + H);
+
+                // Blend the strongest diagonal and horizontal/vertical directions
+                const V diagonal = Select(diagonalMask, c2, c1);
+                const V hv = Select(hvMask, c4, c3);
+                const V color = diagonal + blend * (hv - diagonal);
+
+                // Anti-ringing
+                const V ring = ringing * Select(diagonalMask, (P0 - E) * (I - P3), (P2 - H) * (F - P1));
+                const V minSample = Min(Min(E, F), Min(H, I)) + ring;
+                const V maxSample = Max(Max(E, F), Max(H, I)) - ring;
+
+                out[c] = Min(Max(color, minSample), maxSample);
+            }
+        }
+
+        template<typename V>
+        void LoadTaps(const SuperXBR::Planes& source, const SuperXBR::Planes* diagonal, const TapOffset* taps,
+            bool transpose, u32 x, int y, V (&t)[TAP_COUNT][CHANNELS])
+        {
+            for (int tap = 0; tap < TAP_COUNT; tap++) {
+                const auto& offset = taps[tap];
+                const auto& planes = offset.source == SOURCE ? source : *diagonal;
+                const int dx = transpose ? offset.dy : offset.dx;
+                const int dy = transpose ? offset.dx : offset.dy;
+                const int index = (y + dy) * static_cast<int>(planes.stride) + static_cast<int>(x) + dx;
+
+                for (int c = 0; c < CHANNELS; c++) {
+                    t[tap][c] = V::Load(planes.Plane(c) + index);
+                }
+            }
+        }
+
+        template<typename V>
+        void Pass0Row(const SuperXBR::Planes& src, SuperXBR::Planes& dst, u32 width, int y, const PassParams& params)
+        {
+            const V scale = V(255.0f);
+            const V invScale = V(1.0f / 255.0f);
+            const int row = y * static_cast<int>(dst.stride);
+
+            for (u32 x = 0; x < width; x += V::LANES) {
+                V t[TAP_COUNT][CHANNELS];
+                LoadTaps(src, nullptr, PASS0_TAPS, false, x, y, t);
+
+                V color[3];
+                Filter<V, 0>(t, params, color);
+
+                // Pass 0 renders to an 8 bit render target
+                for (int c = 0; c < 3; c++) {
+                    color[c] = Round(Min(Max(color[c], V(0.0f)), V(1.0f)) * scale) * invScale;
+                    color[c].Store(dst.Plane(c) + row + x);
+                }
+
+                const V luma = color[R] * V(0.2126f) + color[G] * V(0.7152f) + color[B] * V(0.0722f);
+                luma.Store(dst.Plane(Y) + row + x);
+            }
+        }
+
+        // Writes the pixel right of and the pixel below each source pixel of row y to outA and outB,
+        // as three planes of width floats each
+        template<typename V>
+        void Pass1Row(const SuperXBR::Planes& src, const SuperXBR::Planes& diagonal, u32 width, int y,
+            const PassParams& params, float* outA, float* outB)
+        {
+            for (u32 x = 0; x < width; x += V::LANES) {
+                V t[TAP_COUNT][CHANNELS];
+                V color[3];
+
+                LoadTaps(src, &diagonal, PASS1_TAPS, false, x, y, t);
+                Filter<V, 1>(t, params, color);
+
+                for (int c = 0; c < 3; c++) {
+                    color[c].Store(outA + c * width + x);
+                }
+
+                LoadTaps(src, &diagonal, PASS1_TAPS, true, x, y, t);
+                Filter<V, 1>(t, params, color);
+
+                for (int c = 0; c < 3; c++) {
+                    color[c].Store(outB + c * width + x);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#include "stdafx.h"
+
+// This file is compiled with AVX2 code generation (and without the precompiled header, which
+// is built without it), so nothing in it may be called without checking CpuFeatures::HasAVX2() first.
+
+#include "SuperXBR.h"
+#include "SuperXBRKernel.h"
+
+#include <immintrin.h>
+
+namespace
+{
+    struct F32x8
+    {
+        static const u32 LANES = 8;
+
+        __m256 v;
+
+        F32x8() = default;
+        F32x8(__m256 m) : v(m) {}
+        F32x8(float f) : v(_mm256_set1_ps(f)) {}
+
+        static F32x8 Load(const float* p)
+        {
+            return _mm256_loadu_ps(p);
+        }
+
+        void Store(float* p) const
+        {
+            _mm256_storeu_ps(p, v);
+        }
+    };
+
+    F32x8 operator+(F32x8 a, F32x8 b) { return _mm256_add_ps(a.v, b.v); }
+    F32x8 operator-(F32x8 a, F32x8 b) { return _mm256_sub_ps(a.v, b.v); }
+    F32x8 operator*(F32x8 a, F32x8 b) { return _mm256_mul_ps(a.v, b.v); }
+    F32x8 operator/(F32x8 a, F32x8 b) { return _mm256_div_ps(a.v, b.v); }
+    F32x8 Abs(F32x8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+    F32x8 Min(F32x8 a, F32x8 b) { return _mm256_min_ps(a.v, b.v); }
+    F32x8 Max(F32x8 a, F32x8 b) { return _mm256_max_ps(a.v, b.v); }
+    F32x8 Round(F32x8 a) { return _mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+    F32x8 GeZero(F32x8 a) { return _mm256_cmp_ps(a.v, _mm256_setzero_ps(), _CMP_GE_OQ); }
+    F32x8 Select(F32x8 mask, F32x8 a, F32x8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+}
+
+namespace SuperXBRKernel
+{
+    void Pass0RowAVX2(const SuperXBR::Planes& src, SuperXBR::Planes& dst, u32 width, int y, const PassParams& params)
+    {
+        Pass0Row<F32x8>(src, dst, width, y, params);
+    }
+
+    void Pass1RowAVX2(const SuperXBR::Planes& src, const SuperXBR::Planes& diagonal, u32 width, int y,
+        const PassParams& params, float* outA, float* outB)
+    {
+        Pass1Row<F32x8>(src, diagonal, width, y, params, outA, outB);
+    }
+}
@@ -0,0 +1,214 @@
+#include "stdafx.h"
+
+#include "TextureHash.h"
+#include "TextureHashKernel.h"
+#include "CpuFeatures.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <emmintrin.h>
+
+using namespace TextureHashKernel;
+
+// Final mix of a 64-bit value, from SplitMix64
+static u64 Avalanche(u64 h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
+}
+
+namespace TextureHashKernel
+{
+    void AccumulateScalar(u64* acc, const u8* data, std::size_t stripes, u32& blockStripe)
+    {
+        for (std::size_t s = 0; s < stripes; s++, data += TextureHasher::STRIPE_SIZE) {
+            const u64* key = SECRET + blockStripe;
+
+            for (u32 i = 0; i < LANES; i++) {
+                u64 d;
+                std::memcpy(&d, data + i * sizeof(u64), sizeof(d));
+
+                const u64 dk = d ^ key[i];
+                acc[i ^ 1] += d;
+                acc[i] += (dk & 0xffffffffu) * (dk >> 32);
+            }
+
+            if (++blockStripe == STRIPES_PER_BLOCK) {
+                for (u32 i = 0; i < LANES; i++) {
+                    acc[i] ^= acc[i] >> 47;
+                    acc[i] ^= SECRET[STRIPES_PER_BLOCK + i];
+                    acc[i] *= PRIME32;
+                }
+
+                blockStripe = 0;
+            }
+        }
+    }
+
+    void AccumulateSSE2(u64* acc, const u8* data, std::size_t stripes, u32& blockStripe)
+    {
+        __m128i a[4];
+        for (u32 i = 0; i < 4; i++) {
+            a[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc) + i);
+        }
+
+        const __m128i prime = _mm_set1_epi32(static_cast<int>(PRIME32));
+
+        for (std::size_t s = 0; s < stripes; s++, data += TextureHasher::STRIPE_SIZE) {
+            const __m128i* key = reinterpret_cast<const __m128i*>(SECRET + blockStripe);
+
+            for (u32 i = 0; i < 4; i++) {
+                const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data) + i);
+                const __m128i dk = _mm_xor_si128(d, _mm_loadu_si128(key + i));
+
+                // Low half of each key times the high half, and the data added to the other lane
+                const __m128i product = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+                const __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+                a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, swapped));
+            }
+
+            if (++blockStripe == STRIPES_PER_BLOCK) {
+                const __m128i* scramble = reinterpret_cast<const __m128i*>(SECRET + STRIPES_PER_BLOCK);
+
+                for (u32 i = 0; i < 4; i++) {
+                    __m128i x = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+                    x = _mm_xor_si128(x, _mm_loadu_si128(scramble + i));
+
+                    // 64 x 32-bit multiply out of two 32 x 32-bit ones
+                    const __m128i lo = _mm_mul_epu32(x, prime);
+                    const __m128i hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+                    a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+                }
+
+                blockStripe = 0;
+            }
+        }
+
+        for (u32 i = 0; i < 4; i++) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + i, a[i]);
+        }
+    }
+}
+
+TextureHasher::TextureHasher(u64 seed, Kernel kernel) :
+    m_kernel(kernel),
+    m_accumulate(nullptr),
+    m_blockStripe(0),
+    m_totalSize(0),
+    m_buffered(0)
+{
+    if (m_kernel == Kernel::AVX2 && !CpuFeatures::HasAVX2()) {
+        m_kernel = Kernel::Auto;
+    }
+
+    if (m_kernel == Kernel::Auto) {
+        if (CpuFeatures::HasAVX2()) {
+            m_kernel = Kernel::AVX2;
+        } else if (CpuFeatures::HasSSE2()) {
+            m_kernel = Kernel::SSE2;
+        } else {
+            m_kernel = Kernel::Scalar;
+        }
+    }
+
+    switch (m_kernel) {
+    case Kernel::AVX2:
+        m_accumulate = &AccumulateAVX2;
+        break;
+    case Kernel::SSE2:
+        m_accumulate = &AccumulateSSE2;
+        break;
+    default:
+        m_accumulate = &AccumulateScalar;
+        break;
+    }
+
+    for (u32 i = 0; i < LANES; i++) {
+        m_acc[i] = Avalanche(seed + i * PRIME64);
+    }
+}
+
+void TextureHasher::Update(const void* data, std::size_t size)
+{
+    auto bytes = static_cast<const u8*>(data);
+    m_totalSize += size;
+
+    if (m_buffered) {
+        const std::size_t count = std::min<std::size_t>(STRIPE_SIZE - m_buffered, size);
+        std::memcpy(m_buffer + m_buffered, bytes, count);
+        m_buffered += static_cast<u32>(count);
+        bytes += count;
+        size -= count;
+
+        if (m_buffered < STRIPE_SIZE) {
+            return;
+        }
+
+        m_accumulate(m_acc, m_buffer, 1, m_blockStripe);
+        m_buffered = 0;
+    }
+
+    const std::size_t stripes = size / STRIPE_SIZE;
+    if (stripes) {
+        m_accumulate(m_acc, bytes, stripes, m_blockStripe);
+        bytes += stripes * STRIPE_SIZE;
+        size -= stripes * STRIPE_SIZE;
+    }
+
+    if (size) {
+        std::memcpy(m_buffer, bytes, size);
+        m_buffered = static_cast<u32>(size);
+    }
+}
+
+u64 TextureHasher::Finish() const
+{
+    u64 acc[LANES];
+    std::copy(m_acc, m_acc + LANES, acc);
+
+    // The last partial stripe is padded with zeros, the total size tells it apart from real zeros
+    if (m_buffered) {
+        u8 last[STRIPE_SIZE] = {};
+        std::memcpy(last, m_buffer, m_buffered);
+
+        u32 blockStripe = m_blockStripe;
+        AccumulateScalar(acc, last, 1, blockStripe);
+    }
+
+    u64 h = m_totalSize * PRIME64;
+    for (u32 i = 0; i < LANES; i++) {
+        h = (h ^ Avalanche(acc[i] ^ SECRET[i])) * PRIME64;
+    }
+
+    return Avalanche(h);
+}
+
+u64 HashTexture(const void* bits, u32 pitch, u32 width, u32 height, u32 bytesPerPixel,
+    const u32* palette, u32 paletteSize, TextureHasher::Kernel kernel)
+{
+    const u64 seed = (static_cast<u64>(width) << 32 | height) ^ (static_cast<u64>(bytesPerPixel) << 24);
+    TextureHasher hasher(seed, kernel);
+
+    const std::size_t rowSize = static_cast<std::size_t>(width) * bytesPerPixel;
+    auto row = static_cast<const u8*>(bits);
+
+    if (pitch == rowSize) {
+        hasher.Update(row, rowSize * height);
+    } else {
+        for (u32 y = 0; y < height; y++) {
+            hasher.Update(row, rowSize);
+            row += pitch;
+        }
+    }
+
+    if (palette) {
+        hasher.Update(palette, paletteSize * sizeof(u32));
+    }
+
+    return hasher.Finish();
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Common.h"
+
+#include <cstddef>
+
+// Streaming 64-bit hash for texture contents, built for speed on the small textures the game
+// creates in bursts during field loads.
+//
+// The data is processed in 64-byte stripes by eight 64-bit accumulators (a multiply-accumulate
+// design like XXH3), which maps directly onto SSE2 and AVX2. Every kernel gives the same result
+// and the result doesn't depend on how the data is split between Update() calls, so hashes are
+// stable across runs and machines and can be stored in packs and caches.
+class TextureHasher
+{
+public:
+    enum class Kernel
+    {
+        Auto,   // Best kernel supported by the CPU
+        Scalar,
+        SSE2,
+        AVX2
+    };
+
+    static const u32 STRIPE_SIZE = 64;
+
+    explicit TextureHasher(u64 seed = 0, Kernel kernel = Kernel::Auto);
+
+    void Update(const void* data, std::size_t size);
+
+    // Doesn't change the state, so more data can be added after this
+    u64 Finish() const;
+
+    Kernel GetKernel() const
+    {
+        return m_kernel;
+    }
+
+    using AccumulateFunc = void(*)(u64* acc, const u8* data, std::size_t stripes, u32& blockStripe);
+
+private:
+    Kernel m_kernel;
+    AccumulateFunc m_accumulate;
+
+    u64 m_acc[8];
+    u32 m_blockStripe;
+    u64 m_totalSize;
+
+    u8 m_buffer[STRIPE_SIZE];
+    u32 m_buffered;
+};
+
+// Hashes width * height pixels of bytesPerPixel bytes, ignoring the padding at the end of each row.
+// The size and pixel format are part of the hash. If a palette is given (palette-aware mode, for
+// 8-bit textures), it is hashed too, so palette swaps of the same texture get different hashes.
+u64 HashTexture(const void* bits, u32 pitch, u32 width, u32 height, u32 bytesPerPixel,
+    const u32* palette = nullptr, u32 paletteSize = 0, TextureHasher::Kernel kernel = TextureHasher::Kernel::Auto);
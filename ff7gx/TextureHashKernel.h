@@ -0,0 +1,33 @@
+#pragma once
+
+// Constants and kernels shared by the TextureHash*.cpp files. Only include it from those.
+
+#include "Common.h"
+
+#include <cstddef>
+
+namespace TextureHashKernel
+{
+    static const u32 LANES = 8;
+    static const u32 STRIPES_PER_BLOCK = 16;
+
+    // Stripe n of a block uses SECRET[n] to SECRET[n + 7] as its keys
+    static const u64 SECRET[STRIPES_PER_BLOCK + LANES] = {
+        0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+        0x78e5c0cc4ee679cbull, 0x2172ffcc7dd05a82ull, 0x8e2443f7744608b8ull, 0x4c263a81e69035e0ull,
+        0xcb00c391bb52283cull, 0xa32e531b8b65d088ull, 0x4ef90da297486471ull, 0xd8acdea946ef1938ull,
+        0x3f349ce33f76faa8ull, 0x1d4f0bc7c7bbdcf9ull, 0x3159b4cd4be0518aull, 0x647378d9c97e9fc8ull,
+        0xc3ebd33483acc5eaull, 0xeb6313faffa081c5ull, 0x49daf0b751dd0d17ull, 0x9e68d429265516d3ull,
+        0xfca1477d58be162bull, 0xce31d07ad1b8f88full, 0x280416958f3acb45ull, 0x7e404bbbcafbd7afull,
+    };
+
+    static const u32 PRIME32 = 0x9e3779b1u;
+    static const u64 PRIME64 = 0x9e3779b185ebca87ull;
+
+    // Scalar kernel, which defines the hash. The other kernels must give the same result.
+    void AccumulateScalar(u64* acc, const u8* data, std::size_t stripes, u32& blockStripe);
+    void AccumulateSSE2(u64* acc, const u8* data, std::size_t stripes, u32& blockStripe);
+
+    // Compiled separately with AVX2 code generation enabled
+    void AccumulateAVX2(u64* acc, const u8* data, std::size_t stripes, u32& blockStripe);
+}
@@ -0,0 +1,55 @@
+#include "stdafx.h"
+
+// This file is compiled with AVX2 code generation (and without the precompiled header, which
+// is built without it), so nothing in it may be called without checking CpuFeatures::HasAVX2() first.
+
+#include "TextureHash.h"
+#include "TextureHashKernel.h"
+
+#include <immintrin.h>
+
+namespace TextureHashKernel
+{
+    void AccumulateAVX2(u64* acc, const u8* data, std::size_t stripes, u32& blockStripe)
+    {
+        __m256i a[2];
+        for (u32 i = 0; i < 2; i++) {
+            a[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc) + i);
+        }
+
+        const __m256i prime = _mm256_set1_epi32(static_cast<int>(PRIME32));
+
+        for (std::size_t s = 0; s < stripes; s++, data += TextureHasher::STRIPE_SIZE) {
+            const __m256i* key = reinterpret_cast<const __m256i*>(SECRET + blockStripe);
+
+            for (u32 i = 0; i < 2; i++) {
+                const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data) + i);
+                const __m256i dk = _mm256_xor_si256(d, _mm256_loadu_si256(key + i));
+
+                // Lane pairs stay within 128-bit halves, so the swap works like in the SSE2 kernel
+                const __m256i product = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+                const __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+                a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(product, swapped));
+            }
+
+            if (++blockStripe == STRIPES_PER_BLOCK) {
+                const __m256i* scramble = reinterpret_cast<const __m256i*>(SECRET + STRIPES_PER_BLOCK);
+
+                for (u32 i = 0; i < 2; i++) {
+                    __m256i x = _mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47));
+                    x = _mm256_xor_si256(x, _mm256_loadu_si256(scramble + i));
+
+                    const __m256i lo = _mm256_mul_epu32(x, prime);
+                    const __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime);
+                    a[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+                }
+
+                blockStripe = 0;
+            }
+        }
+
+        for (u32 i = 0; i < 2; i++) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc) + i, a[i]);
+        }
+    }
+}
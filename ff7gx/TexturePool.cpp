@@ -0,0 +1,182 @@
+#include "stdafx.h"
+
+#include "TexturePool.h"
+
+#include <algorithm>
+
+// D3DFORMAT values
+static const u32 FORMAT_R5G6B5 = 23;
+static const u32 FORMAT_A8 = 28;
+static const u32 FORMAT_L8 = 50;
+static const u32 FORMAT_G16R16F = 112;
+static const u32 FORMAT_R32F = 114;
+static const u32 FORMAT_A16B16G16R16F = 113;
+static const u32 FORMAT_A32B32G32R32F = 116;
+
+u32 TexturePool::GetBytesPerPixel(u32 format)
+{
+    switch (format) {
+    case FORMAT_A8:
+    case FORMAT_L8:
+        return 1;
+    case FORMAT_R5G6B5:
+        return 2;
+    case FORMAT_A16B16G16R16F:
+        return 8;
+    case FORMAT_A32B32G32R32F:
+        return 16;
+    case FORMAT_G16R16F:
+    case FORMAT_R32F:
+    default:
+        return 4;
+    }
+}
+
+u64 TexturePool::GetBytes(const Desc& desc)
+{
+    return static_cast<u64>(desc.width) * desc.height * GetBytesPerPixel(desc.format);
+}
+
+TexturePool::TexturePool(Allocator& allocator, u32 maxIdlePlans) :
+    m_allocator(allocator),
+    m_maxIdlePlans(maxIdlePlans),
+    m_stats{}
+{
+}
+
+TexturePool::~TexturePool()
+{
+    ReleaseAll();
+}
+
+void TexturePool::BeginPlan()
+{
+    m_requests.clear();
+    m_stats.requests = 0;
+    m_stats.aliased = 0;
+}
+
+u32 TexturePool::Request(const Desc& desc, u32 firstPass, u32 lastPass)
+{
+    m_requests.push_back({ desc, firstPass, std::max(firstPass, lastPass), 0 });
+    m_stats.requests++;
+
+    return static_cast<u32>(m_requests.size() - 1);
+}
+
+bool TexturePool::Allocate()
+{
+    for (auto& slot : m_slots) {
+        slot.inUse = false;
+        slot.isNew = false;
+    }
+
+    // Assigning in order of first use reuses a texture as soon as its last request ends, which
+    // needs as few textures as the most requests of one descriptor overlapping at any pass
+    std::vector<u32> order(m_requests.size());
+    for (u32 i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [this](u32 a, u32 b) {
+        return m_requests[a].firstPass < m_requests[b].firstPass;
+    });
+
+    m_stats.aliased = 0;
+
+    for (const u32 index : order) {
+        auto& request = m_requests[index];
+
+        // The lowest matching slot, so the same plan gets the same slots every time
+        u32 found = UINT32_MAX;
+        for (u32 i = 0; i < m_slots.size(); i++) {
+            const auto& slot = m_slots[i];
+            if (slot.owned && slot.desc == request.desc &&
+                (!slot.inUse || slot.busyUntil < request.firstPass)) {
+                found = i;
+                break;
+            }
+        }
+
+        if (found == UINT32_MAX) {
+            if (!m_freeSlots.empty()) {
+                found = m_freeSlots.back();
+                m_freeSlots.pop_back();
+            } else {
+                found = static_cast<u32>(m_slots.size());
+                m_slots.push_back({});
+            }
+
+            m_slots[found] = { request.desc, true, false, false, false, 0, 0 };
+        }
+
+        auto& slot = m_slots[found];
+        if (slot.inUse) {
+            m_stats.aliased++;
+        }
+
+        slot.inUse = true;
+        slot.busyUntil = request.lastPass;
+        request.slot = found;
+    }
+
+    // Idle textures are released before creating new ones, which keeps the peak down
+    for (u32 i = 0; i < m_slots.size(); i++) {
+        auto& slot = m_slots[i];
+
+        if (slot.inUse) {
+            slot.idlePlans = 0;
+        } else if (slot.owned && ++slot.idlePlans > m_maxIdlePlans) {
+            if (slot.created) {
+                Release(slot, i);
+            }
+
+            slot.owned = false;
+            m_freeSlots.push_back(i);
+        }
+    }
+
+    bool result = true;
+
+    for (u32 i = 0; i < m_slots.size(); i++) {
+        auto& slot = m_slots[i];
+
+        if (!slot.inUse || slot.created) {
+            continue;
+        }
+
+        if (!m_allocator.CreateTexture(i, slot.desc)) {
+            result = false;
+            continue;
+        }
+
+        slot.created = true;
+        slot.isNew = true;
+        m_stats.creations++;
+        m_stats.textures++;
+        m_stats.bytes += GetBytes(slot.desc);
+        m_stats.peakBytes = std::max(m_stats.peakBytes, m_stats.bytes);
+    }
+
+    return result;
+}
+
+void TexturePool::ReleaseAll()
+{
+    for (u32 i = 0; i < m_slots.size(); i++) {
+        if (m_slots[i].created) {
+            Release(m_slots[i], i);
+        }
+    }
+}
+
+void TexturePool::Release(Slot& slot, u32 index)
+{
+    m_allocator.ReleaseTexture(index);
+
+    slot.created = false;
+    slot.isNew = false;
+    m_stats.releases++;
+    m_stats.textures--;
+    m_stats.bytes -= GetBytes(slot.desc);
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "Common.h"
+
+#include <vector>
+
+// Hands out render targets and other D3DPOOL_DEFAULT textures by descriptor, so passes don't create
+// and release their own. The renderer plans a frame as a sequence of passes and requests every
+// texture for the passes from its first write to its last read. Requests with the same descriptor
+// whose passes don't overlap share a texture, and textures are kept from plan to plan, so planning
+// the same frame again creates nothing.
+//
+// A device reset releases every texture, and the next Allocate() creates them again. Descriptors
+// use the raw D3D9 numbers and an Allocator creates the textures, which keeps this portable.
+class TexturePool
+{
+public:
+    struct Desc
+    {
+        u32 width;
+        u32 height;
+        u32 format;     // D3DFORMAT
+        u32 usage;      // D3DUSAGE flags
+
+        bool operator==(const Desc& other) const
+        {
+            return width == other.width && height == other.height && format == other.format && usage == other.usage;
+        }
+    };
+
+    class Allocator
+    {
+    public:
+        virtual ~Allocator() = default;
+
+        // Creates the texture of a slot, returns false if it couldn't
+        virtual bool CreateTexture(u32 slot, const Desc& desc) = 0;
+        virtual void ReleaseTexture(u32 slot) = 0;
+    };
+
+    struct Stats
+    {
+        u64 bytes;          // Of the textures currently created
+        u64 peakBytes;
+        u64 creations;
+        u64 releases;
+        u32 textures;
+        u32 requests;       // In the current plan
+        u32 aliased;        // Requests of the current plan sharing a texture with an earlier one
+    };
+
+    // Bytes per pixel of the D3DFORMATs the renderer uses, 4 for the others
+    static u32 GetBytesPerPixel(u32 format);
+
+    static u64 GetBytes(const Desc& desc);
+
+    // Textures no plan has requested for maxIdlePlans plans are released
+    TexturePool(Allocator& allocator, u32 maxIdlePlans);
+    ~TexturePool();
+
+    TexturePool(TexturePool&) = delete;
+    TexturePool(TexturePool&&) = delete;
+
+    // Starts a new plan replacing the current one. Its handles are invalid after this.
+    void BeginPlan();
+
+    // Requests a texture for the passes from firstPass to lastPass, inclusive. Returns its handle.
+    u32 Request(const Desc& desc, u32 firstPass, u32 lastPass);
+
+    // Assigns textures to the requests of the plan and creates the missing ones. Returns false if
+    // a texture couldn't be created, in which case the plan can't be used.
+    bool Allocate();
+
+    // The Allocator slot of a request's texture, valid after Allocate()
+    u32 GetSlot(u32 handle) const
+    {
+        return m_requests[handle].slot;
+    }
+
+    // True if a request's texture was created by the last Allocate(), so its contents are undefined
+    bool IsNew(u32 handle) const
+    {
+        return m_slots[m_requests[handle].slot].isNew;
+    }
+
+    // Releases every texture, e.g. before a device reset
+    void ReleaseAll();
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    struct PlannedRequest
+    {
+        Desc desc;
+        u32 firstPass;
+        u32 lastPass;
+        u32 slot;
+    };
+
+    struct Slot
+    {
+        Desc desc;
+        bool owned;         // Not in m_freeSlots
+        bool created;
+        bool isNew;
+        bool inUse;         // Requested by the current plan
+        u32 busyUntil;      // Last pass of the latest request assigned to it in the current plan
+        u32 idlePlans;
+    };
+
+    void Release(Slot& slot, u32 index);
+
+    Allocator& m_allocator;
+    u32 m_maxIdlePlans;
+
+    std::vector<PlannedRequest> m_requests;
+
+    // Indices are Allocator slots. Slots stay owned by their descriptor across ReleaseAll(), so
+    // the same textures are created again, until they're idle for too long.
+    std::vector<Slot> m_slots;
+    std::vector<u32> m_freeSlots;
+
+    Stats m_stats;
+};
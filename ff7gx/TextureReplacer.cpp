@@ -0,0 +1,397 @@
+#include "stdafx.h"
+
+#include "TextureReplacer.h"
+#include "D3DHooks.h"
+#include "TextureHash.h"
+#include "Tga.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define VERIFY(hr) assert(SUCCEEDED((hr)))
+
+using SetTextureFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, DWORD, IDirect3DBaseTexture9*);
+using UpdateTextureFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DDevice9*, IDirect3DBaseTexture9*, IDirect3DBaseTexture9*);
+using LockRectFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DTexture9*, UINT, D3DLOCKED_RECT*, const RECT*, DWORD);
+using UnlockRectFunc = HRESULT(STDMETHODCALLTYPE*)(IDirect3DTexture9*, UINT);
+
+// The hooks are static functions, so they need a way to find the instance
+static TextureReplacer* g_instance;
+
+static SetTextureFunc g_setTexture;
+static UpdateTextureFunc g_updateTexture;
+static LockRectFunc g_lockRect;
+static UnlockRectFunc g_unlockRect;
+
+// Returns 0 for formats that aren't hashed, like compressed ones
+static u32 GetBytesPerPixel(D3DFORMAT format)
+{
+    switch (format) {
+    case D3DFMT_A8R8G8B8:
+    case D3DFMT_X8R8G8B8:
+        return 4;
+    case D3DFMT_R5G6B5:
+    case D3DFMT_X1R5G5B5:
+    case D3DFMT_A1R5G5B5:
+    case D3DFMT_A4R4G4B4:
+        return 2;
+    case D3DFMT_A8:
+    case D3DFMT_L8:
+    case D3DFMT_P8:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static ULONG GetRefCount(IUnknown* object)
+{
+    object->AddRef();
+    return object->Release();
+}
+
+TextureReplacer::TextureReplacer(IDirect3DDevice9* device, const std::string& packPath, const std::string& dumpPath,
+    u32 decodeThreads) :
+    m_device(device),
+    m_dumpPath(dumpPath),
+    m_loadDepth(0),
+    m_stats()
+{
+    if (!packPath.empty()) {
+        m_pack = std::make_unique<ImagePackReader>();
+        if (!m_pack->Open(packPath.c_str(), ImagePack::Contents::Textures)) {
+            m_pack.reset();
+        }
+    }
+
+    if (m_pack) {
+        // Copying out of the mapping is where the pack gets read from disk, so it's kept off
+        // the render thread
+        auto pack = m_pack.get();
+        m_uploads = std::make_unique<UploadScheduler>([pack](u64 key, UploadScheduler::Image& image) {
+            ImagePack::Image packImage;
+            if (!pack->Find(key, packImage)) {
+                return false;
+            }
+
+            image.width = packImage.width;
+            image.height = packImage.height;
+            image.pixels.assign(packImage.pixels, packImage.pixels + packImage.width * packImage.height);
+            return true;
+        }, decodeThreads);
+    }
+
+    if (!m_dumpPath.empty()) {
+        CreateDirectoryA(m_dumpPath.c_str(), nullptr);
+    }
+
+    g_instance = this;
+
+    // Any texture will do for finding the texture vtable
+    ComPtr<IDirect3DTexture9> texture;
+    VERIFY(m_device->CreateTexture(1, 1, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &texture, nullptr));
+
+    g_lockRect = reinterpret_cast<LockRectFunc>(D3DHooks::HookMethod(texture.Get(),
+        D3DHooks::TextureMethod::LockRect, reinterpret_cast<const void*>(&LockRectHook)));
+    g_unlockRect = reinterpret_cast<UnlockRectFunc>(D3DHooks::HookMethod(texture.Get(),
+        D3DHooks::TextureMethod::UnlockRect, reinterpret_cast<const void*>(&UnlockRectHook)));
+    g_setTexture = reinterpret_cast<SetTextureFunc>(D3DHooks::HookMethod(m_device.Get(),
+        D3DHooks::DeviceMethod::SetTexture, reinterpret_cast<const void*>(&SetTextureHook)));
+    g_updateTexture = reinterpret_cast<UpdateTextureFunc>(D3DHooks::HookMethod(m_device.Get(),
+        D3DHooks::DeviceMethod::UpdateTexture, reinterpret_cast<const void*>(&UpdateTextureHook)));
+}
+
+TextureReplacer::~TextureReplacer()
+{
+    ComPtr<IDirect3DTexture9> texture;
+    if (SUCCEEDED(m_device->CreateTexture(1, 1, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &texture, nullptr))) {
+        D3DHooks::HookMethod(texture.Get(), D3DHooks::TextureMethod::LockRect, reinterpret_cast<const void*>(g_lockRect));
+        D3DHooks::HookMethod(texture.Get(), D3DHooks::TextureMethod::UnlockRect, reinterpret_cast<const void*>(g_unlockRect));
+    }
+
+    D3DHooks::HookMethod(m_device.Get(), D3DHooks::DeviceMethod::SetTexture, reinterpret_cast<const void*>(g_setTexture));
+    D3DHooks::HookMethod(m_device.Get(), D3DHooks::DeviceMethod::UpdateTexture, reinterpret_cast<const void*>(g_updateTexture));
+
+    g_instance = nullptr;
+}
+
+bool TextureReplacer::GetPalette(u32* palette)
+{
+    UINT paletteNumber;
+    if (FAILED(m_device->GetCurrentTexturePalette(&paletteNumber))) {
+        return false;
+    }
+
+    PALETTEENTRY entries[256];
+    if (FAILED(m_device->GetPaletteEntries(paletteNumber, entries))) {
+        return false;
+    }
+
+    for (u32 i = 0; i < 256; i++) {
+        palette[i] = static_cast<u32>(entries[i].peFlags) << 24 | static_cast<u32>(entries[i].peRed) << 16 |
+            static_cast<u32>(entries[i].peGreen) << 8 | entries[i].peBlue;
+    }
+
+    return true;
+}
+
+void TextureReplacer::BeginLoad()
+{
+    m_loadDepth++;
+}
+
+void TextureReplacer::EndLoad()
+{
+    if (--m_loadDepth == 0) {
+        m_pendingLocks.clear();
+    }
+}
+
+void TextureReplacer::Purge()
+{
+    // Only the map is left holding the game texture if the game has released it
+    for (auto it = m_replacements.begin(); it != m_replacements.end();) {
+        if (GetRefCount(it->second.original.Get()) == 1) {
+            it = m_replacements.erase(it);
+            m_stats.purged++;
+        } else {
+            ++it;
+        }
+    }
+
+    for (auto it = m_waiting.begin(); it != m_waiting.end();) {
+        if (GetRefCount(it->second.original.Get()) == 1) {
+            it = m_waiting.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for (auto it = m_replacementsByKey.begin(); it != m_replacementsByKey.end();) {
+        if (GetRefCount(it->second.Get()) == 1) {
+            it = m_replacementsByKey.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    m_stats.live = static_cast<u32>(m_replacements.size());
+    m_stats.waiting = static_cast<u32>(m_waiting.size());
+}
+
+void TextureReplacer::ApplyUploads(const UploadScheduler::Budget& budget)
+{
+    if (m_uploads) {
+        m_uploads->ApplyCompleted(*this, budget);
+    }
+}
+
+bool TextureReplacer::GetUploadStats(UploadScheduler::Stats& stats) const
+{
+    if (!m_uploads) {
+        return false;
+    }
+
+    stats = m_uploads->GetStats();
+    return true;
+}
+
+void TextureReplacer::Replace(IDirect3DBaseTexture9* texture, u64 key)
+{
+    auto it = m_replacementsByKey.find(key);
+    if (it != m_replacementsByKey.end()) {
+        m_waiting.erase(texture);
+
+        auto& entry = m_replacements[texture];
+        entry.original = texture;
+        entry.replacement = it->second;
+
+        m_stats.replaced++;
+    } else {
+        // The original is used until the replacement has been uploaded
+        m_replacements.erase(texture);
+
+        auto& entry = m_waiting[texture];
+        entry.original = texture;
+        entry.key = key;
+
+        m_uploads->Request(key);
+    }
+
+    m_stats.live = static_cast<u32>(m_replacements.size());
+    m_stats.waiting = static_cast<u32>(m_waiting.size());
+}
+
+void TextureReplacer::Upload(const UploadScheduler::Image& image)
+{
+    ComPtr<IDirect3DTexture9> texture;
+    if (FAILED(m_device->CreateTexture(image.width, image.height, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED,
+        &texture, nullptr))) {
+        return;
+    }
+
+    // Locked through the original functions, the hooks are only for game textures
+    D3DLOCKED_RECT rect;
+    if (FAILED(g_lockRect(texture.Get(), 0, &rect, nullptr, 0))) {
+        return;
+    }
+
+    for (u32 y = 0; y < image.height; y++) {
+        std::memcpy(static_cast<u8*>(rect.pBits) + y * rect.Pitch, &image.pixels[y * image.width],
+            image.width * sizeof(u32));
+    }
+
+    g_unlockRect(texture.Get(), 0);
+
+    m_replacementsByKey[image.key] = texture;
+
+    for (auto it = m_waiting.begin(); it != m_waiting.end();) {
+        if (it->second.key != image.key) {
+            ++it;
+            continue;
+        }
+
+        auto& entry = m_replacements[it->first];
+        entry.original = it->second.original;
+        entry.replacement = texture;
+
+        m_stats.replaced++;
+        it = m_waiting.erase(it);
+    }
+
+    m_stats.live = static_cast<u32>(m_replacements.size());
+    m_stats.waiting = static_cast<u32>(m_waiting.size());
+}
+
+void TextureReplacer::OnTextureFilled(IDirect3DTexture9* texture, const PendingLock& lock)
+{
+    D3DSURFACE_DESC desc;
+    if (FAILED(texture->GetLevelDesc(0, &desc))) {
+        return;
+    }
+
+    const u32 bytesPerPixel = GetBytesPerPixel(desc.Format);
+    if (!bytesPerPixel) {
+        return;
+    }
+
+    // Palette swaps of the same indices are different textures
+    u32 palette[256];
+    const bool paletted = desc.Format == D3DFMT_P8 && GetPalette(palette);
+
+    const u64 key = HashTexture(lock.bits, lock.pitch, desc.Width, desc.Height, bytesPerPixel,
+        paletted ? palette : nullptr, paletted ? 256 : 0);
+    m_stats.hashed++;
+
+    // Dumps are for making replacements, which are always 32-bit, so other formats are skipped
+    if (!m_dumpPath.empty() && bytesPerPixel == 4 && m_dumpedKeys.insert(key).second) {
+        std::vector<u32> pixels(desc.Width * desc.Height);
+        for (u32 y = 0; y < desc.Height; y++) {
+            std::memcpy(&pixels[y * desc.Width], static_cast<const u8*>(lock.bits) + y * lock.pitch,
+                desc.Width * sizeof(u32));
+        }
+
+        if (desc.Format == D3DFMT_X8R8G8B8) {
+            for (auto& pixel : pixels) {
+                pixel |= 0xff000000;
+            }
+        }
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "\\%016llx.tga", static_cast<unsigned long long>(key));
+
+        if (WriteTga(m_dumpPath + name, pixels.data(), desc.Width, desc.Height)) {
+            m_stats.dumped++;
+        }
+    }
+
+    ImagePack::Image image;
+    if (!m_pack || !m_pack->Find(key, image)) {
+        // The game may refill a texture it already has a replacement for
+        m_replacements.erase(texture);
+        m_waiting.erase(texture);
+
+        m_stats.live = static_cast<u32>(m_replacements.size());
+        m_stats.waiting = static_cast<u32>(m_waiting.size());
+        return;
+    }
+
+    Replace(texture, key);
+}
+
+HRESULT STDMETHODCALLTYPE TextureReplacer::SetTextureHook(IDirect3DDevice9* device, DWORD stage,
+    IDirect3DBaseTexture9* texture)
+{
+    if (texture) {
+        auto& replacements = g_instance->m_replacements;
+
+        auto it = replacements.find(texture);
+        if (it != replacements.end()) {
+            return g_setTexture(device, stage, it->second.replacement.Get());
+        }
+    }
+
+    return g_setTexture(device, stage, texture);
+}
+
+HRESULT STDMETHODCALLTYPE TextureReplacer::UpdateTextureHook(IDirect3DDevice9* device, IDirect3DBaseTexture9* src,
+    IDirect3DBaseTexture9* dst)
+{
+    // Textures filled in system memory and then copied to video memory get the same replacement
+    auto& replacements = g_instance->m_replacements;
+    auto& waiting = g_instance->m_waiting;
+
+    if (dst) {
+        auto it = replacements.find(src);
+        if (it != replacements.end()) {
+            auto replacement = it->second.replacement;
+
+            auto& entry = replacements[dst];
+            entry.original = dst;
+            entry.replacement = replacement;
+        } else {
+            auto waitingIt = waiting.find(src);
+            if (waitingIt != waiting.end()) {
+                g_instance->Replace(dst, waitingIt->second.key);
+            }
+        }
+    }
+
+    return g_updateTexture(device, src, dst);
+}
+
+HRESULT STDMETHODCALLTYPE TextureReplacer::LockRectHook(IDirect3DTexture9* texture, UINT level,
+    D3DLOCKED_RECT* lockedRect, const RECT* rect, DWORD flags)
+{
+    HRESULT hr = g_lockRect(texture, level, lockedRect, rect, flags);
+
+    // Only whole level 0 locks can be hashed
+    if (SUCCEEDED(hr) && g_instance->m_loadDepth > 0 && level == 0 && !rect && !(flags & D3DLOCK_READONLY)) {
+        PendingLock lock;
+        lock.bits = lockedRect->pBits;
+        lock.pitch = static_cast<u32>(lockedRect->Pitch);
+
+        g_instance->m_pendingLocks[texture] = lock;
+    }
+
+    return hr;
+}
+
+HRESULT STDMETHODCALLTYPE TextureReplacer::UnlockRectHook(IDirect3DTexture9* texture, UINT level)
+{
+    if (level == 0) {
+        auto& pendingLocks = g_instance->m_pendingLocks;
+
+        auto it = pendingLocks.find(texture);
+        if (it != pendingLocks.end()) {
+            const PendingLock lock = it->second;
+            pendingLocks.erase(it);
+
+            // The data has to be read before unlocking
+            g_instance->OnTextureFilled(texture, lock);
+        }
+    }
+
+    return g_unlockRect(texture, level);
+}
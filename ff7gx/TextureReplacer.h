@@ -0,0 +1,123 @@
+#pragma once
+
+#include "Common.h"
+#include "ImagePack.h"
+#include "UploadScheduler.h"
+
+#include <d3d9.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <wrl.h>
+
+// Replaces game textures with high resolution versions from a texture pack.
+//
+// Textures are identified by a hash of their contents when the game fills them in during
+// GfxFn_50 (texture creation). Texture uploads don't go through the GfxFunctions table, so
+// LockRect/UnlockRect on textures and SetTexture/UpdateTexture on the device are hooked.
+// If a hash matches a pack entry, the replacement is read from the mapped pack on a worker
+// thread and uploaded in ApplyUploads() within a per-frame budget. Until then the original
+// texture is used, after that the replacement is bound instead whenever the game binds it.
+class TextureReplacer : private UploadScheduler::Sink
+{
+public:
+    struct Stats
+    {
+        u32 hashed;         // Textures hashed when the game filled them in
+        u32 replaced;       // Textures that had a replacement in the pack
+        u32 dumped;
+        u32 purged;         // Replacements released after the game released the original
+        u32 live;           // Game textures currently being replaced
+        u32 waiting;        // Game textures waiting for their replacement to be uploaded
+    };
+
+    // Either path may be empty to disable loading replacements or dumping textures
+    TextureReplacer(IDirect3DDevice9* device, const std::string& packPath, const std::string& dumpPath,
+        u32 decodeThreads);
+    ~TextureReplacer();
+
+    TextureReplacer(TextureReplacer&) = delete;
+    TextureReplacer(TextureReplacer&&) = delete;
+
+    // Textures filled in between these are hashed and replaced
+    void BeginLoad();
+    void EndLoad();
+
+    // Uploads replacements that have been read from the pack, called once per frame
+    void ApplyUploads(const UploadScheduler::Budget& budget);
+
+    // Releases the replacements of textures the game has released
+    void Purge();
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+    // Queue depth and upload time, or nothing if there's no pack
+    bool GetUploadStats(UploadScheduler::Stats& stats) const;
+
+private:
+    template<typename T>
+    using ComPtr = Microsoft::WRL::ComPtr<T>;
+
+    struct PendingLock
+    {
+        void* bits;
+        u32 pitch;
+    };
+
+    static HRESULT STDMETHODCALLTYPE SetTextureHook(IDirect3DDevice9* device, DWORD stage,
+        IDirect3DBaseTexture9* texture);
+    static HRESULT STDMETHODCALLTYPE UpdateTextureHook(IDirect3DDevice9* device, IDirect3DBaseTexture9* src,
+        IDirect3DBaseTexture9* dst);
+    static HRESULT STDMETHODCALLTYPE LockRectHook(IDirect3DTexture9* texture, UINT level, D3DLOCKED_RECT* lockedRect,
+        const RECT* rect, DWORD flags);
+    static HRESULT STDMETHODCALLTYPE UnlockRectHook(IDirect3DTexture9* texture, UINT level);
+
+    // Current device palette as A8R8G8B8, for hashing P8 textures
+    bool GetPalette(u32* palette);
+
+    // Called with the texture still locked
+    void OnTextureFilled(IDirect3DTexture9* texture, const PendingLock& lock);
+
+    // Replaces the texture right away if the replacement has been uploaded already, or once it is
+    void Replace(IDirect3DBaseTexture9* texture, u64 key);
+
+    virtual void Upload(const UploadScheduler::Image& image) override;
+
+    ComPtr<IDirect3DDevice9> m_device;
+
+    std::unique_ptr<ImagePackReader> m_pack;
+    std::unique_ptr<UploadScheduler> m_uploads;
+    std::string m_dumpPath;
+    std::unordered_set<u64> m_dumpedKeys;
+
+    u32 m_loadDepth;
+    std::unordered_map<IDirect3DTexture9*, PendingLock> m_pendingLocks;
+
+    // Replacements by game texture. The game texture is referenced too, so the pointer
+    // can't be reused for another texture before the entry is purged.
+    struct Replacement
+    {
+        ComPtr<IDirect3DBaseTexture9> original;
+        ComPtr<IDirect3DTexture9> replacement;
+    };
+
+    std::unordered_map<IDirect3DBaseTexture9*, Replacement> m_replacements;
+
+    // Game textures whose replacement hasn't been uploaded yet
+    struct Waiting
+    {
+        ComPtr<IDirect3DBaseTexture9> original;
+        u64 key;
+    };
+
+    std::unordered_map<IDirect3DBaseTexture9*, Waiting> m_waiting;
+
+    // Replacements by key, shared by game textures with the same contents
+    std::unordered_map<u64, ComPtr<IDirect3DTexture9>> m_replacementsByKey;
+
+    Stats m_stats;
+};
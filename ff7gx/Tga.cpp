@@ -0,0 +1,89 @@
+#include "stdafx.h"
+
+#include "Tga.h"
+
+#include <algorithm>
+#include <fstream>
+
+#pragma pack(push, 1)
+struct TgaHeader
+{
+    u8 idLength;
+    u8 colorMapType;
+    u8 imageType;
+    u8 colorMap[5];
+    u16 xOrigin;
+    u16 yOrigin;
+    u16 width;
+    u16 height;
+    u8 bitsPerPixel;
+    u8 descriptor;
+};
+#pragma pack(pop)
+
+static const u8 TGA_TRUECOLOR = 2;
+static const u8 TGA_TOP_LEFT = 0x20;
+static const u8 TGA_ALPHA_BITS = 8;
+
+bool WriteTga(const std::string& path, const u32* pixels, u32 width, u32 height)
+{
+    if (width > 0xffff || height > 0xffff) {
+        return false;
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+
+    TgaHeader header = {};
+    header.imageType = TGA_TRUECOLOR;
+    header.width = static_cast<u16>(width);
+    header.height = static_cast<u16>(height);
+    header.bitsPerPixel = 32;
+    header.descriptor = TGA_TOP_LEFT | TGA_ALPHA_BITS;
+
+    // TGA stores BGRA, which is the memory layout of A8R8G8B8 on little endian
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(pixels), width * height * sizeof(u32));
+
+    return !!file;
+}
+
+bool ReadTga(const std::string& path, u32& width, u32& height, std::vector<u32>& pixels)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    TgaHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return false;
+    }
+
+    // Only the format written by WriteTga() and most editors' uncompressed 32-bit output is supported
+    if (header.imageType != TGA_TRUECOLOR || header.colorMapType != 0 || header.bitsPerPixel != 32 ||
+        header.width == 0 || header.height == 0) {
+        return false;
+    }
+
+    file.ignore(header.idLength);
+
+    width = header.width;
+    height = header.height;
+    pixels.resize(width * height);
+
+    if (!file.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(u32))) {
+        return false;
+    }
+
+    // Bottom-up is the TGA default
+    if (!(header.descriptor & TGA_TOP_LEFT)) {
+        for (u32 y = 0; y < height / 2; y++) {
+            std::swap_ranges(&pixels[y * width], &pixels[(y + 1) * width], &pixels[(height - 1 - y) * width]);
+        }
+    }
+
+    return true;
+}
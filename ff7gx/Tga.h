@@ -0,0 +1,12 @@
+#pragma once
+
+#include "Common.h"
+
+#include <string>
+#include <vector>
+
+// Uncompressed 32-bit TGA files, used for dumped and replacement textures since
+// practically every image editor can read and write them.
+// Pixels are A8R8G8B8, top row first.
+bool WriteTga(const std::string& path, const u32* pixels, u32 width, u32 height);
+bool ReadTga(const std::string& path, u32& width, u32& height, std::vector<u32>& pixels);
@@ -0,0 +1,164 @@
+#include "stdafx.h"
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(u32 threads) :
+    m_stopping(false),
+    m_task(nullptr),
+    m_batch(0),
+    m_remaining(0),
+    m_batches(0),
+    m_tasks(0),
+    m_steals(0)
+{
+    if (!threads) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    for (u32 i = 0; i < threads; i++) {
+        m_queues.push_back(std::make_unique<Queue>());
+    }
+
+    // Thread 0 is whoever calls Run()
+    for (u32 i = 1; i < threads; i++) {
+        m_workers.emplace_back([this, i] { WorkerMain(i); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+
+    m_batchStarted.notify_all();
+
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Run(u32 count, const Task& task)
+{
+    if (!count) {
+        return;
+    }
+
+    const u32 threads = GetThreadCount();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_task = &task;
+        m_remaining.store(count);
+
+        for (u32 thread = 0; thread < threads; thread++) {
+            const u32 begin = static_cast<u32>(static_cast<u64>(count) * thread / threads);
+            const u32 end = static_cast<u32>(static_cast<u64>(count) * (thread + 1) / threads);
+
+            auto& queue = *m_queues[thread];
+            std::lock_guard<std::mutex> queueLock(queue.mutex);
+
+            for (u32 i = begin; i < end; i++) {
+                queue.tasks.push_back(i);
+            }
+        }
+
+        m_batch++;
+        m_batches++;
+        m_tasks += count;
+    }
+
+    m_batchStarted.notify_all();
+
+    while (RunTask(0)) {
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_batchDone.wait(lock, [this] { return m_remaining.load() == 0; });
+    m_task = nullptr;
+}
+
+bool ThreadPool::RunTask(u32 thread)
+{
+    const u32 threads = GetThreadCount();
+
+    u32 index = 0;
+    bool found = false;
+    bool stolen = false;
+
+    {
+        auto& queue = *m_queues[thread];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (!queue.tasks.empty()) {
+            index = queue.tasks.front();
+            queue.tasks.pop_front();
+            found = true;
+        }
+    }
+
+    // Steal the task furthest from what the victim is working on
+    for (u32 i = 1; i < threads && !found; i++) {
+        auto& queue = *m_queues[(thread + i) % threads];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+
+        if (!queue.tasks.empty()) {
+            index = queue.tasks.back();
+            queue.tasks.pop_back();
+            found = true;
+            stolen = true;
+        }
+    }
+
+    if (!found) {
+        return false;
+    }
+
+    (*m_task)(index);
+
+    if (stolen) {
+        m_steals.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (m_remaining.fetch_sub(1) == 1) {
+        // Taking the lock makes sure Run() is either waiting or hasn't checked m_remaining yet
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_batchDone.notify_all();
+    }
+
+    return true;
+}
+
+void ThreadPool::WorkerMain(u32 thread)
+{
+    u64 lastBatch = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_batchStarted.wait(lock, [&] { return m_stopping || m_batch != lastBatch; });
+
+            if (m_stopping) {
+                return;
+            }
+
+            lastBatch = m_batch;
+        }
+
+        while (RunTask(thread)) {
+        }
+    }
+}
+
+ThreadPool::Stats ThreadPool::GetStats() const
+{
+    Stats stats;
+    stats.batches = m_batches;
+    stats.tasks = m_tasks;
+    stats.steals = m_steals.load(std::memory_order_relaxed);
+    return stats;
+}
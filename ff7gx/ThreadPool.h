@@ -0,0 +1,78 @@
+#pragma once
+
+#include "Common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs batches of independent tasks on a fixed set of threads.
+//
+// Each thread has its own queue, filled with a contiguous range of the batch so neighbouring
+// tasks run on the same thread. A thread that empties its queue steals from the back of the
+// others, so a few expensive tasks (e.g. screen tiles covered by most of the triangles) don't
+// leave the rest of the threads idle. The thread calling Run() works on the batch too.
+class ThreadPool
+{
+public:
+    using Task = std::function<void(u32 index)>;
+
+    struct Stats
+    {
+        u64 batches;
+        u64 tasks;
+        u64 steals;     // Tasks run by a thread other than the one they were queued on
+    };
+
+    // threads includes the calling thread, 0 uses one thread per core
+    explicit ThreadPool(u32 threads);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+
+    u32 GetThreadCount() const
+    {
+        return static_cast<u32>(m_queues.size());
+    }
+
+    // Calls task(i) for every i below count and returns once they have all finished.
+    // Must not be called from a task.
+    void Run(u32 count, const Task& task);
+
+    Stats GetStats() const;
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<u32> tasks;
+    };
+
+    void WorkerMain(u32 thread);
+
+    // Runs one task from the thread's own queue or stolen from another, returns false if there are none
+    bool RunTask(u32 thread);
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_batchStarted;
+    std::condition_variable m_batchDone;
+    bool m_stopping;
+
+    // The current batch, only valid while tasks remain
+    const Task* m_task;
+    u64 m_batch;
+    std::atomic<u32> m_remaining;
+
+    u64 m_batches;
+    u64 m_tasks;
+    std::atomic<u64> m_steals;
+};
@@ -0,0 +1,75 @@
+#include "stdafx.h"
+
+#include "TileBatcher.h"
+
+#include <utility>
+
+TileBatcher::TileBatcher(DrawFunc draw) :
+    m_draw(std::move(draw)),
+    m_merge(true),
+    m_state{},
+    m_vertices(nullptr),
+    m_vertexCount(0),
+    m_stats{}
+{
+}
+
+void TileBatcher::Add(const DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+    const u16* indices, u32 indexCount)
+{
+    m_stats.batches++;
+
+    if (!m_merge || state.primType != FF7::PrimitiveType::TriangleList) {
+        // Strips and fans can't be concatenated, so draw them as is
+        Flush();
+        m_draw(state, vertices, vertexCount, indices, indexCount);
+        m_stats.drawCalls++;
+        return;
+    }
+
+    const bool canMerge = m_vertices && state == m_state &&
+        vertices == m_vertices + m_vertexCount &&
+        m_vertexCount + vertexCount <= MAX_VERTICES;
+
+    if (!canMerge) {
+        Flush();
+
+        m_state = state;
+        m_vertices = vertices;
+        m_vertexCount = vertexCount;
+        m_indices.assign(indices, indices + indexCount);
+        return;
+    }
+
+    const auto base = static_cast<u16>(m_vertexCount);
+    for (u32 i = 0; i < indexCount; i++) {
+        m_indices.push_back(static_cast<u16>(indices[i] + base));
+    }
+
+    m_vertexCount += vertexCount;
+}
+
+void TileBatcher::Flush()
+{
+    if (!m_vertices) {
+        return;
+    }
+
+    // Cleared before drawing, so a texture bound by the draw itself doesn't flush the batch again
+    const auto vertices = m_vertices;
+    m_vertices = nullptr;
+
+    m_draw(m_state, vertices, m_vertexCount, m_indices.data(), static_cast<u32>(m_indices.size()));
+    m_stats.drawCalls++;
+
+    // clear() keeps the capacity, so the index buffer stops reallocating after the first few frames
+    m_vertexCount = 0;
+    m_indices.clear();
+}
+
+void TileBatcher::FlushTexture(const void* texture)
+{
+    if (m_vertices && m_state.texture != texture) {
+        Flush();
+    }
+}
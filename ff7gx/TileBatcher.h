@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Common.h"
+#include "GameTypes.h"
+
+#include <functional>
+#include <vector>
+
+// Coalesces consecutive background tile draws with identical state into a single draw call.
+// Only triangle lists are merged; the indices of merged batches are rebased so they can share
+// one vertex array, which limits a merged draw to 65536 vertices.
+class TileBatcher
+{
+public:
+    struct DrawState
+    {
+        FF7::PrimitiveType primType;
+        u32 drawType;
+        const void* texture;
+        u32 a7;
+        u32 scissor;
+
+        bool operator==(const DrawState& other) const
+        {
+            return primType == other.primType && drawType == other.drawType && texture == other.texture &&
+                a7 == other.a7 && scissor == other.scissor;
+        }
+    };
+
+    struct Stats
+    {
+        u32 batches;    // Tile batches passed to Add()
+        u32 drawCalls;  // Draw calls actually issued
+
+        float MergeRatio() const
+        {
+            return drawCalls ? static_cast<float>(batches) / drawCalls : 0.0f;
+        }
+    };
+
+    using DrawFunc = std::function<void(const DrawState& state, const FF7::Vertex* vertices, u32 vertexCount,
+        const u16* indices, u32 indexCount)>;
+
+    explicit TileBatcher(DrawFunc draw);
+    ~TileBatcher() = default;
+
+    TileBatcher(TileBatcher&) = delete;
+    TileBatcher(TileBatcher&&) = delete;
+
+    // Queues a batch of tiles. The vertices must stay valid until the next Flush(), and are merged
+    // with the pending batch only if they directly follow its vertices in memory. The indices are
+    // copied, since the game may reuse its index buffer for the next batch.
+    void Add(const DrawState& state, const FF7::Vertex* vertices, u32 vertexCount, const u16* indices, u32 indexCount);
+
+    // Draws everything queued so far
+    void Flush();
+
+    // Draws the pending batch if it was queued with another texture, since the draw uses the bound one
+    void FlushTexture(const void* texture);
+
+    // If disabled, every batch is drawn as is, to compare against merging
+    void SetMerging(bool merge)
+    {
+        Flush();
+        m_merge = merge;
+    }
+
+    const Stats& GetStats() const
+    {
+        return m_stats;
+    }
+
+private:
+    static const u32 MAX_VERTICES = 0x10000;
+
+    DrawFunc m_draw;
+    bool m_merge;
+
+    DrawState m_state;
+    const FF7::Vertex* m_vertices;
+    u32 m_vertexCount;
+
+    std::vector<u16> m_indices;
+
+    Stats m_stats;
+};
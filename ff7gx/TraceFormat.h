@@ -0,0 +1,54 @@
+#pragma once
+
+#include "Common.h"
+
+// Binary trace of the calls the game makes to the graphics driver.
+//
+// A trace file is a FileHeader followed by records. Each record is a RecordHeader, argCount u32
+// arguments and payloadCount payloads, where a payload is a u32 size followed by that many bytes
+// padded to a multiple of 4. Pointer arguments are recorded as their value, since the game is
+// 32-bit. If the game exits without stopping the recorder, the last record may be cut off.
+namespace Trace
+{
+    static const u32 MAGIC = 0x52544746; // "FGTR"
+    static const u32 VERSION = 1;
+
+    static const u32 MAX_ARGS = 16;
+    static const u32 MAX_PAYLOADS = 4;
+
+    // Slots of calls that don't go through FF7::GfxFunctions. Those use the offset of the function
+    // in the table, which is always below 0x100.
+    namespace Slot
+    {
+        // The Draw() call made by DrawTilesImpl, with the vertices and indices as payloads. The bound
+        // texture is recorded after the arguments of Draw().
+        static const u16 DrawHook = 0x100;
+
+        // The return value of a call, recorded after the call for the calls whose result the renderer
+        // depends on. The arguments are the slot of the call and the value.
+        static const u16 Return = 0x101;
+
+        // FF7::GameState::mode, recorded by GfxFn_84 since it isn't passed to any of the functions
+        static const u16 GameMode = 0x102;
+    }
+
+    struct FileHeader
+    {
+        u32 magic;
+        u32 version;
+    };
+
+    struct RecordHeader
+    {
+        u32 size;           // Whole record, including this header
+        u16 slot;
+        u8 argCount;
+        u8 payloadCount;
+        u64 time;           // Nanoseconds since the recording started
+    };
+
+    inline u32 AlignPayload(u32 size)
+    {
+        return (size + 3) & ~3u;
+    }
+}
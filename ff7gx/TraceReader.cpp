@@ -0,0 +1,103 @@
+#include "stdafx.h"
+
+#include "TraceReader.h"
+
+#include <cstring>
+
+TraceReader::TraceReader() :
+    m_position(0),
+    m_truncated(false)
+{
+}
+
+bool TraceReader::Open(const char* path)
+{
+    if (!m_file.Open(path)) {
+        return false;
+    }
+
+    Trace::FileHeader header;
+    if (m_file.GetSize() < sizeof(header)) {
+        m_file.Close();
+        return false;
+    }
+
+    std::memcpy(&header, m_file.GetData(), sizeof(header));
+    if (header.magic != Trace::MAGIC || header.version != Trace::VERSION) {
+        m_file.Close();
+        return false;
+    }
+
+    Rewind();
+    return true;
+}
+
+void TraceReader::Rewind()
+{
+    m_position = sizeof(Trace::FileHeader);
+    m_truncated = false;
+}
+
+bool TraceReader::Next(TraceRecord& record)
+{
+    if (!m_file.IsOpen() || m_truncated) {
+        return false;
+    }
+
+    const std::size_t remaining = m_file.GetSize() - m_position;
+    if (remaining == 0) {
+        return false;
+    }
+
+    // Records are only 4-byte aligned, so everything is copied out instead of cast
+    const u8* data = m_file.GetData() + m_position;
+
+    Trace::RecordHeader header;
+    if (remaining < sizeof(header)) {
+        m_truncated = true;
+        return false;
+    }
+
+    std::memcpy(&header, data, sizeof(header));
+
+    if (header.size > remaining || header.size < sizeof(header) || header.argCount > Trace::MAX_ARGS ||
+        header.payloadCount > Trace::MAX_PAYLOADS) {
+        m_truncated = true;
+        return false;
+    }
+
+    std::size_t offset = sizeof(header) + header.argCount * sizeof(u32);
+    if (offset > header.size) {
+        m_truncated = true;
+        return false;
+    }
+
+    record.slot = header.slot;
+    record.time = header.time;
+    record.argCount = header.argCount;
+    record.payloadCount = header.payloadCount;
+    std::memcpy(record.args, data + sizeof(header), header.argCount * sizeof(u32));
+
+    for (u32 i = 0; i < header.payloadCount; i++) {
+        u32 size;
+        if (offset + sizeof(size) > header.size) {
+            m_truncated = true;
+            return false;
+        }
+
+        std::memcpy(&size, data + offset, sizeof(size));
+        offset += sizeof(size);
+
+        if (size > header.size - offset || Trace::AlignPayload(size) > header.size - offset) {
+            m_truncated = true;
+            return false;
+        }
+
+        record.payloads[i].data = data + offset;
+        record.payloads[i].size = size;
+        offset += Trace::AlignPayload(size);
+    }
+
+    m_position += header.size;
+    return true;
+}
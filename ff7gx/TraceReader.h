@@ -0,0 +1,61 @@
+#pragma once
+
+#include "Common.h"
+#include "MappedFile.h"
+#include "TraceFormat.h"
+
+#include <cstddef>
+
+// One call read from a trace. The pointers point into the mapped trace file.
+struct TraceRecord
+{
+    struct Payload
+    {
+        const u8* data;
+        u32 size;
+    };
+
+    u16 slot;
+    u64 time;
+
+    u32 argCount;
+    u32 args[Trace::MAX_ARGS];
+
+    u32 payloadCount;
+    Payload payloads[Trace::MAX_PAYLOADS];
+};
+
+// Reads a trace written by TraceRecorder, one record at a time
+class TraceReader
+{
+public:
+    TraceReader();
+    ~TraceReader() = default;
+
+    TraceReader(TraceReader&) = delete;
+    TraceReader(TraceReader&&) = delete;
+
+    bool Open(const char* path);
+
+    // Returns false at the end of the trace, or at a record that is cut off or invalid
+    bool Next(TraceRecord& record);
+
+    void Rewind();
+
+    // True if reading stopped before the end of the file, which happens if the game exited
+    // without stopping the recorder
+    bool IsTruncated() const
+    {
+        return m_truncated;
+    }
+
+    std::size_t GetSize() const
+    {
+        return m_file.GetSize();
+    }
+
+private:
+    MappedFile m_file;
+    std::size_t m_position;
+    bool m_truncated;
+};
@@ -0,0 +1,181 @@
+#include "stdafx.h"
+
+#include "TraceRecorder.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+// How long the writer thread sleeps when the ring is empty
+static const auto WRITER_INTERVAL = std::chrono::milliseconds(1);
+
+static TraceRecorder* g_traceRecorder;
+
+TraceRecorder* GetTraceRecorder()
+{
+    return g_traceRecorder;
+}
+
+void SetTraceRecorder(TraceRecorder* recorder)
+{
+    g_traceRecorder = recorder;
+}
+
+TraceRecorder::TraceRecorder(const std::string& path, std::size_t ringBytes) :
+    m_file(path, std::ios::binary | std::ios::trunc),
+    m_ringMask(0),
+    m_writePosition(0),
+    m_readPosition(0),
+    m_stopping(false),
+    m_start(Clock::now()),
+    m_records(0),
+    m_dropped(0),
+    m_maxRingUsage(0)
+{
+    if (!m_file.is_open()) {
+        return;
+    }
+
+    std::size_t size = 4096;
+    while (size < ringBytes) {
+        size *= 2;
+    }
+
+    m_ring.resize(size);
+    m_ringMask = size - 1;
+
+    Trace::FileHeader header;
+    header.magic = Trace::MAGIC;
+    header.version = Trace::VERSION;
+    m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    m_writer = std::thread([this] { WriterMain(); });
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    if (!m_file.is_open()) {
+        return;
+    }
+
+    m_stopping.store(true);
+    m_writer.join();
+}
+
+void TraceRecorder::CopyToRing(u64 position, const void* data, std::size_t size)
+{
+    if (!size) {
+        return;
+    }
+
+    const std::size_t offset = static_cast<std::size_t>(position) & m_ringMask;
+    const std::size_t first = std::min(size, m_ring.size() - offset);
+
+    std::memcpy(&m_ring[offset], data, first);
+    std::memcpy(&m_ring[0], static_cast<const u8*>(data) + first, size - first);
+}
+
+void TraceRecorder::Record(u16 slot, const u32* args, u32 argCount, const Payload* payloads, u32 payloadCount)
+{
+    if (!m_file.is_open()) {
+        return;
+    }
+
+    assert(argCount <= Trace::MAX_ARGS && payloadCount <= Trace::MAX_PAYLOADS);
+
+    u32 size = sizeof(Trace::RecordHeader) + argCount * sizeof(u32);
+    for (u32 i = 0; i < payloadCount; i++) {
+        size += sizeof(u32) + Trace::AlignPayload(payloads[i].size);
+    }
+
+    // Only this thread moves the write position, the writer thread only ever frees up more space
+    const u64 write = m_writePosition.load(std::memory_order_relaxed);
+    const u64 read = m_readPosition.load(std::memory_order_acquire);
+    const std::size_t used = static_cast<std::size_t>(write - read);
+
+    if (size > m_ring.size() - used) {
+        m_dropped.store(m_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+
+    Trace::RecordHeader header;
+    header.size = size;
+    header.slot = slot;
+    header.argCount = static_cast<u8>(argCount);
+    header.payloadCount = static_cast<u8>(payloadCount);
+    header.time = static_cast<u64>(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - m_start).count());
+
+    u64 position = write;
+    CopyToRing(position, &header, sizeof(header));
+    position += sizeof(header);
+
+    CopyToRing(position, args, argCount * sizeof(u32));
+    position += argCount * sizeof(u32);
+
+    for (u32 i = 0; i < payloadCount; i++) {
+        CopyToRing(position, &payloads[i].size, sizeof(u32));
+        position += sizeof(u32);
+
+        static const u8 padding[4] = {};
+        const u32 alignedSize = Trace::AlignPayload(payloads[i].size);
+
+        CopyToRing(position, payloads[i].data, payloads[i].size);
+        CopyToRing(position + payloads[i].size, padding, alignedSize - payloads[i].size);
+        position += alignedSize;
+    }
+
+    // Publishes the record to the writer thread
+    m_writePosition.store(write + size, std::memory_order_release);
+
+    m_records.store(m_records.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (used + size > m_maxRingUsage.load(std::memory_order_relaxed)) {
+        m_maxRingUsage.store(used + size, std::memory_order_relaxed);
+    }
+}
+
+void TraceRecorder::Flush()
+{
+    const u64 read = m_readPosition.load(std::memory_order_relaxed);
+    const u64 write = m_writePosition.load(std::memory_order_acquire);
+
+    if (read == write) {
+        return;
+    }
+
+    const std::size_t offset = static_cast<std::size_t>(read) & m_ringMask;
+    const std::size_t size = static_cast<std::size_t>(write - read);
+    const std::size_t first = std::min(size, m_ring.size() - offset);
+
+    m_file.write(reinterpret_cast<const char*>(&m_ring[offset]), first);
+    m_file.write(reinterpret_cast<const char*>(&m_ring[0]), size - first);
+
+    m_readPosition.store(write, std::memory_order_release);
+}
+
+void TraceRecorder::WriterMain()
+{
+    for (;;) {
+        // Checked before flushing, so everything recorded before stopping gets written
+        const bool stopping = m_stopping.load();
+
+        Flush();
+
+        if (stopping) {
+            break;
+        }
+
+        std::this_thread::sleep_for(WRITER_INTERVAL);
+    }
+
+    m_file.flush();
+}
+
+TraceRecorder::Stats TraceRecorder::GetStats() const
+{
+    Stats stats;
+    stats.records = m_records.load(std::memory_order_relaxed);
+    stats.bytes = m_writePosition.load(std::memory_order_relaxed) + sizeof(Trace::FileHeader);
+    stats.dropped = m_dropped.load(std::memory_order_relaxed);
+    stats.maxRingUsage = m_maxRingUsage.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Common.h"
+#include "TraceFormat.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records calls to a binary trace file (see TraceFormat.h).
+//
+// Record() copies the call into a lock-free ring buffer and returns, and a writer thread
+// flushes the ring to disk. If the writer falls behind and the ring is full, records are
+// dropped and counted instead of stalling the game. Record() must only be called from one
+// thread at a time, which is the game's render thread.
+class TraceRecorder
+{
+public:
+    struct Payload
+    {
+        const void* data;
+        u32 size;
+    };
+
+    struct Stats
+    {
+        u64 records;
+        u64 bytes;
+        u64 dropped;
+        std::size_t maxRingUsage;   // In bytes
+    };
+
+    // ringBytes is rounded up to a power of two
+    TraceRecorder(const std::string& path, std::size_t ringBytes);
+    ~TraceRecorder();
+
+    TraceRecorder(TraceRecorder&) = delete;
+    TraceRecorder(TraceRecorder&&) = delete;
+
+    bool IsOpen() const
+    {
+        return m_file.is_open();
+    }
+
+    void Record(u16 slot, const u32* args, u32 argCount, const Payload* payloads = nullptr, u32 payloadCount = 0);
+
+    Stats GetStats() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Copies into the ring at a position that keeps increasing, wrapping around the end
+    void CopyToRing(u64 position, const void* data, std::size_t size);
+
+    void WriterMain();
+    void Flush();
+
+    std::ofstream m_file;
+
+    std::vector<u8> m_ring;
+    std::size_t m_ringMask;
+
+    // Written by Record() and read by the writer thread, and the other way around
+    std::atomic<u64> m_writePosition;
+    std::atomic<u64> m_readPosition;
+
+    std::atomic<bool> m_stopping;
+    std::thread m_writer;
+
+    Clock::time_point m_start;
+
+    std::atomic<u64> m_records;
+    std::atomic<u64> m_dropped;
+    std::atomic<std::size_t> m_maxRingUsage;
+};
+
+// Arguments are recorded as u32, pointers included
+inline u32 TraceArg(u32 value)
+{
+    return value;
+}
+
+template<typename T>
+u32 TraceArg(T* pointer)
+{
+    return static_cast<u32>(reinterpret_cast<std::uintptr_t>(pointer));
+}
+
+// The recorder used by the generated wrappers, or null if recording is disabled
+TraceRecorder* GetTraceRecorder();
+void SetTraceRecorder(TraceRecorder* recorder);
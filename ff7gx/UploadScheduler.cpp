@@ -0,0 +1,168 @@
+#include "stdafx.h"
+
+#include "UploadScheduler.h"
+
+#include "Profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+using Clock = std::chrono::steady_clock;
+
+static double MillisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+UploadScheduler::UploadScheduler(DecodeFunc decode, u32 threads) :
+    m_decode(std::move(decode)),
+    m_stopping(false),
+    m_stats()
+{
+    threads = std::max(threads, 1u);
+
+    for (u32 i = 0; i < threads; i++) {
+        m_workers.emplace_back([this] { WorkerMain(); });
+    }
+}
+
+UploadScheduler::~UploadScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+
+    m_workAvailable.notify_all();
+
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+void UploadScheduler::Request(u64 key)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_inFlight.insert(key).second) {
+            return;
+        }
+
+        m_queue.push_back(key);
+        m_stats.queued++;
+    }
+
+    m_workAvailable.notify_one();
+}
+
+void UploadScheduler::WorkerMain()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for (;;) {
+        m_workAvailable.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+
+        if (m_stopping) {
+            return;
+        }
+
+        const u64 key = m_queue.front();
+        m_queue.pop_front();
+        m_stats.queued--;
+        m_stats.decoding++;
+
+        lock.unlock();
+
+        Image image;
+        image.key = key;
+
+        bool decoded;
+        {
+            ProfileScope _profile("DecodeTexture");
+            decoded = m_decode(key, image);
+        }
+
+        lock.lock();
+
+        m_stats.decoding--;
+
+        if (decoded) {
+            m_ready.push_back(std::move(image));
+            m_stats.ready++;
+        } else {
+            m_inFlight.erase(key);
+            m_stats.failed++;
+        }
+
+        if (m_queue.empty() && m_stats.decoding == 0) {
+            m_idle.notify_all();
+        }
+    }
+}
+
+u32 UploadScheduler::ApplyCompleted(Sink& sink, const Budget& budget)
+{
+    const auto start = Clock::now();
+
+    u32 uploaded = 0;
+    std::size_t uploadedBytes = 0;
+
+    for (;;) {
+        Image image;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_ready.empty()) {
+                break;
+            }
+
+            const std::size_t bytes = m_ready.front().pixels.size() * sizeof(u32);
+            const bool overBudget = uploadedBytes + bytes > budget.bytes ||
+                MillisecondsSince(start) >= budget.milliseconds;
+
+            if (uploaded > 0 && overBudget) {
+                m_stats.framesOverBudget++;
+                break;
+            }
+
+            image = std::move(m_ready.front());
+            m_ready.pop_front();
+            m_stats.ready--;
+        }
+
+        // Uploading is done without the lock, so the workers can keep going
+        sink.Upload(image);
+
+        uploaded++;
+        uploadedBytes += image.pixels.size() * sizeof(u32);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_inFlight.erase(image.key);
+    }
+
+    const double elapsed = MillisecondsSince(start);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.uploaded = uploaded;
+    m_stats.uploadedBytes = uploadedBytes;
+    m_stats.uploadMilliseconds = elapsed;
+    m_stats.maxUploadMilliseconds = std::max(m_stats.maxUploadMilliseconds, elapsed);
+    m_stats.totalUploaded += uploaded;
+
+    return uploaded;
+}
+
+void UploadScheduler::WaitIdle()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle.wait(lock, [this] { return m_queue.empty() && m_stats.decoding == 0; });
+}
+
+UploadScheduler::Stats UploadScheduler::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "Common.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// Decodes images on worker threads and hands them to an upload sink on the render thread,
+// spreading the uploads over frames so a burst of requests doesn't cause a hitch.
+//
+// Requests are made with Request(), and ApplyCompleted() is called once per frame to upload
+// decoded images until the per-frame byte or time budget runs out. At least one image is
+// uploaded per call, so an image bigger than the budget can't stall the queue.
+class UploadScheduler
+{
+public:
+    struct Image
+    {
+        u64 key;
+        u32 width;
+        u32 height;
+        std::vector<u32> pixels;
+    };
+
+    // Called on a worker thread. Returns false if the image can't be decoded.
+    using DecodeFunc = std::function<bool(u64 key, Image& image)>;
+
+    // Called on the thread calling ApplyCompleted()
+    class Sink
+    {
+    public:
+        virtual ~Sink() = default;
+        virtual void Upload(const Image& image) = 0;
+    };
+
+    struct Budget
+    {
+        std::size_t bytes;
+        double milliseconds;
+    };
+
+    struct Stats
+    {
+        u32 queued;             // Waiting for a worker
+        u32 decoding;
+        u32 ready;              // Decoded, waiting for ApplyCompleted()
+        u32 failed;
+
+        // Last ApplyCompleted() call
+        u32 uploaded;
+        std::size_t uploadedBytes;
+        double uploadMilliseconds;
+
+        double maxUploadMilliseconds;
+        u32 totalUploaded;
+        u32 framesOverBudget;   // Calls that left decoded images for the next frame
+    };
+
+    UploadScheduler(DecodeFunc decode, u32 threads);
+    ~UploadScheduler();
+
+    UploadScheduler(UploadScheduler&) = delete;
+    UploadScheduler(UploadScheduler&&) = delete;
+
+    // Requests for a key that is already queued, decoding or ready are ignored
+    void Request(u64 key);
+
+    // Returns the number of images uploaded
+    u32 ApplyCompleted(Sink& sink, const Budget& budget);
+
+    // Blocks until nothing is queued or decoding
+    void WaitIdle();
+
+    Stats GetStats() const;
+
+private:
+    void WorkerMain();
+
+    DecodeFunc m_decode;
+    std::vector<std::thread> m_workers;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_idle;
+    bool m_stopping;
+
+    std::deque<u64> m_queue;
+    std::deque<Image> m_ready;
+
+    // Everything queued, decoding or ready
+    std::unordered_set<u64> m_inFlight;
+
+    Stats m_stats;
+};
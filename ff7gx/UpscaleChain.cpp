@@ -0,0 +1,224 @@
+#include "stdafx.h"
+
+#include "UpscaleChain.h"
+
+#include <sstream>
+
+bool UpscaleChain::Parse(const std::string& text, std::vector<Filter>& filters)
+{
+    filters.clear();
+
+    std::istringstream stream(text);
+    std::string step;
+
+    while (std::getline(stream, step, ',')) {
+        // Allow spaces around the names
+        const auto first = step.find_first_not_of(' ');
+        const auto last = step.find_last_not_of(' ');
+        step = (first == std::string::npos) ? std::string() : step.substr(first, last - first + 1);
+
+        if (step == "superxbr") {
+            filters.push_back(Filter::SuperXBR);
+        } else if (step == "bilinear") {
+            filters.push_back(Filter::Bilinear);
+        } else {
+            filters.clear();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::string UpscaleChain::Format(const std::vector<Filter>& filters)
+{
+    std::string text;
+
+    for (const auto filter : filters) {
+        if (!text.empty()) {
+            text += ',';
+        }
+
+        text += (filter == Filter::SuperXBR) ? "superxbr" : "bilinear";
+    }
+
+    return text;
+}
+
+const char* UpscaleChain::GetShaderName(Shader shader)
+{
+    switch (shader) {
+    case Shader::SuperXBRPass0:
+        return "superxbr-pass0";
+    case Shader::SuperXBRPass1:
+        return "superxbr-pass1";
+    case Shader::Bilinear:
+        return "bilinear";
+    }
+
+    return "unknown";
+}
+
+UpscaleChain::UpscaleChain(u32 width, u32 height, const std::vector<Filter>& filters, u32 maxSize) :
+    m_sourceWidth(width),
+    m_sourceHeight(height),
+    m_output(SOURCE),
+    m_steps(0)
+{
+    for (const auto filter : filters) {
+        if (width * 2 > maxSize || height * 2 > maxSize) {
+            break;
+        }
+
+        if (filter == Filter::SuperXBR) {
+            const u32 pass0 = AddPass(Shader::SuperXBRPass0, m_output, SOURCE, 1, width, height, width, height);
+            m_output = AddPass(Shader::SuperXBRPass1, pass0, m_output, 2, width, height, width * 2, height * 2);
+        } else {
+            m_output = AddPass(Shader::Bilinear, m_output, SOURCE, 1, width, height, width * 2, height * 2);
+        }
+
+        width *= 2;
+        height *= 2;
+        m_steps++;
+    }
+}
+
+u32 UpscaleChain::GetBorder(Shader shader)
+{
+    switch (shader) {
+    case Shader::SuperXBRPass0:
+        // One pixel before and two after
+        return 2;
+    case Shader::SuperXBRPass1:
+        // Up to one and a half input pixels away in both directions
+        return 2;
+    case Shader::Bilinear:
+        return 1;
+    }
+
+    return 0;
+}
+
+u64 UpscaleChain::GetTargetBytes() const
+{
+    u64 bytes = 0;
+
+    for (const auto& target : m_targets) {
+        bytes += static_cast<u64>(target.width) * target.height * 4;
+    }
+
+    return bytes;
+}
+
+u32 UpscaleChain::GetLastRead(u32 target) const
+{
+    if (target == m_output) {
+        return static_cast<u32>(m_passes.size());
+    }
+
+    u32 lastRead = 0;
+
+    for (u32 i = 0; i < m_passes.size(); i++) {
+        for (u32 j = 0; j < m_passes[i].inputCount; j++) {
+            if (m_passes[i].inputs[j] == target) {
+                lastRead = i;
+            }
+        }
+    }
+
+    return lastRead;
+}
+
+void UpscaleChain::GetDirtyRects(const DirtyRects& source, std::vector<DirtyRects>& targets) const
+{
+    targets.resize(m_targets.size());
+
+    for (auto& target : targets) {
+        target.Clear();
+    }
+
+    // The passes are in order, so every input's rectangles are known before they're read
+    for (const auto& pass : m_passes) {
+        for (u32 i = 0; i < pass.inputCount; i++) {
+            const auto& input = (pass.inputs[i] == SOURCE) ? source : targets[pass.inputs[i]];
+            targets[pass.output].AddScaled(input, GetBorder(pass.shader), pass.width / pass.inputWidth,
+                pass.width, pass.height);
+        }
+    }
+}
+
+std::string UpscaleChain::Validate() const
+{
+    std::vector<bool> written(m_targets.size(), false);
+
+    for (u32 i = 0; i < m_passes.size(); i++) {
+        const auto& pass = m_passes[i];
+        std::ostringstream error;
+
+        if (pass.output >= m_targets.size()) {
+            error << "pass " << i << " writes to missing target " << pass.output;
+            return error.str();
+        }
+
+        const auto& output = m_targets[pass.output];
+
+        if (output.width != pass.width || output.height != pass.height) {
+            error << "pass " << i << " writes " << pass.width << "x" << pass.height << " to a "
+                << output.width << "x" << output.height << " target";
+            return error.str();
+        }
+
+        for (u32 j = 0; j < pass.inputCount; j++) {
+            const u32 input = pass.inputs[j];
+
+            if (input == pass.output) {
+                error << "pass " << i << " reads target " << input << " while writing to it";
+                return error.str();
+            }
+
+            if (input != SOURCE && (input >= m_targets.size() || !written[input])) {
+                error << "pass " << i << " reads target " << input << " before it's written";
+                return error.str();
+            }
+        }
+
+        const u32 first = pass.inputs[0];
+        const u32 inputWidth = (first == SOURCE) ? m_sourceWidth : m_targets[first].width;
+        const u32 inputHeight = (first == SOURCE) ? m_sourceHeight : m_targets[first].height;
+
+        if (inputWidth != pass.inputWidth || inputHeight != pass.inputHeight) {
+            error << "pass " << i << " expects a " << pass.inputWidth << "x" << pass.inputHeight << " input but reads "
+                << inputWidth << "x" << inputHeight;
+            return error.str();
+        }
+
+        written[pass.output] = true;
+    }
+
+    if (!m_passes.empty() && m_output != m_passes.back().output) {
+        return "the output isn't the target of the last pass";
+    }
+
+    return std::string();
+}
+
+u32 UpscaleChain::AddPass(Shader shader, u32 input0, u32 input1, u32 inputCount, u32 inputWidth, u32 inputHeight,
+    u32 width, u32 height)
+{
+    const u32 output = static_cast<u32>(m_targets.size());
+    m_targets.push_back({ width, height });
+
+    Pass pass;
+    pass.shader = shader;
+    pass.inputs[0] = input0;
+    pass.inputs[1] = input1;
+    pass.inputCount = inputCount;
+    pass.inputWidth = inputWidth;
+    pass.inputHeight = inputHeight;
+    pass.output = output;
+    pass.width = width;
+    pass.height = height;
+
+    m_passes.push_back(pass);
+    return output;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "Common.h"
+#include "DirtyRects.h"
+
+#include <string>
+#include <vector>
+
+// Plans the GPU passes upscaling the background before its layers are drawn. Each step doubles the
+// size, either with super-xBR or bilinear filtering. Super-xBR takes two passes like its libretro
+// preset: pass 0 filters at the source size, and pass 1 reads both pass 0's output and the source
+// to write twice the size.
+//
+// Every pass writes to its own target, allocated once when the chain is planned and reused every
+// frame. Since every step doubles the size, no two passes write the same size, so sharing targets
+// between passes would need them to draw to a part of a larger one.
+class UpscaleChain
+{
+public:
+    enum class Filter
+    {
+        SuperXBR,
+        Bilinear
+    };
+
+    enum class Shader
+    {
+        SuperXBRPass0,
+        SuperXBRPass1,
+        Bilinear
+    };
+
+    // The chain's input, as a pass input or as the output of an empty chain
+    static const u32 SOURCE = 0xffffffff;
+
+    static const u32 MAX_INPUTS = 2;
+
+    // Registers of the shader constants, bound in the shaders. The input size is set to every
+    // member of the libretro "input" struct preceding texture_size, since the chain never crops.
+    static const u32 VS_MATRIX_REGISTER = 0;
+    static const u32 VS_INPUT_REGISTER = 4;
+    static const u32 PS_INPUT_REGISTER = 0;
+    static const u32 INPUT_REGISTERS = 2;
+
+    struct Target
+    {
+        u32 width;
+        u32 height;
+    };
+
+    struct Pass
+    {
+        Shader shader;
+        u32 inputs[MAX_INPUTS];     // Targets or SOURCE, bound to stages 0 and 1
+        u32 inputCount;
+        u32 inputWidth;             // Size of the first input
+        u32 inputHeight;
+        u32 output;
+        u32 width;                  // Size of the output
+        u32 height;
+    };
+
+    // Parses a comma separated list of "superxbr" and "bilinear" steps. An empty string is an empty chain.
+    static bool Parse(const std::string& text, std::vector<Filter>& filters);
+
+    // The text Parse() reads the filters from
+    static std::string Format(const std::vector<Filter>& filters);
+
+    static const char* GetShaderName(Shader shader);
+
+    // How many input pixels around the one under an output pixel the shader may read
+    static u32 GetBorder(Shader shader);
+
+    // Plans the chain for a width x height source. Steps that would make the output wider or
+    // higher than maxSize are left out.
+    UpscaleChain(u32 width, u32 height, const std::vector<Filter>& filters, u32 maxSize);
+    ~UpscaleChain() = default;
+
+    const std::vector<Pass>& GetPasses() const
+    {
+        return m_passes;
+    }
+
+    const std::vector<Target>& GetTargets() const
+    {
+        return m_targets;
+    }
+
+    // The target holding the upscaled background, or SOURCE if there are no steps
+    u32 GetOutput() const
+    {
+        return m_output;
+    }
+
+    // Steps actually planned, each doubling the size
+    u32 GetSteps() const
+    {
+        return m_steps;
+    }
+
+    // Memory used by the targets, at 4 bytes per pixel
+    u64 GetTargetBytes() const;
+
+    // The last pass reading a target. The output is read after the chain, which is given as the
+    // number of passes.
+    u32 GetLastRead(u32 target) const;
+
+    // Given the parts of the source that changed, sets what each pass has to draw again, indexed
+    // like GetTargets(). Everything else in the targets is the same as the last time the chain ran.
+    void GetDirtyRects(const DirtyRects& source, std::vector<DirtyRects>& targets) const;
+
+    // Replays the plan checking that every pass reads only targets written by earlier passes,
+    // never the one it writes to, and that the sizes of its inputs and output match the targets.
+    // Returns an empty string if the plan is correct, or a description of the first problem.
+    std::string Validate() const;
+
+private:
+    // Returns the target written by the pass
+    u32 AddPass(Shader shader, u32 input0, u32 input1, u32 inputCount, u32 inputWidth, u32 inputHeight,
+        u32 width, u32 height);
+
+    u32 m_sourceWidth;
+    u32 m_sourceHeight;
+    std::vector<Pass> m_passes;
+    std::vector<Target> m_targets;
+    u32 m_output;
+    u32 m_steps;
+};
@@ -0,0 +1,219 @@
+#include "stdafx.h"
+
+#include "VertexTransform.h"
+#include "VertexTransformKernel.h"
+#include "CpuFeatures.h"
+
+#include <cmath>
+#include <cstring>
+
+#include <emmintrin.h>
+
+using namespace VertexTransformKernel;
+
+static u32 QuantizeDepth(float z)
+{
+    const float depth = std::ceil(z * 255.0f);
+
+    if (!(depth > 0.0f)) {
+        return 0;
+    }
+
+    return depth < 255.0f ? static_cast<u32>(depth) : 255;
+}
+
+// round(a * b / 255) for every 8-bit channel. (t + (t >> 8)) >> 8 divides t by 255 exactly for
+// t below 65536, and adding 128 first rounds.
+static u32 ModulateColor(u32 a, u32 b)
+{
+    u32 result = 0;
+    for (u32 shift = 0; shift < 32; shift += 8) {
+        const u32 t = ((a >> shift) & 0xff) * ((b >> shift) & 0xff) + 128;
+        result |= ((t + (t >> 8)) >> 8) << shift;
+    }
+
+    return result;
+}
+
+// Selects the lanes of a where mask is set and the lanes of b elsewhere
+static __m128 Select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// a * b + 128, divided by 255 and rounded like ModulateColor(), for 16-bit channels
+static __m128i ModulateChannels(__m128i a, __m128i b)
+{
+    const __m128i t = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+namespace VertexTransformKernel
+{
+    void TransformPositionsScalar(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform)
+    {
+        for (u32 i = 0; i < count; i++) {
+            FF7::Vertex vertex = src[i];
+            vertex.x = vertex.x * transform.scaleX + transform.offsetX;
+            vertex.y = vertex.y * transform.scaleY + transform.offsetY;
+            dst[i] = vertex;
+        }
+    }
+
+    void TransformTexCoordsScalar(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform)
+    {
+        for (u32 i = 0; i < count; i++) {
+            FF7::Vertex vertex = src[i];
+            vertex.u = vertex.u * transform.scaleX + transform.offsetX;
+            vertex.v = vertex.v * transform.scaleY + transform.offsetY;
+            dst[i] = vertex;
+        }
+    }
+
+    void ModulateColorsScalar(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, u32 color)
+    {
+        for (u32 i = 0; i < count; i++) {
+            FF7::Vertex vertex = src[i];
+            vertex.color = ModulateColor(vertex.color, color);
+            dst[i] = vertex;
+        }
+    }
+
+    void QuantizeDepthsScalar(u8* depths, const FF7::Vertex* vertices, u32 count)
+    {
+        for (u32 i = 0; i < count; i++) {
+            depths[i] = static_cast<u8>(QuantizeDepth(vertices[i].z));
+        }
+    }
+
+    // A vertex is two 128-bit halves, x y z w and color unknown u v. Only the lanes being
+    // transformed are replaced, since the others may hold colors or NaNs that must not pass
+    // through float math.
+    void TransformPositionsSSE2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform)
+    {
+        const __m128 scale = _mm_setr_ps(transform.scaleX, transform.scaleY, 0.0f, 0.0f);
+        const __m128 offset = _mm_setr_ps(transform.offsetX, transform.offsetY, 0.0f, 0.0f);
+        const __m128 mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, 0, 0));
+
+        for (u32 i = 0; i < count; i++) {
+            auto s = reinterpret_cast<const float*>(&src[i]);
+            auto d = reinterpret_cast<float*>(&dst[i]);
+
+            const __m128 position = _mm_loadu_ps(s);
+            const __m128 rest = _mm_loadu_ps(s + 4);
+            _mm_storeu_ps(d, Select(mask, _mm_add_ps(_mm_mul_ps(position, scale), offset), position));
+            _mm_storeu_ps(d + 4, rest);
+        }
+    }
+
+    void TransformTexCoordsSSE2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform)
+    {
+        const __m128 scale = _mm_setr_ps(0.0f, 0.0f, transform.scaleX, transform.scaleY);
+        const __m128 offset = _mm_setr_ps(0.0f, 0.0f, transform.offsetX, transform.offsetY);
+        const __m128 mask = _mm_castsi128_ps(_mm_setr_epi32(0, 0, -1, -1));
+
+        for (u32 i = 0; i < count; i++) {
+            auto s = reinterpret_cast<const float*>(&src[i]);
+            auto d = reinterpret_cast<float*>(&dst[i]);
+
+            const __m128 position = _mm_loadu_ps(s);
+            const __m128 rest = _mm_loadu_ps(s + 4);
+            _mm_storeu_ps(d, position);
+            _mm_storeu_ps(d + 4, Select(mask, _mm_add_ps(_mm_mul_ps(rest, scale), offset), rest));
+        }
+    }
+
+    void ModulateColorsSSE2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, u32 color)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i factor = _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(color)), zero);
+
+        u32 i = 0;
+        for (; i + 4 <= count; i += 4) {
+            const __m128i colors = _mm_setr_epi32(static_cast<int>(src[i].color), static_cast<int>(src[i + 1].color),
+                static_cast<int>(src[i + 2].color), static_cast<int>(src[i + 3].color));
+
+            const __m128i lo = ModulateChannels(_mm_unpacklo_epi8(colors, zero), factor);
+            const __m128i hi = ModulateChannels(_mm_unpackhi_epi8(colors, zero), factor);
+
+            u32 modulated[4];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(modulated), _mm_packus_epi16(lo, hi));
+
+            for (u32 j = 0; j < 4; j++) {
+                dst[i + j] = src[i + j];
+                dst[i + j].color = modulated[j];
+            }
+        }
+
+        ModulateColorsScalar(dst + i, src + i, count - i, color);
+    }
+
+    void QuantizeDepthsSSE2(u8* depths, const FF7::Vertex* vertices, u32 count)
+    {
+        const __m128 scale = _mm_set1_ps(255.0f);
+        const __m128 limit = _mm_set1_ps(256.0f);
+
+        u32 i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128 z = _mm_mul_ps(
+                _mm_setr_ps(vertices[i].z, vertices[i + 1].z, vertices[i + 2].z, vertices[i + 3].z), scale);
+
+            // Keep huge values from overflowing the integer conversion. NaNs pass through (minps returns
+            // its second operand) and convert to INT_MIN, which clamps to 0 below.
+            z = _mm_min_ps(limit, z);
+
+            // SSE2 has no ceil, so truncate and add 1 where truncation rounded down
+            __m128i depth = _mm_cvttps_epi32(z);
+            const __m128 rounded = _mm_cmplt_ps(_mm_cvtepi32_ps(depth), z);
+            depth = _mm_sub_epi32(depth, _mm_castps_si128(rounded));
+
+            // Saturating packs clamp to 0..255
+            depth = _mm_packs_epi32(depth, depth);
+            depth = _mm_packus_epi16(depth, depth);
+
+            const u32 packed = static_cast<u32>(_mm_cvtsi128_si32(depth));
+            std::memcpy(depths + i, &packed, sizeof(packed));
+        }
+
+        QuantizeDepthsScalar(depths + i, vertices + i, count - i);
+    }
+}
+
+VertexTransformer::VertexTransformer(Kernel kernel) :
+    m_kernel(kernel)
+{
+    if (m_kernel == Kernel::AVX2 && !CpuFeatures::HasAVX2()) {
+        m_kernel = Kernel::Auto;
+    }
+
+    if (m_kernel == Kernel::Auto) {
+        if (CpuFeatures::HasAVX2()) {
+            m_kernel = Kernel::AVX2;
+        } else if (CpuFeatures::HasSSE2()) {
+            m_kernel = Kernel::SSE2;
+        } else {
+            m_kernel = Kernel::Scalar;
+        }
+    }
+
+    switch (m_kernel) {
+    case Kernel::AVX2:
+        m_transformPositions = &TransformPositionsAVX2;
+        m_transformTexCoords = &TransformTexCoordsAVX2;
+        m_modulateColors = &ModulateColorsAVX2;
+        m_quantizeDepths = &QuantizeDepthsAVX2;
+        break;
+    case Kernel::SSE2:
+        m_transformPositions = &TransformPositionsSSE2;
+        m_transformTexCoords = &TransformTexCoordsSSE2;
+        m_modulateColors = &ModulateColorsSSE2;
+        m_quantizeDepths = &QuantizeDepthsSSE2;
+        break;
+    default:
+        m_transformPositions = &TransformPositionsScalar;
+        m_transformTexCoords = &TransformTexCoordsScalar;
+        m_modulateColors = &ModulateColorsScalar;
+        m_quantizeDepths = &QuantizeDepthsScalar;
+        break;
+    }
+}
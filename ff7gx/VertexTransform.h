@@ -0,0 +1,73 @@
+#pragma once
+
+#include "Common.h"
+#include "GameTypes.h"
+
+// SIMD kernels over arrays of FF7::Vertex, for the transforms the renderer makes to the game's
+// vertices before drawing them.
+//
+// Each transform copies count vertices from src to dst, changing only what it's for, and leaves
+// every other field bit for bit as it was. dst may be src, but the arrays mustn't otherwise
+// overlap. Every kernel gives the same result as the scalar one, which defines it.
+class VertexTransformer
+{
+public:
+    enum class Kernel
+    {
+        Auto,   // Best kernel supported by the CPU
+        Scalar,
+        SSE2,
+        AVX2
+    };
+
+    // x' = x * scaleX + offsetX and y' = y * scaleY + offsetY, for positions or texture coordinates
+    struct Affine2D
+    {
+        float scaleX, scaleY;
+        float offsetX, offsetY;
+    };
+
+    using AffineFunc = void(*)(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform);
+    using ModulateFunc = void(*)(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, u32 color);
+    using QuantizeFunc = void(*)(u8* depths, const FF7::Vertex* vertices, u32 count);
+
+    explicit VertexTransformer(Kernel kernel = Kernel::Auto);
+
+    // Transforms x and y
+    void TransformPositions(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform) const
+    {
+        m_transformPositions(dst, src, count, transform);
+    }
+
+    // Transforms u and v
+    void TransformTexCoords(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform) const
+    {
+        m_transformTexCoords(dst, src, count, transform);
+    }
+
+    // Multiplies each channel of the vertex colors with the same channel of color, like
+    // D3DTOP_MODULATE: round(a * b / 255)
+    void ModulateColors(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, u32 color) const
+    {
+        m_modulateColors(dst, src, count, color);
+    }
+
+    // Writes the layer depth of each vertex, ceil(z * 255) clamped to 0-255 with NaNs going to 0,
+    // like LayerDepthSet::Mark()
+    void QuantizeDepths(u8* depths, const FF7::Vertex* vertices, u32 count) const
+    {
+        m_quantizeDepths(depths, vertices, count);
+    }
+
+    Kernel GetKernel() const
+    {
+        return m_kernel;
+    }
+
+private:
+    Kernel m_kernel;
+    AffineFunc m_transformPositions;
+    AffineFunc m_transformTexCoords;
+    ModulateFunc m_modulateColors;
+    QuantizeFunc m_quantizeDepths;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+// Kernels shared by the VertexTransform*.cpp files. Only include it from those.
+
+#include "Common.h"
+#include "GameTypes.h"
+#include "VertexTransform.h"
+
+namespace VertexTransformKernel
+{
+    using Affine2D = VertexTransformer::Affine2D;
+
+    static_assert(sizeof(FF7::Vertex) == 32, "The kernels load a vertex as eight 32-bit lanes");
+
+    // Scalar kernels, which define the results. The other kernels must give the same ones.
+    void TransformPositionsScalar(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform);
+    void TransformTexCoordsScalar(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform);
+    void ModulateColorsScalar(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, u32 color);
+    void QuantizeDepthsScalar(u8* depths, const FF7::Vertex* vertices, u32 count);
+
+    void TransformPositionsSSE2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform);
+    void TransformTexCoordsSSE2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform);
+    void ModulateColorsSSE2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, u32 color);
+    void QuantizeDepthsSSE2(u8* depths, const FF7::Vertex* vertices, u32 count);
+
+    // Compiled separately with AVX2 code generation enabled
+    void TransformPositionsAVX2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform);
+    void TransformTexCoordsAVX2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform);
+    void ModulateColorsAVX2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, u32 color);
+    void QuantizeDepthsAVX2(u8* depths, const FF7::Vertex* vertices, u32 count);
+}
@@ -0,0 +1,100 @@
+#include "stdafx.h"
+
+// This file is compiled with AVX2 code generation (and without the precompiled header, which
+// is built without it), so nothing in it may be called without checking CpuFeatures::HasAVX2() first.
+
+#include "VertexTransform.h"
+#include "VertexTransformKernel.h"
+
+#include <immintrin.h>
+
+// A vertex is exactly one 256-bit register: x y z w color unknown u v. The blends only replace
+// the lanes being transformed, since the others may hold colors or NaNs that must not pass
+// through float math.
+template<int Lanes>
+static void TransformLanes(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, __m256 scale, __m256 offset)
+{
+    for (u32 i = 0; i < count; i++) {
+        const __m256 vertex = _mm256_loadu_ps(reinterpret_cast<const float*>(&src[i]));
+        const __m256 transformed = _mm256_add_ps(_mm256_mul_ps(vertex, scale), offset);
+        _mm256_storeu_ps(reinterpret_cast<float*>(&dst[i]), _mm256_blend_ps(vertex, transformed, Lanes));
+    }
+}
+
+// round(a * b / 255) for 16-bit channels, like ModulateColor() in VertexTransform.cpp
+static __m256i ModulateChannels(__m256i a, __m256i b)
+{
+    const __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(a, b), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+namespace VertexTransformKernel
+{
+    void TransformPositionsAVX2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform)
+    {
+        const __m256 scale = _mm256_setr_ps(transform.scaleX, transform.scaleY, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f);
+        const __m256 offset = _mm256_setr_ps(transform.offsetX, transform.offsetY, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f);
+
+        TransformLanes<0x03>(dst, src, count, scale, offset);
+    }
+
+    void TransformTexCoordsAVX2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, const Affine2D& transform)
+    {
+        const __m256 scale = _mm256_setr_ps(0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, transform.scaleX, transform.scaleY);
+        const __m256 offset = _mm256_setr_ps(0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, transform.offsetX, transform.offsetY);
+
+        TransformLanes<0xc0>(dst, src, count, scale, offset);
+    }
+
+    void ModulateColorsAVX2(FF7::Vertex* dst, const FF7::Vertex* src, u32 count, u32 color)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i factor = _mm256_unpacklo_epi8(_mm256_set1_epi32(static_cast<int>(color)), zero);
+
+        u32 i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const __m256i colors = _mm256_setr_epi32(
+                static_cast<int>(src[i].color), static_cast<int>(src[i + 1].color),
+                static_cast<int>(src[i + 2].color), static_cast<int>(src[i + 3].color),
+                static_cast<int>(src[i + 4].color), static_cast<int>(src[i + 5].color),
+                static_cast<int>(src[i + 6].color), static_cast<int>(src[i + 7].color));
+
+            // Unpacking and packing both work within 128-bit halves, so the order comes back as it was
+            const __m256i lo = ModulateChannels(_mm256_unpacklo_epi8(colors, zero), factor);
+            const __m256i hi = ModulateChannels(_mm256_unpackhi_epi8(colors, zero), factor);
+
+            u32 modulated[8];
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(modulated), _mm256_packus_epi16(lo, hi));
+
+            for (u32 j = 0; j < 8; j++) {
+                dst[i + j] = src[i + j];
+                dst[i + j].color = modulated[j];
+            }
+        }
+
+        ModulateColorsSSE2(dst + i, src + i, count - i, color);
+    }
+
+    void QuantizeDepthsAVX2(u8* depths, const FF7::Vertex* vertices, u32 count)
+    {
+        const __m256 scale = _mm256_set1_ps(255.0f);
+        const __m256 zero = _mm256_setzero_ps();
+
+        u32 i = 0;
+        for (; i + 8 <= count; i += 8) {
+            __m256 z = _mm256_setr_ps(vertices[i].z, vertices[i + 1].z, vertices[i + 2].z, vertices[i + 3].z,
+                vertices[i + 4].z, vertices[i + 5].z, vertices[i + 6].z, vertices[i + 7].z);
+            z = _mm256_ceil_ps(_mm256_mul_ps(z, scale));
+
+            // maxps returns its second operand if either is NaN, so NaNs become 0
+            z = _mm256_min_ps(_mm256_max_ps(z, zero), scale);
+
+            const __m256i depth = _mm256_cvttps_epi32(z);
+            __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(depth), _mm256_extracti128_si256(depth, 1));
+            packed = _mm_packus_epi16(packed, packed);
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(depths + i), packed);
+        }
+
+        QuantizeDepthsSSE2(depths + i, vertices + i, count - i);
+    }
+}
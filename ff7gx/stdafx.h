@@ -1,32 +1,38 @@
-// stdafx.h : include file for standard system include files,
-// or project specific include files that are used frequently, but
-// are changed infrequently
-//
-
-#pragma once
-
-#include "targetver.h"
-
-#define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
-
-#include <DirectXMath.h>
-#include <Windows.h>
-
-#include <algorithm>
-#include <array>
-#include <assert.h>
-#include <cassert>
-#include <cmath>
-#include <cstdint>
-#include <cstdio>
-#include <cstring>
-#include <d3d9.h>
-#include <d3dcommon.h>
-#include <functional>
-#include <memory>
-#include <string>
-#include <type_traits>
-#include <unordered_set>
-#include <utility>
-#include <vector>
-#include <wrl.h>
\ No newline at end of file
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+// The tools also build the portable sources on other platforms, where only the standard headers exist
+#ifdef _WIN32
+#include "targetver.h"
+
+#define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
+
+#include <DirectXMath.h>
+#include <Windows.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <assert.h>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <d3d9.h>
+#include <d3dcommon.h>
+#include <wrl.h>
+#endif
\ No newline at end of file
@@ -1,11 +1,41 @@
+# What every wrapper does before calling the renderer
+WRAPPER_PROLOGUE_TEMPLATE = """    ScopedD3DEvent _(L"{fn.name}"{separator}{fn.call_args_str});
+    ProfileScope _profile("{fn.name}");
+{trace}"""
+
 METHOD_WRAPPER_TEMPLATE = """
 static {fn.return_type} __cdecl {fn.name}_wrapper({fn.args_decl_str})
 {{
-    ScopedD3DEvent _(L"{fn.name}({fn.args_fmt_str})"{separator}{fn.call_args_str});
+{prologue}
     return FF7::GetGfxFunctions()->rendererInstance->{fn.name}({fn.call_args_str});
 }}
 """
 
+# The qualified call isn't virtual, and calls GfxContextBase's method if Derived doesn't override it
+STATIC_WRAPPER_TEMPLATE = """
+    static {fn.return_type} __cdecl {fn.name}_wrapper({fn.args_decl_str})
+    {{
+    {prologue}
+        return s_instance->Derived::{fn.name}({fn.call_args_str});
+    }}
+"""
+
+STATIC_WRAPPER_ASSIGNMENT_TEMPLATE = """functions->{fn.name} = {fn.name}_wrapper;"""
+
+BYPASS_TEMPLATE = """if (!IsOverridden(&Derived::{fn.name})) {{
+            functions->{fn.name} = GetOriginalFunctions()->{fn.name};
+        }}"""
+
+# Recording is opt-in, the recorder is null unless a trace was requested
+TRACE_TEMPLATE = """    if (auto recorder = GetTraceRecorder()) {{
+        const u32 args[] = {{ {trace_args} }};
+        recorder->Record(0x{fn.offset:02X}, args, {arg_count});
+    }}"""
+
+TRACE_NO_ARGS_TEMPLATE = """    if (auto recorder = GetTraceRecorder()) {{
+        recorder->Record(0x{fn.offset:02X}, nullptr, 0);
+    }}"""
+
 METHOD_IMPL_TEMPLATE = """
 {fn.return_type} GfxContextBase::{fn.name}({fn.args_decl_str})
 {{
@@ -32,6 +62,15 @@ namespace FF7
 }}
 """
 
+SLOT_NAMES_TEMPLATE = """
+#pragma once
+
+// Names of the hooked FF7::GfxFunctions slots, indexed by offset / 4, for tools reading traces
+static const char* const GFX_SLOT_NAMES[] = {{
+    {names}
+}};
+"""
+
 CLASS_DECL_TEMPLATE = """
 #pragma once
 
@@ -45,6 +84,9 @@ public:
 
     {methods}
 
+protected:
+    const FF7::GfxFunctions* GetOriginalFunctions() const;
+
 private:
     FF7::GfxFunctions* const m_originalImpl;
     FF7::GfxFunctions m_impl;
@@ -66,11 +108,75 @@ FF7::GfxFunctions* GfxContextBase::GetFunctions()
     return &m_impl;
 }}
 
+const FF7::GfxFunctions* GfxContextBase::GetOriginalFunctions() const
+{{
+    return m_originalImpl;
+}}
+
 {method_impls}
 """
 
-def is_pointer(arg_type):
-    return arg_type[-1] == "*"
+STATIC_CLASS_TEMPLATE = """
+#pragma once
+
+// GfxContextBase with the wrappers dispatching statically to Derived, which must derive from
+// GfxContext<Derived>. The wrappers use a cached instance pointer instead of looking the
+// renderer up through the game's context, and call Derived's methods without a virtual call.
+// There can only be one instance of Derived at a time.
+template<typename Derived>
+class GfxContext : public GfxContextBase
+{{
+public:
+    GfxContext(FF7::GfxFunctions* impl) :
+        GfxContextBase(impl)
+    {{
+        s_instance = static_cast<Derived*>(this);
+
+        auto functions = GetFunctions();
+        {wrapper_assignments}
+    }}
+
+    ~GfxContext()
+    {{
+        s_instance = nullptr;
+    }}
+
+    static Derived* GetInstance()
+    {{
+        return s_instance;
+    }}
+
+protected:
+    // Points the slots Derived doesn't override at the original functions, so the game calls
+    // them with no wrapper in between. Calls to those slots are no longer traced, profiled or
+    // marked with D3D events.
+    void BypassUnhookedSlots()
+    {{
+        auto functions = GetFunctions();
+
+        {bypasses}
+    }}
+
+private:
+    // &Derived::Method has the type of the class that declares the method
+    template<typename TResult, typename... TArgs>
+    static constexpr bool IsOverridden(TResult (Derived::*)(TArgs...))
+    {{
+        return true;
+    }}
+
+    template<typename TResult, typename... TArgs>
+    static constexpr bool IsOverridden(TResult (GfxContextBase::*)(TArgs...))
+    {{
+        return false;
+    }}
+{static_wrappers}
+    static Derived* s_instance;
+}};
+
+template<typename Derived>
+Derived* GfxContext<Derived>::s_instance = nullptr;
+"""
 
 class Function:
     def __init__(self, offset, return_type, name, arg_types):
@@ -81,15 +187,34 @@ class Function:
 
         self.call_args = map(lambda x: "a{}".format(x), range(0, len(self.arg_types)))
         self.args_decl = map(lambda (x, y): "{} {}".format(x, y), zip(self.arg_types, self.call_args))
-        self.args_fmt = map(lambda x: "%p" if is_pointer(x) else "0x%x", self.arg_types)
 
         self.call_args_str = ", ".join(self.call_args)
         self.args_decl_str = ", ".join(self.args_decl)
-        self.args_fmt_str = ", ".join(self.args_fmt)
 
-    def generate_method_wrapper(self):
+    def generate_trace(self):
+        if not self.call_args:
+            return TRACE_NO_ARGS_TEMPLATE.format(fn=self)
+
+        trace_args = ", ".join(map(lambda x: "TraceArg({})".format(x), self.call_args))
+        return TRACE_TEMPLATE.format(fn=self, trace_args=trace_args, arg_count=len(self.call_args))
+
+    def generate_prologue(self):
         separator = ", " if self.call_args else ""
-        return METHOD_WRAPPER_TEMPLATE.format(fn=self, separator=separator)
+        return WRAPPER_PROLOGUE_TEMPLATE.format(fn=self, separator=separator, trace=self.generate_trace())
+
+    def generate_method_wrapper(self):
+        return METHOD_WRAPPER_TEMPLATE.format(fn=self, prologue=self.generate_prologue())
+
+    def generate_static_wrapper(self):
+        # Indented one more level, for the class body
+        prologue = self.generate_prologue().replace("\n", "\n    ")
+        return STATIC_WRAPPER_TEMPLATE.format(fn=self, prologue=prologue)
+
+    def generate_static_wrapper_assignment(self):
+        return STATIC_WRAPPER_ASSIGNMENT_TEMPLATE.format(fn=self)
+
+    def generate_bypass(self):
+        return BYPASS_TEMPLATE.format(fn=self)
 
     def generate_method_impl(self):
         separator = ", " if self.call_args else ""
@@ -115,6 +240,14 @@ def generate_context_struct(functions):
     return CONTEXT_STRUCT_TEMPLATE.format(fields="\n        ".join(fields))
 
 
+def generate_slot_names(functions):
+    names = ["nullptr"] * (0xF0 / 4)
+    for fn in functions:
+        names[fn.offset / 4] = '"{}"'.format(fn.name)
+
+    return SLOT_NAMES_TEMPLATE.format(names=",\n    ".join(names))
+
+
 def generate_class(functions):
     wrapper_assignments = "\n    ".join(map(lambda x: x.generate_wrapper_assignment(), functions))
     method_wrappers = "".join(map(lambda x: x.generate_method_wrapper(), functions))
@@ -125,6 +258,14 @@ def generate_class(functions):
     return (decl, impl)
 
 
+def generate_static_class(functions):
+    wrapper_assignments = "\n        ".join(map(lambda x: x.generate_static_wrapper_assignment(), functions))
+    bypasses = "\n\n        ".join(map(lambda x: x.generate_bypass(), functions))
+    static_wrappers = "".join(map(lambda x: x.generate_static_wrapper(), functions))
+    return STATIC_CLASS_TEMPLATE.format(wrapper_assignments=wrapper_assignments, bypasses=bypasses,
+                                        static_wrappers=static_wrappers)
+
+
 ff7_gfx_functions = [
     Function(offset=0x00, return_type="u32", name="GfxFn_0", arg_types=["u32"]),
     Function(offset=0x04, return_type="u32", name="Shutdown", arg_types=["u32"]),
@@ -165,6 +306,8 @@ ff7_gfx_functions = [
 
 decl, impl = generate_class(ff7_gfx_functions)
 ctx = generate_context_struct(ff7_gfx_functions)
+slot_names = generate_slot_names(ff7_gfx_functions)
+static_class = generate_static_class(ff7_gfx_functions)
 
 with open("Generated/GfxContextBase.h", "w") as f:
     f.write(decl)
@@ -173,4 +316,10 @@ with open("Generated/GfxContextBase.cpp", "w") as f:
     f.write(impl)
 
 with open("Generated/GfxFunctions.h", "w") as f:
-    f.write(ctx)
\ No newline at end of file
+    f.write(ctx)
+
+with open("Generated/GfxSlotNames.h", "w") as f:
+    f.write(slot_names)
+
+with open("Generated/GfxContext.h", "w") as f:
+    f.write(static_class)
\ No newline at end of file